@@ -0,0 +1,461 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: micro-benchmarks for the parsers, lookups and formatting
+ * Synthetic tables of each engine (format) and size are written, loaded
+ * and searched with the same keys (fixed seed), so two runs on different
+ * commits can be compared. Results go to stdout and, with -o, to a JSON file.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <parser.h>
+
+#define RESULTS_MAX	512
+
+/* Keys per ip2clue_list_lookup_sorted call, as ip2clue-annotate does */
+#define SORTED_BATCH	4096
+
+struct result
+{
+	const char		*bench;
+	const char		*engine;
+	unsigned long		ranges;
+	unsigned long		ops;
+	double			ns_op;
+	double			misses_op;	/* -1 if not available */
+	unsigned long long	mem;		/* bytes used by the table */
+};
+
+static struct result		results[RESULTS_MAX];
+static unsigned int		results_no;
+static int			perf_fd = -1;
+static unsigned long long	seed = 1, rnd_state;
+static unsigned long long	t_start, m_start;
+static volatile unsigned long	sink;
+
+static const char		*codes[8][2] = {
+	{ "RO", "Romania" }, { "US", "United States" }, { "DE", "Germany" },
+	{ "FR", "France" }, { "JP", "Japan" }, { "BR", "Brazil" },
+	{ "IN", "India" }, { "ZA", "South Africa" }
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (unsigned long long) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* xorshift64 */
+static unsigned long long rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+
+	return rnd_state;
+}
+
+/*
+ * Cache misses of this process, from the PMU; not available in most VMs
+ */
+static void perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static unsigned long long perf_read(void)
+{
+	unsigned long long v = 0;
+
+	if ((perf_fd == -1) || (read(perf_fd, &v, sizeof(v)) != sizeof(v)))
+		return 0;
+
+	return v;
+}
+
+static void meter_start(void)
+{
+	m_start = perf_read();
+	t_start = now_ns();
+}
+
+static void meter_stop(const char *bench, const char *engine,
+	const unsigned long ranges, const unsigned long ops,
+	const unsigned long long mem)
+{
+	unsigned long long t = now_ns() - t_start;
+	unsigned long long m = perf_read() - m_start;
+	struct result *r;
+
+	if (results_no == RESULTS_MAX)
+		return;
+
+	r = &results[results_no++];
+	r->bench = bench;
+	r->engine = engine;
+	r->ranges = ranges;
+	r->ops = ops;
+	r->ns_op = ops > 0 ? (double) t / ops : 0;
+	r->misses_op = (perf_fd == -1) || (ops == 0) ? -1 : (double) m / ops;
+	r->mem = mem;
+
+	printf("%-20s %-12s %10lu %10lu %10.1f", bench, engine, ranges, ops,
+		r->ns_op);
+	if (r->misses_op < 0)
+		printf(" %10s", "-");
+	else
+		printf(" %10.2f", r->misses_op);
+	printf(" %12llu\n", mem);
+}
+
+/*
+ * Writes a table of @n ranges; about a quarter of the space is in holes.
+ * v4 tables cover all the space, v6 ones 2000::/3.
+ */
+static int gen_table(const char *file, const char *engine, const unsigned long n)
+{
+	FILE *f;
+	unsigned long i;
+	unsigned long long step, len;
+	unsigned int s[4], e[4];
+	char a[64], b[64];
+	const char **c;
+	int v6;
+
+	f = fopen(file, "w");
+	if (f == NULL)
+		return -1;
+
+	v6 = strcmp(engine, "maxmind-v6") == 0;
+	step = v6 ? (1ULL << 29) / n : (1ULL << 32) / n;
+	if (step < 2) {
+		fclose(f);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		c = codes[rnd() % 8];
+		len = step / 2 + rnd() % (step / 2) + 1;
+
+		if (v6) {
+			s[0] = 0x20000000 + i * step;
+			e[0] = s[0] + len - 1;
+			s[1] = s[2] = s[3] = 0;
+			e[1] = e[2] = e[3] = 0xFFFFFFFF;
+			ip2clue_addr_v6(a, sizeof(a), s);
+			ip2clue_addr_v6(b, sizeof(b), e);
+			fprintf(f, "\"%s\",\"%s\",\"x\",\"x\",\"%s\",\"%s\"\n",
+				a, b, c[0], c[1]);
+			continue;
+		}
+
+		s[0] = i * step;
+		e[0] = s[0] + len - 1;
+		if (strcmp(engine, "software77") == 0)
+			fprintf(f, "\"%u\",\"%u\",\"ripencc\",\"0\",\"%s\",\"%s\","
+				"\"%s\"\n", s[0], e[0], c[0], c[0], c[1]);
+		else
+			fprintf(f, "\"%u.%u.%u.%u\",\"%u.%u.%u.%u\",\"%u\",\"%u\","
+				"\"%s\",\"%s\"\n",
+				s[0] >> 24, (s[0] >> 16) & 0xFF, (s[0] >> 8) & 0xFF,
+				s[0] & 0xFF, e[0] >> 24, (e[0] >> 16) & 0xFF,
+				(e[0] >> 8) & 0xFF, e[0] & 0xFF, s[0], e[0],
+				c[0], c[1]);
+	}
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	return ip2clue_compare_v6(a, b);
+}
+
+/*
+ * The keys: @ops random addresses (4 words each, host order) and their text
+ */
+static unsigned int	*keys, *sorted;
+static char		(*keys_str)[48];
+static unsigned char	*found;
+static struct ip2clue_result *res;
+
+static int keys_init(const unsigned long ops)
+{
+	keys = (unsigned int *) calloc(ops, 4 * sizeof(unsigned int));
+	sorted = (unsigned int *) calloc(ops, 4 * sizeof(unsigned int));
+	keys_str = malloc(ops * sizeof(keys_str[0]));
+	found = (unsigned char *) malloc(SORTED_BATCH);
+	res = (struct ip2clue_result *) malloc(SORTED_BATCH
+		* sizeof(struct ip2clue_result));
+
+	if (!keys || !sorted || !keys_str || !found || !res)
+		return -1;
+
+	/* No page faults in the first benchmark */
+	memset(keys_str, 0, ops * sizeof(keys_str[0]));
+	memset(res, 0, SORTED_BATCH * sizeof(struct ip2clue_result));
+
+	return 0;
+}
+
+static void keys_gen(const unsigned long ops, const int v6)
+{
+	unsigned long i;
+	unsigned int *k;
+
+	rnd_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	for (i = 0; i < ops; i++) {
+		k = &keys[4 * i];
+		if (v6) {
+			k[0] = 0x20000000 + (rnd() & 0x1FFFFFFF);
+			k[1] = rnd();
+			k[2] = rnd();
+			k[3] = rnd();
+			ip2clue_addr_v6(keys_str[i], sizeof(keys_str[i]), k);
+		} else {
+			k[0] = rnd();
+			k[1] = k[2] = k[3] = 0;
+			snprintf(keys_str[i], sizeof(keys_str[i]), "%u.%u.%u.%u",
+				k[0] >> 24, (k[0] >> 16) & 0xFF, (k[0] >> 8) & 0xFF,
+				k[0] & 0xFF);
+		}
+	}
+}
+
+static int bench_engine(const char *dir, const char *engine,
+	const unsigned long n, const unsigned long ops)
+{
+	struct ip2clue_list list;
+	struct ip2clue_db *db;
+	struct ip2clue_result r;
+	const struct ip2clue_fmt *fmt;
+	char file[1024], spec[64], out[512];
+	unsigned long i, k, hit = 0;
+	int v6 = strcmp(engine, "maxmind-v6") == 0;
+
+	snprintf(file, sizeof(file), "%s/%s.csv", dir, engine);
+	rnd_state = seed;
+	if (gen_table(file, engine, n) != 0) {
+		fprintf(stderr, "Cannot write [%s]!\n", file);
+		return -1;
+	}
+
+	snprintf(spec, sizeof(spec), "%s:%s.csv", engine, engine);
+	ip2clue_list_init(&list);
+	meter_start();
+	if (ip2clue_list_load(&list, dir, spec) != 0) {
+		fprintf(stderr, "Cannot load [%s] (%s)!\n", file,
+			ip2clue_strerror());
+		ip2clue_list_destroy(&list);
+		unlink(file);
+		return -1;
+	}
+	db = list.entries[0];
+	meter_stop("parse", engine, n, n, db->mem);
+	unlink(file);
+
+	keys_gen(ops, v6);
+
+	if (v6) {
+		meter_start();
+		for (i = 0; i < ops; i++)
+			sink += ip2clue_search_v6_bin(db, &keys[4 * i]) != NULL;
+		meter_stop("search_v6_bin", engine, n, ops, db->mem);
+
+		meter_start();
+		for (i = 0; i < ops; i++)
+			sink += ip2clue_search_v6(db, keys_str[i]) != NULL;
+		meter_stop("search_v6", engine, n, ops, db->mem);
+	} else {
+		meter_start();
+		for (i = 0; i < ops; i++)
+			sink += ip2clue_search_v4_bin(db, keys[4 * i]) != NULL;
+		meter_stop("search_v4_bin", engine, n, ops, db->mem);
+
+		meter_start();
+		for (i = 0; i < ops; i++)
+			sink += ip2clue_search_v4(db, keys_str[i]) != NULL;
+		meter_stop("search_v4", engine, n, ops, db->mem);
+	}
+
+	meter_start();
+	for (i = 0; i < ops; i++)
+		sink += ip2clue_list_search(&list, out, sizeof(out),
+			"OK ip=%P cs=%s tz=%t isp=%i", keys_str[i]);
+	meter_stop("list_search", engine, n, ops, db->mem);
+
+	/*
+	 * The sort is part of the cost, as in ip2clue-annotate; v4 keys have
+	 * 0 in the other words, so they sort the same way
+	 */
+	meter_start();
+	memcpy(sorted, keys, ops * 4 * sizeof(unsigned int));
+	qsort(sorted, ops, 4 * sizeof(unsigned int), cmp_key);
+	for (i = 0; i < ops; i += SORTED_BATCH) {
+		k = ops - i < SORTED_BATCH ? ops - i : SORTED_BATCH;
+		memset(found, 0, k);
+		sink += ip2clue_list_lookup_sorted(&list, v6 ? IP2CLUE_TYPE_V6 :
+			IP2CLUE_TYPE_V4, &sorted[4 * i], k, IP2CLUE_FIELD_ALL,
+			res, found);
+	}
+	meter_stop("sort+lookup_sorted", engine, n, ops, db->mem);
+
+	/* Render the answer of the first key found */
+	for (i = 0; i < ops; i++)
+		if ((hit = ip2clue_list_lookup(&list, keys_str[i],
+			IP2CLUE_FIELD_ALL, &r)) == 1)
+			break;
+	fmt = ip2clue_fmt_get("OK ip=%P cs=%s tz=%t isp=%i");
+	if (hit && (fmt != NULL)) {
+		meter_start();
+		for (i = 0; i < ops; i++)
+			sink += ip2clue_fmt_render(out, sizeof(out), fmt, &r,
+				keys_str[i]);
+		meter_stop("fmt_render", engine, n, ops, db->mem);
+	}
+
+	ip2clue_list_destroy(&list);
+
+	return 0;
+}
+
+static void bench_split(const unsigned long ops)
+{
+	struct ip2clue_split s;
+	unsigned long i;
+	const char *line = "\"1.0.0.0\",\"1.0.0.255\",\"16777216\",\"16777471\","
+		"\"AU\",\"Australia\"";
+
+	meter_start();
+	for (i = 0; i < ops; i++)
+		sink += ip2clue_split(&s, line, ",");
+	meter_stop("split", "-", 0, ops, 0);
+}
+
+static int json_write(const char *file, const char *label,
+	const unsigned long ops)
+{
+	FILE *f;
+	unsigned int i;
+	struct result *r;
+	char esc[512];
+
+	f = fopen(file, "w");
+	if (f == NULL)
+		return -1;
+
+	ip2clue_json_escape(esc, sizeof(esc), label);
+	fprintf(f, "{\"label\":\"%s\",\"seed\":%llu,\"ops\":%lu,"
+		"\"cache_misses\":%s,\"results\":[\n",
+		esc, seed, ops, perf_fd == -1 ? "false" : "true");
+	for (i = 0; i < results_no; i++) {
+		r = &results[i];
+		fprintf(f, "{\"bench\":\"%s\",\"engine\":\"%s\",\"ranges\":%lu,"
+			"\"ops\":%lu,\"ns_per_op\":%.2f,", r->bench, r->engine,
+			r->ranges, r->ops, r->ns_op);
+		if (r->misses_op < 0)
+			fprintf(f, "\"cache_misses_per_op\":null,");
+		else
+			fprintf(f, "\"cache_misses_per_op\":%.3f,", r->misses_op);
+		fprintf(f, "\"mem_bytes\":%llu}%s\n", r->mem,
+			i + 1 < results_no ? "," : "");
+	}
+	fprintf(f, "]}\n");
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bench_lookup [-s sizes] [-e engines] [-n ops]"
+		" [-S seed] [-d tmpdir] [-o file.json] [-l label]\n"
+		"  -s sizes    ranges per table (default"
+		" 10000,100000,1000000,10000000)\n"
+		"  -e engines  maxmind,software77,maxmind-v6 (default all)\n"
+		"  -n ops      lookups per benchmark (default 1000000)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char sizes[256] = "10000,100000,1000000,10000000";
+	char engines[256] = "maxmind,software77,maxmind-v6";
+	char dir[512], *tmp = "/tmp", *json = NULL, *label = "";
+	char *s, *sp, *eng[8];
+	unsigned long ops = 1000000, n;
+	unsigned int i, eng_no = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:e:n:S:d:o:l:h")) != -1) {
+		switch (opt) {
+		case 's': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+		case 'e': snprintf(engines, sizeof(engines), "%s", optarg); break;
+		case 'n': ops = strtoul(optarg, NULL, 10); break;
+		case 'S': seed = strtoull(optarg, NULL, 10) | 1; break;
+		case 'd': tmp = optarg; break;
+		case 'o': json = optarg; break;
+		case 'l': label = optarg; break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if ((ops == 0) || (keys_init(ops) != 0)) {
+		usage();
+		return 1;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/ip2clue_bench_XXXXXX", tmp);
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Cannot create a dir in [%s]!\n", tmp);
+		return 1;
+	}
+
+	for (s = strtok_r(engines, ",", &sp); (s != NULL) && (eng_no < 8);
+		s = strtok_r(NULL, ",", &sp))
+		eng[eng_no++] = s;
+
+	perf_open();
+	setlinebuf(stdout);
+	printf("%-20s %-12s %10s %10s %10s %10s %12s\n", "bench", "engine",
+		"ranges", "ops", "ns/op", "misses/op", "mem");
+
+	bench_split(ops);
+	for (s = strtok_r(sizes, ",", &sp); s != NULL;
+		s = strtok_r(NULL, ",", &sp)) {
+		n = strtoul(s, NULL, 10);
+		if (n == 0)
+			continue;
+		for (i = 0; i < eng_no; i++)
+			bench_engine(dir, eng[i], n, ops);
+	}
+	rmdir(dir);
+
+	if ((json != NULL) && (json_write(json, label, ops) != 0)) {
+		fprintf(stderr, "Cannot write [%s]!\n", json);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: fast IPv4/IPv6 text address parser
+ * Accepts the same addresses as inet_pton, plus IPv6 zone ids. The result
+ * is the binary key (host order) and the class of the address, in one pass
+ * over the text, without copying it.
+ */
+
+#include <i_config.h>
+
+#include <i_addr.h>
+
+/*
+ * Char classes: hex value, 16 for ':', 17 for '.', 255 for the rest
+ */
+static const unsigned char ip2clue_addr_tab[256] =
+{
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  17, 255,
+	  0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  16, 255, 255, 255, 255, 255,
+	255,  10,  11,  12,  13,  14,  15, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  10,  11,  12,  13,  14,  15, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+};
+
+/*
+ * Returns the class of a char (see ip2clue_addr_tab)
+ */
+static inline unsigned int ip2clue_addr_class(const char c)
+{
+	return ip2clue_addr_tab[(unsigned char) c];
+}
+
+/*
+ * Parses a dotted quad
+ * Octets are read one char at a time: for 1 to 3 digits this beats 8 byte
+ * (SWAR) conversion, whose data dependent shifts form a long chain, and it
+ * never reads past the end of the string.
+ */
+static const char *ip2clue_addr_scan_v4(const char *p, unsigned int *out)
+{
+	unsigned int i, v, d, r = 0;
+
+	for (i = 0; i < 4; i++) {
+		v = (unsigned char) *p - '0';
+		if (v > 9)
+			return NULL;
+		p++;
+
+		d = (unsigned char) *p - '0';
+		if (d <= 9) {
+			if (v == 0)
+				return NULL;	/* inet_pton refuses leading zeros */
+			v = v * 10 + d;
+			p++;
+
+			d = (unsigned char) *p - '0';
+			if (d <= 9) {
+				v = v * 10 + d;
+				p++;
+				d = (unsigned char) *p - '0';
+				if ((v > 255) || (d <= 9))
+					return NULL;
+			}
+		}
+
+		r = (r << 8) | v;
+
+		if (i < 3) {
+			if (*p != '.')
+				return NULL;
+			p++;
+		}
+	}
+
+	*out = r;
+
+	return p;
+}
+
+/*
+ * Parses an IPv6 address (with an optional IPv4 tail)
+ */
+static const char *ip2clue_addr_scan_v6(const char *p, unsigned int *out)
+{
+	unsigned int g[8], val = 0, h, v4, i, n;
+	int tp = 0, colonp = -1, digits = 0;
+	const char *curtok;
+
+	if (*p == ':') {
+		if (p[1] != ':')
+			return NULL;
+		p++;
+	}
+
+	curtok = p;
+	while (1) {
+		h = ip2clue_addr_class(*p);
+		if (h < 16) {
+			if (++digits > 4)
+				return NULL;
+			val = (val << 4) | h;
+			p++;
+			continue;
+		}
+
+		if (h == 16) {
+			p++;
+			curtok = p;
+			if (digits == 0) {
+				if (colonp != -1)
+					return NULL;
+				colonp = tp;
+				continue;
+			}
+			if (ip2clue_addr_class(*p) > 16)
+				return NULL;	/* trailing ':' */
+			if (tp == 8)
+				return NULL;
+			g[tp++] = val;
+			val = 0;
+			digits = 0;
+			continue;
+		}
+
+		if ((h == 17) && (tp <= 6)) {
+			p = ip2clue_addr_scan_v4(curtok, &v4);
+			if (p == NULL)
+				return NULL;
+			g[tp++] = v4 >> 16;
+			g[tp++] = v4 & 0xFFFF;
+			digits = 0;
+		}
+
+		break;
+	}
+
+	if (digits > 0) {
+		if (tp == 8)
+			return NULL;
+		g[tp++] = val;
+	}
+
+	if (colonp != -1) {
+		if (tp == 8)
+			return NULL;
+		n = tp - colonp;
+		for (i = 1; i <= n; i++)
+			g[8 - i] = g[tp - i];
+		for (i = colonp; i < 8 - n; i++)
+			g[i] = 0;
+	} else if (tp != 8) {
+		return NULL;
+	}
+
+	for (i = 0; i < 4; i++)
+		out[i] = (g[2 * i] << 16) | g[2 * i + 1];
+
+	return p;
+}
+
+/*
+ * Sets the class (and the embedded IPv4, if any) of the IPv6 address in ip
+ */
+void ip2clue_addr_class_v6(struct ip2clue_addr *a)
+{
+	a->v4_or_v6 = IP2CLUE_TYPE_V6;
+	a->addr_class = IP2CLUE_ADDR_V6;
+	a->v4 = 0;
+	if ((a->ip[0] == 0) && (a->ip[1] == 0)) {
+		if (a->ip[2] == 0xFFFF) {
+			a->addr_class = IP2CLUE_ADDR_V4_MAPPED;
+			a->v4 = a->ip[3];
+		} else if ((a->ip[2] == 0) && (a->ip[3] > 1)) {
+			a->addr_class = IP2CLUE_ADDR_V4_COMPAT;
+			a->v4 = a->ip[3];
+		}
+	} else if ((a->ip[0] >> 16) == 0x2002) {
+		a->addr_class = IP2CLUE_ADDR_6TO4;
+		a->v4 = (a->ip[0] << 16) | (a->ip[1] >> 16);
+	}
+}
+
+/*
+ * Parses an address. Stops at the first char that cannot be part of it.
+ * Returns a pointer after the address (and after the zone id, if present)
+ * or NULL if the address is invalid.
+ */
+const char *ip2clue_addr_parse(struct ip2clue_addr *a, const char *s)
+{
+	unsigned int i, c;
+	const char *e, *z;
+
+	a->addr_class = IP2CLUE_ADDR_INVALID;
+
+	/*
+	 * One pass over @s, in place: the scanners stop at the first char
+	 * that cannot be part of the address (the NUL included). The first
+	 * char that is not a hex digit decides the family.
+	 */
+	for (i = 0; (c = ip2clue_addr_class(s[i])) < 16; i++)
+		;
+
+	if (c == 17) {
+		e = ip2clue_addr_scan_v4(s, &a->ip[0]);
+		if (e == NULL)
+			return NULL;
+		a->v4_or_v6 = IP2CLUE_TYPE_V4;
+		a->addr_class = IP2CLUE_ADDR_V4;
+		a->ip[1] = a->ip[2] = a->ip[3] = 0;
+		a->v4 = a->ip[0];
+
+		return e;
+	}
+
+	z = ip2clue_addr_scan_v6(s, a->ip);
+	if (z == NULL)
+		return NULL;
+
+	/* zone id: fe80::1%eth0 */
+	if (*z == '%') {
+		z++;
+		for (i = 0; (z[i] != '\0') && (z[i] != ' ') && (z[i] != '\t')
+			&& (z[i] != '\r') && (z[i] != '\n'); i++)
+			;
+		if (i == 0)
+			return NULL;
+		z += i;
+	}
+
+	ip2clue_addr_class_v6(a);
+
+	return z;
+}
+
+/*
+ * Parses an address that must fill the whole string
+ * Returns 0 if OK, -1 if invalid.
+ */
+int ip2clue_addr_parse_strict(struct ip2clue_addr *a, const char *s)
+{
+	const char *e;
+
+	e = ip2clue_addr_parse(a, s);
+	if ((e == NULL) || (*e != '\0')) {
+		a->addr_class = IP2CLUE_ADDR_INVALID;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: fast IPv4/IPv6 text address parser
+ */
+
+#ifndef IP2CLUE_I_ADDR_H
+#define IP2CLUE_I_ADDR_H 1
+
+#include <i_config.h>
+
+#include <i_types.h>
+
+enum ip2clue_addr_class
+{
+	IP2CLUE_ADDR_INVALID = 0,
+	IP2CLUE_ADDR_V4,
+	IP2CLUE_ADDR_V6,
+	IP2CLUE_ADDR_V4_MAPPED,		/* ::ffff:a.b.c.d */
+	IP2CLUE_ADDR_V4_COMPAT,		/* ::a.b.c.d */
+	IP2CLUE_ADDR_6TO4		/* 2002:xxyy:zztt::/48 */
+};
+
+struct ip2clue_addr
+{
+	enum ip2clue_type	v4_or_v6;
+	enum ip2clue_addr_class	addr_class;
+	unsigned int		ip[4];		/* host order; v4 uses ip[0] */
+	unsigned int		v4;		/* embedded IPv4 for special classes */
+};
+
+extern const char	*ip2clue_addr_parse(struct ip2clue_addr *a,
+				const char *s);
+extern int		ip2clue_addr_parse_strict(struct ip2clue_addr *a,
+				const char *s);
+extern void		ip2clue_addr_class_v6(struct ip2clue_addr *a);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: compact binary protocol (batches of binary addresses)
+ * A client sends IP2CLUE_BIN_MAGIC as the first byte of the connection and
+ * gets the same byte back. After that, every request is:
+ *	id(4) fields(2) count(1) family(1) count * address(4 or 16)
+ * and gets a response:
+ *	len(4) id(4) fields(2) count(1) status(1) count * record
+ * A record is status(1) family(1) and, if found:
+ *	start(4/16) end(4/16) country(2) [lat(4) lon(4)] [strings]
+ * lat/lon are there if any of them is asked, as signed 1e-6 degrees; every
+ * other asked field is a string: len(1) bytes, in the order of the
+ * IP2CLUE_FIELD_* bits. All numbers are big endian.
+ * No address parsing, no format string, no line scanning.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <i_util.h>
+#include <i_bin.h>
+
+#define IP2CLUE_BIN_STR(f, m) \
+	{ f, offsetof(struct ip2clue_extra, m), \
+		sizeof(((struct ip2clue_extra *) 0)->m) }
+
+/* The string fields, in wire order */
+static const struct
+{
+	unsigned int	field;
+	size_t		off, size;
+} ip2clue_bin_strings[] = {
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_COUNTRY_LONG, country_long),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_REGION, region),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_CITY, city),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_ISP, isp),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_ZIP, zip),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_DOMAIN, domain),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_TIMEZONE, timezone),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_NETSPEED, netspeed),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_IDD, idd),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_AREACODE, areacode),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_WS_CODE, ws_code),
+	IP2CLUE_BIN_STR(IP2CLUE_FIELD_WS_NAME, ws_name)
+};
+
+#define IP2CLUE_BIN_STRINGS	\
+	(sizeof(ip2clue_bin_strings) / sizeof(ip2clue_bin_strings[0]))
+
+#define IP2CLUE_BIN_LATLON_FIELDS \
+	(IP2CLUE_FIELD_LATITUDE | IP2CLUE_FIELD_LONGITUDE)
+
+static void ip2clue_bin_put16(unsigned char *p, const unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void ip2clue_bin_put32(unsigned char *p, const unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned int ip2clue_bin_get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int ip2clue_bin_get32(const unsigned char *p)
+{
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Bytes of an address on the wire
+ */
+static unsigned int ip2clue_bin_addr_len(const unsigned int family)
+{
+	return family == IP2CLUE_TYPE_V4 ? 4 : 16;
+}
+
+static void ip2clue_bin_put_addr(unsigned char *p, const unsigned int family,
+	const unsigned int *ip)
+{
+	unsigned int i;
+
+	for (i = 0; i < ip2clue_bin_addr_len(family) / 4; i++)
+		ip2clue_bin_put32(p + i * 4, ip[i]);
+}
+
+static void ip2clue_bin_get_addr(unsigned int *ip, const unsigned int family,
+	const unsigned char *p)
+{
+	unsigned int i;
+
+	memset(ip, 0, 4 * sizeof(unsigned int));
+	for (i = 0; i < ip2clue_bin_addr_len(family) / 4; i++)
+		ip[i] = ip2clue_bin_get32(p + i * 4);
+}
+
+/*
+ * Encodes one found result
+ * Returns the length or 0 if it does not fit.
+ */
+static size_t ip2clue_bin_put_result(unsigned char *out, const size_t out_size,
+	const unsigned int fields, const struct ip2clue_result *r)
+{
+	const struct ip2clue_extra *e = r->extra;
+	const char *s;
+	size_t len, slen, alen;
+	unsigned int i;
+	double v;
+
+	alen = ip2clue_bin_addr_len(r->v4_or_v6);
+	len = 2 + 2 * alen + 2;
+	if (len > out_size)
+		return 0;
+
+	out[0] = IP2CLUE_BIN_FOUND;
+	out[1] = r->v4_or_v6;
+	ip2clue_bin_put_addr(out + 2, r->v4_or_v6, r->ip_start);
+	ip2clue_bin_put_addr(out + 2 + alen, r->v4_or_v6, r->ip_end);
+	out[2 + 2 * alen] = r->country_short[0];
+	out[3 + 2 * alen] = r->country_short[0] ? r->country_short[1] : 0;
+
+	if (fields & IP2CLUE_BIN_LATLON_FIELDS) {
+		if (len + 8 > out_size)
+			return 0;
+		v = e ? e->latitude * IP2CLUE_BIN_LATLON : 0;
+		ip2clue_bin_put32(out + len, (unsigned int) (int) v);
+		v = e ? e->longitude * IP2CLUE_BIN_LATLON : 0;
+		ip2clue_bin_put32(out + len + 4, (unsigned int) (int) v);
+		len += 8;
+	}
+
+	for (i = 0; i < IP2CLUE_BIN_STRINGS; i++) {
+		if (!(fields & ip2clue_bin_strings[i].field))
+			continue;
+
+		s = e ? (const char *) e + ip2clue_bin_strings[i].off : "";
+		slen = strnlen(s, ip2clue_bin_strings[i].size);
+		if (len + 1 + slen > out_size)
+			return 0;
+		out[len] = slen;
+		memcpy(out + len + 1, s, slen);
+		len += 1 + slen;
+	}
+
+	return len;
+}
+
+/*
+ * Answers one request from @in
+ * Sets @used to the request length, 0 if it is not complete yet, and
+ * @close to 1 if the stream cannot be followed anymore (bad family).
+ * Returns the length of the response written in @out; IP2CLUE_BIN_OUT_MAX
+ * bytes are enough for any request.
+ */
+size_t ip2clue_bin_answer(struct ip2clue_list *l, const unsigned char *in,
+	const size_t in_len, size_t *used, unsigned char *out,
+	const size_t out_size, int *close)
+{
+	struct ip2clue_result res;
+	struct ip2clue_addr a;
+	unsigned int id, fields, count, family, alen = 0, i, status;
+	const unsigned char *p;
+	size_t len, n;
+
+	*used = 0;
+	if (in_len < IP2CLUE_BIN_REQ_HEADER)
+		return 0;
+
+	id = ip2clue_bin_get32(in);
+	fields = ip2clue_bin_get16(in + 4) & IP2CLUE_FIELD_ALL;
+	count = in[6];
+	family = in[7];
+
+	status = IP2CLUE_BIN_OK;
+	if ((family != IP2CLUE_TYPE_V4) && (family != IP2CLUE_TYPE_V6)) {
+		/* We do not know where the next request starts */
+		status = IP2CLUE_BIN_EINVAL;
+		*used = in_len;
+		*close = 1;
+		count = 0;
+	} else {
+		alen = ip2clue_bin_addr_len(family);
+		if (in_len < IP2CLUE_BIN_REQ_HEADER + count * alen)
+			return 0;
+		*used = IP2CLUE_BIN_REQ_HEADER + count * alen;
+		if (count > IP2CLUE_BIN_MAX_ADDRS) {
+			status = IP2CLUE_BIN_EINVAL;
+			count = 0;
+		}
+	}
+
+	len = IP2CLUE_BIN_RESP_HEADER;
+	p = in + IP2CLUE_BIN_REQ_HEADER;
+	for (i = 0; i < count; i++, p += alen) {
+		memset(&a, 0, sizeof(a));
+		ip2clue_bin_get_addr(a.ip, family, p);
+		if (family == IP2CLUE_TYPE_V4) {
+			a.v4_or_v6 = IP2CLUE_TYPE_V4;
+			a.addr_class = IP2CLUE_ADDR_V4;
+			a.v4 = a.ip[0];
+		} else {
+			ip2clue_addr_class_v6(&a);
+		}
+
+		if (ip2clue_list_lookup_addr(l, &a, fields, &res) == 1) {
+			n = ip2clue_bin_put_result(out + len, out_size - len,
+				fields, &res);
+		} else if (len + 2 <= out_size) {
+			out[len] = IP2CLUE_BIN_NOTFOUND;
+			out[len + 1] = family;
+			n = 2;
+		} else {
+			n = 0;
+		}
+
+		if (n == 0) {
+			status = IP2CLUE_BIN_ESPACE;
+			break;
+		}
+		len += n;
+	}
+
+	ip2clue_bin_put32(out, len - 4);
+	ip2clue_bin_put32(out + 4, id);
+	ip2clue_bin_put16(out + 8, fields);
+	out[10] = i;
+	out[11] = status;
+
+	return len;
+}
+
+/*
+ * Builds a request for @count addresses (host order, 1 or 4 words each)
+ * Returns its length or -1 if it does not fit.
+ */
+int ip2clue_bin_request(unsigned char *out, const size_t out_size,
+	const unsigned int id, const unsigned int fields,
+	const enum ip2clue_type type, const unsigned int *ips,
+	const unsigned int count)
+{
+	unsigned int i, alen, words;
+	size_t len;
+
+	alen = ip2clue_bin_addr_len(type);
+	words = alen / 4;
+	len = IP2CLUE_BIN_REQ_HEADER + count * alen;
+	if ((count > IP2CLUE_BIN_MAX_ADDRS) || (len > out_size)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"request too big (%u addresses)", count);
+		return -1;
+	}
+
+	ip2clue_bin_put32(out, id);
+	ip2clue_bin_put16(out + 4, fields);
+	out[6] = count;
+	out[7] = type;
+	for (i = 0; i < count; i++)
+		ip2clue_bin_put_addr(out + IP2CLUE_BIN_REQ_HEADER + i * alen,
+			type, ips + i * words);
+
+	return len;
+}
+
+/*
+ * Decodes a response header
+ * Returns 0 if more bytes are needed, else the length of the whole frame.
+ */
+int ip2clue_bin_header(const unsigned char *in, const size_t in_len,
+	struct ip2clue_bin_header *h)
+{
+	if (in_len < IP2CLUE_BIN_RESP_HEADER)
+		return 0;
+
+	h->len = ip2clue_bin_get32(in);
+	h->id = ip2clue_bin_get32(in + 4);
+	h->fields = ip2clue_bin_get16(in + 8);
+	h->count = in[10];
+	h->status = in[11];
+
+	if (in_len < 4 + (size_t) h->len)
+		return 0;
+
+	return 4 + h->len;
+}
+
+/*
+ * Decodes one record of a response; the strings go in r->extra_buf
+ * Returns the record length or -1 if it is truncated.
+ */
+int ip2clue_bin_record(const unsigned char *in, const size_t in_len,
+	const unsigned int fields, int *found, struct ip2clue_result *r)
+{
+	struct ip2clue_extra *e = &r->extra_buf;
+	unsigned int i, alen, slen;
+	size_t len;
+	char *s;
+
+	if ((in_len < 2) || ((in[1] != IP2CLUE_TYPE_V4)
+		&& (in[1] != IP2CLUE_TYPE_V6)))
+		goto out_trunc;
+
+	memset(r, 0, sizeof(struct ip2clue_result));
+	r->v4_or_v6 = in[1];
+	r->extra = e;
+	*found = in[0] == IP2CLUE_BIN_FOUND;
+	if (!*found)
+		return 2;
+
+	alen = ip2clue_bin_addr_len(r->v4_or_v6);
+	len = 2 + 2 * alen + 2;
+	if (in_len < len)
+		goto out_trunc;
+	ip2clue_bin_get_addr(r->ip_start, r->v4_or_v6, in + 2);
+	ip2clue_bin_get_addr(r->ip_end, r->v4_or_v6, in + 2 + alen);
+	r->country_short[0] = in[2 + 2 * alen];
+	r->country_short[1] = in[3 + 2 * alen];
+
+	if (fields & IP2CLUE_BIN_LATLON_FIELDS) {
+		if (in_len < len + 8)
+			goto out_trunc;
+		e->latitude = (int) ip2clue_bin_get32(in + len)
+			/ IP2CLUE_BIN_LATLON;
+		e->longitude = (int) ip2clue_bin_get32(in + len + 4)
+			/ IP2CLUE_BIN_LATLON;
+		len += 8;
+	}
+
+	for (i = 0; i < IP2CLUE_BIN_STRINGS; i++) {
+		if (!(fields & ip2clue_bin_strings[i].field))
+			continue;
+
+		if (in_len < len + 1)
+			goto out_trunc;
+		slen = in[len];
+		if (in_len < len + 1 + slen)
+			goto out_trunc;
+		s = (char *) e + ip2clue_bin_strings[i].off;
+		if (slen >= ip2clue_bin_strings[i].size)
+			slen = ip2clue_bin_strings[i].size - 1;
+		memcpy(s, in + len + 1, slen);
+		s[slen] = '\0';
+		len += 1 + in[len];
+	}
+
+	return len;
+
+	out_trunc:
+	snprintf(ip2clue_error, sizeof(ip2clue_error), "truncated record");
+	return -1;
+}
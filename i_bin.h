@@ -0,0 +1,69 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: compact binary protocol (batches of binary addresses)
+ */
+
+#ifndef IP2CLUE_I_BIN_H
+#define IP2CLUE_I_BIN_H 1
+
+#include <i_config.h>
+
+#include <stdlib.h>
+
+#include <i_types.h>
+
+/* First byte sent by a client that wants the binary protocol */
+#define IP2CLUE_BIN_MAGIC	0xB1
+
+/* Max addresses in one request */
+#define IP2CLUE_BIN_MAX_ADDRS	64
+
+/* Request header: id(4) fields(2) count(1) family(1) */
+#define IP2CLUE_BIN_REQ_HEADER	8
+
+/* Response header: len(4) id(4) fields(2) count(1) status(1) */
+#define IP2CLUE_BIN_RESP_HEADER	12
+
+/* Enough for a response to a full request, all fields */
+#define IP2CLUE_BIN_OUT_MAX	32768
+
+/* Frame status */
+#define IP2CLUE_BIN_OK		0
+#define IP2CLUE_BIN_EINVAL	1	/* bad request, nothing looked up */
+#define IP2CLUE_BIN_ESPACE	2	/* the answer does not fit */
+
+/* Record status */
+#define IP2CLUE_BIN_FOUND	0
+#define IP2CLUE_BIN_NOTFOUND	1
+
+/* Latitude/longitude unit: 1e-6 degrees */
+#define IP2CLUE_BIN_LATLON	1000000.0
+
+struct ip2clue_bin_header
+{
+	unsigned int		len;	/* bytes after the len field */
+	unsigned int		id;
+	unsigned int		fields;
+	unsigned int		count;
+	unsigned int		status;
+};
+
+extern size_t		ip2clue_bin_answer(struct ip2clue_list *l,
+				const unsigned char *in, const size_t in_len,
+				size_t *used, unsigned char *out,
+				const size_t out_size, int *close);
+
+extern int		ip2clue_bin_request(unsigned char *out,
+				const size_t out_size, const unsigned int id,
+				const unsigned int fields,
+				const enum ip2clue_type type,
+				const unsigned int *ips,
+				const unsigned int count);
+extern int		ip2clue_bin_header(const unsigned char *in,
+				const size_t in_len,
+				struct ip2clue_bin_header *h);
+extern int		ip2clue_bin_record(const unsigned char *in,
+				const size_t in_len, const unsigned int fields,
+				int *found, struct ip2clue_result *r);
+
+#endif
@@ -0,0 +1,677 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: client of ip2clued (pooled, pipelined, batched)
+ * Addresses are spread over a pool of connections. On each connection up to
+ * 'window' addresses can wait for an answer, and they are packed 'batch' at a
+ * time in "M" lines; the daemon answers one line per address, in order, so
+ * a per connection queue of tags is enough to match the answers.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <i_util.h>
+#include <libip2clue.h>
+
+/* The daemon keeps 1KiB per address in a 64KiB answer: at most 63 */
+#define IP2CLUE_CLIENT_BATCH_MAX	60
+
+/* Longest address we send */
+#define IP2CLUE_CLIENT_ADDR_MAX	63
+
+/* Longest answer line */
+#define IP2CLUE_CLIENT_IN_MAX	(64 * 1024)
+
+struct ip2clue_client_conn
+{
+	int			fd;		/* -1 = not connected */
+	char			*in;
+	size_t			in_len;
+	char			*out;		/* requests not sent yet */
+	size_t			out_len, out_off, out_size;
+	unsigned int		batch_no;	/* addresses in the open line */
+	void			**tags;		/* ring of 'window' entries */
+	unsigned int		head, count;
+};
+
+struct ip2clue_client
+{
+	char			addr[256];
+	char			format[512];	/* "" = the daemon's */
+	unsigned int		window, batch;
+	ip2clue_client_cb	*cb;
+	void			*arg;
+	unsigned int		conns_no, next;
+	struct ip2clue_client_conn	*conns;
+	struct pollfd		*pfd;		/* one per connection */
+};
+
+/*
+ * Connects to @addr: "/path" (unix socket), "host:port" or "[v6]:port"
+ * Returns the socket (blocking) or -1.
+ */
+static int ip2clue_client_connect(const char *addr)
+{
+	struct sockaddr_un su;
+	struct addrinfo hints, *res, *ai;
+	char host[256], *port;
+	int fd, err, on = 1;
+
+	if (addr[0] == '/') {
+		if (strlen(addr) >= sizeof(su.sun_path)) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"unix socket path too long");
+			return -1;
+		}
+
+		memset(&su, 0, sizeof(su));
+		su.sun_family = AF_UNIX;
+		strcpy(su.sun_path, addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot create socket (%s)", strerror(errno));
+			return -1;
+		}
+
+		if (connect(fd, (struct sockaddr *) &su, sizeof(su)) != 0) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot connect to [%.128s] (%s)",
+				addr, strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+
+	snprintf(host, sizeof(host), "%s", addr[0] == '[' ? addr + 1 : addr);
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"no port in [%.128s]", addr);
+		return -1;
+	}
+	*port++ = '\0';
+	if ((addr[0] == '[') && (port - host >= 2) && (port[-2] == ']'))
+		port[-2] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot resolve [%.128s] (%s)",
+			addr, gai_strerror(err));
+		return -1;
+	}
+
+	fd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot connect to [%.128s] (%s)",
+			addr, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd != -1)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return fd;
+}
+
+/*
+ * Sends a line and waits for its answer; nothing else may be in flight
+ * Returns 0 if the answer is "OK...", else -1.
+ */
+static int ip2clue_client_command(struct ip2clue_client_conn *cc,
+	const char *cmd)
+{
+	size_t len, off = 0;
+	ssize_t n;
+	char *e;
+
+	len = strlen(cmd);
+	while (off < len) {
+		n = send(cc->fd, cmd + off, len - off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot send (%s)", strerror(errno));
+			return -1;
+		}
+		off += n;
+	}
+
+	cc->in_len = 0;
+	while ((e = (char *) memchr(cc->in, '\n', cc->in_len)) == NULL) {
+		n = recv(cc->fd, cc->in + cc->in_len,
+			IP2CLUE_CLIENT_IN_MAX - 1 - cc->in_len, 0);
+		if ((n == -1) && (errno == EINTR))
+			continue;
+		if (n <= 0) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"connection lost");
+			return -1;
+		}
+		cc->in_len += n;
+	}
+
+	*e = '\0';
+	if ((e > cc->in) && (e[-1] == '\r'))
+		e[-1] = '\0';
+	cc->in_len = 0;
+
+	if (strncmp(cc->in, "OK", 2) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error), "%s", cc->in);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * (Re)connects a connection of the pool and sets the format on it
+ */
+static int ip2clue_client_conn_open(struct ip2clue_client *c,
+	struct ip2clue_client_conn *cc)
+{
+	char cmd[sizeof(c->format) + 4];
+
+	cc->fd = ip2clue_client_connect(c->addr);
+	if (cc->fd == -1)
+		return -1;
+
+	if (c->format[0] != '\0') {
+		snprintf(cmd, sizeof(cmd), "F%s\n", c->format);
+		if (ip2clue_client_command(cc, cmd) != 0)
+			goto out_close;
+	}
+
+	if (fcntl(cc->fd, F_SETFL, O_NONBLOCK) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot set non-blocking (%s)", strerror(errno));
+		goto out_close;
+	}
+
+	return 0;
+
+	out_close:
+	close(cc->fd);
+	cc->fd = -1;
+	return -1;
+}
+
+/*
+ * Drops a connection: all its pending addresses get @err as answer
+ * Returns the number of answers given.
+ */
+static int ip2clue_client_conn_fail(struct ip2clue_client *c,
+	struct ip2clue_client_conn *cc, const char *err)
+{
+	char answer[300];
+	void *tag;
+	int answers = 0;
+
+	if (cc->fd != -1)
+		close(cc->fd);
+	cc->fd = -1;
+	cc->in_len = 0;
+	cc->out_len = 0;
+	cc->out_off = 0;
+	cc->batch_no = 0;
+
+	snprintf(answer, sizeof(answer), IP2CLUE_CLIENT_LOST "errmsg=\"%s\"",
+		err);
+	while (cc->count > 0) {
+		tag = cc->tags[cc->head];
+		cc->head = (cc->head + 1) % c->window;
+		cc->count--;
+		c->cb(tag, answer, c->arg);
+		answers++;
+	}
+
+	return answers;
+}
+
+/*
+ * Opens a pool of @conns connections to @addr (see ip2clue_client_connect)
+ * Up to @window addresses wait for answers on a connection, sent @batch
+ * per request line. @cb is called for every answer.
+ */
+struct ip2clue_client *ip2clue_client_open(const char *addr,
+	const unsigned int conns, const unsigned int window,
+	const unsigned int batch, ip2clue_client_cb *cb, void *arg)
+{
+	struct ip2clue_client *c;
+	struct ip2clue_client_conn *cc;
+	unsigned int i;
+
+	if ((conns == 0) || (window == 0) || (batch == 0)
+		|| (batch > IP2CLUE_CLIENT_BATCH_MAX)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"invalid pool (conns and window > 0, batch 1-%u)",
+			IP2CLUE_CLIENT_BATCH_MAX);
+		return NULL;
+	}
+
+	c = (struct ip2clue_client *) calloc(1, sizeof(struct ip2clue_client));
+	if (c == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for a client");
+		return NULL;
+	}
+
+	snprintf(c->addr, sizeof(c->addr), "%s", addr);
+	c->window = window;
+	c->batch = batch;
+	c->cb = cb;
+	c->arg = arg;
+
+	c->conns = (struct ip2clue_client_conn *) calloc(conns,
+		sizeof(struct ip2clue_client_conn));
+	c->pfd = (struct pollfd *) calloc(conns, sizeof(struct pollfd));
+	if ((c->conns == NULL) || (c->pfd == NULL)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for %u connections", conns);
+		free(c->conns);
+		free(c->pfd);
+		free(c);
+		return NULL;
+	}
+
+	for (i = 0; i < conns; i++) {
+		cc = &c->conns[i];
+		c->conns_no++;
+		cc->fd = -1;
+		/* Every pending address takes at most a command char, the
+		 * address and a separator */
+		cc->out_size = window * (IP2CLUE_CLIENT_ADDR_MAX + 3);
+		cc->out = (char *) malloc(cc->out_size);
+		cc->in = (char *) malloc(IP2CLUE_CLIENT_IN_MAX);
+		cc->tags = (void **) malloc(window * sizeof(void *));
+		if ((cc->out == NULL) || (cc->in == NULL) || (cc->tags == NULL)) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot alloc memory for a connection");
+			goto out_close;
+		}
+
+		if (ip2clue_client_conn_open(c, cc) != 0)
+			goto out_close;
+	}
+
+	return c;
+
+	out_close:
+	ip2clue_client_close(c);
+	return NULL;
+}
+
+/*
+ * Sets the answer format for all the connections ("" = the daemon's)
+ * Waits for the pending answers first. Needs a daemon with I/O threads.
+ */
+int ip2clue_client_format(struct ip2clue_client *c, const char *format)
+{
+	struct ip2clue_client_conn *cc;
+	char cmd[sizeof(c->format) + 4];
+	unsigned int i;
+
+	if (strlen(format) >= sizeof(c->format)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"format too long");
+		return -1;
+	}
+
+	if (ip2clue_client_wait(c) != 0)
+		return -1;
+
+	snprintf(c->format, sizeof(c->format), "%s", format);
+	snprintf(cmd, sizeof(cmd), "F%s\n", format);
+	for (i = 0; i < c->conns_no; i++) {
+		cc = &c->conns[i];
+		if (cc->fd == -1)
+			continue;
+
+		/* The command is done in blocking mode */
+		fcntl(cc->fd, F_SETFL, 0);
+		if (ip2clue_client_command(cc, cmd) != 0)
+			return -1;
+		fcntl(cc->fd, F_SETFL, O_NONBLOCK);
+	}
+
+	return 0;
+}
+
+/*
+ * Ends the open request line, if any
+ */
+static void ip2clue_client_end_line(struct ip2clue_client_conn *cc)
+{
+	if (cc->batch_no == 0)
+		return;
+
+	cc->out[cc->out_len++] = '\n';
+	cc->batch_no = 0;
+}
+
+/*
+ * Sends what we can from the output buffer; the rest moves to its start
+ * Returns -1 if the connection is dead.
+ */
+static int ip2clue_client_flush(struct ip2clue_client_conn *cc)
+{
+	ssize_t n;
+
+	while (cc->out_off < cc->out_len) {
+		n = send(cc->fd, cc->out + cc->out_off,
+			cc->out_len - cc->out_off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if (errno == EINTR)
+				continue;
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot send (%s)", strerror(errno));
+			return -1;
+		}
+		cc->out_off += n;
+	}
+
+	if (cc->out_off < cc->out_len) {
+		memmove(cc->out, cc->out + cc->out_off,
+			cc->out_len - cc->out_off);
+		cc->out_len -= cc->out_off;
+		cc->out_off = 0;
+		return 0;
+	}
+
+	cc->out_off = 0;
+	cc->out_len = 0;
+
+	return 0;
+}
+
+/*
+ * Reads the answers that arrived and gives them to the callback
+ * Returns the number of answers or -1 if the connection is dead.
+ */
+static int ip2clue_client_read(struct ip2clue_client *c,
+	struct ip2clue_client_conn *cc)
+{
+	ssize_t n;
+	char *line, *e;
+	size_t left;
+	void *tag;
+	int answers = 0;
+
+	while (1) {
+		n = recv(cc->fd, cc->in + cc->in_len,
+			IP2CLUE_CLIENT_IN_MAX - cc->in_len, 0);
+		if (n == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if (errno == EINTR)
+				continue;
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot receive (%s)", strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"connection closed by the daemon");
+			return -1;
+		}
+		cc->in_len += n;
+
+		line = cc->in;
+		left = cc->in_len;
+		while ((e = (char *) memchr(line, '\n', left)) != NULL) {
+			*e = '\0';
+			if ((e > line) && (e[-1] == '\r'))
+				e[-1] = '\0';
+
+			/* Nobody waits for it: ignore */
+			if (cc->count > 0) {
+				tag = cc->tags[cc->head];
+				cc->head = (cc->head + 1) % c->window;
+				cc->count--;
+				c->cb(tag, line, c->arg);
+				answers++;
+			}
+
+			left -= e + 1 - line;
+			line = e + 1;
+		}
+
+		if (left == IP2CLUE_CLIENT_IN_MAX) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"answer too long");
+			return -1;
+		}
+		memmove(cc->in, line, left);
+		cc->in_len = left;
+	}
+
+	return answers;
+}
+
+/*
+ * Sends the queued requests and waits up to @timeout_ns (-1 = forever) for
+ * answers. Returns the number of answers given to the callback, or -1.
+ * With no request pending it returns right away.
+ */
+int ip2clue_client_poll_ns(struct ip2clue_client *c,
+	const long long timeout_ns)
+{
+	struct ip2clue_client_conn *cc;
+	struct pollfd *pfd = c->pfd;
+	struct timespec ts;
+	unsigned int i, busy = 0;
+	int ret, answers = 0;
+
+	for (i = 0; i < c->conns_no; i++) {
+		cc = &c->conns[i];
+		pfd[i].fd = -1;
+		pfd[i].events = 0;
+		pfd[i].revents = 0;
+		if ((cc->fd == -1) || (cc->count == 0))
+			continue;
+
+		/* We wait, so the partial lines must go */
+		ip2clue_client_end_line(cc);
+		if (ip2clue_client_flush(cc) != 0) {
+			answers += ip2clue_client_conn_fail(c, cc, ip2clue_error);
+			continue;
+		}
+
+		pfd[i].fd = cc->fd;
+		pfd[i].events = POLLIN;
+		if (cc->out_off < cc->out_len)
+			pfd[i].events |= POLLOUT;
+		busy++;
+	}
+
+	if (busy == 0)
+		return answers;
+
+	ts.tv_sec = timeout_ns / 1000000000LL;
+	ts.tv_nsec = timeout_ns % 1000000000LL;
+	ret = ppoll(pfd, c->conns_no, timeout_ns < 0 ? NULL : &ts, NULL);
+	if (ret == -1) {
+		if (errno == EINTR)
+			return answers;
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"poll error (%s)", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < c->conns_no; i++) {
+		cc = &c->conns[i];
+		if (pfd[i].revents == 0)
+			continue;
+
+		if ((pfd[i].revents & POLLOUT)
+			&& (ip2clue_client_flush(cc) != 0)) {
+			answers += ip2clue_client_conn_fail(c, cc, ip2clue_error);
+			continue;
+		}
+
+		if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ret = ip2clue_client_read(c, cc);
+			if (ret == -1) {
+				answers += ip2clue_client_conn_fail(c, cc,
+					ip2clue_error);
+				continue;
+			}
+			answers += ret;
+		}
+	}
+
+	return answers;
+}
+
+/*
+ * As ip2clue_client_poll_ns, with @timeout in ms (-1 = forever)
+ */
+int ip2clue_client_poll(struct ip2clue_client *c, const int timeout)
+{
+	return ip2clue_client_poll_ns(c, timeout < 0 ? -1 :
+		timeout * 1000000LL);
+}
+
+/*
+ * Queues address @ip; @tag comes back with its answer
+ * If all the windows are full, it first waits for answers.
+ * Returns 0 if OK, -1 on error (bad address or no connection).
+ */
+int ip2clue_client_submit(struct ip2clue_client *c, const char *ip, void *tag)
+{
+	struct ip2clue_client_conn *cc = NULL;
+	size_t len;
+	unsigned int i, k;
+
+	len = strcspn(ip, " \t\r\n");
+	if ((len == 0) || (len > IP2CLUE_CLIENT_ADDR_MAX) || (ip[len] != '\0')) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"malformed address");
+		return -1;
+	}
+
+	while (1) {
+		for (i = 0; i < c->conns_no; i++) {
+			k = (c->next + i) % c->conns_no;
+			if (c->conns[k].count < c->window) {
+				cc = &c->conns[k];
+				break;
+			}
+		}
+		if (cc != NULL)
+			break;
+
+		if (ip2clue_client_poll(c, -1) == -1)
+			return -1;
+	}
+
+	/* Stay on the same connection for a whole line */
+	if (cc->batch_no + 1 >= c->batch)
+		c->next = (cc - c->conns + 1) % c->conns_no;
+	else
+		c->next = cc - c->conns;
+
+	if ((cc->fd == -1) && (ip2clue_client_conn_open(c, cc) != 0))
+		return -1;
+
+	/* Command char or separator, the address and maybe the '\n' */
+	if (cc->out_len + len + 2 > cc->out_size) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"output buffer full");
+		return -1;
+	}
+
+	if (cc->batch_no == 0)
+		cc->out[cc->out_len++] = c->batch > 1 ? 'M' : 'R';
+	else
+		cc->out[cc->out_len++] = ' ';
+	memcpy(cc->out + cc->out_len, ip, len);
+	cc->out_len += len;
+
+	cc->tags[(cc->head + cc->count) % c->window] = tag;
+	cc->count++;
+
+	if (++cc->batch_no < c->batch)
+		return 0;
+
+	ip2clue_client_end_line(cc);
+	if (ip2clue_client_flush(cc) != 0)
+		ip2clue_client_conn_fail(c, cc, ip2clue_error);
+
+	return 0;
+}
+
+/*
+ * Waits for all the answers
+ */
+int ip2clue_client_wait(struct ip2clue_client *c)
+{
+	unsigned int i, pending;
+
+	while (1) {
+		pending = 0;
+		for (i = 0; i < c->conns_no; i++)
+			pending += c->conns[i].count;
+		if (pending == 0)
+			return 0;
+
+		if (ip2clue_client_poll(c, -1) == -1)
+			return -1;
+	}
+}
+
+/*
+ * Closes the pool; pending addresses are answered with an error
+ */
+void ip2clue_client_close(struct ip2clue_client *c)
+{
+	struct ip2clue_client_conn *cc;
+	unsigned int i;
+
+	if (c == NULL)
+		return;
+
+	for (i = 0; i < c->conns_no; i++) {
+		cc = &c->conns[i];
+		if (cc->tags != NULL)
+			ip2clue_client_conn_fail(c, cc, "client closed");
+		free(cc->in);
+		free(cc->out);
+		free(cc->tags);
+	}
+	free(c->conns);
+	free(c->pfd);
+	free(c);
+}
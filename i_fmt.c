@@ -0,0 +1,339 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: compiled response formats
+ * A format string ("OK ip=%P cs=%s ...") is parsed once into a list of
+ * operations (literal text, the address, a field) and the set of fields it
+ * uses, so a lookup asks only for those and rendering does not parse again.
+ * The formats of the configuration and of the library calls are kept in a
+ * hash table shared by all the threads and are never freed, so a client can
+ * keep a pointer to one without a lock. The ones sent by the clients of the
+ * daemon are compiled per connection (ip2clue_fmt_new), and freed with it.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <i_util.h>
+#include <i_fmt.h>
+
+struct ip2clue_fmt_spec
+{
+	char			c;
+	unsigned int		field;
+};
+
+static const struct ip2clue_fmt_spec ip2clue_fmt_specs[] =
+{
+	{ 's', IP2CLUE_FIELD_COUNTRY_SHORT },
+	{ 'L', IP2CLUE_FIELD_COUNTRY_LONG },
+	{ 'r', IP2CLUE_FIELD_REGION },
+	{ 'c', IP2CLUE_FIELD_CITY },
+	{ 'i', IP2CLUE_FIELD_ISP },
+	{ 'x', IP2CLUE_FIELD_LATITUDE },
+	{ 'y', IP2CLUE_FIELD_LONGITUDE },
+	{ 'z', IP2CLUE_FIELD_ZIP },
+	{ 'd', IP2CLUE_FIELD_DOMAIN },
+	{ 't', IP2CLUE_FIELD_TIMEZONE },
+	{ 'n', IP2CLUE_FIELD_NETSPEED },
+	{ 'k', IP2CLUE_FIELD_IDD },
+	{ 'a', IP2CLUE_FIELD_AREACODE },
+	{ 'w', IP2CLUE_FIELD_WS_CODE },
+	{ 'W', IP2CLUE_FIELD_WS_NAME },
+	{ '\0', 0 }
+};
+
+static struct ip2clue_fmt	*ip2clue_fmt_cache[IP2CLUE_FMT_CACHE];
+static unsigned int		ip2clue_fmt_cache_no;
+static pthread_mutex_t		ip2clue_fmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * FNV-1a
+ */
+static unsigned int ip2clue_fmt_hash(const char *s)
+{
+	unsigned int h = 2166136261U;
+
+	while (*s != '\0') {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static unsigned int ip2clue_fmt_field(const char c)
+{
+	const struct ip2clue_fmt_spec *s;
+
+	for (s = ip2clue_fmt_specs; s->c != '\0'; s++)
+		if (s->c == c)
+			return s->field;
+
+	return 0;
+}
+
+/*
+ * Appends a literal char to the last operation (or to a new one)
+ */
+static void ip2clue_fmt_text(struct ip2clue_fmt *f, unsigned int *text_len,
+	const char c)
+{
+	struct ip2clue_fmt_op *op;
+
+	op = f->ops_no > 0 ? &f->ops[f->ops_no - 1] : NULL;
+	if ((op == NULL) || (op->type != IP2CLUE_FMT_TEXT)) {
+		op = &f->ops[f->ops_no++];
+		op->type = IP2CLUE_FMT_TEXT;
+		op->field = 0;
+		op->off = *text_len;
+		op->len = 0;
+	}
+
+	f->text[(*text_len)++] = c;
+	op->len++;
+}
+
+/*
+ * Parses a format string
+ * Same rules as always: "%%" is a '%', an unknown "%<c>" is dropped.
+ */
+static struct ip2clue_fmt *ip2clue_fmt_compile(const char *format,
+	const unsigned int hash)
+{
+	struct ip2clue_fmt *f;
+	struct ip2clue_fmt_op *op;
+	size_t len;
+	unsigned int text_len = 0, field;
+	const char *p;
+	char *mem;
+
+	len = strlen(format);
+
+	/* One block: the struct, at most one op per char, two copies */
+	mem = (char *) malloc(sizeof(struct ip2clue_fmt)
+		+ (len + 1) * sizeof(struct ip2clue_fmt_op) + 2 * (len + 1));
+	if (mem == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for a format");
+		return NULL;
+	}
+
+	f = (struct ip2clue_fmt *) mem;
+	f->ops = (struct ip2clue_fmt_op *) (mem + sizeof(struct ip2clue_fmt));
+	f->format = (char *) (f->ops + len + 1);
+	f->text = f->format + len + 1;
+	strcpy(f->format, format);
+	f->hash = hash;
+	f->fields = 0;
+	f->ops_no = 0;
+
+	for (p = format; *p != '\0'; p++) {
+		if (*p != '%') {
+			ip2clue_fmt_text(f, &text_len, *p);
+			continue;
+		}
+
+		p++;
+		if (*p == '\0')
+			break;
+
+		if (*p == '%') {
+			ip2clue_fmt_text(f, &text_len, '%');
+			continue;
+		}
+
+		if (*p == 'P') {
+			op = &f->ops[f->ops_no++];
+			op->type = IP2CLUE_FMT_IP;
+			op->field = 0;
+			continue;
+		}
+
+		field = ip2clue_fmt_field(*p);
+		if (field == 0)
+			continue;
+
+		op = &f->ops[f->ops_no++];
+		op->type = IP2CLUE_FMT_FIELD;
+		op->field = field;
+		f->fields |= field;
+	}
+	f->text[text_len] = '\0';
+
+	return f;
+}
+
+static int ip2clue_fmt_check(const char *format)
+{
+	if (strlen(format) > IP2CLUE_FMT_MAX) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"format too long (max %u)", IP2CLUE_FMT_MAX);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Compiles @format for one user, outside the shared table
+ * Returns NULL on error; the caller frees it with ip2clue_fmt_free.
+ */
+const struct ip2clue_fmt *ip2clue_fmt_new(const char *format)
+{
+	if (ip2clue_fmt_check(format) != 0)
+		return NULL;
+
+	return ip2clue_fmt_compile(format, ip2clue_fmt_hash(format));
+}
+
+void ip2clue_fmt_free(const struct ip2clue_fmt *f)
+{
+	free((void *) f); /* one block, see ip2clue_fmt_compile */
+}
+
+/*
+ * Returns the compiled version of @format, compiling it the first time
+ * Lookups do not lock; only adding a new format does.
+ */
+const struct ip2clue_fmt *ip2clue_fmt_get(const char *format)
+{
+	struct ip2clue_fmt *f;
+	unsigned int hash, i, slot = 0;
+
+	if (ip2clue_fmt_check(format) != 0)
+		return NULL;
+
+	hash = ip2clue_fmt_hash(format);
+	for (i = 0; i < IP2CLUE_FMT_CACHE; i++) {
+		slot = (hash + i) % IP2CLUE_FMT_CACHE;
+		f = __atomic_load_n(&ip2clue_fmt_cache[slot], __ATOMIC_ACQUIRE);
+		if (f == NULL)
+			break;
+		if ((f->hash == hash) && (strcmp(f->format, format) == 0))
+			return f;
+	}
+
+	pthread_mutex_lock(&ip2clue_fmt_lock);
+
+	/* Somebody may have added it (or another one) meanwhile */
+	for (; i < IP2CLUE_FMT_CACHE; i++) {
+		slot = (hash + i) % IP2CLUE_FMT_CACHE;
+		f = ip2clue_fmt_cache[slot];
+		if (f == NULL)
+			break;
+		if ((f->hash == hash) && (strcmp(f->format, format) == 0))
+			goto out_unlock;
+	}
+
+	f = NULL;
+	if ((i == IP2CLUE_FMT_CACHE)
+		|| (ip2clue_fmt_cache_no >= IP2CLUE_FMT_CACHE - 1)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"too many formats (max %u)", IP2CLUE_FMT_CACHE - 1);
+		goto out_unlock;
+	}
+
+	f = ip2clue_fmt_compile(format, hash);
+	if (f == NULL)
+		goto out_unlock;
+
+	__atomic_store_n(&ip2clue_fmt_cache[slot], f, __ATOMIC_RELEASE);
+	ip2clue_fmt_cache_no++;
+
+	out_unlock:
+	pthread_mutex_unlock(&ip2clue_fmt_lock);
+	return f;
+}
+
+/*
+ * Returns the text of a field; numbers are printed in @num
+ */
+static const char *ip2clue_fmt_value(const unsigned int field,
+	const struct ip2clue_result *r, const struct ip2clue_extra *e,
+	char *num, const size_t num_size)
+{
+	if (field == IP2CLUE_FIELD_COUNTRY_SHORT)
+		return r->country_short;
+
+	if (e == NULL)
+		return "";
+
+	switch (field) {
+	case IP2CLUE_FIELD_COUNTRY_LONG: return e->country_long;
+	case IP2CLUE_FIELD_REGION: return e->region;
+	case IP2CLUE_FIELD_CITY: return e->city;
+	case IP2CLUE_FIELD_ISP: return e->isp;
+	case IP2CLUE_FIELD_ZIP: return e->zip;
+	case IP2CLUE_FIELD_DOMAIN: return e->domain;
+	case IP2CLUE_FIELD_TIMEZONE: return e->timezone;
+	case IP2CLUE_FIELD_NETSPEED: return e->netspeed;
+	case IP2CLUE_FIELD_IDD: return e->idd;
+	case IP2CLUE_FIELD_AREACODE: return e->areacode;
+	case IP2CLUE_FIELD_WS_CODE: return e->ws_code;
+	case IP2CLUE_FIELD_WS_NAME: return e->ws_name;
+	case IP2CLUE_FIELD_LATITUDE:
+		snprintf(num, num_size, "%f", e->latitude);
+		return num;
+	case IP2CLUE_FIELD_LONGITUDE:
+		snprintf(num, num_size, "%f", e->longitude);
+		return num;
+	}
+
+	return "";
+}
+
+/*
+ * Builds the answer for result @r of address @ip
+ * A format without extra fields never touches the extra record.
+ * Returns the length or -1 if @out is too short.
+ */
+int ip2clue_fmt_render(char *out, const size_t out_size,
+	const struct ip2clue_fmt *f, const struct ip2clue_result *r,
+	const char *ip)
+{
+	const struct ip2clue_fmt_op *op;
+	const struct ip2clue_extra *e = NULL;
+	const char *s;
+	char num[64];
+	size_t len = 0, n;
+	unsigned int i;
+
+	if (f->fields & IP2CLUE_FIELD_EXTRA)
+		e = r->extra;
+
+	for (i = 0; i < f->ops_no; i++) {
+		op = &f->ops[i];
+		switch (op->type) {
+		case IP2CLUE_FMT_TEXT:
+			s = f->text + op->off;
+			n = op->len;
+			break;
+
+		case IP2CLUE_FMT_IP:
+			s = ip;
+			n = strlen(s);
+			break;
+
+		default:
+			s = ip2clue_fmt_value(op->field, r, e, num, sizeof(num));
+			n = strlen(s);
+			break;
+		}
+
+		if (n >= out_size - len) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"output buffer too short to add"
+				" more %zu bytes", n);
+			return -1;
+		}
+
+		memcpy(out + len, s, n);
+		len += n;
+	}
+	out[len] = '\0';
+
+	return len;
+}
@@ -0,0 +1,54 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: compiled response formats
+ */
+
+#ifndef IP2CLUE_I_FMT_H
+#define IP2CLUE_I_FMT_H 1
+
+#include <i_config.h>
+
+#include <stdlib.h>
+
+#include <i_types.h>
+
+/* Max length of a format string */
+#define IP2CLUE_FMT_MAX		256
+
+/* Max number of formats in the shared table; they are never freed */
+#define IP2CLUE_FMT_CACHE	256
+
+enum ip2clue_fmt_op_type
+{
+	IP2CLUE_FMT_TEXT = 0,	/* literal text */
+	IP2CLUE_FMT_IP,		/* %P, the address as asked */
+	IP2CLUE_FMT_FIELD	/* a field of the result */
+};
+
+struct ip2clue_fmt_op
+{
+	unsigned short		type;
+	unsigned short		field;		/* IP2CLUE_FIELD_* */
+	unsigned short		off, len;	/* in 'text', for TEXT */
+};
+
+struct ip2clue_fmt
+{
+	unsigned int		hash;
+	unsigned int		fields;		/* what the lookup must fill */
+	unsigned int		ops_no;
+	struct ip2clue_fmt_op	*ops;
+	char			*format;	/* the source */
+	char			*text;		/* the literal parts */
+};
+
+extern const struct ip2clue_fmt	*ip2clue_fmt_get(const char *format);
+extern const struct ip2clue_fmt	*ip2clue_fmt_new(const char *format);
+extern void			ip2clue_fmt_free(const struct ip2clue_fmt *f);
+
+extern int		ip2clue_fmt_render(char *out, const size_t out_size,
+				const struct ip2clue_fmt *f,
+				const struct ip2clue_result *r,
+				const char *ip);
+
+#endif
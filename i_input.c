@@ -0,0 +1,392 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: buffered input for data files (plain, gzip, zip)
+ * Compressed files are inflated in fixed size chunks, straight into the
+ * parser, so the uncompressed copy never lands on disk. Plain files are
+ * given to the parser from the read buffer, without a copy.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <i_util.h>
+#include <i_input.h>
+
+/*
+ * Little endian readers for zip headers
+ */
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+ * Reads more raw data in 'in' buffer, keeping the unconsumed bytes
+ * Returns number of new bytes, 0 on EOF, -1 on error.
+ */
+static int ip2clue_input_read(struct ip2clue_input *in)
+{
+	ssize_t n;
+
+	if (in->in_pos > 0) {
+		memmove(in->in, in->in + in->in_pos, in->in_len - in->in_pos);
+		in->in_len -= in->in_pos;
+		in->in_pos = 0;
+	}
+
+	if (in->in_len == sizeof(in->in))
+		return 0;
+
+	n = read(in->fd, in->in + in->in_len, sizeof(in->in) - in->in_len);
+	if (n == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot read (%s)", strerror(errno));
+		return -1;
+	}
+
+	in->in_len += n;
+	in->bytes_in += n;
+
+	return n;
+}
+
+/*
+ * Parse zip local headers and position on the first real file
+ */
+static int ip2clue_input_zip(struct ip2clue_input *in)
+{
+	unsigned char *h;
+	unsigned int flags, method, name_len, extra_len, csize, hlen;
+
+	while (1) {
+		if (in->in_len - in->in_pos < 30) {
+			if (ip2clue_input_read(in) == -1)
+				return -1;
+			if (in->in_len - in->in_pos < 30)
+				break;
+		}
+
+		h = in->in + in->in_pos;
+		if (le32(h) != 0x04034b50)
+			break;
+
+		flags = le16(h + 6);
+		method = le16(h + 8);
+		csize = le32(h + 18);
+		name_len = le16(h + 26);
+		extra_len = le16(h + 28);
+		hlen = 30 + name_len + extra_len;
+
+		if (in->in_len - in->in_pos < hlen) {
+			if (ip2clue_input_read(in) == -1)
+				return -1;
+			h = in->in + in->in_pos;
+			if (in->in_len - in->in_pos < hlen) {
+				snprintf(ip2clue_error, sizeof(ip2clue_error),
+					"zip header too big");
+				return -1;
+			}
+		}
+
+		if (flags & 1) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"encrypted zip files are not supported");
+			return -1;
+		}
+
+		/* Skip directories */
+		if ((name_len > 0) && (h[30 + name_len - 1] == '/')) {
+			if (flags & 8) {
+				snprintf(ip2clue_error, sizeof(ip2clue_error),
+					"zip: cannot skip streamed entry");
+				return -1;
+			}
+			in->in_pos += hlen;
+			while (csize > 0) {
+				if (in->in_pos == in->in_len) {
+					if (ip2clue_input_read(in) <= 0) {
+						snprintf(ip2clue_error, sizeof(ip2clue_error),
+							"zip: truncated file");
+						return -1;
+					}
+				}
+				hlen = in->in_len - in->in_pos;
+				if (hlen > csize)
+					hlen = csize;
+				in->in_pos += hlen;
+				csize -= hlen;
+			}
+			continue;
+		}
+
+		in->in_pos += hlen;
+
+		if (method == 0) {
+			if (flags & 8) {
+				snprintf(ip2clue_error, sizeof(ip2clue_error),
+					"zip: stored entry without size");
+				return -1;
+			}
+			in->type = IP2CLUE_INPUT_ZIP_STORED;
+			in->stored_left = csize;
+			return 0;
+		}
+
+		if (method == 8) {
+			if (inflateInit2(&in->z, -MAX_WBITS) != Z_OK) {
+				snprintf(ip2clue_error, sizeof(ip2clue_error),
+					"zip: cannot init zlib");
+				return -1;
+			}
+			in->z_init = 1;
+			in->type = IP2CLUE_INPUT_ZIP_DEFLATE;
+			return 0;
+		}
+
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"zip: unsupported compression method %u", method);
+		return -1;
+	}
+
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"zip: no file found in archive");
+	return -1;
+}
+
+/*
+ * Opens a file and detects the compression by magic bytes
+ */
+struct ip2clue_input *ip2clue_input_open(const char *file)
+{
+	struct ip2clue_input *in;
+
+	in = (struct ip2clue_input *) malloc(sizeof(struct ip2clue_input));
+	if (in == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for input");
+		return NULL;
+	}
+	memset(in, 0, sizeof(struct ip2clue_input));
+
+	in->fd = open(file, O_RDONLY);
+	if (in->fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot open [%s] (%s)", file, strerror(errno));
+		free(in);
+		return NULL;
+	}
+	posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (ip2clue_input_read(in) == -1)
+		goto out_close;
+
+	in->type = IP2CLUE_INPUT_PLAIN;
+	if ((in->in_len >= 2) && (in->in[0] == 0x1f) && (in->in[1] == 0x8b)) {
+		if (inflateInit2(&in->z, MAX_WBITS + 16) != Z_OK) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"gzip: cannot init zlib");
+			goto out_close;
+		}
+		in->z_init = 1;
+		in->type = IP2CLUE_INPUT_GZIP;
+	} else if ((in->in_len >= 4) && (le32(in->in) == 0x04034b50)) {
+		if (ip2clue_input_zip(in) != 0)
+			goto out_close;
+	}
+
+	return in;
+
+	out_close:
+	ip2clue_input_close(in);
+
+	return NULL;
+}
+
+/*
+ * Fills the output buffer
+ * Returns number of bytes available, 0 on EOF, -1 on error.
+ */
+static int ip2clue_input_fill_raw(struct ip2clue_input *in)
+{
+	unsigned int n;
+	int err;
+
+	in->out_pos = 0;
+	in->out_len = 0;
+
+	while (in->eof == 0) {
+		if (in->in_pos == in->in_len) {
+			err = ip2clue_input_read(in);
+			if (err == -1)
+				return -1;
+			if (err == 0) {
+				if (in->type != IP2CLUE_INPUT_PLAIN) {
+					snprintf(ip2clue_error, sizeof(ip2clue_error),
+						"truncated compressed file");
+					return -1;
+				}
+				in->eof = 1;
+				break;
+			}
+		}
+
+		switch (in->type) {
+		/*
+		 * Plain and stored data is given from the read buffer;
+		 * ip2clue_input_read moves it only after it was consumed.
+		 */
+		case IP2CLUE_INPUT_PLAIN:
+			n = in->in_len - in->in_pos;
+			in->out = (char *) in->in + in->in_pos;
+			in->in_pos += n;
+			in->out_len = n;
+			break;
+
+		case IP2CLUE_INPUT_ZIP_STORED:
+			n = in->in_len - in->in_pos;
+			if (n > in->stored_left)
+				n = in->stored_left;
+			in->out = (char *) in->in + in->in_pos;
+			in->in_pos += n;
+			in->stored_left -= n;
+			in->out_len = n;
+			if (in->stored_left == 0)
+				in->eof = 1;
+			break;
+
+		default:
+			in->z.next_in = in->in + in->in_pos;
+			in->z.avail_in = in->in_len - in->in_pos;
+			in->out = in->out_buf;
+			in->z.next_out = (unsigned char *) in->out_buf;
+			in->z.avail_out = sizeof(in->out_buf);
+			err = inflate(&in->z, Z_NO_FLUSH);
+			in->in_pos = in->in_len - in->z.avail_in;
+			in->out_len = sizeof(in->out_buf) - in->z.avail_out;
+			if (err == Z_STREAM_END) {
+				/* gzip may have more members */
+				if ((in->type == IP2CLUE_INPUT_GZIP)
+					&& ((in->in_pos < in->in_len)
+					|| (ip2clue_input_read(in) > 0)))
+					inflateReset(&in->z);
+				else
+					in->eof = 1;
+			} else if ((err != Z_OK) && (err != Z_BUF_ERROR)) {
+				snprintf(ip2clue_error, sizeof(ip2clue_error),
+					"corrupted compressed data (%s)",
+					in->z.msg ? in->z.msg : "?");
+				return -1;
+			}
+			break;
+		}
+
+		if (in->out_len > 0)
+			break;
+	}
+
+	in->bytes_out += in->out_len;
+
+	return in->out_len;
+}
+
+/*
+ * Same as above, accounting the time as I/O in the load stats
+ */
+static int ip2clue_input_fill(struct ip2clue_input *in)
+{
+	struct ip2clue_clock start;
+	int ret;
+
+	if (in->stats == NULL)
+		return ip2clue_input_fill_raw(in);
+
+	ip2clue_clock_now(&start);
+	ret = ip2clue_input_fill_raw(in);
+	ip2clue_phase_end(in->stats, IP2CLUE_PHASE_IO, &start);
+
+	return ret;
+}
+
+/*
+ * Same semantic as fgets: reads at most @line_size - 1 chars, stops after '\n'
+ */
+char *ip2clue_input_gets(struct ip2clue_input *in, char *line,
+	const size_t line_size)
+{
+	size_t len = 0, n;
+	char *p;
+
+	if (line_size < 2)
+		return NULL;
+
+	while (len < line_size - 1) {
+		if (in->out_pos == in->out_len) {
+			if (ip2clue_input_fill(in) <= 0)
+				break;
+		}
+
+		n = in->out_len - in->out_pos;
+		if (n > line_size - 1 - len)
+			n = line_size - 1 - len;
+		p = memchr(in->out + in->out_pos, '\n', n);
+		if (p != NULL)
+			n = p - (in->out + in->out_pos) + 1;
+
+		memcpy(line + len, in->out + in->out_pos, n);
+		in->out_pos += n;
+		len += n;
+
+		if (p != NULL)
+			break;
+	}
+
+	if (len == 0)
+		return NULL;
+
+	line[len] = '\0';
+
+	return line;
+}
+
+/*
+ * Closes the file and drops it from the page cache: it was already consumed
+ */
+void ip2clue_input_close(struct ip2clue_input *in)
+{
+	if (in == NULL)
+		return;
+
+	if (in->z_init == 1)
+		inflateEnd(&in->z);
+
+	if (in->fd != -1) {
+		posix_fadvise(in->fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(in->fd);
+	}
+
+	free(in);
+}
+
+/*
+ * Returns a printable name for the input type
+ */
+const char *ip2clue_input_type_name(const struct ip2clue_input *in)
+{
+	switch (in->type) {
+	case IP2CLUE_INPUT_GZIP: return "gzip";
+	case IP2CLUE_INPUT_ZIP_STORED: return "zip";
+	case IP2CLUE_INPUT_ZIP_DEFLATE: return "zip";
+	default: return "plain";
+	}
+}
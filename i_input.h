@@ -0,0 +1,49 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: buffered input for data files (plain, gzip, zip)
+ */
+
+#ifndef IP2CLUE_I_INPUT_H
+#define IP2CLUE_I_INPUT_H 1
+
+#include <i_config.h>
+
+#include <zlib.h>
+
+#include <i_types.h>
+
+#define IP2CLUE_INPUT_BUF	(64 * 1024)
+
+enum ip2clue_input_type
+{
+	IP2CLUE_INPUT_PLAIN = 0,
+	IP2CLUE_INPUT_GZIP,
+	IP2CLUE_INPUT_ZIP_STORED,
+	IP2CLUE_INPUT_ZIP_DEFLATE
+};
+
+struct ip2clue_input
+{
+	int			fd;
+	enum ip2clue_input_type	type;
+	z_stream		z;
+	int			z_init;
+	int			eof;
+	unsigned long long	stored_left;	/* zip, method 0 */
+	unsigned long long	bytes_in;	/* bytes read from disk */
+	unsigned long long	bytes_out;	/* bytes given to the parser */
+	struct ip2clue_load_stats *stats;	/* if not NULL, I/O time goes here */
+	unsigned char		in[IP2CLUE_INPUT_BUF];
+	unsigned int		in_pos, in_len;
+	char			*out;		/* in 'in' or 'out_buf' */
+	unsigned int		out_pos, out_len;
+	char			out_buf[IP2CLUE_INPUT_BUF];	/* inflated data */
+};
+
+extern struct ip2clue_input	*ip2clue_input_open(const char *file);
+extern char			*ip2clue_input_gets(struct ip2clue_input *in,
+					char *line, const size_t line_size);
+extern void			ip2clue_input_close(struct ip2clue_input *in);
+extern const char		*ip2clue_input_type_name(const struct ip2clue_input *in);
+
+#endif
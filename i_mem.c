@@ -0,0 +1,243 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: placement of the big tables (huge pages, prefault, mlock)
+ * After a reload, the first lookups used to take page faults and TLB misses
+ * all over the new tables. With a policy set, the tables are mmap-ed (huge
+ * pages if possible), faulted in and optionally locked before the new list
+ * is published. Everything is best effort: what really happened is kept in
+ * the flags of each block and shown in the stats.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <i_util.h>
+#include <i_mem.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ	22
+#endif
+
+/* What the user asked for: IP2CLUE_MEM_THP/HUGETLB/PREFAULT/LOCK */
+static unsigned int	ip2clue_mem_policy;
+
+/*
+ * Sets the placement policy for the tables loaded from now on
+ */
+void ip2clue_mem_set_policy(const unsigned int policy)
+{
+	ip2clue_mem_policy = policy & (IP2CLUE_MEM_THP | IP2CLUE_MEM_HUGETLB
+		| IP2CLUE_MEM_PREFAULT | IP2CLUE_MEM_LOCK);
+}
+
+unsigned int ip2clue_mem_get_policy(void)
+{
+	return ip2clue_mem_policy;
+}
+
+static pthread_once_t	ip2clue_mem_huge_once = PTHREAD_ONCE_INIT;
+static size_t		ip2clue_mem_huge = 2 * 1024 * 1024;
+
+/*
+ * Reads the default huge page size, once (the loaders may race here)
+ */
+static void ip2clue_mem_huge_init(void)
+{
+	FILE *f;
+	char line[128];
+	unsigned long kb;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			ip2clue_mem_huge = kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * Returns the default huge page size
+ */
+static size_t ip2clue_mem_huge_size(void)
+{
+	pthread_once(&ip2clue_mem_huge_once, ip2clue_mem_huge_init);
+
+	return ip2clue_mem_huge;
+}
+
+/*
+ * Rounds @size up to a multiple of @unit
+ */
+static size_t ip2clue_mem_round(const size_t size, const size_t unit)
+{
+	return (size + unit - 1) / unit * unit;
+}
+
+/*
+ * Allocates @size bytes following the policy
+ * Without a policy this is a plain malloc, as before.
+ */
+int ip2clue_mem_alloc(struct ip2clue_mem *m, const size_t size)
+{
+	void *p;
+	size_t len;
+
+	memset(m, 0, sizeof(struct ip2clue_mem));
+
+	if ((ip2clue_mem_policy == 0) || (size == 0)) {
+		m->p = malloc(size);
+		if (m->p == NULL) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot alloc %llu bytes",
+				(unsigned long long) size);
+			return -1;
+		}
+		m->size = size;
+		return 0;
+	}
+
+	if (ip2clue_mem_policy & IP2CLUE_MEM_HUGETLB) {
+		len = ip2clue_mem_round(size, ip2clue_mem_huge_size());
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			m->p = p;
+			m->size = len;
+			m->flags = IP2CLUE_MEM_MMAP | IP2CLUE_MEM_HUGETLB;
+			return 0;
+		}
+		/* No huge pages reserved, probably; try THP */
+	}
+
+	len = ip2clue_mem_round(size, sysconf(_SC_PAGESIZE));
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot map %llu bytes (%s)",
+			(unsigned long long) len, strerror(errno));
+		return -1;
+	}
+	m->p = p;
+	m->size = len;
+	m->flags = IP2CLUE_MEM_MMAP;
+
+	if (ip2clue_mem_policy & (IP2CLUE_MEM_THP | IP2CLUE_MEM_HUGETLB))
+		if (madvise(p, len, MADV_HUGEPAGE) == 0)
+			m->flags |= IP2CLUE_MEM_THP;
+
+	return 0;
+}
+
+/*
+ * Takes ownership of a malloc-ed buffer of @size useful bytes
+ * (the text parser grows its table with realloc, not knowing the size).
+ * Without a policy the buffer is only shrunk, else it is moved.
+ */
+int ip2clue_mem_adopt(struct ip2clue_mem *m, void *p, const size_t size)
+{
+	void *q;
+
+	if (ip2clue_mem_policy != 0) {
+		if (ip2clue_mem_alloc(m, size) == 0) {
+			memcpy(m->p, p, size);
+			free(p);
+			return 0;
+		}
+		/* Keep the buffer we have */
+	}
+
+	memset(m, 0, sizeof(struct ip2clue_mem));
+	q = realloc(p, size);
+	m->p = q != NULL ? q : p;
+	m->size = size;
+
+	return 0;
+}
+
+/*
+ * Records a read-only file mapping done by a parser
+ */
+void ip2clue_mem_map(struct ip2clue_mem *m, void *p, const size_t size)
+{
+	m->p = p;
+	m->size = size;
+	m->flags = IP2CLUE_MEM_MMAP;
+
+	/* Works only if the kernel has THP for the page cache */
+	if (ip2clue_mem_policy & (IP2CLUE_MEM_THP | IP2CLUE_MEM_HUGETLB))
+		if (madvise(p, size, MADV_HUGEPAGE) == 0)
+			m->flags |= IP2CLUE_MEM_THP;
+}
+
+/*
+ * Called when a block is filled, before the db is published:
+ * faults in all the pages and locks them, if asked.
+ */
+void ip2clue_mem_finish(struct ip2clue_mem *m)
+{
+	volatile const unsigned char *q;
+	unsigned char sum = 0;
+	size_t i, page;
+
+	if ((m->p == NULL) || (m->size == 0))
+		return;
+
+	if (ip2clue_mem_policy & IP2CLUE_MEM_PREFAULT) {
+		if (madvise(m->p, m->size, MADV_POPULATE_READ) != 0) {
+			/* Old kernel: touch every page */
+			madvise(m->p, m->size, MADV_WILLNEED);
+			page = sysconf(_SC_PAGESIZE);
+			q = (volatile const unsigned char *) m->p;
+			for (i = 0; i < m->size; i += page)
+				sum += q[i];
+			(void) sum;
+		}
+		m->flags |= IP2CLUE_MEM_PREFAULT;
+	}
+
+	if (ip2clue_mem_policy & IP2CLUE_MEM_LOCK)
+		if (mlock(m->p, m->size) == 0)
+			m->flags |= IP2CLUE_MEM_LOCK;
+}
+
+/*
+ * Frees a block
+ */
+void ip2clue_mem_free(struct ip2clue_mem *m)
+{
+	if (m->p == NULL)
+		return;
+
+	if (m->flags & IP2CLUE_MEM_MMAP)
+		munmap(m->p, m->size);
+	else
+		free(m->p);
+
+	memset(m, 0, sizeof(struct ip2clue_mem));
+}
+
+/*
+ * Shows flags as 'hugetlb+prefault+mlock'
+ */
+void ip2clue_mem_flags(char *out, const size_t out_size,
+	const unsigned int flags)
+{
+	snprintf(out, out_size, "%s%s%s",
+		(flags & IP2CLUE_MEM_HUGETLB) ? "hugetlb" :
+			(flags & IP2CLUE_MEM_THP) ? "thp" :
+			(flags & IP2CLUE_MEM_MMAP) ? "mmap" : "malloc",
+		(flags & IP2CLUE_MEM_PREFAULT) ? "+prefault" : "",
+		(flags & IP2CLUE_MEM_LOCK) ? "+mlock" : "");
+}
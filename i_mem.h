@@ -0,0 +1,30 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: placement of the big tables (huge pages, prefault, mlock)
+ */
+
+#ifndef IP2CLUE_I_MEM_H
+#define IP2CLUE_I_MEM_H 1
+
+#include <i_config.h>
+
+#include <stdlib.h>
+
+#include <i_types.h>
+
+extern void		ip2clue_mem_set_policy(const unsigned int policy);
+extern unsigned int	ip2clue_mem_get_policy(void);
+
+extern int		ip2clue_mem_alloc(struct ip2clue_mem *m,
+				const size_t size);
+extern int		ip2clue_mem_adopt(struct ip2clue_mem *m, void *p,
+				const size_t size);
+extern void		ip2clue_mem_map(struct ip2clue_mem *m, void *p,
+				const size_t size);
+extern void		ip2clue_mem_finish(struct ip2clue_mem *m);
+extern void		ip2clue_mem_free(struct ip2clue_mem *m);
+
+extern void		ip2clue_mem_flags(char *out, const size_t out_size,
+				const unsigned int flags);
+
+#endif
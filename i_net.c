@@ -0,0 +1,1266 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: multi-threaded line server (one epoll loop per thread)
+ * Every thread has its own listening sockets (SO_REUSEPORT, the kernel
+ * spreads the new connections), its own epoll and its own connections, so
+ * the threads share nothing but the data they search.
+ * With io_uring, a thread runs a ring instead of epoll: multishot accept and
+ * recv (the kernel picks a buffer from a provided buffer ring), and all the
+ * answers produced by one batch of completions go out in one submit.
+ * An optional unix stream socket is shared by all the threads; its clients
+ * are counted by uid (SO_PEERCRED), see ip2clue_net_peer_count.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <i_util.h>
+#include <i_fmt.h>
+#include <i_uring.h>
+#include <i_bin.h>
+#include <i_net.h>
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT	15
+#endif
+
+/* What a client speaks; decided by its first byte */
+enum ip2clue_net_mode
+{
+	IP2CLUE_NET_MODE_NONE = 0,
+	IP2CLUE_NET_MODE_TEXT,
+	IP2CLUE_NET_MODE_BIN
+};
+
+enum ip2clue_net_type
+{
+	IP2CLUE_NET_LISTEN = 1,
+	IP2CLUE_NET_CLIENT,
+	IP2CLUE_NET_WAKE
+};
+
+struct ip2clue_net_conn
+{
+	enum ip2clue_net_type	type;
+	int			fd;
+	int			close;		/* close when 'out' is sent */
+	enum ip2clue_net_mode	mode;
+	unsigned int		events;		/* what epoll watches now */
+	char			*out;
+	size_t			out_len, out_off, out_size;
+	size_t			in_len;
+	int			local;		/* listener: the unix socket */
+	int			peer;		/* client: 'uid' is known */
+	unsigned int		uid;
+	unsigned int		requests;	/* answered in this batch */
+	const struct ip2clue_fmt *fmt;		/* set by the client, owned */
+	/* io_uring only */
+	unsigned int		ops;		/* requests in flight */
+	int			sending, closing, dirty;
+	char			*out_old;	/* being sent, 'out' moved */
+	struct ip2clue_net_conn	*next;		/* in the dirty list */
+	char			in[IP2CLUE_NET_LINE_MAX];
+};
+
+struct ip2clue_net_thread
+{
+	pthread_t		tid;
+	unsigned int		no;
+	int			epoll_fd;
+	struct ip2clue_net_conn	listen[3];
+	unsigned int		listen_no;
+#ifdef IP2CLUE_HAVE_URING
+	struct ip2clue_uring	ring;
+	struct ip2clue_uring_bufs	bufs;
+	struct ip2clue_net_conn	*dirty;		/* have answers to send */
+#endif
+};
+
+static struct ip2clue_net_conf		ip2clue_net_conf;
+static struct ip2clue_net_thread	ip2clue_net_threads[IP2CLUE_NET_MAX_THREADS];
+static unsigned int			ip2clue_net_threads_no;
+static struct ip2clue_net_conn		ip2clue_net_wake;
+static int				ip2clue_net_exit;
+static int				ip2clue_net_local = -1;
+
+/* The io_uring workers report if their ring works */
+static pthread_mutex_t			ip2clue_net_start_lock =
+	PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			ip2clue_net_start_cond =
+	PTHREAD_COND_INITIALIZER;
+static unsigned int			ip2clue_net_started;
+static int				ip2clue_net_start_failed;
+
+struct ip2clue_net_peer
+{
+	unsigned int		uid;	/* uid + 1; 0 = free slot */
+	unsigned long long	requests;
+};
+
+static struct ip2clue_net_peer		ip2clue_net_peers[IP2CLUE_NET_PEERS];
+static unsigned long long		ip2clue_net_peers_other;
+
+/*
+ * Creates a socket bound to @port on all addresses, shared with the other
+ * threads (SO_REUSEPORT); a stream socket is also put in listen state.
+ * Returns the fd or -1.
+ */
+int ip2clue_net_bind(const int domain, const int type, const unsigned int port)
+{
+	struct sockaddr_in sa4;
+	struct sockaddr_in6 sa6;
+	struct sockaddr *sa;
+	socklen_t sa_len;
+	int fd, on = 1;
+
+	fd = socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create socket (%s)", strerror(errno));
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot set SO_REUSEPORT (%s)", strerror(errno));
+		goto out_close;
+	}
+
+	if (domain == PF_INET6) {
+		/* The IPv4 socket takes the IPv4 clients */
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+		memset(&sa6, 0, sizeof(sa6));
+		sa6.sin6_family = AF_INET6;
+		sa6.sin6_addr = in6addr_any;
+		sa6.sin6_port = htons(port);
+		sa = (struct sockaddr *) &sa6;
+		sa_len = sizeof(sa6);
+	} else {
+		memset(&sa4, 0, sizeof(sa4));
+		sa4.sin_family = AF_INET;
+		sa4.sin_addr.s_addr = htonl(INADDR_ANY);
+		sa4.sin_port = htons(port);
+		sa = (struct sockaddr *) &sa4;
+		sa_len = sizeof(sa4);
+	}
+
+	if (bind(fd, sa, sa_len) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot bind port %u (%s)", port, strerror(errno));
+		goto out_close;
+	}
+
+	if ((type == SOCK_STREAM) && (listen(fd, 1024) != 0)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot listen (%s)", strerror(errno));
+		goto out_close;
+	}
+
+	return fd;
+
+	out_close:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Returns 1 if somebody still serves the unix socket at @path
+ * A stale one (left by a crash) refuses the connection.
+ */
+static int ip2clue_net_local_live(const struct sockaddr_un *sa,
+	const int type)
+{
+	int fd, ret;
+
+	fd = socket(PF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return 1;
+
+	ret = connect(fd, (const struct sockaddr *) sa, sizeof(*sa)) == 0;
+	if ((ret == 0) && (errno != ECONNREFUSED))
+		ret = 1; /* a full backlog, no rights...: do not touch it */
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Creates a unix socket at @path with permissions @mode; a stale socket
+ * left there is removed, a live one is an error. A stream socket is also
+ * put in listen state; a datagram one gets the credentials of every sender.
+ * Returns the fd or -1.
+ */
+int ip2clue_net_bind_local(const char *path, const int type,
+	const unsigned int mode)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	int fd, on = 1;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"unix socket path too long [%s]", path);
+		return -1;
+	}
+
+	fd = socket(PF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create unix socket (%s)", strerror(errno));
+		return -1;
+	}
+
+	if ((type == SOCK_DGRAM)
+		&& (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) != 0)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot set SO_PASSCRED (%s)", strerror(errno));
+		goto out_close;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+		if (ip2clue_net_local_live(&sa, type)) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"unix socket [%s] is in use", path);
+			goto out_close;
+		}
+		unlink(path);
+	}
+
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot bind [%s] (%s)", path, strerror(errno));
+		goto out_close;
+	}
+
+	/* Nobody can connect before listen(); a datagram may come earlier */
+	if (chmod(path, mode) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot chmod [%s] (%s)", path, strerror(errno));
+		unlink(path);
+		goto out_close;
+	}
+
+	if ((type == SOCK_STREAM) && (listen(fd, 1024) != 0)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot listen (%s)", strerror(errno));
+		unlink(path);
+		goto out_close;
+	}
+
+	return fd;
+
+	out_close:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Adds @requests to the counter of local peer @uid; called concurrently
+ */
+void ip2clue_net_peer_count(const unsigned int uid, const unsigned int requests)
+{
+	struct ip2clue_net_peer *p;
+	unsigned int i, k;
+
+	for (i = 0; i < IP2CLUE_NET_PEERS; i++) {
+		p = &ip2clue_net_peers[(uid + i) % IP2CLUE_NET_PEERS];
+		k = __atomic_load_n(&p->uid, __ATOMIC_ACQUIRE);
+		if (k == 0) {
+			/* Take it; if another thread was faster, k is its uid */
+			if (__atomic_compare_exchange_n(&p->uid, &k, uid + 1,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				k = uid + 1;
+		}
+		if (k == uid + 1) {
+			__atomic_add_fetch(&p->requests, requests,
+				__ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	__atomic_add_fetch(&ip2clue_net_peers_other, requests,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Writes the local peer counters: one "peer:" line each (prefixed by
+ * '\n'), or a JSON member ',"peers":[...]'. Nothing is written if they do
+ * not fit. Returns the length.
+ */
+size_t ip2clue_net_peer_stats(char *out, const size_t out_size, const int json)
+{
+	char buf[IP2CLUE_NET_PEERS * 64 + 128];
+	unsigned long long requests;
+	unsigned int i, uid, n = 0;
+	size_t len = 0;
+
+	buf[0] = '\0';
+	if (json)
+		len = snprintf(buf, sizeof(buf), ",\"peers\":[");
+
+	for (i = 0; i < IP2CLUE_NET_PEERS; i++) {
+		uid = __atomic_load_n(&ip2clue_net_peers[i].uid, __ATOMIC_ACQUIRE);
+		if (uid == 0)
+			continue;
+
+		requests = __atomic_load_n(&ip2clue_net_peers[i].requests,
+			__ATOMIC_RELAXED);
+		if (json)
+			len += snprintf(buf + len, sizeof(buf) - len,
+				"%s{\"uid\":%u,\"requests\":%llu}",
+				n > 0 ? "," : "", uid - 1, requests);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len,
+				"\npeer: uid=%u, requests=%llu",
+				uid - 1, requests);
+		n++;
+	}
+
+	requests = __atomic_load_n(&ip2clue_net_peers_other, __ATOMIC_RELAXED);
+	if (requests > 0) {
+		if (json)
+			len += snprintf(buf + len, sizeof(buf) - len,
+				"%s{\"uid\":\"other\",\"requests\":%llu}",
+				n > 0 ? "," : "", requests);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len,
+				"\npeer: uid=other, requests=%llu", requests);
+	}
+
+	if (json)
+		len += snprintf(buf + len, sizeof(buf) - len, "]");
+
+	if (len >= out_size)
+		return 0;
+
+	memcpy(out, buf, len + 1);
+
+	return len;
+}
+
+/*
+ * Creates a listening socket for this thread
+ */
+static int ip2clue_net_listen(struct ip2clue_net_conn *l, const int domain,
+	const unsigned int port)
+{
+	int fd;
+
+	fd = ip2clue_net_bind(domain, SOCK_STREAM, port);
+	if (fd == -1)
+		return -1;
+
+	memset(l, 0, sizeof(struct ip2clue_net_conn));
+	l->type = IP2CLUE_NET_LISTEN;
+	l->fd = fd;
+
+	return 0;
+}
+
+/*
+ * Changes what epoll watches for a client
+ */
+static void ip2clue_net_watch(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *c, const unsigned int events)
+{
+	struct epoll_event ev;
+
+	if (c->events == events)
+		return;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+}
+
+static void ip2clue_net_close(struct ip2clue_net_conn *c)
+{
+	close(c->fd); /* removes it from epoll, too */
+	if (c->out != NULL)
+		free(c->out);
+	if (c->out_old != NULL)
+		free(c->out_old);
+	if (c->fmt != NULL)
+		ip2clue_fmt_free(c->fmt);
+	free(c);
+}
+
+/*
+ * Allocates the state of a new client accepted on listener @l
+ */
+static struct ip2clue_net_conn *ip2clue_net_conn_new(const int fd,
+	const struct ip2clue_net_conn *l)
+{
+	struct ip2clue_net_conn *c;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	int on = 1;
+
+	c = (struct ip2clue_net_conn *) malloc(sizeof(struct ip2clue_net_conn));
+	if (c == NULL)
+		return NULL;
+
+	memset(c, 0, offsetof(struct ip2clue_net_conn, in));
+	c->type = IP2CLUE_NET_CLIENT;
+	c->fd = fd;
+
+	if (l->local) {
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred,
+			&cred_len) == 0) {
+			c->peer = 1;
+			c->uid = cred.uid;
+		}
+	} else {
+		/* Answers are small and must leave now */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+
+	return c;
+}
+
+/*
+ * Accepts all the pending connections
+ */
+static void ip2clue_net_accept(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *l)
+{
+	struct ip2clue_net_conn *c;
+	struct epoll_event ev;
+	int fd;
+
+	while (1) {
+		fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1)
+			return;
+
+		c = ip2clue_net_conn_new(fd, l);
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->events = EPOLLIN;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+/*
+ * Appends an answer to the output buffer
+ * With io_uring, the kernel may be sending from 'out' now: a bigger buffer
+ * is then a copy and the old one is kept until the send completes.
+ */
+static int ip2clue_net_append(struct ip2clue_net_conn *c, const char *buf,
+	const size_t len)
+{
+	char *p;
+	size_t size;
+
+	if ((c->out_off == c->out_len) && (c->sending == 0))
+		c->out_off = c->out_len = 0;
+
+	if (c->out_len + len > c->out_size) {
+		size = c->out_size == 0 ? 4096 : c->out_size;
+		while (size < c->out_len + len)
+			size *= 2;
+		if (c->sending && (c->out_old == NULL)) {
+			p = (char *) malloc(size);
+			if (p == NULL)
+				return -1;
+			memcpy(p, c->out, c->out_len);
+			c->out_old = c->out;
+		} else {
+			p = (char *) realloc(c->out, size);
+			if (p == NULL)
+				return -1;
+		}
+		c->out = p;
+		c->out_size = size;
+	}
+
+	memcpy(c->out + c->out_len, buf, len);
+	c->out_len += len;
+
+	return 0;
+}
+
+/*
+ * Sends what we can from the output buffer
+ * Returns -1 if the connection is dead.
+ */
+static int ip2clue_net_flush(struct ip2clue_net_conn *c)
+{
+	ssize_t n;
+
+	while (c->out_off < c->out_len) {
+		n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+			MSG_NOSIGNAL);
+		if (n == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		c->out_off += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Runs the binary callback for every complete request in the input buffer
+ */
+static int ip2clue_net_frames(struct ip2clue_net_conn *c)
+{
+	unsigned char out[IP2CLUE_BIN_OUT_MAX];
+	size_t off = 0, used, len;
+
+	while ((c->close == 0) && (off < c->in_len)) {
+		len = ip2clue_net_conf.bin((unsigned char *) c->in + off,
+			c->in_len - off, &used, out, sizeof(out), &c->close);
+		if (used == 0)
+			break;
+
+		c->requests++;
+		if (ip2clue_net_append(c, (char *) out, len) != 0)
+			return -1;
+		off += used;
+	}
+
+	c->in_len -= off;
+	if ((c->in_len > 0) && (off > 0))
+		memmove(c->in, c->in + off, c->in_len);
+
+	return 0;
+}
+
+/*
+ * Runs the callback for every complete line in the input buffer
+ * A first byte IP2CLUE_BIN_MAGIC switches the client to binary requests.
+ */
+static int ip2clue_net_lines(struct ip2clue_net_conn *c)
+{
+	char out[IP2CLUE_NET_ANSWER_MAX], *line, *end, *nl;
+	size_t len;
+
+	if ((c->mode == IP2CLUE_NET_MODE_NONE) && (c->in_len > 0)) {
+		c->mode = IP2CLUE_NET_MODE_TEXT;
+		if (((unsigned char) c->in[0] == IP2CLUE_BIN_MAGIC)
+			&& (ip2clue_net_conf.bin != NULL)) {
+			c->mode = IP2CLUE_NET_MODE_BIN;
+			if (ip2clue_net_append(c, c->in, 1) != 0)
+				return -1;
+			c->in_len--;
+			memmove(c->in, c->in + 1, c->in_len);
+		}
+	}
+
+	if (c->mode == IP2CLUE_NET_MODE_BIN)
+		return ip2clue_net_frames(c);
+
+	line = c->in;
+	end = c->in + c->in_len;
+	while ((c->close == 0) && (line < end)) {
+		nl = (char *) memchr(line, '\n', end - line);
+		if (nl == NULL)
+			break;
+
+		*nl = '\0';
+		if ((nl > line) && (nl[-1] == '\r'))
+			nl[-1] = '\0';
+
+		len = ip2clue_net_conf.cb(line, out, sizeof(out), &c->close,
+			&c->fmt);
+		c->requests++;
+		if (ip2clue_net_append(c, out, len) != 0)
+			return -1;
+
+		line = nl + 1;
+	}
+
+	c->in_len = end - line;
+	if ((c->in_len > 0) && (line != c->in))
+		memmove(c->in, line, c->in_len);
+
+	return 0;
+}
+
+/*
+ * Answers all the complete requests of a read; the answers are appended
+ * to one buffer, sent later with one system call.
+ */
+static int ip2clue_net_batch(struct ip2clue_net_conn *c)
+{
+	int ret;
+
+	if (ip2clue_net_conf.begin != NULL)
+		ip2clue_net_conf.begin();
+
+	ret = ip2clue_net_lines(c);
+
+	if (ip2clue_net_conf.end != NULL)
+		ip2clue_net_conf.end();
+
+	if (c->peer && (c->requests > 0))
+		ip2clue_net_peer_count(c->uid, c->requests);
+	c->requests = 0;
+
+	return ret;
+}
+
+/*
+ * A client has data or room for our answers
+ * Returns -1 if the connection must be closed now.
+ */
+static int ip2clue_net_client(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *c, const unsigned int events)
+{
+	ssize_t n;
+	unsigned int want;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return -1;
+
+	if ((events & EPOLLIN) && (c->close == 0)) {
+		n = recv(c->fd, c->in + c->in_len,
+			sizeof(c->in) - c->in_len, 0);
+		if (n == 0)
+			return -1;
+		if (n == -1) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+				&& (errno != EINTR))
+				return -1;
+		} else {
+			c->in_len += n;
+			if (ip2clue_net_batch(c) != 0)
+				return -1;
+
+			/* No '\n' in a full buffer: this is not a client */
+			if (c->in_len == sizeof(c->in))
+				return -1;
+		}
+	}
+
+	if (ip2clue_net_flush(c) != 0)
+		return -1;
+
+	if (c->out_off < c->out_len) {
+		/* Does not read: stop reading from it, until it does */
+		want = EPOLLOUT;
+		if (c->out_len - c->out_off < IP2CLUE_NET_OUT_MAX)
+			want |= EPOLLIN;
+	} else {
+		if (c->close == 1)
+			return -1;
+		want = EPOLLIN;
+	}
+	ip2clue_net_watch(t, c, want);
+
+	return 0;
+}
+
+static void *ip2clue_net_worker(void *arg)
+{
+	struct ip2clue_net_thread *t = (struct ip2clue_net_thread *) arg;
+	struct epoll_event events[256];
+	struct ip2clue_net_conn *c;
+	int n, i;
+
+	while (__atomic_load_n(&ip2clue_net_exit, __ATOMIC_RELAXED) == 0) {
+		n = epoll_wait(t->epoll_fd, events, 256, -1);
+		for (i = 0; i < n; i++) {
+			c = (struct ip2clue_net_conn *) events[i].data.ptr;
+			switch (c->type) {
+			case IP2CLUE_NET_LISTEN:
+				ip2clue_net_accept(t, c);
+				break;
+
+			case IP2CLUE_NET_CLIENT:
+				if (ip2clue_net_client(t, c, events[i].events) != 0)
+					ip2clue_net_close(c);
+				break;
+
+			case IP2CLUE_NET_WAKE:
+				break;
+			}
+		}
+	}
+
+	/*
+	 * The clients still connected are not freed: we are called only
+	 * when the process exits.
+	 */
+	return NULL;
+}
+
+#ifdef IP2CLUE_HAVE_URING
+
+/* What a completion is for; stored in the low bits of user_data */
+#define IP2CLUE_NET_OP_ACCEPT	0UL
+#define IP2CLUE_NET_OP_RECV	1UL
+#define IP2CLUE_NET_OP_SEND	2UL
+#define IP2CLUE_NET_OP_WAKE	3UL
+#define IP2CLUE_NET_OP_MASK	3UL
+
+/* Provided buffers, per thread */
+#define IP2CLUE_NET_BUFS	256
+#define IP2CLUE_NET_BUF_SIZE	4096
+
+/*
+ * Returns a free sqe, submitting the prepared ones if the queue is full
+ */
+static struct io_uring_sqe *ip2clue_net_sqe(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *c, const unsigned long op)
+{
+	struct io_uring_sqe *sqe;
+
+	while ((sqe = ip2clue_uring_sqe(&t->ring)) == NULL)
+		ip2clue_uring_submit(&t->ring, 0);
+
+	sqe->user_data = (unsigned long) c | op;
+	sqe->fd = c->fd;
+	if (op != IP2CLUE_NET_OP_WAKE)
+		c->ops++;
+
+	return sqe;
+}
+
+static void ip2clue_net_uring_accept(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *l)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ip2clue_net_sqe(t, l, IP2CLUE_NET_OP_ACCEPT);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void ip2clue_net_uring_recv(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ip2clue_net_sqe(t, c, IP2CLUE_NET_OP_RECV);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = t->bufs.bgid;
+}
+
+/*
+ * Starts closing a client: the requests in flight fail and, when the last
+ * one completes, the client is freed.
+ */
+static void ip2clue_net_uring_close(struct ip2clue_net_conn *c)
+{
+	if (c->closing)
+		return;
+
+	c->closing = 1;
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+/*
+ * Frees a closing client that has nothing in flight and is not queued
+ */
+static void ip2clue_net_uring_put(struct ip2clue_net_conn *c)
+{
+	if ((c->closing == 0) || (c->ops > 0) || (c->dirty))
+		return;
+
+	ip2clue_net_close(c);
+}
+
+static void ip2clue_net_uring_dirty(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *c)
+{
+	if (c->dirty)
+		return;
+
+	c->dirty = 1;
+	c->next = t->dirty;
+	t->dirty = c;
+}
+
+/*
+ * Queues a send for every client with answers (one send in flight/client)
+ */
+static void ip2clue_net_uring_flush(struct ip2clue_net_thread *t)
+{
+	struct ip2clue_net_conn *c;
+	struct io_uring_sqe *sqe;
+
+	while (t->dirty != NULL) {
+		c = t->dirty;
+		t->dirty = c->next;
+		c->dirty = 0;
+
+		if ((c->closing) || (c->sending)
+			|| (c->out_off == c->out_len)) {
+			ip2clue_net_uring_put(c);
+			continue;
+		}
+
+		sqe = ip2clue_net_sqe(t, c, IP2CLUE_NET_OP_SEND);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (unsigned long) (c->out + c->out_off);
+		sqe->len = c->out_len - c->out_off;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		c->sending = 1;
+	}
+}
+
+/*
+ * Data arrived in provided buffer @bid
+ * Returns -1 if the connection must be closed.
+ */
+static int ip2clue_net_uring_data(struct ip2clue_net_thread *t,
+	struct ip2clue_net_conn *c, const unsigned int bid, size_t len)
+{
+	const char *p;
+	size_t room;
+	int ret = 0;
+
+	p = t->bufs.base + (size_t) bid * t->bufs.size;
+	while ((len > 0) && (c->close == 0)) {
+		room = sizeof(c->in) - c->in_len;
+		if (room > len)
+			room = len;
+		memcpy(c->in + c->in_len, p, room);
+		c->in_len += room;
+		p += room;
+		len -= room;
+
+		if (ip2clue_net_batch(c) != 0) {
+			ret = -1;
+			break;
+		}
+
+		/* No '\n' in a full buffer: this is not a client */
+		if (c->in_len == sizeof(c->in)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	ip2clue_uring_buf_put(&t->bufs, bid);
+	ip2clue_uring_bufs_commit(&t->bufs);
+
+	/*
+	 * The recv cannot be paused like with epoll; a client that does
+	 * not read its answers is dropped.
+	 */
+	if (c->out_len - c->out_off > 4 * IP2CLUE_NET_OUT_MAX)
+		ret = -1;
+
+	if (c->out_off < c->out_len)
+		ip2clue_net_uring_dirty(t, c);
+	else if (c->close == 1)
+		ret = -1;
+
+	return ret;
+}
+
+static void ip2clue_net_uring_cqe(struct ip2clue_net_thread *t,
+	const struct io_uring_cqe *cqe)
+{
+	struct ip2clue_net_conn *c, *n;
+	unsigned long op;
+	int more;
+
+	op = cqe->user_data & IP2CLUE_NET_OP_MASK;
+	c = (struct ip2clue_net_conn *) (cqe->user_data & ~IP2CLUE_NET_OP_MASK);
+	more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	if ((op != IP2CLUE_NET_OP_WAKE) && (more == 0))
+		c->ops--;
+
+	switch (op) {
+	case IP2CLUE_NET_OP_ACCEPT:
+		if (cqe->res >= 0) {
+			n = ip2clue_net_conn_new(cqe->res, c);
+			if (n == NULL)
+				close(cqe->res);
+			else
+				ip2clue_net_uring_recv(t, n);
+		}
+		if ((more == 0)
+			&& (__atomic_load_n(&ip2clue_net_exit, __ATOMIC_RELAXED) == 0))
+			ip2clue_net_uring_accept(t, c);
+		return;
+
+	case IP2CLUE_NET_OP_RECV:
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			if (ip2clue_net_uring_data(t, c,
+				cqe->flags >> IORING_CQE_BUFFER_SHIFT,
+				cqe->res > 0 ? cqe->res : 0) != 0)
+				ip2clue_net_uring_close(c);
+		}
+		if ((cqe->res == 0) || ((cqe->res < 0) && (cqe->res != -ENOBUFS)))
+			ip2clue_net_uring_close(c);
+		else if ((more == 0) && (c->close == 0) && (c->closing == 0))
+			ip2clue_net_uring_recv(t, c); /* out of buffers */
+		break;
+
+	case IP2CLUE_NET_OP_SEND:
+		c->sending = 0;
+		if (c->out_old != NULL) {
+			free(c->out_old);
+			c->out_old = NULL;
+		}
+		if (cqe->res < 0) {
+			ip2clue_net_uring_close(c);
+			break;
+		}
+		c->out_off += cqe->res;
+		if (c->out_off < c->out_len)
+			ip2clue_net_uring_dirty(t, c);
+		else if (c->close == 1)
+			ip2clue_net_uring_close(c);
+		break;
+
+	case IP2CLUE_NET_OP_WAKE:
+		return;
+	}
+
+	ip2clue_net_uring_put(c);
+}
+
+static void *ip2clue_net_uring_worker(void *arg)
+{
+	struct ip2clue_net_thread *t = (struct ip2clue_net_thread *) arg;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int i;
+	int ret;
+
+	/*
+	 * A worker without a ring would leave its listeners in the
+	 * SO_REUSEPORT group, never accepted: ip2clue_net_start fails.
+	 */
+	ret = ip2clue_uring_enable(&t->ring);
+	pthread_mutex_lock(&ip2clue_net_start_lock);
+	ip2clue_net_started++;
+	if (ret != 0)
+		ip2clue_net_start_failed = 1;
+	pthread_cond_signal(&ip2clue_net_start_cond);
+	pthread_mutex_unlock(&ip2clue_net_start_lock);
+	if (ret != 0)
+		goto out;
+
+	for (i = 0; i < t->listen_no; i++)
+		ip2clue_net_uring_accept(t, &t->listen[i]);
+
+	sqe = ip2clue_net_sqe(t, &ip2clue_net_wake, IP2CLUE_NET_OP_WAKE);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->poll32_events = POLLIN;
+
+	while (__atomic_load_n(&ip2clue_net_exit, __ATOMIC_RELAXED) == 0) {
+		ip2clue_net_uring_flush(t);
+		if (ip2clue_uring_submit(&t->ring, 1) != 0)
+			break;
+
+		while ((cqe = ip2clue_uring_peek(&t->ring)) != NULL) {
+			ip2clue_net_uring_cqe(t, cqe);
+			ip2clue_uring_seen(&t->ring);
+		}
+	}
+
+	/* Same as with epoll, the clients die with the process */
+	out:
+	ip2clue_uring_bufs_free(&t->ring, &t->bufs);
+	ip2clue_uring_exit(&t->ring);
+
+	return NULL;
+}
+
+#endif
+
+/*
+ * Prepares the sockets and the epoll (or the ring) of a thread
+ */
+static int ip2clue_net_thread_init(struct ip2clue_net_thread *t)
+{
+	struct epoll_event ev;
+	unsigned int i;
+
+	/* ip2clue_net_start's cleanup looks at these if a bind fails */
+	t->epoll_fd = -1;
+#ifdef IP2CLUE_HAVE_URING
+	t->ring.fd = -1;
+	t->dirty = NULL;
+#endif
+	t->listen_no = 0;
+	if (ip2clue_net_conf.ipv4) {
+		if (ip2clue_net_listen(&t->listen[t->listen_no], PF_INET,
+			ip2clue_net_conf.port) != 0)
+			return -1;
+		t->listen_no++;
+	}
+	if (ip2clue_net_conf.ipv6) {
+		if (ip2clue_net_listen(&t->listen[t->listen_no], PF_INET6,
+			ip2clue_net_conf.port) != 0)
+			return -1;
+		t->listen_no++;
+	}
+	if (ip2clue_net_local != -1) {
+		/* Same fd in all the threads; closed by ip2clue_net_stop */
+		memset(&t->listen[t->listen_no], 0, sizeof(struct ip2clue_net_conn));
+		t->listen[t->listen_no].type = IP2CLUE_NET_LISTEN;
+		t->listen[t->listen_no].fd = ip2clue_net_local;
+		t->listen[t->listen_no].local = 1;
+		t->listen_no++;
+	}
+
+#ifdef IP2CLUE_HAVE_URING
+	if (ip2clue_net_conf.uring) {
+		if (ip2clue_uring_init(&t->ring, 1024) != 0)
+			return -1;
+		return ip2clue_uring_bufs_init(&t->ring, &t->bufs, 0,
+			IP2CLUE_NET_BUFS, IP2CLUE_NET_BUF_SIZE);
+	}
+#endif
+
+	t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (t->epoll_fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create epoll (%s)", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < t->listen_no; i++) {
+		ev.events = EPOLLIN;
+		/* A shared socket wakes up only one of the threads */
+		if (t->listen[i].local)
+			ev.events |= EPOLLEXCLUSIVE;
+		ev.data.ptr = &t->listen[i];
+		if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->listen[i].fd,
+			&ev) != 0) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot add to epoll (%s)", strerror(errno));
+			return -1;
+		}
+	}
+
+	/* Never read, so it wakes up all the threads */
+	ev.events = EPOLLIN;
+	ev.data.ptr = &ip2clue_net_wake;
+	epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, ip2clue_net_wake.fd, &ev);
+
+	return 0;
+}
+
+/*
+ * Closes the listening sockets of a thread, but not the shared one
+ */
+static void ip2clue_net_unlisten(struct ip2clue_net_thread *t)
+{
+	while (t->listen_no > 0) {
+		t->listen_no--;
+		if (t->listen[t->listen_no].local == 0)
+			close(t->listen[t->listen_no].fd);
+	}
+}
+
+/*
+ * Closes and removes the unix socket
+ */
+static void ip2clue_net_unlisten_local(void)
+{
+	if (ip2clue_net_local == -1)
+		return;
+
+	close(ip2clue_net_local);
+	ip2clue_net_local = -1;
+	unlink(ip2clue_net_conf.local_path);
+}
+
+/*
+ * Pins thread @t to the (no % count)-th CPU of the set
+ */
+static void ip2clue_net_pin(struct ip2clue_net_thread *t, const cpu_set_t *cpus)
+{
+	cpu_set_t one;
+	unsigned int i, count, k;
+
+	count = CPU_COUNT(cpus);
+	if (count == 0)
+		return;
+
+	k = t->no % count;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, cpus))
+			continue;
+		if (k-- > 0)
+			continue;
+
+		CPU_ZERO(&one);
+		CPU_SET(i, &one);
+		pthread_setaffinity_np(t->tid, sizeof(one), &one);
+		return;
+	}
+}
+
+/*
+ * Starts the I/O threads
+ */
+int ip2clue_net_start(const struct ip2clue_net_conf *c)
+{
+	struct ip2clue_net_thread *t;
+	void *(*worker)(void *);
+	unsigned int i, j;
+	int ret;
+
+	if ((c->threads == 0) || (c->threads > IP2CLUE_NET_MAX_THREADS)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"invalid number of threads %u (1..%u)",
+			c->threads, IP2CLUE_NET_MAX_THREADS);
+		return -1;
+	}
+
+#ifndef IP2CLUE_HAVE_URING
+	if (c->uring) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"io_uring support not compiled in");
+		return -1;
+	}
+#endif
+
+	ip2clue_net_conf = *c;
+	ip2clue_net_exit = 0;
+	ip2clue_net_started = 0;
+	ip2clue_net_start_failed = 0;
+
+	ip2clue_net_wake.type = IP2CLUE_NET_WAKE;
+	ip2clue_net_wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ip2clue_net_wake.fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create eventfd (%s)", strerror(errno));
+		return -1;
+	}
+
+	if (c->local_path != NULL) {
+		ip2clue_net_local = ip2clue_net_bind_local(c->local_path,
+			SOCK_STREAM, c->local_mode);
+		if (ip2clue_net_local == -1) {
+			close(ip2clue_net_wake.fd);
+			return -1;
+		}
+	}
+
+	/* All the sockets first, so a bind error stops everything */
+	for (i = 0; i < c->threads; i++) {
+		t = &ip2clue_net_threads[i];
+		t->no = i;
+		if (ip2clue_net_thread_init(t) != 0)
+			goto out_close;
+	}
+
+	for (i = 0; i < c->threads; i++) {
+		t = &ip2clue_net_threads[i];
+		worker = ip2clue_net_worker;
+#ifdef IP2CLUE_HAVE_URING
+		if (c->uring)
+			worker = ip2clue_net_uring_worker;
+#endif
+		ret = pthread_create(&t->tid, NULL, worker, t);
+		if (ret != 0) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot create thread (%s)", strerror(ret));
+			ip2clue_net_threads_no = i;
+			ip2clue_net_stop();
+			return -1;
+		}
+		if (c->cpus != NULL)
+			ip2clue_net_pin(t, c->cpus);
+	}
+	ip2clue_net_threads_no = c->threads;
+
+#ifdef IP2CLUE_HAVE_URING
+	if (c->uring) {
+		/* ip2clue_error was set by the worker that failed */
+		pthread_mutex_lock(&ip2clue_net_start_lock);
+		while (ip2clue_net_started < c->threads)
+			pthread_cond_wait(&ip2clue_net_start_cond,
+				&ip2clue_net_start_lock);
+		ret = ip2clue_net_start_failed;
+		pthread_mutex_unlock(&ip2clue_net_start_lock);
+		if (ret != 0) {
+			ip2clue_net_stop();
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+
+	out_close:
+	for (j = 0; j <= i; j++) {
+		t = &ip2clue_net_threads[j];
+		ip2clue_net_unlisten(t);
+		if (t->epoll_fd != -1)
+			close(t->epoll_fd);
+#ifdef IP2CLUE_HAVE_URING
+		if (t->ring.fd != -1) {
+			ip2clue_uring_bufs_free(&t->ring, &t->bufs);
+			ip2clue_uring_exit(&t->ring);
+		}
+#endif
+	}
+	ip2clue_net_unlisten_local();
+	close(ip2clue_net_wake.fd);
+
+	return -1;
+}
+
+/*
+ * Stops the I/O threads and closes the listening sockets
+ */
+void ip2clue_net_stop(void)
+{
+	struct ip2clue_net_thread *t;
+	unsigned long long one = 1;
+	unsigned int i;
+
+	__atomic_store_n(&ip2clue_net_exit, 1, __ATOMIC_RELAXED);
+	if (write(ip2clue_net_wake.fd, &one, sizeof(one)) != sizeof(one))
+		return;
+
+	for (i = 0; i < ip2clue_net_threads_no; i++) {
+		t = &ip2clue_net_threads[i];
+		pthread_join(t->tid, NULL);
+		ip2clue_net_unlisten(t);
+		if (t->epoll_fd != -1)
+			close(t->epoll_fd);
+	}
+	ip2clue_net_threads_no = 0;
+	ip2clue_net_unlisten_local();
+	close(ip2clue_net_wake.fd);
+}
@@ -0,0 +1,80 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: multi-threaded line server (one epoll loop per thread)
+ */
+
+#ifndef IP2CLUE_I_NET_H
+#define IP2CLUE_I_NET_H 1
+
+#include <i_config.h>
+
+#include <stdlib.h>
+#include <sched.h>
+
+/* Max number of I/O threads */
+#define IP2CLUE_NET_MAX_THREADS	64
+
+/* A command line longer than this closes the connection */
+#define IP2CLUE_NET_LINE_MAX	16384
+
+/* Max answer to one line ("M" answers many addresses) */
+#define IP2CLUE_NET_ANSWER_MAX	(64 * 1024)
+
+/* Stop reading from a client that does not read its answers */
+#define IP2CLUE_NET_OUT_MAX	(256 * 1024)
+
+/* Local peers (unix sockets) counted by uid; the others go together */
+#define IP2CLUE_NET_PEERS	64
+
+struct ip2clue_fmt;
+
+/*
+ * Answers one line (without '\n'): writes the answer, '\n' included, in
+ * @out and returns its length. Sets @close to 1 to close the connection
+ * after the answer is sent. @fmt is the format of the client (NULL =
+ * default), kept between lines; a new one must come from ip2clue_fmt_new,
+ * it is freed with the connection. Called from the I/O threads, concurrently.
+ */
+typedef size_t (*ip2clue_net_line_cb)(char *line, char *out,
+	const size_t out_size, int *close, const struct ip2clue_fmt **fmt);
+
+/*
+ * Answers one binary request from @in (see i_bin.c): sets @used to its
+ * length (0 = not complete yet) and returns the length of the answer.
+ */
+typedef size_t (*ip2clue_net_bin_cb)(const unsigned char *in,
+	const size_t in_len, size_t *used, unsigned char *out,
+	const size_t out_size, int *close);
+
+/* Called before/after all the complete requests of one read */
+typedef void (*ip2clue_net_batch_cb)(void);
+
+struct ip2clue_net_conf
+{
+	unsigned int		threads;
+	unsigned int		port;
+	unsigned int		ipv4, ipv6;
+	const cpu_set_t		*cpus;	/* thread i is pinned to the i-th CPU */
+	unsigned int		uring;	/* io_uring instead of epoll */
+	const char		*local_path;	/* unix stream socket or NULL */
+	unsigned int		local_mode;	/* its permissions */
+	ip2clue_net_line_cb	cb;
+	ip2clue_net_bin_cb	bin;	/* NULL = text only */
+	ip2clue_net_batch_cb	begin, end;	/* optional */
+};
+
+extern int		ip2clue_net_bind(const int domain, const int type,
+				const unsigned int port);
+
+extern int		ip2clue_net_bind_local(const char *path,
+				const int type, const unsigned int mode);
+
+extern void		ip2clue_net_peer_count(const unsigned int uid,
+				const unsigned int requests);
+extern size_t		ip2clue_net_peer_stats(char *out,
+				const size_t out_size, const int json);
+
+extern int		ip2clue_net_start(const struct ip2clue_net_conf *c);
+extern void		ip2clue_net_stop(void);
+
+#endif
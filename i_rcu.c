@@ -0,0 +1,186 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: lock-free publication of shared data (epoch based RCU)
+ * Readers announce the epoch they started in, in a per thread slot, and then
+ * just load the published pointer: no lock, no shared cache line written.
+ * A writer swaps the pointer, starts a new epoch and waits until no reader is
+ * still in an older one; after that, nobody can see the old data anymore.
+ * Any thread can be a reader; the slot is taken at the first read_lock and
+ * given back when the thread exits.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <i_util.h>
+#include <i_rcu.h>
+
+/* One per reader thread; padded to a cache line, readers write it often */
+struct ip2clue_rcu_reader
+{
+	unsigned long long	epoch;		/* 0 = not in a read section */
+	unsigned int		in_use;
+	unsigned int		nesting;
+	char			pad[64 - 16];
+};
+
+static struct ip2clue_rcu_reader	ip2clue_rcu_readers[IP2CLUE_RCU_MAX_READERS]
+						__attribute__((aligned(64)));
+static unsigned long long		ip2clue_rcu_epoch = 1;
+static pthread_mutex_t			ip2clue_rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t			ip2clue_rcu_key;
+static pthread_once_t			ip2clue_rcu_once = PTHREAD_ONCE_INIT;
+static __thread struct ip2clue_rcu_reader	*ip2clue_rcu_self;
+
+/*
+ * Gives the slot back (thread exit)
+ */
+static void ip2clue_rcu_release(void *arg)
+{
+	struct ip2clue_rcu_reader *r = (struct ip2clue_rcu_reader *) arg;
+
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+	r->nesting = 0;
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ip2clue_rcu_init(void)
+{
+	pthread_key_create(&ip2clue_rcu_key, ip2clue_rcu_release);
+}
+
+/*
+ * Takes a reader slot for the current thread
+ */
+static int ip2clue_rcu_register(void)
+{
+	unsigned int i;
+
+	pthread_once(&ip2clue_rcu_once, ip2clue_rcu_init);
+
+	pthread_mutex_lock(&ip2clue_rcu_lock);
+	for (i = 0; i < IP2CLUE_RCU_MAX_READERS; i++) {
+		if (ip2clue_rcu_readers[i].in_use == 0) {
+			ip2clue_rcu_readers[i].in_use = 1;
+			ip2clue_rcu_readers[i].nesting = 0;
+			ip2clue_rcu_self = &ip2clue_rcu_readers[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ip2clue_rcu_lock);
+
+	if (ip2clue_rcu_self == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"too many rcu readers (max %u)",
+			IP2CLUE_RCU_MAX_READERS);
+		return -1;
+	}
+
+	pthread_setspecific(ip2clue_rcu_key, ip2clue_rcu_self);
+
+	return 0;
+}
+
+/*
+ * Gives back the slot of the current thread before it exits
+ * (not needed for pthreads, the slot is released automatically)
+ */
+void ip2clue_rcu_unregister(void)
+{
+	if (ip2clue_rcu_self == NULL)
+		return;
+
+	pthread_setspecific(ip2clue_rcu_key, NULL);
+	ip2clue_rcu_release(ip2clue_rcu_self);
+	ip2clue_rcu_self = NULL;
+}
+
+/*
+ * Enters a read section. Can be nested.
+ * Returns 0 if OK, -1 if there is no free reader slot.
+ */
+int ip2clue_rcu_read_lock(void)
+{
+	struct ip2clue_rcu_reader *r;
+
+	if ((ip2clue_rcu_self == NULL) && (ip2clue_rcu_register() != 0))
+		return -1;
+
+	r = ip2clue_rcu_self;
+	if (r->nesting++ > 0)
+		return 0;
+
+	/*
+	 * The store must be visible before we load the published pointer,
+	 * else a writer could miss us: seq_cst store + load.
+	 */
+	__atomic_store_n(&r->epoch,
+		__atomic_load_n(&ip2clue_rcu_epoch, __ATOMIC_SEQ_CST),
+		__ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+/*
+ * Leaves a read section
+ */
+void ip2clue_rcu_read_unlock(void)
+{
+	struct ip2clue_rcu_reader *r = ip2clue_rcu_self;
+
+	if ((r == NULL) || (r->nesting == 0))
+		return;
+
+	if (--r->nesting > 0)
+		return;
+
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Loads a published pointer; use it only inside a read section
+ */
+void *ip2clue_rcu_dereference(void **p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Publishes @v in @p and returns the old value. The old value can be freed
+ * only after ip2clue_rcu_synchronize().
+ */
+void *ip2clue_rcu_publish(void **p, void *v)
+{
+	return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Waits until all the readers that could see an old pointer are gone
+ * Must not be called from inside a read section.
+ */
+void ip2clue_rcu_synchronize(void)
+{
+	unsigned long long e, re;
+	unsigned int i;
+	struct timespec ts;
+
+	e = __atomic_add_fetch(&ip2clue_rcu_epoch, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 100000;
+	for (i = 0; i < IP2CLUE_RCU_MAX_READERS; i++) {
+		while (1) {
+			re = __atomic_load_n(&ip2clue_rcu_readers[i].epoch,
+				__ATOMIC_ACQUIRE);
+			if ((re == 0) || (re >= e))
+				break;
+			nanosleep(&ts, NULL);
+		}
+	}
+}
@@ -0,0 +1,23 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: lock-free publication of shared data (epoch based RCU)
+ */
+
+#ifndef IP2CLUE_I_RCU_H
+#define IP2CLUE_I_RCU_H 1
+
+#include <i_config.h>
+
+/* Max number of threads that can be readers at the same time */
+#define IP2CLUE_RCU_MAX_READERS	256
+
+extern int		ip2clue_rcu_read_lock(void);
+extern void		ip2clue_rcu_read_unlock(void);
+
+extern void		*ip2clue_rcu_dereference(void **p);
+extern void		*ip2clue_rcu_publish(void **p, void *v);
+extern void		ip2clue_rcu_synchronize(void);
+
+extern void		ip2clue_rcu_unregister(void);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: background freeing of retired lists/databases
+ * Freeing a retired db (millions of extras, big tables) used to be done by the
+ * loader right after a reload. Now the old list is queued and a low priority
+ * thread waits for the RCU grace period and frees it, in small chunks.
+ * Nobody waits for it; the memory not freed yet is shown in the stats.
+ * Only under a memory budget the loader waits: then it frees the retired lists
+ * itself, at its own priority, so it is not left waiting for an idle thread.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <i_util.h>
+#include <i_rcu.h>
+#include <i_reclaim.h>
+
+struct ip2clue_reclaim_item
+{
+	struct ip2clue_list		*list;
+	unsigned long long		bytes;	/* estimation, for the gauge */
+	struct ip2clue_reclaim_item	*next;
+};
+
+static pthread_mutex_t			ip2clue_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			ip2clue_reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t			ip2clue_reclaim_idle = PTHREAD_COND_INITIALIZER;
+static int				ip2clue_reclaim_busy;
+static struct ip2clue_reclaim_item	*ip2clue_reclaim_head, *ip2clue_reclaim_tail;
+static pthread_t			ip2clue_reclaim_thread;
+static int				ip2clue_reclaim_running;
+static int				ip2clue_reclaim_exit;
+static int				ip2clue_reclaim_sched_idle; /* else nice 19 */
+static pid_t				ip2clue_reclaim_tid;
+
+/* Gauges, read without a lock by the stats */
+static unsigned long long		ip2clue_reclaim_pending_bytes;
+static unsigned int			ip2clue_reclaim_pending_lists;
+static unsigned long long		ip2clue_reclaim_bytes;
+static unsigned long long		ip2clue_reclaim_dbs;
+
+/*
+ * Returns how many bytes will be freed with list @l: the dbs that are
+ * not used by any other list
+ */
+static unsigned long long ip2clue_reclaim_estimate(struct ip2clue_list *l)
+{
+	unsigned long long bytes = 0;
+	unsigned int i;
+	struct ip2clue_db *db;
+
+	for (i = 0; i < l->number; i++) {
+		db = l->entries[i];
+		if (__atomic_load_n(&db->usage_count, __ATOMIC_ACQUIRE) == 1)
+			bytes += db->mem;
+	}
+
+	return bytes;
+}
+
+/*
+ * Waits for the readers and frees a retired list
+ */
+static void ip2clue_reclaim_one(struct ip2clue_list *l,
+	const unsigned long long bytes, const unsigned int batch)
+{
+	unsigned int i;
+	struct ip2clue_db *db;
+
+	ip2clue_rcu_synchronize();
+
+	for (i = 0; i < l->number; i++) {
+		db = l->entries[i];
+		if (ip2clue_db_put(db) == 0)
+			continue;
+
+		__atomic_add_fetch(&ip2clue_reclaim_bytes, db->mem,
+			__ATOMIC_RELAXED);
+		__atomic_add_fetch(&ip2clue_reclaim_dbs, 1, __ATOMIC_RELAXED);
+		ip2clue_db_free(db, batch);
+	}
+
+	if (l->entries != NULL)
+		free(l->entries);
+	if (l->failures != NULL)
+		free(l->failures);
+	if (l->loading != NULL)
+		free(l->loading);
+	free(l);
+
+	__atomic_sub_fetch(&ip2clue_reclaim_pending_bytes, bytes,
+		__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&ip2clue_reclaim_pending_lists, 1,
+		__ATOMIC_RELAXED);
+}
+
+static void *ip2clue_reclaim_worker(void *arg)
+{
+	struct ip2clue_reclaim_item *item;
+	struct sched_param sp;
+
+	(void) arg;
+
+	/* Run only when nobody else wants the CPU; else, at least be nice */
+	memset(&sp, 0, sizeof(sp));
+	pthread_mutex_lock(&ip2clue_reclaim_lock);
+	ip2clue_reclaim_tid = syscall(SYS_gettid);
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp) == 0)
+		ip2clue_reclaim_sched_idle = 1;
+	else
+		setpriority(PRIO_PROCESS, 0, 19); /* Linux: this thread only */
+
+	while (1) {
+		while ((ip2clue_reclaim_head == NULL) && (ip2clue_reclaim_exit == 0))
+			pthread_cond_wait(&ip2clue_reclaim_cond,
+				&ip2clue_reclaim_lock);
+
+		/* On exit, we drain the queue first */
+		item = ip2clue_reclaim_head;
+		if (item == NULL)
+			break;
+
+		ip2clue_reclaim_head = item->next;
+		if (ip2clue_reclaim_head == NULL)
+			ip2clue_reclaim_tail = NULL;
+		ip2clue_reclaim_busy = 1;
+		pthread_mutex_unlock(&ip2clue_reclaim_lock);
+
+		ip2clue_reclaim_one(item->list, item->bytes,
+			IP2CLUE_RECLAIM_BATCH);
+		free(item);
+
+		pthread_mutex_lock(&ip2clue_reclaim_lock);
+		ip2clue_reclaim_busy = 0;
+		pthread_cond_broadcast(&ip2clue_reclaim_idle);
+	}
+	pthread_mutex_unlock(&ip2clue_reclaim_lock);
+
+	return NULL;
+}
+
+/*
+ * Starts the reclaimer thread
+ */
+int ip2clue_reclaim_start(void)
+{
+	int ret;
+
+	if (ip2clue_reclaim_running == 1)
+		return 0;
+
+	ip2clue_reclaim_exit = 0;
+	ret = pthread_create(&ip2clue_reclaim_thread, NULL,
+		ip2clue_reclaim_worker, NULL);
+	if (ret != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot start reclaim thread (%s)", strerror(ret));
+		return -1;
+	}
+	ip2clue_reclaim_running = 1;
+
+	return 0;
+}
+
+/*
+ * Frees everything still queued and stops the thread
+ */
+void ip2clue_reclaim_stop(void)
+{
+	if (ip2clue_reclaim_running == 0)
+		return;
+
+	pthread_mutex_lock(&ip2clue_reclaim_lock);
+	ip2clue_reclaim_exit = 1;
+	pthread_cond_signal(&ip2clue_reclaim_cond);
+	pthread_mutex_unlock(&ip2clue_reclaim_lock);
+
+	pthread_join(ip2clue_reclaim_thread, NULL);
+	ip2clue_reclaim_running = 0;
+}
+
+/*
+ * Retires a malloc-ed list that was just unpublished; returns immediately.
+ * The list and the dbs used only by it are freed after the grace period.
+ * Without the thread (or memory for the queue), or if @now is 1, this is
+ * done right away, by the caller.
+ */
+void ip2clue_reclaim_list(struct ip2clue_list *l, const int now)
+{
+	struct ip2clue_reclaim_item *item;
+	unsigned long long bytes;
+
+	bytes = ip2clue_reclaim_estimate(l);
+	__atomic_add_fetch(&ip2clue_reclaim_pending_bytes, bytes,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&ip2clue_reclaim_pending_lists, 1,
+		__ATOMIC_RELAXED);
+
+	item = NULL;
+	if ((ip2clue_reclaim_running == 1) && (now == 0))
+		item = (struct ip2clue_reclaim_item *)
+			malloc(sizeof(struct ip2clue_reclaim_item));
+	if (item == NULL) {
+		ip2clue_reclaim_one(l, bytes, 0);
+		return;
+	}
+
+	item->list = l;
+	item->bytes = bytes;
+	item->next = NULL;
+
+	pthread_mutex_lock(&ip2clue_reclaim_lock);
+	if (ip2clue_reclaim_tail == NULL)
+		ip2clue_reclaim_head = item;
+	else
+		ip2clue_reclaim_tail->next = item;
+	ip2clue_reclaim_tail = item;
+	pthread_cond_signal(&ip2clue_reclaim_cond);
+	pthread_mutex_unlock(&ip2clue_reclaim_lock);
+}
+
+/*
+ * Gives the reclaimer the scheduling of the calling thread (@boost 1)
+ * or puts it back to idle (@boost 0). Best effort: without the rights
+ * to raise it, it stays as it is. Called with the lock held.
+ */
+static void ip2clue_reclaim_boost(const int boost)
+{
+	struct sched_param sp;
+	int policy;
+
+	if (ip2clue_reclaim_sched_idle == 0) {
+		setpriority(PRIO_PROCESS, ip2clue_reclaim_tid,
+			boost ? getpriority(PRIO_PROCESS, 0) : 19);
+		return;
+	}
+
+	memset(&sp, 0, sizeof(sp));
+	policy = SCHED_IDLE;
+	if (boost)
+		pthread_getschedparam(pthread_self(), &policy, &sp);
+	pthread_setschedparam(ip2clue_reclaim_thread, policy, &sp);
+}
+
+/*
+ * Frees everything retired so far before returning
+ * (the loader uses it to keep only one copy of a db when memory is short).
+ * The queued lists are freed by the caller; for the one the reclaimer is
+ * busy with, the reclaimer runs with the caller's priority until it is done.
+ */
+void ip2clue_reclaim_wait(void)
+{
+	struct ip2clue_reclaim_item *item;
+
+	pthread_mutex_lock(&ip2clue_reclaim_lock);
+	while ((item = ip2clue_reclaim_head) != NULL) {
+		ip2clue_reclaim_head = item->next;
+		if (ip2clue_reclaim_head == NULL)
+			ip2clue_reclaim_tail = NULL;
+		pthread_mutex_unlock(&ip2clue_reclaim_lock);
+
+		ip2clue_reclaim_one(item->list, item->bytes, 0);
+		free(item);
+
+		pthread_mutex_lock(&ip2clue_reclaim_lock);
+	}
+
+	if ((ip2clue_reclaim_running == 1) && (ip2clue_reclaim_busy == 1)) {
+		ip2clue_reclaim_boost(1);
+		while (ip2clue_reclaim_busy == 1)
+			pthread_cond_wait(&ip2clue_reclaim_idle,
+				&ip2clue_reclaim_lock);
+		ip2clue_reclaim_boost(0);
+	}
+	pthread_mutex_unlock(&ip2clue_reclaim_lock);
+}
+
+/*
+ * Returns the reclaimer gauges
+ */
+void ip2clue_reclaim_stats(struct ip2clue_reclaim_stats *s)
+{
+	s->pending_bytes = __atomic_load_n(&ip2clue_reclaim_pending_bytes,
+		__ATOMIC_RELAXED);
+	s->pending_lists = __atomic_load_n(&ip2clue_reclaim_pending_lists,
+		__ATOMIC_RELAXED);
+	s->reclaimed_bytes = __atomic_load_n(&ip2clue_reclaim_bytes,
+		__ATOMIC_RELAXED);
+	s->reclaimed_dbs = __atomic_load_n(&ip2clue_reclaim_dbs,
+		__ATOMIC_RELAXED);
+}
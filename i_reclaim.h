@@ -0,0 +1,32 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: background freeing of retired lists/databases
+ */
+
+#ifndef IP2CLUE_I_RECLAIM_H
+#define IP2CLUE_I_RECLAIM_H 1
+
+#include <i_config.h>
+
+#include <i_types.h>
+
+/* Free cells in chunks of this size, giving away the CPU in between */
+#define IP2CLUE_RECLAIM_BATCH	65536
+
+struct ip2clue_reclaim_stats
+{
+	unsigned long long	pending_bytes;	/* retired, not freed yet */
+	unsigned int		pending_lists;
+	unsigned long long	reclaimed_bytes;
+	unsigned long long	reclaimed_dbs;
+};
+
+extern int		ip2clue_reclaim_start(void);
+extern void		ip2clue_reclaim_stop(void);
+
+extern void		ip2clue_reclaim_list(struct ip2clue_list *l, const int now);
+extern void		ip2clue_reclaim_wait(void);
+
+extern void		ip2clue_reclaim_stats(struct ip2clue_reclaim_stats *s);
+
+#endif
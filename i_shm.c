@@ -0,0 +1,636 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: tables published in shared memory, searched in-process
+ * The daemon copies the cells of the active list in a data file (on tmpfs,
+ * like /dev/shm) named "<path>.<generation>", then points the control file
+ * "<path>" to it (seqlock) and removes the old one. A process on the same
+ * host maps the control file once; a lookup checks the generation (one
+ * load), remaps only when it changed and then searches the mapped tables,
+ * with no system call. A client that still uses an old generation keeps a
+ * valid mapping until it notices the new one.
+ * mmdb databases are decoded on demand and are not published.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <i_util.h>
+#include <i_shm.h>
+
+/* Every part of a data file starts 8 bytes aligned */
+#define IP2CLUE_SHM_ALIGN(x)	(((x) + 7ULL) & ~7ULL)
+
+/*
+ * Opens (or creates) the control file; a valid one left by a previous run
+ * is kept, so the clients that have it mapped go on working. A symlink or
+ * anything else than a regular file there is refused.
+ */
+int ip2clue_shm_create(struct ip2clue_shm_writer *w, const char *path)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (strlen(path) + 16 > sizeof(w->path)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"shm path too long [%s]", path);
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot open [%s] (%s)", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot stat [%s] (%s)", path, strerror(errno));
+		goto out_close;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s] is not a regular file", path);
+		goto out_close;
+	}
+
+	if (((size_t) st.st_size < sizeof(struct ip2clue_shm_header))
+		&& (ftruncate(fd, sizeof(struct ip2clue_shm_header)) != 0)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot resize [%s] (%s)", path, strerror(errno));
+		goto out_close;
+	}
+
+	p = mmap(NULL, sizeof(struct ip2clue_shm_header),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot mmap [%s] (%s)", path, strerror(errno));
+		goto out_close;
+	}
+
+	strcpy(w->path, path);
+	w->fd = fd;
+	w->h = (struct ip2clue_shm_header *) p;
+	if ((w->h->magic != IP2CLUE_SHM_MAGIC)
+		|| (w->h->version != IP2CLUE_SHM_VERSION)) {
+		memset(w->h, 0, sizeof(struct ip2clue_shm_header));
+		w->h->version = IP2CLUE_SHM_VERSION;
+		__atomic_store_n(&w->h->magic, IP2CLUE_SHM_MAGIC,
+			__ATOMIC_RELEASE);
+	}
+	/*
+	 * A client that did not look at the file while we were down may
+	 * still have the last generation mapped: never publish it again.
+	 */
+	w->generation = w->h->last;
+
+	return 0;
+
+	out_close:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Points the control file to generation @gen in file @data (seqlock write)
+ */
+static void ip2clue_shm_switch(struct ip2clue_shm_header *h,
+	const unsigned int gen, const char *data)
+{
+	unsigned int seq;
+
+	seq = h->seq;
+	__atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	snprintf(h->data, sizeof(h->data), "%s", data);
+	__atomic_store_n(&h->generation, gen, __ATOMIC_RELEASE);
+	if (gen != 0)
+		h->last = gen;
+
+	__atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Number of extras of a db: consecutive cells often share one
+ */
+static unsigned int ip2clue_shm_extras(const struct ip2clue_db *db)
+{
+	const struct ip2clue_extra *e, *prev = NULL;
+	unsigned long long i;
+	unsigned int n = 0;
+
+	for (i = 0; i < db->no_of_cells; i++) {
+		if (db->v4_or_v6 == IP2CLUE_TYPE_V4)
+			e = ((struct ip2clue_cell_v4 *) db->cells)[i].extra;
+		else
+			e = ((struct ip2clue_cell_v6 *) db->cells)[i].extra;
+		if ((e != NULL) && (e != prev))
+			n++;
+		prev = e;
+	}
+
+	return n;
+}
+
+static size_t ip2clue_shm_cell_size(const unsigned int v4_or_v6)
+{
+	if (v4_or_v6 == IP2CLUE_TYPE_V4)
+		return sizeof(struct ip2clue_shm_cell_v4);
+
+	return sizeof(struct ip2clue_shm_cell_v6);
+}
+
+/*
+ * Copies the cells (and their extras) of @db at its offsets in @base
+ */
+static void ip2clue_shm_fill(char *base, const struct ip2clue_shm_db *sdb,
+	const struct ip2clue_db *db)
+{
+	struct ip2clue_shm_cell_v4 *s4;
+	struct ip2clue_shm_cell_v6 *s6;
+	const struct ip2clue_cell_v4 *c4;
+	const struct ip2clue_cell_v6 *c6;
+	const struct ip2clue_extra *e, *prev = NULL;
+	struct ip2clue_extra *extras;
+	unsigned long long i;
+	unsigned int n = 0, *extra;
+
+	extras = (struct ip2clue_extra *) (base + sdb->extras);
+	for (i = 0; i < sdb->cells_no; i++) {
+		if (sdb->v4_or_v6 == IP2CLUE_TYPE_V4) {
+			c4 = &((const struct ip2clue_cell_v4 *) db->cells)[i];
+			s4 = &((struct ip2clue_shm_cell_v4 *) (base + sdb->cells))[i];
+			s4->ip_start = c4->ip_start;
+			s4->ip_end = c4->ip_end;
+			memcpy(s4->country_short, c4->country_short, 4);
+			e = c4->extra;
+			extra = &s4->extra;
+		} else {
+			c6 = &((const struct ip2clue_cell_v6 *) db->cells)[i];
+			s6 = &((struct ip2clue_shm_cell_v6 *) (base + sdb->cells))[i];
+			memcpy(s6->ip_start, c6->ip_start, sizeof(s6->ip_start));
+			memcpy(s6->ip_end, c6->ip_end, sizeof(s6->ip_end));
+			memcpy(s6->country_short, c6->country_short, 4);
+			e = c6->extra;
+			extra = &s6->extra;
+		}
+
+		if ((e != NULL) && (e != prev))
+			memcpy(&extras[n++], e, sizeof(struct ip2clue_extra));
+		*extra = e != NULL ? n : 0;
+		prev = e;
+	}
+}
+
+/*
+ * Writes the tables of @list in a new data file and switches to it
+ * Called by one thread only (the loader).
+ */
+int ip2clue_shm_publish(struct ip2clue_shm_writer *w,
+	const struct ip2clue_list *list)
+{
+	struct ip2clue_shm_data *d;
+	struct ip2clue_shm_db *sdb;
+	const struct ip2clue_db *db;
+	char name[256], old[256];
+	unsigned long long size;
+	unsigned int i, n, gen;
+	char *base;
+	void *p;
+	int fd;
+
+	n = 0;
+	for (i = 0; i < list->number; i++) {
+		db = list->entries[i];
+		if ((db->format != IP2CLUE_FORMAT_MMDB) && (db->cells != NULL))
+			n++;
+	}
+
+	size = IP2CLUE_SHM_ALIGN(sizeof(struct ip2clue_shm_data)
+		+ n * sizeof(struct ip2clue_shm_db));
+	sdb = (struct ip2clue_shm_db *) malloc((n + 1) * sizeof(struct ip2clue_shm_db));
+	if (sdb == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for shm dbs");
+		return -1;
+	}
+
+	n = 0;
+	for (i = 0; i < list->number; i++) {
+		db = list->entries[i];
+		if ((db->format == IP2CLUE_FORMAT_MMDB) || (db->cells == NULL))
+			continue;
+
+		sdb[n].v4_or_v6 = db->v4_or_v6;
+		sdb[n].cells_no = db->no_of_cells;
+		sdb[n].extras_no = ip2clue_shm_extras(db);
+		sdb[n].cells = size;
+		size = IP2CLUE_SHM_ALIGN(size
+			+ db->no_of_cells * ip2clue_shm_cell_size(db->v4_or_v6));
+		sdb[n].extras = size;
+		size = IP2CLUE_SHM_ALIGN(size
+			+ sdb[n].extras_no * sizeof(struct ip2clue_extra));
+		n++;
+	}
+
+	gen = w->generation + 1;
+	if (gen == 0)
+		gen = 1;
+	snprintf(name, sizeof(name), "%s.%u", w->path, gen);
+
+	/*
+	 * The name is predictable: whatever is there (a file of a crashed
+	 * run or a planted symlink) is removed, and the file must be new.
+	 */
+	unlink(name);
+	fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		0644);
+	if (fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create [%.200s] (%s)", name, strerror(errno));
+		goto out_free;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot resize [%.200s] to %lluB (%s)",
+			name, size, strerror(errno));
+		goto out_unlink;
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot mmap [%.200s] (%s)", name, strerror(errno));
+		goto out_unlink;
+	}
+
+	base = (char *) p;
+	d = (struct ip2clue_shm_data *) p;
+	d->magic = IP2CLUE_SHM_MAGIC;
+	d->version = IP2CLUE_SHM_VERSION;
+	d->generation = gen;
+	d->dbs_no = n;
+	d->size = size;
+	memcpy(base + sizeof(struct ip2clue_shm_data), sdb,
+		n * sizeof(struct ip2clue_shm_db));
+
+	n = 0;
+	for (i = 0; i < list->number; i++) {
+		db = list->entries[i];
+		if ((db->format == IP2CLUE_FORMAT_MMDB) || (db->cells == NULL))
+			continue;
+		ip2clue_shm_fill(base, &sdb[n++], db);
+	}
+
+	munmap(p, size);
+	close(fd);
+	free(sdb);
+
+	snprintf(old, sizeof(old), "%s", w->h->data);
+	ip2clue_shm_switch(w->h, gen, name);
+	w->generation = gen;
+	if (old[0] != '\0')
+		unlink(old);
+
+	return 0;
+
+	out_unlink:
+	close(fd);
+	unlink(name);
+
+	out_free:
+	free(sdb);
+	return -1;
+}
+
+/*
+ * Tells the clients that nothing is published and removes the data
+ */
+void ip2clue_shm_destroy(struct ip2clue_shm_writer *w)
+{
+	char name[256];
+
+	if (w->h == NULL)
+		return;
+
+	snprintf(name, sizeof(name), "%s", w->h->data);
+	ip2clue_shm_switch(w->h, 0, "");
+	if (name[0] != '\0')
+		unlink(name);
+
+	/* A publish interrupted by the exit may have left the next one */
+	snprintf(name, sizeof(name), "%s.%u", w->path, w->generation + 1);
+	unlink(name);
+
+	munmap(w->h, sizeof(struct ip2clue_shm_header));
+	w->h = NULL;
+	close(w->fd);
+}
+
+/*
+ * Maps the control file published by the daemon at @path
+ */
+int ip2clue_shm_open(struct ip2clue_shm *s, const char *path)
+{
+	const struct ip2clue_shm_header *h;
+	struct stat st;
+	void *p;
+	int fd;
+
+	memset(s, 0, sizeof(struct ip2clue_shm));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot open [%s] (%s)", path, strerror(errno));
+		return -1;
+	}
+
+	if ((fstat(fd, &st) != 0)
+		|| ((size_t) st.st_size < sizeof(struct ip2clue_shm_header))) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s] is not an ip2clue shm file", path);
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, sizeof(struct ip2clue_shm_header), PROT_READ,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot mmap [%s] (%s)", path, strerror(errno));
+		return -1;
+	}
+
+	h = (const struct ip2clue_shm_header *) p;
+	if ((__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != IP2CLUE_SHM_MAGIC)
+		|| (h->version != IP2CLUE_SHM_VERSION)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s] is not an ip2clue shm file (version %u)",
+			path, IP2CLUE_SHM_VERSION);
+		munmap(p, sizeof(struct ip2clue_shm_header));
+		return -1;
+	}
+	s->h = h;
+
+	return 0;
+}
+
+static void ip2clue_shm_unmap(struct ip2clue_shm *s)
+{
+	if (s->data == NULL)
+		return;
+
+	munmap((void *) s->data, s->data_size);
+	s->data = NULL;
+	s->generation = 0;
+}
+
+/*
+ * Checks that all the tables are inside the mapping
+ */
+static int ip2clue_shm_valid(const struct ip2clue_shm_data *d,
+	const size_t size, const unsigned int gen)
+{
+	const struct ip2clue_shm_db *sdb;
+	unsigned long long end;
+	unsigned int i;
+
+	if ((d->magic != IP2CLUE_SHM_MAGIC) || (d->version != IP2CLUE_SHM_VERSION)
+		|| (d->generation != gen) || (d->size != size))
+		return 0;
+
+	end = sizeof(struct ip2clue_shm_data)
+		+ (unsigned long long) d->dbs_no * sizeof(struct ip2clue_shm_db);
+	if (end > size)
+		return 0;
+
+	sdb = (const struct ip2clue_shm_db *) (d + 1);
+	for (i = 0; i < d->dbs_no; i++) {
+		if ((sdb[i].v4_or_v6 != IP2CLUE_TYPE_V4)
+			&& (sdb[i].v4_or_v6 != IP2CLUE_TYPE_V6))
+			return 0;
+		if ((sdb[i].cells > size) || (sdb[i].cells_no
+			> (size - sdb[i].cells) / ip2clue_shm_cell_size(sdb[i].v4_or_v6)))
+			return 0;
+		if ((sdb[i].extras > size) || (sdb[i].extras_no
+			> (size - sdb[i].extras) / sizeof(struct ip2clue_extra)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Maps the data of the current generation
+ */
+static int ip2clue_shm_remap(struct ip2clue_shm *s)
+{
+	char name[sizeof(s->h->data)];
+	unsigned int seq, gen, tries;
+	struct stat st;
+	void *p;
+	int fd;
+
+	for (tries = 0; tries < 1000; tries++) {
+		/* seqlock read */
+		seq = __atomic_load_n(&s->h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		gen = __atomic_load_n(&s->h->generation, __ATOMIC_RELAXED);
+		memcpy(name, s->h->data, sizeof(name));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->h->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		name[sizeof(name) - 1] = '\0';
+
+		if (gen == 0) {
+			ip2clue_shm_unmap(s);
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"nothing published");
+			return -1;
+		}
+
+		/* Already replaced and removed: read the control file again */
+		fd = open(name, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		if ((fstat(fd, &st) != 0)
+			|| ((size_t) st.st_size < sizeof(struct ip2clue_shm_data))) {
+			close(fd);
+			continue;
+		}
+
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			continue;
+
+		if (!ip2clue_shm_valid((const struct ip2clue_shm_data *) p,
+			st.st_size, gen)) {
+			munmap(p, st.st_size);
+			continue;
+		}
+
+		ip2clue_shm_unmap(s);
+		s->data = (const struct ip2clue_shm_data *) p;
+		s->data_size = st.st_size;
+		s->generation = gen;
+		return 0;
+	}
+
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"cannot map the published tables");
+	return -1;
+}
+
+/*
+ * Searches the published dbs of type @type; fills @r if found
+ */
+static int ip2clue_shm_search(const struct ip2clue_shm *s,
+	const enum ip2clue_type type, const unsigned int *ip,
+	struct ip2clue_result *r)
+{
+	const char *base = (const char *) s->data;
+	const struct ip2clue_shm_db *sdb;
+	const struct ip2clue_shm_cell_v4 *c4;
+	const struct ip2clue_shm_cell_v6 *c6;
+	unsigned long long left, right, middle;
+	unsigned int i, extra;
+
+	sdb = (const struct ip2clue_shm_db *) (s->data + 1);
+	for (i = 0; i < s->data->dbs_no; i++, sdb++) {
+		if (sdb->v4_or_v6 != (unsigned int) type)
+			continue;
+
+		/* The last cell that starts at or before ip */
+		left = 0;
+		right = sdb->cells_no;
+		if (type == IP2CLUE_TYPE_V4) {
+			c4 = (const struct ip2clue_shm_cell_v4 *) (base + sdb->cells);
+			while (left < right) {
+				middle = left + (right - left) / 2;
+				if (c4[middle].ip_start <= ip[0])
+					left = middle + 1;
+				else
+					right = middle;
+			}
+			if ((left == 0) || (ip[0] > c4[left - 1].ip_end))
+				continue;
+
+			c4 += left - 1;
+			r->ip_start[0] = c4->ip_start;
+			r->ip_end[0] = c4->ip_end;
+			memcpy(r->country_short, c4->country_short, 4);
+			extra = c4->extra;
+		} else {
+			c6 = (const struct ip2clue_shm_cell_v6 *) (base + sdb->cells);
+			while (left < right) {
+				middle = left + (right - left) / 2;
+				if (ip2clue_compare_v6(c6[middle].ip_start, ip) <= 0)
+					left = middle + 1;
+				else
+					right = middle;
+			}
+			if ((left == 0)
+				|| (ip2clue_compare_v6(ip, c6[left - 1].ip_end) > 0))
+				continue;
+
+			c6 += left - 1;
+			memcpy(r->ip_start, c6->ip_start, sizeof(r->ip_start));
+			memcpy(r->ip_end, c6->ip_end, sizeof(r->ip_end));
+			memcpy(r->country_short, c6->country_short, 4);
+			extra = c6->extra;
+		}
+
+		r->v4_or_v6 = type;
+		r->country_short[3] = '\0';
+		r->extra = NULL;
+		if ((extra > 0) && (extra <= sdb->extras_no))
+			r->extra = (struct ip2clue_extra *) (base + sdb->extras)
+				+ extra - 1;
+		r->db = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Search a parsed address in the published tables
+ * IPv6 addresses that embed an IPv4 one fall back to the IPv4 databases.
+ * r->extra points in the mapping: it is valid until the next lookup.
+ * Returns 1 if found, 0 if not found or error.
+ */
+int ip2clue_shm_lookup_addr(struct ip2clue_shm *s, const struct ip2clue_addr *a,
+	struct ip2clue_result *r)
+{
+	unsigned int gen;
+
+	gen = __atomic_load_n(&s->h->generation, __ATOMIC_ACQUIRE);
+	if ((gen != s->generation) || (s->data == NULL)) {
+		if (ip2clue_shm_remap(s) != 0)
+			return 0;
+	}
+
+	if (ip2clue_shm_search(s, a->v4_or_v6, a->ip, r) == 1)
+		return 1;
+
+	if (((a->addr_class == IP2CLUE_ADDR_V4_MAPPED)
+		|| (a->addr_class == IP2CLUE_ADDR_V4_COMPAT)
+		|| (a->addr_class == IP2CLUE_ADDR_6TO4))
+		&& (ip2clue_shm_search(s, IP2CLUE_TYPE_V4, &a->v4, r) == 1))
+		return 1;
+
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"not found");
+
+	return 0;
+}
+
+/*
+ * Search a textual address in the published tables
+ * Returns 1 if found, 0 if not found or error.
+ */
+int ip2clue_shm_lookup(struct ip2clue_shm *s, const char *ip,
+	struct ip2clue_result *r)
+{
+	struct ip2clue_addr a;
+	const char *e;
+
+	e = ip2clue_addr_parse(&a, ip);
+	if ((e == NULL) || ((*e != '\0') && (*e != ' ') && (*e != '\t')
+		&& (*e != '\r') && (*e != '\n'))) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"malformed address");
+		return 0;
+	}
+
+	return ip2clue_shm_lookup_addr(s, &a, r);
+}
+
+void ip2clue_shm_close(struct ip2clue_shm *s)
+{
+	ip2clue_shm_unmap(s);
+	if (s->h != NULL)
+		munmap((void *) s->h, sizeof(struct ip2clue_shm_header));
+	s->h = NULL;
+}
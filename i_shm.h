@@ -0,0 +1,103 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: tables published in shared memory, searched in-process
+ */
+
+#ifndef IP2CLUE_I_SHM_H
+#define IP2CLUE_I_SHM_H 1
+
+#include <i_config.h>
+
+#include <stdlib.h>
+
+#include <i_types.h>
+#include <i_addr.h>
+
+#define IP2CLUE_SHM_MAGIC	0x49503243U	/* "IP2C" */
+#define IP2CLUE_SHM_VERSION	1
+
+/*
+ * The control segment, at the configured path; never changes size.
+ * 'seq' is a seqlock: odd while 'generation' and 'data' are changed.
+ */
+struct ip2clue_shm_header
+{
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned int		seq;
+	unsigned int		generation;	/* 0 = nothing published */
+	unsigned int		last;		/* never goes back, see create */
+	char			data[256];	/* file with the tables */
+};
+
+/*
+ * A data segment; written once, then only read, then unlinked
+ * The dbs follow the header, in the order of preference.
+ */
+struct ip2clue_shm_data
+{
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned int		generation;
+	unsigned int		dbs_no;
+	unsigned long long	size;
+};
+
+struct ip2clue_shm_db
+{
+	unsigned int		v4_or_v6;
+	unsigned int		extras_no;
+	unsigned long long	cells_no;
+	unsigned long long	cells;		/* offsets in the segment */
+	unsigned long long	extras;
+};
+
+/* 'extra' is 1 + the index in the extras of the db; 0 = none */
+struct ip2clue_shm_cell_v4
+{
+	unsigned int		ip_start, ip_end;
+	char			country_short[4];
+	unsigned int		extra;
+};
+
+struct ip2clue_shm_cell_v6
+{
+	unsigned int		ip_start[4], ip_end[4];
+	char			country_short[4];
+	unsigned int		extra;
+};
+
+/* Publisher side (the daemon) */
+struct ip2clue_shm_writer
+{
+	char			path[200];
+	int			fd;
+	struct ip2clue_shm_header	*h;
+	unsigned int		generation;
+};
+
+/* Reader side; one per thread, it is not locked */
+struct ip2clue_shm
+{
+	const struct ip2clue_shm_header	*h;
+	unsigned int		generation;	/* of the mapped data */
+	const struct ip2clue_shm_data	*data;
+	size_t			data_size;
+};
+
+extern int		ip2clue_shm_create(struct ip2clue_shm_writer *w,
+				const char *path);
+extern int		ip2clue_shm_publish(struct ip2clue_shm_writer *w,
+				const struct ip2clue_list *list);
+extern void		ip2clue_shm_destroy(struct ip2clue_shm_writer *w);
+
+extern int		ip2clue_shm_open(struct ip2clue_shm *s,
+				const char *path);
+extern int		ip2clue_shm_lookup_addr(struct ip2clue_shm *s,
+				const struct ip2clue_addr *a,
+				struct ip2clue_result *r);
+extern int		ip2clue_shm_lookup(struct ip2clue_shm *s,
+				const char *ip, struct ip2clue_result *r);
+extern void		ip2clue_shm_close(struct ip2clue_shm *s);
+
+#endif
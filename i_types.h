@@ -9,6 +9,7 @@
 #include <i_config.h>
 
 #include <time.h>
+#include <stddef.h>
 
 enum ip2clue_type
 {
@@ -22,7 +23,86 @@ enum ip2clue_format
 	IP2CLUE_FORMAT_MAXMIND,
 	IP2CLUE_FORMAT_MAXMIND_V6,
 	IP2CLUE_FORMAT_SOFTWARE77,
-	IP2CLUE_FORMAT_IP2LOCATION
+	IP2CLUE_FORMAT_IP2LOCATION,
+	IP2CLUE_FORMAT_MMDB
+};
+
+/* Fields a response format needs (see ip2clue_format_fields) */
+#define IP2CLUE_FIELD_COUNTRY_SHORT	(1U << 0)
+#define IP2CLUE_FIELD_COUNTRY_LONG	(1U << 1)
+#define IP2CLUE_FIELD_REGION		(1U << 2)
+#define IP2CLUE_FIELD_CITY		(1U << 3)
+#define IP2CLUE_FIELD_ISP		(1U << 4)
+#define IP2CLUE_FIELD_LATITUDE		(1U << 5)
+#define IP2CLUE_FIELD_LONGITUDE		(1U << 6)
+#define IP2CLUE_FIELD_ZIP		(1U << 7)
+#define IP2CLUE_FIELD_DOMAIN		(1U << 8)
+#define IP2CLUE_FIELD_TIMEZONE		(1U << 9)
+#define IP2CLUE_FIELD_NETSPEED		(1U << 10)
+#define IP2CLUE_FIELD_IDD		(1U << 11)
+#define IP2CLUE_FIELD_AREACODE		(1U << 12)
+#define IP2CLUE_FIELD_WS_CODE		(1U << 13)
+#define IP2CLUE_FIELD_WS_NAME		(1U << 14)
+#define IP2CLUE_FIELD_EXTRA		(0x7FFFU & ~IP2CLUE_FIELD_COUNTRY_SHORT)
+#define IP2CLUE_FIELD_ALL		0x7FFFU
+
+/* Load phases, see struct ip2clue_load_stats */
+enum ip2clue_load_phase
+{
+	IP2CLUE_PHASE_IO = 0,		/* read, inflate, mmap */
+	IP2CLUE_PHASE_PARSE,		/* split lines, convert fields */
+	IP2CLUE_PHASE_INDEX,		/* build/check the search structures */
+	IP2CLUE_PHASE_ALLOC,		/* malloc/realloc of the tables */
+	IP2CLUE_PHASE_MAX
+};
+
+/*
+ * How a db was loaded. Times are in microseconds, CPU is thread CPU time.
+ */
+struct ip2clue_load_stats
+{
+	unsigned long long	wall_us[IP2CLUE_PHASE_MAX];
+	unsigned long long	cpu_us[IP2CLUE_PHASE_MAX];
+	unsigned long long	total_wall_us, total_cpu_us;
+	unsigned long long	bytes_read;	/* from disk, before inflate */
+	unsigned long long	rows;		/* records parsed */
+	unsigned long long	rows_per_sec;
+	/* RSS peak during this load above the RSS at its start; -1 = unknown */
+	long long		rss_peak_delta_kb;
+};
+
+/* A point in time, for the load stats */
+struct ip2clue_clock
+{
+	unsigned long long	wall_us;
+	unsigned long long	cpu_us;
+};
+
+/* Memory placement: policy bits, and what took effect for a block */
+#define IP2CLUE_MEM_THP		(1U << 0)	/* madvise(MADV_HUGEPAGE) */
+#define IP2CLUE_MEM_HUGETLB	(1U << 1)	/* MAP_HUGETLB, else THP */
+#define IP2CLUE_MEM_PREFAULT	(1U << 2)	/* pages faulted in at load */
+#define IP2CLUE_MEM_LOCK	(1U << 3)	/* mlock-ed */
+#define IP2CLUE_MEM_MMAP	(1U << 4)	/* result only: block is mmap-ed */
+
+/*
+ * A big block of memory (cells, extras, mapped file), see i_mem.c
+ */
+struct ip2clue_mem
+{
+	void			*p;
+	size_t			size;
+	unsigned int		flags;		/* IP2CLUE_MEM_*, what took effect */
+};
+
+/*
+ * Identity of a loaded file: if any of these changes, the file is reloaded
+ */
+struct ip2clue_file_id
+{
+	unsigned long long	dev, ino;
+	unsigned long long	size;
+	unsigned long long	mtime_ns;
 };
 
 struct ip2clue_extra
@@ -61,6 +141,21 @@ struct ip2clue_split
 	char			fields[32][256];
 };
 
+/*
+ * Lookup counters of a db, one slot per thread (modulo the number of
+ * slots). The slots are 128 bytes apart, so the I/O threads do not bounce
+ * a shared cache line on every lookup; the stats add them up.
+ */
+#define IP2CLUE_COUNTER_SLOTS	64
+
+struct ip2clue_counters
+{
+	unsigned long long	ok;
+	unsigned long long	notfound;
+	unsigned long long	malformed;
+	char			pad[128 - 3 * sizeof(unsigned long long)];
+};
+
 /* common */
 struct ip2clue_db
 {
@@ -71,12 +166,42 @@ struct ip2clue_db
 	time_t			ts;		/* Db building time */
 	time_t			ts_load;	/* Time when the table was loaded. */
 	unsigned int		elap_load_ms;	/* How much time was needed for load */
+	struct ip2clue_load_stats load;	/* Details about the load */
 	char			file[128];	/* Input file */
+	struct ip2clue_file_id	file_id;	/* what was loaded */
 	unsigned long long	mem;		/* How many bytes this table is using */
 	unsigned int		usage_count;	/* If 0, we can safely drop it */
-	unsigned long long	lookup_ok;
-	unsigned long long	lookup_notfound;
-	unsigned long long	lookup_malformed;
+	struct ip2clue_counters	counters[IP2CLUE_COUNTER_SLOTS];
+	struct ip2clue_mem	cells_mem;	/* where 'cells' lives */
+	struct ip2clue_mem	extras_mem;	/* arena for the extras, if any */
+	struct ip2clue_mem	map;		/* mmap-ed file, if any */
+	void			*priv;		/* format specific data */
+};
+
+/* Retry a file that failed to load after 10s, 20s, 40s... up to 1h */
+#define IP2CLUE_RETRY_MIN	10
+#define IP2CLUE_RETRY_MAX	3600
+
+/*
+ * A file that failed to load; the previous copy (if any) is still used
+ */
+struct ip2clue_failure
+{
+	char			file[128];
+	char			error[256];
+	unsigned int		count;		/* failures in a row */
+	time_t			last;		/* last try */
+	time_t			retry;		/* next try, not before */
+	struct ip2clue_file_id	file_id;	/* a new version is tried now */
+};
+
+/*
+ * A file not loaded yet (startup or memory bounded reload)
+ */
+struct ip2clue_loading
+{
+	char			file[128];
+	unsigned int		has_old;	/* the old copy is still used */
 };
 
 /*
@@ -86,6 +211,10 @@ struct ip2clue_list
 {
 	unsigned int		number;
 	struct ip2clue_db	**entries;
+	unsigned int		failures_no;
+	struct ip2clue_failure	*failures;
+	unsigned int		loading_no;
+	struct ip2clue_loading	*loading;
 };
 
 /* v4 */
@@ -104,4 +233,17 @@ struct ip2clue_cell_v6
 	struct ip2clue_extra	*extra;
 };
 
+/*
+ * Answer of a lookup, independent of the db format
+ */
+struct ip2clue_result
+{
+	enum ip2clue_type	v4_or_v6;
+	unsigned int		ip_start[4], ip_end[4];	/* matched range; v4 uses [0] */
+	char			country_short[4];
+	struct ip2clue_extra	*extra;
+	struct ip2clue_extra	extra_buf;	/* for formats decoded on demand */
+	struct ip2clue_db	*db;
+};
+
 #endif
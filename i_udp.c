@@ -0,0 +1,423 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: UDP query server (recvmmsg/sendmmsg batches)
+ * A datagram carries one or more command lines and gets one datagram back
+ * with the answers, in the same order. If the first line is "#<id>", it is
+ * copied as the first line of the reply, so a client can match the replies
+ * to its requests. A reply is never longer than its request, so a spoofed
+ * source gets no amplification: a client pads its datagram (with empty
+ * lines, for example) to make room for the answers; the first one that does
+ * not fit is replaced by "ER" and ends the reply. Every thread has its own sockets (SO_REUSEPORT) and
+ * receives/sends up to IP2CLUE_UDP_BATCH datagrams per system call.
+ * An optional unix datagram socket is polled by all the threads; its
+ * senders are counted by uid (SCM_CREDENTIALS) and must be bound to an
+ * address to get a reply.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include <i_util.h>
+#include <i_udp.h>
+
+struct ip2clue_udp_thread
+{
+	pthread_t		tid;
+	int			fd[3];
+	unsigned int		fd_no;
+	struct mmsghdr		in_msg[IP2CLUE_UDP_BATCH];
+	struct mmsghdr		out_msg[IP2CLUE_UDP_BATCH];
+	struct iovec		in_iov[IP2CLUE_UDP_BATCH];
+	struct iovec		out_iov[IP2CLUE_UDP_BATCH];
+	struct sockaddr_storage	from[IP2CLUE_UDP_BATCH];
+	char			cmsg[IP2CLUE_UDP_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+	char			in[IP2CLUE_UDP_BATCH][IP2CLUE_UDP_IN_MAX + 1];
+	char			out[IP2CLUE_UDP_BATCH][IP2CLUE_UDP_OUT_MAX];
+};
+
+static struct ip2clue_udp_conf		ip2clue_udp_conf;
+static struct ip2clue_udp_thread	*ip2clue_udp_threads[IP2CLUE_UDP_MAX_THREADS];
+static unsigned int			ip2clue_udp_threads_no;
+static int				ip2clue_udp_wake = -1;
+static int				ip2clue_udp_exit;
+static int				ip2clue_udp_local = -1;
+
+/*
+ * Builds the reply for one request; @requests is set to the number of
+ * lines answered. Returns its length (0 = nothing to send).
+ * Over the network the reply is not longer than the request (or than
+ * IP2CLUE_UDP_PAD), so a spoofed request is not amplified. The local
+ * senders (@local 1) are known by their uid: they get up to
+ * IP2CLUE_UDP_OUT_MAX.
+ */
+static size_t ip2clue_udp_reply(char *in, const size_t in_len, char *out,
+	const int local, unsigned int *requests)
+{
+	char *line, *end, *nl;
+	size_t len = 0, alen, max;
+	int close;
+
+	/* -2: an answer cut by the callback (OUT_MAX - 1 long) does not fit */
+	max = in_len;
+	if (local)
+		max = IP2CLUE_UDP_OUT_MAX - 2;
+	else if (max < sizeof(IP2CLUE_UDP_PAD) - 1)
+		max = sizeof(IP2CLUE_UDP_PAD) - 1;
+
+	*requests = 0;
+	line = in;
+	end = in + in_len;
+	*end = '\0';
+	while (line < end) {
+		nl = (char *) memchr(line, '\n', end - line);
+		if (nl == NULL)
+			nl = end; /* the last '\n' is optional */
+		*nl = '\0';
+		if ((nl > line) && (nl[-1] == '\r'))
+			nl[-1] = '\0';
+
+		if (line[0] == '\0') {
+			line = nl + 1;
+			continue;
+		}
+
+		/* Over the network len <= in_len, so the answer has 12KiB */
+		if ((line == in) && (line[0] == '#')) {
+			alen = snprintf(out, IP2CLUE_UDP_OUT_MAX, "%s\n", line);
+		} else {
+			close = 0;
+			alen = ip2clue_udp_conf.cb(line, out + len,
+				IP2CLUE_UDP_OUT_MAX - len, &close, NULL);
+			(*requests)++;
+		}
+
+		if (len + alen > max) {
+			if (len + sizeof(IP2CLUE_UDP_PAD) - 1 <= max) {
+				memcpy(out + len, IP2CLUE_UDP_PAD,
+					sizeof(IP2CLUE_UDP_PAD) - 1);
+				len += sizeof(IP2CLUE_UDP_PAD) - 1;
+			}
+			break;
+		}
+		len += alen;
+
+		line = nl + 1;
+	}
+
+	return len;
+}
+
+/*
+ * Returns the uid of the sender of a datagram received on the unix socket
+ * or -1 if it has no credentials.
+ */
+static long ip2clue_udp_uid(struct msghdr *h)
+{
+	struct cmsghdr *cm;
+	struct ucred cred;
+
+	for (cm = CMSG_FIRSTHDR(h); cm != NULL; cm = CMSG_NXTHDR(h, cm)) {
+		if ((cm->cmsg_level != SOL_SOCKET)
+			|| (cm->cmsg_type != SCM_CREDENTIALS))
+			continue;
+
+		memcpy(&cred, CMSG_DATA(cm), sizeof(cred));
+		return cred.uid;
+	}
+
+	return -1;
+}
+
+/*
+ * Answers a batch of datagrams from socket @fd
+ * Returns the number of datagrams received.
+ */
+static int ip2clue_udp_batch(struct ip2clue_udp_thread *t, const int fd)
+{
+	struct msghdr *h;
+	unsigned int i, k, sent, requests;
+	size_t len;
+	long uid;
+	int n, r, local;
+
+	local = fd == ip2clue_udp_local;
+
+	for (i = 0; i < IP2CLUE_UDP_BATCH; i++) {
+		t->in_iov[i].iov_base = t->in[i];
+		t->in_iov[i].iov_len = IP2CLUE_UDP_IN_MAX;
+		h = &t->in_msg[i].msg_hdr;
+		memset(h, 0, sizeof(struct msghdr));
+		h->msg_name = &t->from[i];
+		h->msg_namelen = sizeof(t->from[i]);
+		h->msg_iov = &t->in_iov[i];
+		h->msg_iovlen = 1;
+		if (local) {
+			h->msg_control = t->cmsg[i];
+			h->msg_controllen = sizeof(t->cmsg[i]);
+		}
+	}
+
+	n = recvmmsg(fd, t->in_msg, IP2CLUE_UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return 0;
+
+	if (ip2clue_udp_conf.begin != NULL)
+		ip2clue_udp_conf.begin();
+
+	k = 0;
+	for (i = 0; i < (unsigned int) n; i++) {
+		h = &t->in_msg[i].msg_hdr;
+		/* An unbound unix sender cannot get a reply */
+		if (local && (h->msg_namelen <= offsetof(struct sockaddr_un,
+			sun_path)))
+			continue;
+
+		requests = 0;
+		if (h->msg_flags & MSG_TRUNC)
+			len = snprintf(t->out[k], IP2CLUE_UDP_OUT_MAX,
+				"ER errmsg=\"request too big\"\n");
+		else
+			len = ip2clue_udp_reply(t->in[i], t->in_msg[i].msg_len,
+				t->out[k], local, &requests);
+
+		if (local && (requests > 0)) {
+			uid = ip2clue_udp_uid(h);
+			if (uid != -1)
+				ip2clue_net_peer_count(uid, requests);
+		}
+
+		if (len == 0)
+			continue;
+
+		t->out_iov[k].iov_base = t->out[k];
+		t->out_iov[k].iov_len = len;
+		h = &t->out_msg[k].msg_hdr;
+		memset(h, 0, sizeof(struct msghdr));
+		h->msg_name = &t->from[i];
+		h->msg_namelen = t->in_msg[i].msg_hdr.msg_namelen;
+		h->msg_iov = &t->out_iov[k];
+		h->msg_iovlen = 1;
+		k++;
+	}
+
+	if (ip2clue_udp_conf.end != NULL)
+		ip2clue_udp_conf.end();
+
+	sent = 0;
+	while (sent < k) {
+		r = sendmmsg(fd, t->out_msg + sent, k - sent, MSG_DONTWAIT);
+		if (r == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			/* This one cannot be sent; UDP may lose it anyway */
+			sent++;
+			continue;
+		}
+		sent += r;
+	}
+
+	return n;
+}
+
+static void *ip2clue_udp_worker(void *arg)
+{
+	struct ip2clue_udp_thread *t = (struct ip2clue_udp_thread *) arg;
+	struct pollfd pfd[4];
+	unsigned int i;
+
+	for (i = 0; i < t->fd_no; i++) {
+		pfd[i].fd = t->fd[i];
+		pfd[i].events = POLLIN;
+	}
+	/* Never read, so it wakes up all the threads */
+	pfd[i].fd = ip2clue_udp_wake;
+	pfd[i].events = POLLIN;
+
+	while (__atomic_load_n(&ip2clue_udp_exit, __ATOMIC_RELAXED) == 0) {
+		if (poll(pfd, t->fd_no + 1, -1) <= 0)
+			continue;
+
+		for (i = 0; i < t->fd_no; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			while (ip2clue_udp_batch(t, t->fd[i]) == IP2CLUE_UDP_BATCH);
+		}
+	}
+
+	return NULL;
+}
+
+static void ip2clue_udp_free(struct ip2clue_udp_thread *t)
+{
+	/* The unix socket is shared; closed by ip2clue_udp_stop */
+	while (t->fd_no > 0) {
+		t->fd_no--;
+		if (t->fd[t->fd_no] != ip2clue_udp_local)
+			close(t->fd[t->fd_no]);
+	}
+	free(t);
+}
+
+/*
+ * Closes and removes the unix socket
+ */
+static void ip2clue_udp_unlisten_local(void)
+{
+	if (ip2clue_udp_local == -1)
+		return;
+
+	close(ip2clue_udp_local);
+	ip2clue_udp_local = -1;
+	unlink(ip2clue_udp_conf.local_path);
+}
+
+/*
+ * Allocates a thread and its sockets
+ */
+static struct ip2clue_udp_thread *ip2clue_udp_thread_new(void)
+{
+	struct ip2clue_udp_thread *t;
+	int fd;
+
+	t = (struct ip2clue_udp_thread *) malloc(sizeof(struct ip2clue_udp_thread));
+	if (t == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for an UDP thread");
+		return NULL;
+	}
+	t->fd_no = 0;
+
+	if (ip2clue_udp_conf.ipv4) {
+		fd = ip2clue_net_bind(PF_INET, SOCK_DGRAM, ip2clue_udp_conf.port);
+		if (fd == -1)
+			goto out_free;
+		t->fd[t->fd_no++] = fd;
+	}
+	if (ip2clue_udp_conf.ipv6) {
+		fd = ip2clue_net_bind(PF_INET6, SOCK_DGRAM, ip2clue_udp_conf.port);
+		if (fd == -1)
+			goto out_free;
+		t->fd[t->fd_no++] = fd;
+	}
+	if (ip2clue_udp_local != -1)
+		t->fd[t->fd_no++] = ip2clue_udp_local;
+
+	return t;
+
+	out_free:
+	ip2clue_udp_free(t);
+	return NULL;
+}
+
+/*
+ * Starts the UDP threads
+ */
+int ip2clue_udp_start(const struct ip2clue_udp_conf *c)
+{
+	struct ip2clue_udp_thread *t;
+	sigset_t all, old;
+	unsigned int i;
+	int ret;
+
+	if ((c->threads == 0) || (c->threads > IP2CLUE_UDP_MAX_THREADS)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"invalid number of UDP threads %u (1..%u)",
+			c->threads, IP2CLUE_UDP_MAX_THREADS);
+		return -1;
+	}
+
+	ip2clue_udp_conf = *c;
+	ip2clue_udp_exit = 0;
+
+	ip2clue_udp_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ip2clue_udp_wake == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create eventfd (%s)", strerror(errno));
+		return -1;
+	}
+
+	if (c->local_path != NULL) {
+		ip2clue_udp_local = ip2clue_net_bind_local(c->local_path,
+			SOCK_DGRAM, c->local_mode);
+		if (ip2clue_udp_local == -1) {
+			close(ip2clue_udp_wake);
+			ip2clue_udp_wake = -1;
+			return -1;
+		}
+	}
+
+	/* All the sockets first, so a bind error stops everything */
+	for (i = 0; i < c->threads; i++) {
+		t = ip2clue_udp_thread_new();
+		if (t == NULL) {
+			while (i > 0)
+				ip2clue_udp_free(ip2clue_udp_threads[--i]);
+			ip2clue_udp_unlisten_local();
+			close(ip2clue_udp_wake);
+			ip2clue_udp_wake = -1;
+			return -1;
+		}
+		ip2clue_udp_threads[i] = t;
+	}
+
+	/* The signals are for the thread that serves TCP */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < c->threads; i++) {
+		t = ip2clue_udp_threads[i];
+		ret = pthread_create(&t->tid, NULL, ip2clue_udp_worker, t);
+		if (ret != 0) {
+			snprintf(ip2clue_error, sizeof(ip2clue_error),
+				"cannot create thread (%s)", strerror(ret));
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ip2clue_udp_threads_no = i;
+	if (i < c->threads) {
+		while (i < c->threads)
+			ip2clue_udp_free(ip2clue_udp_threads[i++]);
+		ip2clue_udp_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stops the UDP threads and closes the sockets
+ */
+void ip2clue_udp_stop(void)
+{
+	unsigned long long one = 1;
+	unsigned int i;
+
+	if (ip2clue_udp_wake == -1)
+		return;
+
+	__atomic_store_n(&ip2clue_udp_exit, 1, __ATOMIC_RELAXED);
+	if (write(ip2clue_udp_wake, &one, sizeof(one)) != sizeof(one))
+		return;
+
+	for (i = 0; i < ip2clue_udp_threads_no; i++) {
+		pthread_join(ip2clue_udp_threads[i]->tid, NULL);
+		ip2clue_udp_free(ip2clue_udp_threads[i]);
+	}
+	ip2clue_udp_threads_no = 0;
+	ip2clue_udp_unlisten_local();
+	close(ip2clue_udp_wake);
+	ip2clue_udp_wake = -1;
+}
@@ -0,0 +1,47 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: UDP query server (recvmmsg/sendmmsg batches)
+ */
+
+#ifndef IP2CLUE_I_UDP_H
+#define IP2CLUE_I_UDP_H 1
+
+#include <i_config.h>
+
+#include <stdlib.h>
+
+#include <i_net.h>
+
+/* Max number of UDP threads */
+#define IP2CLUE_UDP_MAX_THREADS	16
+
+/* Datagrams received/sent with one system call */
+#define IP2CLUE_UDP_BATCH	32
+
+/* A request longer than this gets an error */
+#define IP2CLUE_UDP_IN_MAX	4096
+
+/*
+ * Where a reply is built. Over the network, what is sent is never longer
+ * than the request; over the unix socket it can take all of it.
+ */
+#define IP2CLUE_UDP_OUT_MAX	16384
+
+/* Ends a reply in place of the first answer that does not fit in it */
+#define IP2CLUE_UDP_PAD		"ER pad\n"
+
+struct ip2clue_udp_conf
+{
+	unsigned int		threads;
+	unsigned int		port;
+	unsigned int		ipv4, ipv6;
+	const char		*local_path;	/* unix datagram socket or NULL */
+	unsigned int		local_mode;	/* its permissions */
+	ip2clue_net_line_cb	cb;	/* as for TCP; 'fmt' is NULL */
+	ip2clue_net_batch_cb	begin, end;	/* around a batch, optional */
+};
+
+extern int		ip2clue_udp_start(const struct ip2clue_udp_conf *c);
+extern void		ip2clue_udp_stop(void);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: minimal io_uring access (raw system calls, no liburing)
+ * Only what the network backend needs: one ring per thread, provided buffer
+ * rings and a probe that tells if the kernel has all we use.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <i_util.h>
+#include <i_uring.h>
+
+#ifdef IP2CLUE_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+/*
+ * Creates a ring with @entries submission entries
+ */
+int ip2clue_uring_init(struct ip2clue_uring *u, const unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int i;
+	void *sq;
+
+	memset(u, 0, sizeof(struct ip2clue_uring));
+
+	/*
+	 * Only one thread submits and completions run when we ask for them.
+	 * The ring starts disabled: the thread that enables it is the owner.
+	 */
+	memset(&p, 0, sizeof(p));
+#if defined(IORING_SETUP_SINGLE_ISSUER) && defined(IORING_SETUP_DEFER_TASKRUN)
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN
+		| IORING_SETUP_R_DISABLED;
+#endif
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if ((u->fd == -1) && (p.flags != 0)) {
+		memset(&p, 0, sizeof(p));
+		u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (u->fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot setup io_uring (%s)", strerror(errno));
+		return -1;
+	}
+	u->flags = p.flags;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP)
+		&& (u->cq_ring_size > u->sq_ring_size))
+		u->sq_ring_size = u->cq_ring_size;
+
+	sq = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto out_map;
+	u->sq_ring = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = sq;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto out_map;
+		}
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+		IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto out_map;
+	}
+
+	u->sq_head = (unsigned int *) ((char *) sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *) ((char *) sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *) ((char *) sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *) ((char *) sq + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned int *) ((char *) u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *) ((char *) u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+
+	/* sqe i always goes in slot i */
+	for (i = 0; i < p.sq_entries; i++)
+		u->sq_array[i] = i;
+	u->sqe_tail = *u->sq_tail;
+
+	return 0;
+
+	out_map:
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"cannot map io_uring (%s)", strerror(errno));
+	ip2clue_uring_exit(u);
+	return -1;
+}
+
+/*
+ * Must be called by the thread that will use the ring, before any submit
+ */
+int ip2clue_uring_enable(struct ip2clue_uring *u)
+{
+	if (!(u->flags & IORING_SETUP_R_DISABLED))
+		return 0;
+
+	if (syscall(__NR_io_uring_register, u->fd,
+		IORING_REGISTER_ENABLE_RINGS, NULL, 0) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot enable io_uring (%s)", strerror(errno));
+		return -1;
+	}
+	u->flags &= ~IORING_SETUP_R_DISABLED;
+
+	return 0;
+}
+
+void ip2clue_uring_exit(struct ip2clue_uring *u)
+{
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_size);
+	if ((u->cq_ring != NULL) && (u->cq_ring != u->sq_ring))
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd != -1)
+		close(u->fd);
+
+	memset(u, 0, sizeof(struct ip2clue_uring));
+	u->fd = -1;
+}
+
+/*
+ * Returns a clean sqe, or NULL if the queue is full (submit, then retry)
+ */
+struct io_uring_sqe *ip2clue_uring_sqe(struct ip2clue_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (u->sqe_tail - head >= u->sq_entries)
+		return NULL;
+
+	sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	u->sqe_tail++;
+	u->to_submit++;
+
+	return sqe;
+}
+
+/*
+ * Submits the prepared sqes and waits for @wait_nr completions
+ * Returns 0 if OK (also when interrupted), -1 on error.
+ */
+int ip2clue_uring_submit(struct ip2clue_uring *u, const unsigned int wait_nr)
+{
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+	ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait_nr,
+		wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret == -1) {
+		/* Busy: the completions must be reaped first */
+		if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+			return 0;
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"io_uring_enter error (%s)", strerror(errno));
+		return -1;
+	}
+	u->to_submit -= ret;
+
+	return 0;
+}
+
+/*
+ * Returns the next completion, or NULL
+ */
+struct io_uring_cqe *ip2clue_uring_peek(struct ip2clue_uring *u)
+{
+	unsigned int head;
+
+	head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u->cqes[head & *u->cq_mask];
+}
+
+/*
+ * Gives the completion returned by ip2clue_uring_peek back to the kernel
+ */
+void ip2clue_uring_seen(struct ip2clue_uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Registers @count buffers of @size bytes as group @bgid
+ * @count must be a power of 2.
+ */
+int ip2clue_uring_bufs_init(struct ip2clue_uring *u,
+	struct ip2clue_uring_bufs *b, const unsigned short bgid,
+	const unsigned int count, const unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+	void *p;
+
+	memset(b, 0, sizeof(struct ip2clue_uring_bufs));
+
+	b->br_size = count * sizeof(struct io_uring_buf);
+	p = mmap(NULL, b->br_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot map buffer ring (%s)", strerror(errno));
+		return -1;
+	}
+	b->br = (struct io_uring_buf_ring *) p;
+
+	b->base = (char *) malloc((size_t) count * size);
+	if (b->base == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc %u buffers", count);
+		goto out_unmap;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) b->br;
+	reg.ring_entries = count;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+		&reg, 1) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot register buffer ring (%s)", strerror(errno));
+		goto out_free;
+	}
+
+	b->count = count;
+	b->size = size;
+	b->mask = count - 1;
+	b->bgid = bgid;
+	for (i = 0; i < count; i++)
+		ip2clue_uring_buf_put(b, i);
+	ip2clue_uring_bufs_commit(b);
+
+	return 0;
+
+	out_free:
+	free(b->base);
+	out_unmap:
+	munmap(b->br, b->br_size);
+	memset(b, 0, sizeof(struct ip2clue_uring_bufs));
+	return -1;
+}
+
+void ip2clue_uring_bufs_free(struct ip2clue_uring *u,
+	struct ip2clue_uring_bufs *b)
+{
+	struct io_uring_buf_reg reg;
+
+	if (b->br == NULL)
+		return;
+
+	if (u->fd != -1) {
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = b->bgid;
+		syscall(__NR_io_uring_register, u->fd,
+			IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	}
+	munmap(b->br, b->br_size);
+	free(b->base);
+	memset(b, 0, sizeof(struct ip2clue_uring_bufs));
+}
+
+/*
+ * Gives buffer @bid back to the kernel (visible after commit)
+ */
+void ip2clue_uring_buf_put(struct ip2clue_uring_bufs *b,
+	const unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &b->br->bufs[b->tail & b->mask];
+	buf->addr = (unsigned long) (b->base + (size_t) bid * b->size);
+	buf->len = b->size;
+	buf->bid = bid;
+	b->tail++;
+}
+
+void ip2clue_uring_bufs_commit(struct ip2clue_uring_bufs *b)
+{
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Checks that the kernel has what the network backend needs:
+ * rings, provided buffer rings and multishot recv.
+ */
+int ip2clue_uring_probe(void)
+{
+	struct ip2clue_uring u;
+	struct ip2clue_uring_bufs b;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int sv[2], ret = -1;
+
+	if (ip2clue_uring_init(&u, 8) != 0)
+		return -1;
+
+	if (ip2clue_uring_bufs_init(&u, &b, 0, 2, 64) != 0)
+		goto out_exit;
+
+	if (ip2clue_uring_enable(&u) != 0)
+		goto out_bufs;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot create socketpair (%s)", strerror(errno));
+		goto out_bufs;
+	}
+
+	sqe = ip2clue_uring_sqe(&u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	if ((write(sv[1], "x", 1) != 1)
+		|| (ip2clue_uring_submit(&u, 1) != 0)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot submit (%s)", strerror(errno));
+		goto out_close;
+	}
+
+	cqe = ip2clue_uring_peek(&u);
+	if ((cqe == NULL) || (cqe->res != 1)
+		|| !(cqe->flags & IORING_CQE_F_MORE)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"no multishot recv (res %d)", cqe ? cqe->res : 0);
+		goto out_close;
+	}
+	ret = 0;
+
+	out_close:
+	close(sv[0]);
+	close(sv[1]);
+	out_bufs:
+	ip2clue_uring_bufs_free(&u, &b);
+	out_exit:
+	ip2clue_uring_exit(&u);
+
+	return ret;
+}
+
+#else
+
+int ip2clue_uring_probe(void)
+{
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"io_uring support not compiled in");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: minimal io_uring access (raw system calls, no liburing)
+ */
+
+#ifndef IP2CLUE_I_URING_H
+#define IP2CLUE_I_URING_H 1
+
+#include <i_config.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IP2CLUE_HAVE_URING 1
+#endif
+#endif
+
+#ifdef IP2CLUE_HAVE_URING
+
+#include <stdlib.h>
+#include <linux/io_uring.h>
+
+struct ip2clue_uring
+{
+	int			fd;
+	/* submission queue */
+	unsigned int		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		sq_entries;
+	unsigned int		sqe_tail;	/* prepared, not published yet */
+	unsigned int		to_submit;
+	/* completion queue */
+	unsigned int		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe	*cqes;
+	/* mappings */
+	void			*sq_ring, *cq_ring;
+	size_t			sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int		flags;		/* setup flags that worked */
+};
+
+/* A ring of provided buffers: the kernel picks one for every recv */
+struct ip2clue_uring_bufs
+{
+	struct io_uring_buf_ring	*br;
+	char			*base;
+	unsigned int		count, size, mask;
+	unsigned short		bgid;
+	unsigned short		tail;
+	size_t			br_size;
+};
+
+extern int		ip2clue_uring_init(struct ip2clue_uring *u,
+				const unsigned int entries);
+extern int		ip2clue_uring_enable(struct ip2clue_uring *u);
+extern void		ip2clue_uring_exit(struct ip2clue_uring *u);
+
+extern struct io_uring_sqe	*ip2clue_uring_sqe(struct ip2clue_uring *u);
+extern int		ip2clue_uring_submit(struct ip2clue_uring *u,
+				const unsigned int wait_nr);
+extern struct io_uring_cqe	*ip2clue_uring_peek(struct ip2clue_uring *u);
+extern void		ip2clue_uring_seen(struct ip2clue_uring *u);
+
+extern int		ip2clue_uring_bufs_init(struct ip2clue_uring *u,
+				struct ip2clue_uring_bufs *b,
+				const unsigned short bgid,
+				const unsigned int count,
+				const unsigned int size);
+extern void		ip2clue_uring_bufs_free(struct ip2clue_uring *u,
+				struct ip2clue_uring_bufs *b);
+extern void		ip2clue_uring_buf_put(struct ip2clue_uring_bufs *b,
+				const unsigned short bid);
+extern void		ip2clue_uring_bufs_commit(struct ip2clue_uring_bufs *b);
+
+#endif
+
+extern int		ip2clue_uring_probe(void);
+
+#endif
@@ -6,18 +6,28 @@
 #include <i_config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sched.h>
 
 #include <i_util.h>
+#include <i_addr.h>
+#include <i_mem.h>
+#include <parser_mmdb.h>
+#include <libip2clue.h>
 
-char		ip2clue_error[256];
+/* Per thread: lookups run in several threads */
+__thread char	ip2clue_error[256];
 
 /*
  * Returns ip2clue_error content
@@ -27,6 +37,41 @@ char *ip2clue_strerror(void)
 	return ip2clue_error;
 }
 
+/* Slot of this thread in the db counters, plus 1 (0: not chosen yet) */
+__thread unsigned int		ip2clue_counter_slot;
+static unsigned int		ip2clue_counter_next;
+
+/*
+ * Gives the next slot to a thread that counts for the first time
+ */
+unsigned int ip2clue_counter_slot_get(void)
+{
+	unsigned int slot;
+
+	slot = __atomic_fetch_add(&ip2clue_counter_next, 1, __ATOMIC_RELAXED);
+	ip2clue_counter_slot = slot % IP2CLUE_COUNTER_SLOTS + 1;
+
+	return ip2clue_counter_slot;
+}
+
+/*
+ * Adds up the lookup counters of all the threads
+ */
+void ip2clue_counters_sum(struct ip2clue_db *db, struct ip2clue_counters *sum)
+{
+	unsigned int i;
+
+	memset(sum, 0, sizeof(struct ip2clue_counters));
+	for (i = 0; i < IP2CLUE_COUNTER_SLOTS; i++) {
+		sum->ok += __atomic_load_n(&db->counters[i].ok,
+			__ATOMIC_RELAXED);
+		sum->notfound += __atomic_load_n(&db->counters[i].notfound,
+			__ATOMIC_RELAXED);
+		sum->malformed += __atomic_load_n(&db->counters[i].malformed,
+			__ATOMIC_RELAXED);
+	}
+}
+
 /*
  * Show a nice IPv6 address
  * TODO: Replace with inet_ntop!
@@ -176,23 +221,140 @@ long ip2clue_file_lines(const char *file)
 }
 
 /*
- * Destroy data
+ * Fills @id for @file. The time has nanoseconds, so a change in the same
+ * second as the previous load is not missed.
  */
-void ip2clue_destroy(struct ip2clue_db *db)
+int ip2clue_file_id_get(struct ip2clue_file_id *id, const char *file)
 {
-	unsigned int i;
-	struct ip2clue_cell_v4 *p_cell4, *cell4;
-	struct ip2clue_cell_v6 *p_cell6, *cell6;
+	struct stat S;
 
-	if (db == NULL)
-		return;
+	if (stat(file, &S) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot stat file [%s] (%s)", file, strerror(errno));
+		return -1;
+	}
 
-	db->usage_count--;
-	if (db->usage_count > 0)
-		return;
+	id->dev = S.st_dev;
+	id->ino = S.st_ino;
+	id->size = S.st_size;
+	id->mtime_ns = (unsigned long long) S.st_mtim.tv_sec * 1000000000ULL
+		+ S.st_mtim.tv_nsec;
+
+	return 0;
+}
+
+/*
+ * Reads wall and thread CPU time, for the load stats
+ */
+void ip2clue_clock_now(struct ip2clue_clock *c)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	c->wall_us = t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	c->cpu_us = t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
 
-	/* TODO: put 'for' under 'p_cell4 = ' */
-	for (i = 0; i < db->no_of_cells; i++) {
+/*
+ * Reads a "Vm...:" field (kB) of /proc/self/status; -1 if not available
+ */
+static long long ip2clue_proc_kb(const char *field)
+{
+	char line[128];
+	long long kb = -1;
+	size_t len;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "re");
+	if (f == NULL)
+		return -1;
+
+	len = strlen(field);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, len) == 0) {
+			kb = strtoll(line + len, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+
+	return kb;
+}
+
+/*
+ * Starts measuring the peak RSS of a load: the process peak (VmHWM) is
+ * reset to the current RSS, which is returned (kB). Returns -1 if the
+ * kernel does not let us reset it.
+ */
+long long ip2clue_rss_peak_start(void)
+{
+	int fd;
+	ssize_t n;
+
+	fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	n = write(fd, "5", 1);
+	close(fd);
+	if (n != 1)
+		return -1;
+
+	return ip2clue_proc_kb("VmRSS:");
+}
+
+/*
+ * How much the RSS peaked above @start (from ip2clue_rss_peak_start), kB
+ * Returns -1 if unknown.
+ */
+long long ip2clue_rss_peak_delta(const long long start)
+{
+	long long peak;
+
+	if (start == -1)
+		return -1;
+
+	peak = ip2clue_proc_kb("VmHWM:");
+	if (peak == -1)
+		return -1;
+
+	return peak > start ? peak - start : 0;
+}
+
+/*
+ * Adds the time passed since @start to @phase and restarts @start,
+ * so consecutive phases can be chained.
+ */
+void ip2clue_phase_end(struct ip2clue_load_stats *st,
+	const enum ip2clue_load_phase phase, struct ip2clue_clock *start)
+{
+	struct ip2clue_clock now;
+
+	ip2clue_clock_now(&now);
+
+	if (st != NULL) {
+		st->wall_us[phase] += now.wall_us - start->wall_us;
+		st->cpu_us[phase] += now.cpu_us - start->cpu_us;
+	}
+
+	*start = now;
+}
+
+/*
+ * Frees a db nobody uses anymore
+ * If @batch > 0, the CPU is given away every @batch cells, so a low priority
+ * thread freeing millions of extras does not hog a core.
+ */
+void ip2clue_db_free(struct ip2clue_db *db, const unsigned int batch)
+{
+	unsigned long long i;
+	struct ip2clue_cell_v4 *p_cell4, *cell4;
+	struct ip2clue_cell_v6 *p_cell6, *cell6;
+
+	/* Extras in an arena go away with one free/munmap below */
+	for (i = 0; (db->cells != NULL) && (db->extras_mem.p == NULL)
+		&& (i < db->no_of_cells); i++) {
 		if (db->v4_or_v6 == IP2CLUE_TYPE_V4) {
 			p_cell4 = (struct ip2clue_cell_v4 *) db->cells;
 			cell4 = &p_cell4[i];
@@ -204,39 +366,65 @@ void ip2clue_destroy(struct ip2clue_db *db)
 			if (cell6->extra != NULL)
 				free(cell6->extra);
 		}
+
+		if ((batch > 0) && (i % batch == batch - 1))
+			sched_yield();
 	}
 
-	if (db->cells != NULL)
+	ip2clue_mem_free(&db->extras_mem);
+
+	if (db->cells_mem.p != NULL)
+		ip2clue_mem_free(&db->cells_mem);
+	else if (db->cells != NULL)
 		free(db->cells);
 
+	ip2clue_mem_free(&db->map);
+
+	if (db->priv != NULL)
+		free(db->priv);
+
 	free(db);
 }
 
+/*
+ * Drops a reference to a db
+ * Returns 1 if it was the last one (the caller must free the db), else 0.
+ */
+int ip2clue_db_put(struct ip2clue_db *db)
+{
+	if (db == NULL)
+		return 0;
+
+	/* The same db can be in several lists, released by different threads */
+	if (__atomic_sub_fetch(&db->usage_count, 1, __ATOMIC_ACQ_REL) > 0)
+		return 0;
+
+	return 1;
+}
 
 /*
- * Search for an IPv4
+ * Destroy data
  */
-struct ip2clue_cell_v4 *ip2clue_search_v4(struct ip2clue_db *db,
-	const char *s_ip)
+void ip2clue_destroy(struct ip2clue_db *db)
 {
-	unsigned int ip;
-	struct in_addr in;
-	long left, middle, right;
-	struct ip2clue_cell_v4 *cells;
+	if (ip2clue_db_put(db) == 1)
+		ip2clue_db_free(db, 0);
+}
 
-	if (inet_pton(AF_INET, s_ip, &in) != 1) {
-		snprintf(ip2clue_error, sizeof(ip2clue_error),
-			"malformed address");
-		db->lookup_malformed++;
-		return NULL;
-	}
 
-	ip = ntohl(in.s_addr);
+/*
+ * Search for an IPv4 (host order)
+ */
+struct ip2clue_cell_v4 *ip2clue_search_v4_bin(struct ip2clue_db *db,
+	const unsigned int ip)
+{
+	long left, middle, right;
+	struct ip2clue_cell_v4 *cells;
 
 	left = 0;
 	right = db->no_of_cells - 1;
 	cells = (struct ip2clue_cell_v4 *) db->cells;
-	while (right >= left) {
+	while ((cells != NULL) && (right >= left)) {
 		middle = (right + left + 1) / 2;
 
 		/*
@@ -249,50 +437,61 @@ struct ip2clue_cell_v4 *ip2clue_search_v4(struct ip2clue_db *db,
 
 		if (ip > cells[middle].ip_end) {
 			left = middle + 1;
-			if (left == db->no_of_cells)
+			if (left == (long) db->no_of_cells)
 				break;
 		} else if (ip < cells[middle].ip_start) {
 			right = middle - 1;
 			if (right == -1)
 				break;
 		} else {
-			db->lookup_ok++;
+			__atomic_add_fetch(&ip2clue_counters(db)->ok,
+				1, __ATOMIC_RELAXED);
 			return &cells[middle];
 		}
 	}
 
 	snprintf(ip2clue_error, sizeof(ip2clue_error),
 		"cannot find address");
-	db->lookup_notfound++;
+	__atomic_add_fetch(&ip2clue_counters(db)->notfound,
+		1, __ATOMIC_RELAXED);
 
 	return NULL;
 }
 
 /*
- * search for an IPv6
+ * Search for an IPv4
  */
-struct ip2clue_cell_v6 *ip2clue_search_v6(struct ip2clue_db *db, const char *s_ip)
+struct ip2clue_cell_v4 *ip2clue_search_v4(struct ip2clue_db *db,
+	const char *s_ip)
 {
-	unsigned int ip[4], i;
-	struct in6_addr in;
-	long left, middle, right;
-	struct ip2clue_cell_v6 *cells;
-	/*char a1[64], a2[64], a3[64];*/
+	struct ip2clue_addr a;
 
-	if (inet_pton(AF_INET6, s_ip, &in) != 1) {
+	if ((ip2clue_addr_parse_strict(&a, s_ip) != 0)
+		|| (a.v4_or_v6 != IP2CLUE_TYPE_V4)) {
 		snprintf(ip2clue_error, sizeof(ip2clue_error),
 			"malformed address");
-		db->lookup_malformed++;
+		__atomic_add_fetch(&ip2clue_counters(db)->malformed,
+			1, __ATOMIC_RELAXED);
 		return NULL;
 	}
 
-	for (i = 0; i < 4; i++)
-		ip[i] = ntohl(in.s6_addr32[i]);
+	return ip2clue_search_v4_bin(db, a.ip[0]);
+}
+
+/*
+ * Search for an IPv6 (host order words)
+ */
+struct ip2clue_cell_v6 *ip2clue_search_v6_bin(struct ip2clue_db *db,
+	const unsigned int *ip)
+{
+	long left, middle, right;
+	struct ip2clue_cell_v6 *cells;
+	/*char a1[64], a2[64], a3[64];*/
 
 	left = 0;
 	right = db->no_of_cells - 1;
 	cells = (struct ip2clue_cell_v6 *) db->cells;
-	while (right >= left) {
+	while ((cells != NULL) && (right >= left)) {
 		middle = (right + left + 1) / 2;
 
 		/*
@@ -304,25 +503,46 @@ struct ip2clue_cell_v6 *ip2clue_search_v6(struct ip2clue_db *db, const char *s_i
 		*/
 		if (ip2clue_compare_v6(ip, cells[middle].ip_end) > 0) {
 			left = middle + 1;
-			if (left == db->no_of_cells)
+			if (left == (long) db->no_of_cells)
 				break;
 		} else if (ip2clue_compare_v6(ip, cells[middle].ip_start) < 0) {
 			right = middle - 1;
 			if (right == -1)
 				break;
 		} else {
-			db->lookup_ok++;
+			__atomic_add_fetch(&ip2clue_counters(db)->ok,
+				1, __ATOMIC_RELAXED);
 			return &cells[middle];
 		}
 	}
 
 	snprintf(ip2clue_error, sizeof(ip2clue_error),
 		"cannot find address");
-	db->lookup_notfound++;
+	__atomic_add_fetch(&ip2clue_counters(db)->notfound,
+		1, __ATOMIC_RELAXED);
 
 	return NULL;
 }
 
+/*
+ * search for an IPv6
+ */
+struct ip2clue_cell_v6 *ip2clue_search_v6(struct ip2clue_db *db, const char *s_ip)
+{
+	struct ip2clue_addr a;
+
+	if ((ip2clue_addr_parse_strict(&a, s_ip) != 0)
+		|| (a.v4_or_v6 != IP2CLUE_TYPE_V6)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"malformed address");
+		__atomic_add_fetch(&ip2clue_counters(db)->malformed,
+			1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return ip2clue_search_v6_bin(db, a.ip);
+}
+
 /*
  * Dump info about a cell
  */
@@ -361,7 +581,7 @@ struct ip2clue_cell_v4 *ip2clue_list_search_v4(struct ip2clue_list *list,
 
 	for (i = 0; i < list->number; i++) {
 		db = list->entries[i];
-		if (db->v4_or_v6 != IP2CLUE_TYPE_V4)
+		if ((db->v4_or_v6 != IP2CLUE_TYPE_V4) || (db->cells == NULL))
 			continue;
 
 		ret = ip2clue_search_v4(db, ip);
@@ -376,12 +596,6 @@ struct ip2clue_cell_v4 *ip2clue_list_search_v4(struct ip2clue_list *list,
 	return ret;
 }
 
-/*
- * Returns a IPv4 address from a special IPv6 address
- * 2002:xxyy:zztt::/48, ::a.b.c.d and ::ffff:a.b.c.d
- */
-/* TODO */
-
 /*
  * Search an IP in a list
  */
@@ -394,7 +608,7 @@ struct ip2clue_cell_v6 *ip2clue_list_search_v6(struct ip2clue_list *list,
 
 	for (i = 0; i < list->number; i++) {
 		db = list->entries[i];
-		if (db->v4_or_v6 != IP2CLUE_TYPE_V6)
+		if ((db->v4_or_v6 != IP2CLUE_TYPE_V6) || (db->cells == NULL))
 			continue;
 
 		ret = ip2clue_search_v6(db, ip);
@@ -414,92 +628,350 @@ struct ip2clue_cell_v6 *ip2clue_list_search_v6(struct ip2clue_list *list,
 }
 
 /*
- * Builds a string answer
- * Returns 0 if address not found or other errors received, else 1.
+ * Returns the fields used by a format string
  */
-int ip2clue_list_search(struct ip2clue_list *list, char *out,
-	const unsigned int out_size, const char *format, const char *ip)
+unsigned int ip2clue_format_fields(const char *format)
+{
+	unsigned int fields = 0;
+
+	for (; *format != '\0'; format++) {
+		if (*format != '%')
+			continue;
+
+		format++;
+		switch (*format) {
+		case '\0': return fields;
+		case 's': fields |= IP2CLUE_FIELD_COUNTRY_SHORT; break;
+		case 'L': fields |= IP2CLUE_FIELD_COUNTRY_LONG; break;
+		case 'r': fields |= IP2CLUE_FIELD_REGION; break;
+		case 'c': fields |= IP2CLUE_FIELD_CITY; break;
+		case 'i': fields |= IP2CLUE_FIELD_ISP; break;
+		case 'x': fields |= IP2CLUE_FIELD_LATITUDE; break;
+		case 'y': fields |= IP2CLUE_FIELD_LONGITUDE; break;
+		case 'z': fields |= IP2CLUE_FIELD_ZIP; break;
+		case 'd': fields |= IP2CLUE_FIELD_DOMAIN; break;
+		case 't': fields |= IP2CLUE_FIELD_TIMEZONE; break;
+		case 'n': fields |= IP2CLUE_FIELD_NETSPEED; break;
+		case 'k': fields |= IP2CLUE_FIELD_IDD; break;
+		case 'a': fields |= IP2CLUE_FIELD_AREACODE; break;
+		case 'w': fields |= IP2CLUE_FIELD_WS_CODE; break;
+		case 'W': fields |= IP2CLUE_FIELD_WS_NAME; break;
+		}
+	}
+
+	return fields;
+}
+
+/*
+ * Copies a found cell in a result
+ */
+static void ip2clue_result_v4(struct ip2clue_result *r, struct ip2clue_db *db,
+	const struct ip2clue_cell_v4 *c)
+{
+	r->v4_or_v6 = IP2CLUE_TYPE_V4;
+	r->ip_start[0] = c->ip_start;
+	r->ip_end[0] = c->ip_end;
+	memcpy(r->country_short, c->country_short, sizeof(r->country_short));
+	r->extra = c->extra;
+	r->db = db;
+}
+
+static void ip2clue_result_v6(struct ip2clue_result *r, struct ip2clue_db *db,
+	const struct ip2clue_cell_v6 *c)
 {
+	r->v4_or_v6 = IP2CLUE_TYPE_V6;
+	memcpy(r->ip_start, c->ip_start, sizeof(r->ip_start));
+	memcpy(r->ip_end, c->ip_end, sizeof(r->ip_end));
+	memcpy(r->country_short, c->country_short, sizeof(r->country_short));
+	r->extra = c->extra;
+	r->db = db;
+}
+
+/*
+ * Search a binary address (host order, v4 in ip[0]) in a list
+ * @fields tells what formats decoded on demand (mmdb) must fill.
+ * Returns 1 if found, 0 if not found or error.
+ */
+int ip2clue_list_lookup_bin(struct ip2clue_list *list,
+	const enum ip2clue_type type, const unsigned int *ip,
+	const unsigned int fields, struct ip2clue_result *r)
+{
+	unsigned int i;
+	struct ip2clue_db *db;
 	struct ip2clue_cell_v4 *v4;
 	struct ip2clue_cell_v6 *v6;
-	struct ip2clue_extra *e;
-	char cs[4];
-	unsigned int rest, i, format_size, special, a_len;
-	char a[256];
-
-	if (strchr(ip, '.')) {
-		v4 = ip2clue_list_search_v4(list, ip);
-		if (v4 == NULL)
-			return 0;
-
-		strcpy(cs, v4->country_short);
-		e = v4->extra;
-	} else {
-		v6 = ip2clue_list_search_v6(list, ip);
-		if (v6 == NULL)
-			return 0;
-
-		strcpy(cs, v6->country_short);
-		e = v6->extra;
+
+	for (i = 0; i < list->number; i++) {
+		db = list->entries[i];
+
+		if (db->format == IP2CLUE_FORMAT_MMDB) {
+			if (ip2clue_mmdb_lookup(db, type, ip, fields, r) == 1)
+				return 1;
+			continue;
+		}
+
+		if (db->v4_or_v6 != type)
+			continue;
+
+		if (type == IP2CLUE_TYPE_V4) {
+			v4 = ip2clue_search_v4_bin(db, ip[0]);
+			if (v4 != NULL) {
+				ip2clue_result_v4(r, db, v4);
+				return 1;
+			}
+		} else {
+			v6 = ip2clue_search_v6_bin(db, ip);
+			if (v6 != NULL) {
+				ip2clue_result_v6(r, db, v6);
+				return 1;
+			}
+		}
 	}
 
-	strcpy(out, "");
-	rest = out_size - 1;
-	format_size = strlen(format);
-	special = 0;
-	for (i = 0; i < format_size; i++) {
-		strcpy(a, "");
-
-		if (format[i] == '%') {
-			if (special == 1) {
-				strcpy(a, "%");
-				special = 0;
-			} else {
-				special = 1;
-				continue;
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"not found");
+
+	return 0;
+}
+
+/*
+ * Merge join of sorted IPv4 addresses with a table
+ * The cursor only goes forward: it gallops to the first cell that ends at
+ * or after the address, so close addresses cost a step or two.
+ */
+static unsigned long ip2clue_merge_v4(struct ip2clue_db *db,
+	const unsigned int *ips, const unsigned long n,
+	struct ip2clue_result *r, unsigned char *found)
+{
+	const struct ip2clue_cell_v4 *cells;
+	unsigned long long pos = 0, lo, hi, mid, step, no;
+	unsigned long i, ok = 0, miss = 0;
+	unsigned int ip;
+
+	cells = (const struct ip2clue_cell_v4 *) db->cells;
+	no = cells == NULL ? 0 : db->no_of_cells;
+	for (i = 0; i < n; i++) {
+		if (found[i])
+			continue;
+
+		ip = ips[4 * i];
+		if ((pos < no) && (cells[pos].ip_end < ip)) {
+			lo = pos;
+			step = 1;
+			while ((lo + step < no) && (cells[lo + step].ip_end < ip)) {
+				lo += step;
+				step *= 2;
 			}
-		} else if (special == 1) {
-			if (format[i] == 's') {
-				snprintf(a, sizeof(a), "%s", cs);
-			} else if (format[i] == 'P') {
-				snprintf(a, sizeof(a), "%s", ip);
-			} else if (e != NULL) {
-				switch (format[i]) {
-				case 'L': snprintf(a, sizeof(a), "%s", e->country_long); break;
-				case 'r': snprintf(a, sizeof(a), "%s", e->region); break;
-				case 'c': snprintf(a, sizeof(a), "%s", e->city); break;
-				case 'i': snprintf(a, sizeof(a), "%s", e->isp); break;
-				case 'x': snprintf(a, sizeof(a), "%f", e->latitude); break;
-				case 'y': snprintf(a, sizeof(a), "%f", e->longitude); break;
-				case 'z': snprintf(a, sizeof(a), "%s", e->zip); break;
-				case 'd': snprintf(a, sizeof(a), "%s", e->domain); break;
-				case 't': snprintf(a, sizeof(a), "%s", e->timezone); break;
-				case 'n': snprintf(a, sizeof(a), "%s", e->netspeed); break;
-				case 'k': snprintf(a, sizeof(a), "%s", e->idd); break;
-				case 'a': snprintf(a, sizeof(a), "%s", e->areacode); break;
-				case 'w': snprintf(a, sizeof(a), "%s", e->ws_code); break;
-				case 'W': snprintf(a, sizeof(a), "%s", e->ws_name); break;
-				}
+
+			/* cells[lo] ends before ip, cells[hi] (if any) does not */
+			hi = lo + step < no ? lo + step : no;
+			while (hi - lo > 1) {
+				mid = lo + (hi - lo) / 2;
+				if (cells[mid].ip_end < ip)
+					lo = mid;
+				else
+					hi = mid;
 			}
+			pos = hi;
+		}
+
+		if ((pos < no) && (cells[pos].ip_start <= ip)) {
+			ip2clue_result_v4(&r[i], db, &cells[pos]);
+			found[i] = 1;
+			ok++;
 		} else {
-			snprintf(a, 2, "%c", format[i]);
+			miss++;
 		}
+	}
 
-		special = 0;
+	__atomic_add_fetch(&ip2clue_counters(db)->ok, ok, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ip2clue_counters(db)->notfound,
+		miss, __ATOMIC_RELAXED);
 
-		a_len = strlen(a);
-		if (a_len > rest) {
-			snprintf(ip2clue_error, sizeof(ip2clue_error),
-				"output buffer too short to add"
-				" more %u bytes (%s)",
-				a_len, a);
-			return 0;
+	return ok;
+}
+
+static unsigned long ip2clue_merge_v6(struct ip2clue_db *db,
+	const unsigned int *ips, const unsigned long n,
+	struct ip2clue_result *r, unsigned char *found)
+{
+	const struct ip2clue_cell_v6 *cells;
+	unsigned long long pos = 0, lo, hi, mid, step, no;
+	unsigned long i, ok = 0, miss = 0;
+	const unsigned int *ip;
+
+	cells = (const struct ip2clue_cell_v6 *) db->cells;
+	no = cells == NULL ? 0 : db->no_of_cells;
+	for (i = 0; i < n; i++) {
+		if (found[i])
+			continue;
+
+		ip = &ips[4 * i];
+		if ((pos < no) && (ip2clue_compare_v6(cells[pos].ip_end, ip) < 0)) {
+			lo = pos;
+			step = 1;
+			while ((lo + step < no)
+				&& (ip2clue_compare_v6(cells[lo + step].ip_end, ip) < 0)) {
+				lo += step;
+				step *= 2;
+			}
+
+			hi = lo + step < no ? lo + step : no;
+			while (hi - lo > 1) {
+				mid = lo + (hi - lo) / 2;
+				if (ip2clue_compare_v6(cells[mid].ip_end, ip) < 0)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			pos = hi;
+		}
+
+		if ((pos < no) && (ip2clue_compare_v6(cells[pos].ip_start, ip) <= 0)) {
+			ip2clue_result_v6(&r[i], db, &cells[pos]);
+			found[i] = 1;
+			ok++;
+		} else {
+			miss++;
+		}
+	}
+
+	__atomic_add_fetch(&ip2clue_counters(db)->ok, ok, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ip2clue_counters(db)->notfound,
+		miss, __ATOMIC_RELAXED);
+
+	return ok;
+}
+
+/*
+ * Search @n addresses of the same @type, sorted ascending, in a list
+ * Same answers as ip2clue_list_lookup_bin for each address, but every table
+ * is walked once, forward, instead of a binary search per address: for big
+ * batches the reads become a sequential scan.
+ * @ips has 4 words per address (v4 uses [0]). Addresses with @found[i] set
+ * are skipped; the found ones get @found[i] = 1 and their result in @r[i].
+ * Returns the number of addresses found.
+ */
+unsigned long ip2clue_list_lookup_sorted(struct ip2clue_list *list,
+	const enum ip2clue_type type, const unsigned int *ips,
+	const unsigned long n, const unsigned int fields,
+	struct ip2clue_result *r, unsigned char *found)
+{
+	unsigned int i;
+	unsigned long j, ok = 0;
+	struct ip2clue_db *db;
+
+	for (i = 0; i < list->number; i++) {
+		db = list->entries[i];
+
+		/* A trie, not a range table: one search per address */
+		if (db->format == IP2CLUE_FORMAT_MMDB) {
+			for (j = 0; j < n; j++) {
+				if (found[j])
+					continue;
+				if (ip2clue_mmdb_lookup(db, type, &ips[4 * j], fields,
+					&r[j]) == 1) {
+					found[j] = 1;
+					ok++;
+				}
+			}
+			continue;
 		}
 
-		strcat(out, a);
-		rest -= a_len;
+		if (db->v4_or_v6 != type)
+			continue;
+
+		if (type == IP2CLUE_TYPE_V4)
+			ok += ip2clue_merge_v4(db, ips, n, r, found);
+		else
+			ok += ip2clue_merge_v6(db, ips, n, r, found);
+	}
+
+	return ok;
+}
+
+/*
+ * Search a parsed address in a list
+ * IPv6 addresses that embed an IPv4 one fall back to the IPv4 databases.
+ * Returns 1 if found, 0 if not found or error.
+ */
+int ip2clue_list_lookup_addr(struct ip2clue_list *list,
+	const struct ip2clue_addr *a, const unsigned int fields,
+	struct ip2clue_result *r)
+{
+	if (ip2clue_list_lookup_bin(list, a->v4_or_v6, a->ip, fields, r) == 1)
+		return 1;
+
+	if ((a->addr_class == IP2CLUE_ADDR_V4_MAPPED)
+		|| (a->addr_class == IP2CLUE_ADDR_V4_COMPAT)
+		|| (a->addr_class == IP2CLUE_ADDR_6TO4))
+		return ip2clue_list_lookup_bin(list, IP2CLUE_TYPE_V4, &a->v4,
+			fields, r);
+
+	return 0;
+}
+
+/*
+ * Search a textual address in a list
+ * The address may be followed by white space.
+ * IPv6 addresses that embed an IPv4 one (::ffff:a.b.c.d, ::a.b.c.d and
+ * 2002:xxyy:zztt::/48) fall back to the IPv4 databases.
+ * Returns 1 if found, 0 if not found or error.
+ */
+int ip2clue_list_lookup(struct ip2clue_list *list, const char *ip,
+	const unsigned int fields, struct ip2clue_result *r)
+{
+	struct ip2clue_addr a;
+	const char *e;
+	unsigned int i;
+
+	e = ip2clue_addr_parse(&a, ip);
+	if ((e == NULL) || ((*e != '\0') && (*e != ' ') && (*e != '\t')
+		&& (*e != '\r') && (*e != '\n'))) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"malformed address");
+		for (i = 0; i < list->number; i++)
+			__atomic_add_fetch(
+				&ip2clue_counters(list->entries[i])->malformed,
+				1, __ATOMIC_RELAXED);
+		return 0;
 	}
 
+	return ip2clue_list_lookup_addr(list, &a, fields, r);
+}
+
+/*
+ * Builds a string answer with a compiled format
+ * Only the fields used by the format are looked up.
+ * Returns 0 if address not found or other errors received, else 1.
+ */
+int ip2clue_list_search_fmt(struct ip2clue_list *list, char *out,
+	const unsigned int out_size, const struct ip2clue_fmt *f, const char *ip)
+{
+	struct ip2clue_result res;
+
+	if (ip2clue_list_lookup(list, ip, f->fields, &res) != 1)
+		return 0;
+
+	if (ip2clue_fmt_render(out, out_size, f, &res, ip) == -1)
+		return 0;
+
 	return 1;
 }
 
+/*
+ * Builds a string answer
+ * Returns 0 if address not found or other errors received, else 1.
+ */
+int ip2clue_list_search(struct ip2clue_list *list, char *out,
+	const unsigned int out_size, const char *format, const char *ip)
+{
+	const struct ip2clue_fmt *f;
+
+	f = ip2clue_fmt_get(format);
+	if (f == NULL)
+		return 0;
+
+	return ip2clue_list_search_fmt(list, out, out_size, f, ip);
+}
+
@@ -6,25 +6,63 @@
 #include <stdlib.h>
 
 #include <i_types.h>
+#include <i_addr.h>
+#include <i_fmt.h>
 
-extern char		ip2clue_error[256];
+extern __thread char	ip2clue_error[256];
 
 extern char		*ip2clue_strerror(void);
 
+extern __thread unsigned int	ip2clue_counter_slot;
+extern unsigned int	ip2clue_counter_slot_get(void);
+extern void		ip2clue_counters_sum(struct ip2clue_db *db,
+				struct ip2clue_counters *sum);
+
+/*
+ * Returns the lookup counters of this thread in @db
+ */
+static inline struct ip2clue_counters *ip2clue_counters(struct ip2clue_db *db)
+{
+	unsigned int slot = ip2clue_counter_slot;
+
+	if (slot == 0)
+		slot = ip2clue_counter_slot_get();
+
+	return &db->counters[slot - 1];
+}
+
 extern int		ip2clue_addr_v6(char *out, size_t out_size,
 				const unsigned int *a);
+extern int		ip2clue_compare_v6(const unsigned int *a,
+				const unsigned int *b);
 
 extern int		ip2clue_split(struct ip2clue_split *s, const char *line,
 				const char *sep);
 
 extern long		ip2clue_file_lines(const char *file);
+extern int		ip2clue_file_id_get(struct ip2clue_file_id *id,
+				const char *file);
 
+extern void		ip2clue_clock_now(struct ip2clue_clock *c);
+extern void		ip2clue_phase_end(struct ip2clue_load_stats *st,
+				const enum ip2clue_load_phase phase,
+				struct ip2clue_clock *start);
+extern long long	ip2clue_rss_peak_start(void);
+extern long long	ip2clue_rss_peak_delta(const long long start);
+
+extern void		ip2clue_db_free(struct ip2clue_db *db,
+				const unsigned int batch);
+extern int		ip2clue_db_put(struct ip2clue_db *db);
 extern void		ip2clue_destroy(struct ip2clue_db *db);
 
 extern void		ip2clue_print_extra(char *out, size_t out_size,
 				const struct ip2clue_extra *e);
 
+extern unsigned int	ip2clue_format_fields(const char *format);
+
 /* v4 */
+extern struct ip2clue_cell_v4	*ip2clue_search_v4_bin(struct ip2clue_db *db,
+					const unsigned int ip);
 extern struct ip2clue_cell_v4	*ip2clue_search_v4(struct ip2clue_db *db,
 					const char *ip);
 extern struct ip2clue_cell_v4	*ip2clue_list_search_v4(struct ip2clue_list *list,
@@ -33,6 +71,8 @@ extern void		ip2clue_dump_cell_v4(char *out, size_t out_size,
 				struct ip2clue_cell_v4 *cell); /* TODO */
 
 /* v6 */
+extern struct ip2clue_cell_v6	*ip2clue_search_v6_bin(struct ip2clue_db *db,
+					const unsigned int *ip);
 extern struct ip2clue_cell_v6	*ip2clue_search_v6(struct ip2clue_db *db,
 					const char *ip);
 extern struct ip2clue_cell_v6   *ip2clue_list_search_v6(struct ip2clue_list *list,
@@ -41,7 +81,27 @@ extern void		ip2clue_dump_cell_v6(char *out, size_t out_size,
 				struct ip2clue_cell_v6 *cell);
 
 /* common */
+extern int		ip2clue_list_lookup_bin(struct ip2clue_list *list,
+				const enum ip2clue_type type,
+				const unsigned int *ip,
+				const unsigned int fields,
+				struct ip2clue_result *r);
+extern unsigned long	ip2clue_list_lookup_sorted(struct ip2clue_list *list,
+				const enum ip2clue_type type,
+				const unsigned int *ips, const unsigned long n,
+				const unsigned int fields,
+				struct ip2clue_result *r, unsigned char *found);
+extern int		ip2clue_list_lookup_addr(struct ip2clue_list *list,
+				const struct ip2clue_addr *a,
+				const unsigned int fields,
+				struct ip2clue_result *r);
+extern int		ip2clue_list_lookup(struct ip2clue_list *list,
+				const char *ip, const unsigned int fields,
+				struct ip2clue_result *r);
 extern int		ip2clue_list_search(struct ip2clue_list *list,
 				char *out, const unsigned int out_size,
 				const char *format, const char *ip);
+extern int		ip2clue_list_search_fmt(struct ip2clue_list *list,
+				char *out, const unsigned int out_size,
+				const struct ip2clue_fmt *f, const char *ip);
 #endif
@@ -1,125 +1,264 @@
 #include <i_config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <unistd.h>
 
-#include <Conn.h>
+#include <libip2clue.h>
 
-#include <i_types.h>
-#include <i_util.h>
-#include <i_conf.h>
-#include <parser.h>
+/*
+ * Streaming: the answers of a pool can come out of order, so the lines wait
+ * in a ring, by sequence number, until all the ones before are answered.
+ */
+struct slot
+{
+	char			*line;
+	char			*answer;	/* NULL = not answered yet */
+};
 
-static FILE			*Logf = NULL;
-static int			conf_port = 9999;
-static char			cmd[128];
+static struct slot		*slots;
+static unsigned long		slots_no;
+static unsigned long		seq_in, seq_out;
+static int			stream_nomem;	/* a strdup failed */
+static char			single[4096];
 
 
-static void connected_cb(struct Conn *C)
+static void usage(void)
 {
-	Log(1, "Enqueue [%s]...\n", cmd);
-
-	if (Conn_enqueue(C, cmd, strlen(cmd)) == -1) {
-		Log(0, "Cannot enqueue (%s)!\n",
-			Conn_strerror());
-	}
+	fprintf(stderr, "Usage: ip2clue <ip> [<ip2clue_daemon_port>]\n"
+		"       ip2clue -s [-f file] [-p port | -a addr] [-w window]"
+		" [-b batch] [-c conns] [-F format]\n"
+		"  -s         annotate the lines from stdin (or -f file):"
+		" '<line>\\t<answer>'\n"
+		"             the address is the first word of a line\n"
+		"  -a addr    host:port, [v6]:port or /unix/socket"
+		" (default [::1]:9999, then 127.0.0.1:9999)\n"
+		"  -w window  addresses waiting for answers, per connection"
+		" (default 1000)\n"
+		"  -b batch   addresses per request (default 32, max 60)\n"
+		"  -c conns   connections (default 1)\n"
+		"  -F format  answer format (needs a daemon with I/O threads)\n");
 }
 
-static int data_cb(struct Conn *C, char *line)
+static void single_cb(void *tag, const char *answer, void *arg)
 {
-	printf("%s\n", line);
-	Conn_close(C);
+	(void) tag;
+	(void) arg;
 
-	return 0;
+	snprintf(single, sizeof(single), "%s", answer);
 }
 
-static void data(struct Conn *C)
+static void stream_cb(void *tag, const char *answer, void *arg)
 {
-	Conn_for_every_line(C, data_cb);
-}
+	unsigned long seq = (unsigned long) tag;
+
+	(void) arg;
 
+	slots[seq % slots_no].answer = strdup(answer);
+	if (slots[seq % slots_no].answer == NULL)
+		stream_nomem = 1;
+}
 
-static void error(struct Conn *C)
+/*
+ * Prints the answered lines, in order
+ */
+static int stream_output(void)
 {
-	Log(0, "Error on id=%llu (%s).\n",
-		Conn_getid(C), Conn_strerror());
+	struct slot *s;
+
+	if (stream_nomem)
+		return -1;
+
+	while (seq_out < seq_in) {
+		s = &slots[seq_out % slots_no];
+		if (s->answer == NULL)
+			break;
+
+		printf("%s\t%s\n", s->line, s->answer);
+		free(s->line);
+		free(s->answer);
+		s->line = NULL;
+		s->answer = NULL;
+		seq_out++;
+	}
+
+	return ferror(stdout) ? -1 : 0;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Annotates every line of @in
+ */
+static int stream(struct ip2clue_client *c, FILE *in)
 {
-	struct Conn *C;
-	int ret;
+	struct slot *s;
+	char *line = NULL, *ip, *e, err[512];
+	size_t line_size = 0;
+	ssize_t n;
+	int ret = 0;
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: ip2clue <ip> [<ip2clue_daemon_port>]\n");
-		return 1;
+	while ((n = getline(&line, &line_size, in)) != -1) {
+		while ((n > 0) && ((line[n - 1] == '\n') || (line[n - 1] == '\r')))
+			line[--n] = '\0';
+
+		/* The ring is full: wait for the oldest line */
+		while (seq_in - seq_out >= slots_no) {
+			if (ip2clue_client_poll(c, -1) == -1)
+				goto out_err;
+			if (stream_output() != 0)
+				goto out_err;
+		}
+
+		s = &slots[seq_in % slots_no];
+		s->line = strdup(line);
+		if (s->line == NULL) {
+			stream_nomem = 1;
+			goto out_err;
+		}
+		seq_in++;
+
+		ip = line + strspn(line, " \t");
+		e = ip + strcspn(ip, " \t");
+		*e = '\0';
+		if (*ip == '\0')
+			snprintf(err, sizeof(err), "ER errmsg=\"no address\"");
+		else if (ip2clue_client_submit(c, ip, (void *) (seq_in - 1)) != 0)
+			snprintf(err, sizeof(err), "ER ip=%s errmsg=\"%s\"",
+				ip, ip2clue_strerror());
+		else
+			err[0] = '\0';
+
+		if (err[0] != '\0') {
+			s->answer = strdup(err);
+			if (s->answer == NULL) {
+				stream_nomem = 1;
+				goto out_err;
+			}
+		}
+
+		if (stream_output() != 0)
+			goto out_err;
 	}
 
-	/* prepare sending */
-	snprintf(cmd, sizeof(cmd), "R%s\n", argv[1]);
+	if (ip2clue_client_wait(c) != 0)
+		goto out_err;
+	if (stream_output() != 0)
+		goto out_err;
 
-	Conn_debug(Logf, 0);
+	goto out;
 
-	if (argc >= 3)
-		conf_port = strtol(argv[2], NULL, 10);
+	out_err:
+	fprintf(stderr, "Cannot annotate (%s)!\n", stream_nomem ?
+		"out of memory" : ferror(stdout) ? "write error"
+		: ip2clue_strerror());
+	ret = -1;
 
-	ret = Conn_init(0);
-	if (ret == -1) {
-		Log(0, "Cannot init Conn (%s)!\n",
-			Conn_strerror());
-		return 1;
+	out:
+	free(line);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ip2clue_client *c;
+	FILE *in = stdin;
+	const char *file = NULL, *format = NULL;
+	char addr[256];
+	unsigned int window = 1000, batch = 32, conns = 1;
+	int port = 9999, streaming = 0, opt, ret;
+
+	addr[0] = '\0';
+	while ((opt = getopt(argc, argv, "sf:p:a:w:b:c:F:h")) != -1) {
+		switch (opt) {
+		case 's': streaming = 1; break;
+		case 'f': file = optarg; break;
+		case 'p': port = strtol(optarg, NULL, 10); break;
+		case 'a': snprintf(addr, sizeof(addr), "%s", optarg); break;
+		case 'w': window = strtoul(optarg, NULL, 10); break;
+		case 'b': batch = strtoul(optarg, NULL, 10); break;
+		case 'c': conns = strtoul(optarg, NULL, 10); break;
+		case 'F': format = optarg; break;
+		default:
+			usage();
+			return 1;
+		}
 	}
 
-	/* set callbacks */
-	Conn_data_cb = data;
-	Conn_error_cb = error;
-	Conn_connected_cb = connected_cb;
+	if (!streaming) {
+		if (optind >= argc) {
+			usage();
+			return 1;
+		}
+		if (optind + 1 < argc)
+			port = strtol(argv[optind + 1], NULL, 10);
+		conns = 1;
+		window = 1;
+		batch = 1;
+	}
 
 	/* prefer IPv6 */
-	Log(1, "IPv6...\n");
-	C = Conn_alloc();
-	if (!C) {
-		Log(0, "Cannot alloc a Conn v6 structure (%s)!\n",
-			Conn_strerror());
+	if (addr[0] != '\0') {
+		c = ip2clue_client_open(addr, conns, window, batch,
+			streaming ? stream_cb : single_cb, NULL);
+	} else {
+		snprintf(addr, sizeof(addr), "[::1]:%d", port);
+		c = ip2clue_client_open(addr, conns, window, batch,
+			streaming ? stream_cb : single_cb, NULL);
+		if (c == NULL) {
+			snprintf(addr, sizeof(addr), "127.0.0.1:%d", port);
+			c = ip2clue_client_open(addr, conns, window, batch,
+				streaming ? stream_cb : single_cb, NULL);
+		}
+	}
+	if (c == NULL) {
+		fprintf(stderr, "Cannot connect (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	if ((format != NULL) && (ip2clue_client_format(c, format) != 0)) {
+		fprintf(stderr, "Cannot set format (%s)!\n",
+			ip2clue_strerror());
+		ip2clue_client_close(c);
 		return 1;
 	}
 
-	Conn_set_socket_domain(C, PF_INET6);
-	Conn_set_socket_type(C, SOCK_STREAM);
-	Conn_set_socket_addr(C, "::1");
-	Conn_set_socket_port(C, conf_port);
-	ret = Conn_commit(C);
-	if (ret != 0) {
-		Log(0, "Cannot commit v6 (%s)!\n",
-			Conn_strerror());
-
-		Log(1, "IPv4...\n");
-		Conn_set_socket_domain(C, PF_INET);
-		Conn_set_socket_type(C, SOCK_STREAM);
-		Conn_set_socket_addr(C, "127.0.0.1");
-		Conn_set_socket_port(C, conf_port);
-		ret = Conn_commit(C);
-		if (ret != 0) {
-			Log(0, "Cannot commit v4 (%s)!\n",
-				Conn_strerror());
+	if (!streaming) {
+		ret = ip2clue_client_submit(c, argv[optind], NULL);
+		if (ret == 0)
+			ret = ip2clue_client_wait(c);
+		if (ret == 0)
+			printf("%s\n", single);
+		else
+			fprintf(stderr, "Error (%s)!\n", ip2clue_strerror());
+		ip2clue_client_close(c);
+		return ret == 0 ? 0 : 1;
+	}
+
+	if (file != NULL) {
+		in = fopen(file, "r");
+		if (in == NULL) {
+			fprintf(stderr, "Cannot open [%s]!\n", file);
+			ip2clue_client_close(c);
 			return 1;
 		}
 	}
 
-	Log(1, "Start polling...\n");
-	while (1) {
-		ret = Conn_poll(-1);
-		if (ret == -1) {
-			Log(0, "Error in Conn_poll (%s)!\n",
-				Conn_strerror());
-			break;
-		} else if (ret == 0) {
-			break;
-		}
+	/* Every connection can hold 'window' lines */
+	slots_no = (unsigned long) conns * window;
+	slots = (struct slot *) calloc(slots_no, sizeof(struct slot));
+	if (slots == NULL) {
+		fprintf(stderr, "Cannot alloc memory for %lu lines!\n",
+			slots_no);
+		ip2clue_client_close(c);
+		return 1;
 	}
 
-	Conn_shutdown();
+	ret = stream(c, in);
+
+	if (in != stdin)
+		fclose(in);
+	ip2clue_client_close(c);
+	free(slots);
 
-	return 0;
+	return ret == 0 ? 0 : 1;
 }
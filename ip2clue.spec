@@ -7,13 +7,22 @@ Group:		Applications/Internet
 Source:		http://kernel.embedromix.ro/us/ip2clue/%{name}-%{version}.tar.gz
 URL:		http://kernel.embedromix.ro/us/
 BuildRoot:	%{_tmppath}/%{name}-%{version}-buildroot
-BuildRequires:	Conn >= 1.0.31
+BuildRequires:	Conn >= 1.0.31, zlib-devel
 Requires:	Conn >= 1.0.31, gzip, wget, unzip, crontabs
 
 %description
 A set of tools for IP 2 country look up operations. It has a fast daemon that
 caches and searches for information and tools on the client side.
 
+%package devel
+Summary:	Development files for libip2clue
+Group:		Development/Libraries
+Requires:	%{name} = %{version}-%{release}
+
+%description devel
+The header, the static library and the link to the shared library, to build
+programs that search the ip2clue databases or talk to ip2clued.
+
 %prep
 %setup -q
 
@@ -33,6 +42,9 @@ rm -rf ${RPM_BUILD_ROOT}
 %defattr (-,root,root)
 %{_sbindir}/ip2clued
 %{_bindir}/ip2clue
+%{_bindir}/ip2clue-annotate
+%{_libdir}/libip2clue.so.0
+%{_libdir}/libip2clue.so.0.*
 %{_sysconfdir}/ip2clue/*
 %{_sysconfdir}/rc.d/init.d/ip2clued
 %{_sysconfdir}/cron.daily/*
@@ -40,8 +52,17 @@ rm -rf ${RPM_BUILD_ROOT}
 %dir %{_var}/cache/ip2clue
 %doc README Changelog TODO LICENSE clients
 
+%files devel
+%defattr (-,root,root)
+%{_libdir}/libip2clue.a
+%{_libdir}/libip2clue.so
+%{_includedir}/libip2clue.h
+
 %post
 /sbin/chkconfig --add ip2clued
+/sbin/ldconfig
+
+%postun -p /sbin/ldconfig
 
 %preun
 if [ "$1" = "0" ]; then
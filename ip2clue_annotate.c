@@ -0,0 +1,660 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: annotates big log files offline, without the daemon
+ * The input is read in rounds of 'threads' chunks; every thread takes the
+ * addresses of its chunk, sorts them and walks the tables once (merge join,
+ * ip2clue_list_lookup_sorted), then the chunks are written in order.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <i_addr.h>
+#include <i_fmt.h>
+#include <parser.h>
+
+#define MAX_THREADS	64
+
+/* Addresses searched together; bounds the memory for the results */
+#define SUB_BATCH	4096
+
+struct line
+{
+	char			*text;		/* NUL terminated, in the chunk */
+	unsigned int		len;
+	const char		*ip;		/* not terminated */
+	unsigned int		ip_len;
+	size_t			ans_off;	/* in job->ans */
+	unsigned int		ans_len;
+};
+
+/* An IPv6 key; IPv4 keys are packed in 64 bits (address << 32 | line) */
+struct key
+{
+	unsigned int		ip[4];
+	unsigned int		v4;		/* embedded IPv4, see i_addr.h */
+	enum ip2clue_addr_class	addr_class;
+	unsigned int		line;
+};
+
+struct job
+{
+	char			*buf;
+	size_t			len;
+	struct line		*lines;
+	unsigned long		lines_no;
+	char			*ans;		/* answers, in any order */
+	size_t			ans_len, ans_size;
+	char			*out;
+	size_t			out_len;
+	unsigned int		*ips;		/* SUB_BATCH addresses */
+	struct ip2clue_result	*r;
+	unsigned char		*found_set;
+	unsigned long		found, notfound, bad;
+	int			err;
+};
+
+static struct ip2clue_list	list;
+static const struct ip2clue_fmt	*fmt;
+static unsigned int		conf_column = 1;
+static const char		*conf_delims = " \t";
+static regex_t			conf_re;
+static int			conf_use_re;
+static int			conf_merge = 1;
+
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ip2clue-annotate -f files [-d dir] [-c column"
+		" | -r regex] [-D delims]\n"
+		"       [-F format] [-t threads] [-b chunk_KiB] [-m merge|search]"
+		" [-v] [file...]\n"
+		"  -f files   same as 'files' in ip2clued.conf"
+		" ('maxmind:a.csv, ip2location:b.bin')\n"
+		"  -c column  the address is this field (default 1)\n"
+		"  -D delims  field separators (default space and tab)\n"
+		"  -r regex   the address is the first match (or its first"
+		" group)\n"
+		"  -m search  one binary search per address instead of"
+		" the merge join\n"
+		"Writes '<line>\\t<answer>' for every line, in order.\n");
+}
+
+/*
+ * Finds the address in a line: a column or a regex match
+ */
+static int extract(struct line *l)
+{
+	regmatch_t m[2];
+	const char *p, *s, *end;
+	unsigned int col = 1;
+
+	if (conf_use_re) {
+		if (regexec(&conf_re, l->text, 2, m, 0) != 0)
+			return -1;
+		if ((conf_re.re_nsub == 0) || (m[1].rm_so == -1))
+			m[1] = m[0];
+		l->ip = l->text + m[1].rm_so;
+		l->ip_len = m[1].rm_eo - m[1].rm_so;
+		return 0;
+	}
+
+	p = l->text;
+	end = l->text + l->len;
+	while ((p < end) && strchr(conf_delims, *p))
+		p++;
+	while (p < end) {
+		s = p;
+		while ((p < end) && !strchr(conf_delims, *p))
+			p++;
+
+		if (col++ == conf_column) {
+			/* "1.2.3.4" in csv files */
+			if ((p - s >= 2) && (*s == '"') && (p[-1] == '"')) {
+				s++;
+				p--;
+			}
+			l->ip = s;
+			l->ip_len = p - s;
+			return 0;
+		}
+
+		while ((p < end) && strchr(conf_delims, *p))
+			p++;
+	}
+
+	return -1;
+}
+
+static int ans_add(struct job *j, struct line *l, const char *s)
+{
+	size_t len, size;
+	char *p;
+
+	len = strlen(s);
+	if (j->ans_len + len > j->ans_size) {
+		size = (j->ans_size + len) * 2;
+		p = (char *) realloc(j->ans, size);
+		if (p == NULL)
+			return -1;
+		j->ans = p;
+		j->ans_size = size;
+	}
+
+	memcpy(j->ans + j->ans_len, s, len);
+	l->ans_off = j->ans_len;
+	l->ans_len = len;
+	j->ans_len += len;
+
+	return 0;
+}
+
+/*
+ * Builds the answer of a line: the result @r or the error @err
+ */
+static int answer(struct job *j, struct line *l, const struct ip2clue_result *r,
+	const char *err)
+{
+	char ip[64], out[4096];
+
+	snprintf(ip, sizeof(ip), "%.*s", (int) l->ip_len, l->ip);
+
+	if (err != NULL) {
+		snprintf(out, sizeof(out), "ER ip=%s errmsg=\"%s\"", ip, err);
+		if (strcmp(err, "not found") == 0)
+			j->notfound++;
+		else
+			j->bad++;
+	} else if (ip2clue_fmt_render(out, sizeof(out), fmt, r, ip) == -1) {
+		snprintf(out, sizeof(out), "ER ip=%s errmsg=\"%s\"", ip,
+			ip2clue_strerror());
+		j->bad++;
+	} else {
+		j->found++;
+	}
+
+	return ans_add(j, l, out);
+}
+
+/*
+ * Sorts IPv4 keys (address << 32 | line): 4 passes of 8 bits over the
+ * address, much cheaper than qsort for millions of keys
+ */
+static void radix_sort(unsigned long long *k, unsigned long long *tmp,
+	const unsigned long n)
+{
+	unsigned long count[256], i, sum, c;
+	unsigned long long *src = k, *dst = tmp, *t;
+	unsigned int shift;
+
+	for (shift = 32; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(src[i] >> shift) & 0xFF]++;
+
+		sum = 0;
+		for (i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+
+		for (i = 0; i < n; i++)
+			dst[count[(src[i] >> shift) & 0xFF]++] = src[i];
+
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	/* An even number of passes: the result is back in @k */
+}
+
+static int key_cmp_v6(const void *a, const void *b)
+{
+	return ip2clue_compare_v6(((const struct key *) a)->ip,
+		((const struct key *) b)->ip);
+}
+
+/*
+ * Answers the lines of a looked up batch
+ */
+static int merge_answers(struct job *j, const unsigned long line,
+	const unsigned int k)
+{
+	if (j->found_set[k])
+		return answer(j, &j->lines[line], &j->r[k], NULL);
+
+	return answer(j, &j->lines[line], NULL, "not found");
+}
+
+/*
+ * Merge join of sorted IPv4 keys, SUB_BATCH at a time
+ */
+static int merge_v4(struct job *j, const unsigned long long *keys,
+	const unsigned long n)
+{
+	unsigned long i, k, m;
+
+	for (i = 0; i < n; i += SUB_BATCH) {
+		m = n - i < SUB_BATCH ? n - i : SUB_BATCH;
+		for (k = 0; k < m; k++)
+			j->ips[4 * k] = keys[i + k] >> 32;
+		memset(j->found_set, 0, m);
+
+		ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V4, j->ips, m,
+			fmt->fields, j->r, j->found_set);
+
+		for (k = 0; k < m; k++)
+			if (merge_answers(j, keys[i + k] & 0xFFFFFFFF, k) != 0)
+				return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Same for IPv6; the keys not found that embed an IPv4 go to @fallback
+ */
+static int merge_v6(struct job *j, const struct key *keys,
+	const unsigned long n, unsigned long long *fallback,
+	unsigned long *fallback_no)
+{
+	const struct key *key;
+	unsigned long i, k, m;
+
+	for (i = 0; i < n; i += SUB_BATCH) {
+		m = n - i < SUB_BATCH ? n - i : SUB_BATCH;
+		for (k = 0; k < m; k++)
+			memcpy(&j->ips[4 * k], keys[i + k].ip, sizeof(keys[0].ip));
+		memset(j->found_set, 0, m);
+
+		ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V6, j->ips, m,
+			fmt->fields, j->r, j->found_set);
+
+		for (k = 0; k < m; k++) {
+			key = &keys[i + k];
+			if (!j->found_set[k]
+				&& ((key->addr_class == IP2CLUE_ADDR_V4_MAPPED)
+				|| (key->addr_class == IP2CLUE_ADDR_V4_COMPAT)
+				|| (key->addr_class == IP2CLUE_ADDR_6TO4))) {
+				fallback[(*fallback_no)++] =
+					((unsigned long long) key->v4 << 32) | key->line;
+				continue;
+			}
+
+			if (merge_answers(j, key->line, k) != 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int job_run(struct job *j)
+{
+	unsigned long long *k4, *tmp;
+	struct key *k6, *key;
+	struct ip2clue_addr a;
+	struct ip2clue_result r;
+	struct line *l;
+	unsigned long i, n4 = 0, n6 = 0, nf = 0;
+	char *p, *e, ip[64];
+	size_t size;
+	int ret = -1, err;
+
+	/* Split in lines */
+	for (p = j->buf; p < j->buf + j->len; p = e + 1) {
+		e = (char *) memchr(p, '\n', j->buf + j->len - p);
+		j->lines_no++;
+	}
+
+	j->lines = (struct line *) malloc(j->lines_no * sizeof(struct line));
+	k4 = (unsigned long long *) malloc(j->lines_no
+		* sizeof(unsigned long long));
+	tmp = (unsigned long long *) malloc(j->lines_no
+		* sizeof(unsigned long long));
+	k6 = (struct key *) malloc(j->lines_no * sizeof(struct key));
+	j->ans_size = j->len + 4096;
+	j->ans = (char *) malloc(j->ans_size);
+	j->ips = (unsigned int *) malloc(4 * SUB_BATCH * sizeof(unsigned int));
+	j->r = (struct ip2clue_result *) malloc(SUB_BATCH
+		* sizeof(struct ip2clue_result));
+	j->found_set = (unsigned char *) malloc(SUB_BATCH);
+	if ((j->lines == NULL) || (k4 == NULL) || (tmp == NULL) || (k6 == NULL)
+		|| (j->ans == NULL) || (j->ips == NULL) || (j->r == NULL) || (j->found_set == NULL))
+		goto out;
+
+	i = 0;
+	for (p = j->buf; p < j->buf + j->len; p = e + 1) {
+		e = (char *) memchr(p, '\n', j->buf + j->len - p);
+		*e = '\0';
+		if ((e > p) && (e[-1] == '\r'))
+			e[-1] = '\0';
+
+		l = &j->lines[i];
+		l->text = p;
+		l->len = strlen(p);
+		l->ip = "";
+		l->ip_len = 0;
+
+		if (extract(l) != 0) {
+			l->ip = "";
+			l->ip_len = 0;
+			j->bad++;
+			if (ans_add(j, l, "ER errmsg=\"no address\"") != 0)
+				goto out;
+			i++;
+			continue;
+		}
+
+		snprintf(ip, sizeof(ip), "%.*s", (int) l->ip_len, l->ip);
+		if ((l->ip_len >= sizeof(ip))
+			|| (ip2clue_addr_parse_strict(&a, ip) != 0)) {
+			if (answer(j, l, NULL, "malformed address") != 0)
+				goto out;
+			i++;
+			continue;
+		}
+
+		if (!conf_merge) {
+			if (ip2clue_list_lookup_addr(&list, &a, fmt->fields, &r) == 1)
+				err = answer(j, l, &r, NULL);
+			else
+				err = answer(j, l, NULL, "not found");
+			if (err != 0)
+				goto out;
+			i++;
+			continue;
+		}
+
+		if (a.v4_or_v6 == IP2CLUE_TYPE_V4) {
+			k4[n4++] = ((unsigned long long) a.ip[0] << 32) | i;
+		} else {
+			key = &k6[n6++];
+			memcpy(key->ip, a.ip, sizeof(key->ip));
+			key->v4 = a.v4;
+			key->addr_class = a.addr_class;
+			key->line = i;
+		}
+		i++;
+	}
+
+	if (conf_merge) {
+		radix_sort(k4, tmp, n4);
+		qsort(k6, n6, sizeof(struct key), key_cmp_v6);
+
+		if (merge_v4(j, k4, n4) != 0)
+			goto out;
+
+		/* The v4 keys are done: their room takes the fallbacks */
+		if (merge_v6(j, k6, n6, k4, &nf) != 0)
+			goto out;
+
+		radix_sort(k4, tmp, nf);
+		if (merge_v4(j, k4, nf) != 0)
+			goto out;
+	}
+
+	/* Lines and answers, in order */
+	size = j->len + j->ans_len + j->lines_no * 2;
+	j->out = (char *) malloc(size);
+	if (j->out == NULL)
+		goto out;
+	for (i = 0; i < j->lines_no; i++) {
+		l = &j->lines[i];
+		memcpy(j->out + j->out_len, l->text, l->len);
+		j->out_len += l->len;
+		j->out[j->out_len++] = '\t';
+		memcpy(j->out + j->out_len, j->ans + l->ans_off, l->ans_len);
+		j->out_len += l->ans_len;
+		j->out[j->out_len++] = '\n';
+	}
+
+	ret = 0;
+
+	out:
+	free(k4);
+	free(tmp);
+	free(k6);
+	free(j->lines);
+	free(j->ans);
+	free(j->ips);
+	free(j->r);
+	free(j->found_set);
+	j->lines = NULL;
+	j->ans = NULL;
+	j->err = ret;
+	return ret;
+}
+
+static void *job_thread(void *arg)
+{
+	job_run((struct job *) arg);
+
+	return NULL;
+}
+
+/*
+ * Annotates a file: rounds of 'threads' chunks of 'chunk' bytes
+ */
+static int annotate(FILE *in, const unsigned int threads, const size_t chunk,
+	unsigned long *lines, unsigned long *found, unsigned long *notfound,
+	unsigned long *bad)
+{
+	struct job jobs[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	char *buf, *p, *e;
+	size_t size, have = 0, cut, n, part;
+	unsigned int i, jobs_no, started;
+	int eof = 0, ret = 0, err;
+
+	size = threads * chunk;
+	buf = (char *) malloc(size + 1);
+	if (buf == NULL) {
+		fprintf(stderr, "Cannot alloc %zu bytes!\n", size + 1);
+		return -1;
+	}
+
+	while (!eof || (have > 0)) {
+		while (!eof && (have < size)) {
+			n = fread(buf + have, 1, size - have, in);
+			have += n;
+			if (n == 0)
+				eof = 1;
+		}
+		if (have == 0)
+			break;
+
+		/* Only whole lines; at the end, the last one may have no '\n' */
+		cut = have;
+		if (!eof) {
+			p = (char *) memrchr(buf, '\n', have);
+			if (p == NULL) {
+				/* A line longer than the buffer: grow it, read on */
+				p = (char *) realloc(buf, size * 2 + 1);
+				if (p == NULL) {
+					fprintf(stderr, "Cannot alloc %zu bytes!\n",
+						size * 2 + 1);
+					ret = -1;
+					break;
+				}
+				buf = p;
+				size *= 2;
+				continue;
+			}
+			cut = p + 1 - buf;
+		}
+		if (buf[cut - 1] != '\n') {
+			memmove(buf + cut + 1, buf + cut, have - cut);
+			buf[cut++] = '\n';
+			have++;
+		}
+
+		/* Split in chunks, at line ends */
+		jobs_no = 0;
+		part = cut / threads + 1;
+		for (p = buf; (p < buf + cut) && (jobs_no < threads); p = e) {
+			e = p + part < buf + cut ? p + part : buf + cut;
+			if (jobs_no == threads - 1)
+				e = buf + cut;
+			e = (char *) memchr(e - 1, '\n', buf + cut - (e - 1)) + 1;
+
+			memset(&jobs[jobs_no], 0, sizeof(struct job));
+			jobs[jobs_no].buf = p;
+			jobs[jobs_no].len = e - p;
+			jobs_no++;
+		}
+
+		for (started = 0; started < jobs_no; started++) {
+			err = pthread_create(&tids[started], NULL, job_thread,
+				&jobs[started]);
+			if (err != 0) {
+				fprintf(stderr, "Cannot create thread (%s)!\n",
+					strerror(err));
+				ret = -1;
+				break;
+			}
+		}
+
+		for (i = 0; i < started; i++) {
+			pthread_join(tids[i], NULL);
+			if (jobs[i].err != 0)
+				ret = -1;
+			if ((ret == 0) && (fwrite(jobs[i].out, 1, jobs[i].out_len,
+				stdout) != jobs[i].out_len))
+				ret = -1;
+			free(jobs[i].out);
+			*lines += jobs[i].lines_no;
+			*found += jobs[i].found;
+			*notfound += jobs[i].notfound;
+			*bad += jobs[i].bad;
+		}
+		if (ret != 0) {
+			if (started == jobs_no)
+				fprintf(stderr, "Cannot annotate (%s)!\n",
+					ferror(stdout) ? strerror(errno)
+					: "no memory");
+			break;
+		}
+
+		memmove(buf, buf + cut, have - cut);
+		have -= cut;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = ".", *files = NULL, *format, *re = NULL;
+	unsigned long lines = 0, found = 0, notfound = 0, bad = 0;
+	unsigned int threads, chunk_kib = 4096;
+	struct timeval start, end;
+	int opt, verbose = 0, ret = 0, i;
+	FILE *in;
+
+	format = "OK ip=%P cs=%s tz=%t isp=%i";
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "d:f:c:D:r:F:t:b:m:vh")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 'f': files = optarg; break;
+		case 'c': conf_column = strtoul(optarg, NULL, 10); break;
+		case 'D': conf_delims = optarg; break;
+		case 'r': re = optarg; break;
+		case 'F': format = optarg; break;
+		case 't': threads = strtoul(optarg, NULL, 10); break;
+		case 'b': chunk_kib = strtoul(optarg, NULL, 10); break;
+		case 'm': conf_merge = strcmp(optarg, "search") != 0; break;
+		case 'v': verbose = 1; break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if ((files == NULL) || (conf_column == 0) || (chunk_kib == 0)) {
+		usage();
+		return 1;
+	}
+	if (threads == 0)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	if (re != NULL) {
+		if (regcomp(&conf_re, re, REG_EXTENDED) != 0) {
+			fprintf(stderr, "Invalid regex [%s]!\n", re);
+			return 1;
+		}
+		conf_use_re = 1;
+	}
+
+	fmt = ip2clue_fmt_get(format);
+	if (fmt == NULL) {
+		fprintf(stderr, "Invalid format (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	ip2clue_list_init(&list);
+	if (ip2clue_list_load(&list, dir, files) != 0) {
+		fprintf(stderr, "Cannot load [%s] from [%s] (%s)!\n",
+			files, dir, ip2clue_strerror());
+		return 1;
+	}
+	gettimeofday(&end, NULL);
+	if (verbose)
+		fprintf(stderr, "Loaded in %.3fs.\n",
+			(end.tv_sec - start.tv_sec)
+			+ (end.tv_usec - start.tv_usec) / 1000000.0);
+
+	gettimeofday(&start, NULL);
+	if (optind >= argc) {
+		ret = annotate(stdin, threads, chunk_kib * 1024UL, &lines,
+			&found, &notfound, &bad);
+	} else {
+		for (i = optind; (i < argc) && (ret == 0); i++) {
+			in = fopen(argv[i], "r");
+			if (in == NULL) {
+				fprintf(stderr, "Cannot open [%s] (%s)!\n",
+					argv[i], strerror(errno));
+				ret = -1;
+				break;
+			}
+			ret = annotate(in, threads, chunk_kib * 1024UL, &lines,
+				&found, &notfound, &bad);
+			fclose(in);
+		}
+	}
+	if (fflush(stdout) != 0)
+		ret = -1;
+	gettimeofday(&end, NULL);
+
+	if (verbose)
+		fprintf(stderr, "%lu lines (%lu found, %lu not found,"
+			" %lu without address) in %.3fs, %s, %u threads.\n",
+			lines, found, notfound, bad,
+			(end.tv_sec - start.tv_sec)
+			+ (end.tv_usec - start.tv_usec) / 1000000.0,
+			conf_merge ? "merge join" : "binary search", threads);
+
+	ip2clue_list_destroy(&list);
+	if (conf_use_re)
+		regfree(&conf_re);
+
+	return ret == 0 ? 0 : 1;
+}
@@ -1,139 +1,443 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: load generator for ip2clued
+ * Open loop: request i is due at start + i / rate, whatever the daemon does,
+ * and its latency is counted from that time, not from when it could be
+ * sent, so a stalled daemon is not hidden (coordinated omission). With no
+ * rate it is a closed loop: every connection keeps 'depth' requests going.
+ */
+
 #include <i_config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/prctl.h>
 
-#include <Conn.h>
+#include <libip2clue.h>
 
-#include <i_types.h>
-#include <i_util.h>
-#include <i_conf.h>
-#include <parser.h>
+enum dist
+{
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_REPLAY
+};
 
-#define REQUESTS 50000
+/*
+ * Latency histogram, HDR style: 64 sub-buckets per power of two, so every
+ * value is kept with less than 1.6% error, from 1ns to hours.
+ */
+#define HIST_SUB	64
+#define HIST_EXP	40
 
-static FILE			*Logf = NULL;
-static int			conf_port = 9999;
+struct hist
+{
+	unsigned long long	counts[HIST_EXP][HIST_SUB];
+	unsigned long long	total, min, max;
+	double			sum;
+};
 
-static char			ips[REQUESTS][64];
-static unsigned int		ips_now = 0;
+static struct hist		hist;
+static unsigned long long	answers_ok, answers_er, answers_lost;
+static unsigned long long	start_ns;
+static unsigned long long	rnd_state = 88172645463325252ULL;
 
-static void send_data(struct Conn *C)
+static unsigned long long now_ns(void)
 {
-	char cmd[64];
+	struct timespec t;
 
-	snprintf(cmd, sizeof(cmd), "R%s\n", ips[ips_now]);
-	ips_now++;
-	if (Conn_enqueue(C, cmd, strlen(cmd)) == -1) {
-		Log(0, "Cannot enqueue (%s)!\n",
-			Conn_strerror());
-	}
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (unsigned long long) t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
-static void connected_cb(struct Conn *C)
+/* xorshift64: cheap, and the same sequence for the same seed */
+static unsigned long long rnd(void)
 {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
 
-	send_data(C);
+	return rnd_state;
 }
 
-static int data_cb(struct Conn *C, char *line)
+static void hist_pos(const unsigned long long v, unsigned int *e,
+	unsigned int *s)
 {
-	/*printf("%s\n", line);*/
+	unsigned int bits;
 
-	if (ips_now == REQUESTS)
-		Conn_close(C);
-	else
-		send_data(C);
+	if (v < HIST_SUB) {
+		*e = 0;
+		*s = v;
+		return;
+	}
 
-	return 0;
+	bits = 63 - __builtin_clzll(v);		/* v >= 2^bits */
+	*e = bits - 5;				/* 6 bits: 64..127 -> 1 */
+	if (*e >= HIST_EXP)
+		*e = HIST_EXP - 1;
+	*s = (v >> (*e - 1)) - HIST_SUB;
+	if (*s >= HIST_SUB)
+		*s = HIST_SUB - 1;
 }
 
-static void data(struct Conn *C)
+static void hist_add(const unsigned long long v)
 {
-	Conn_for_every_line(C, data_cb);
+	unsigned int e, s;
+
+	hist_pos(v, &e, &s);
+	hist.counts[e][s]++;
+	if ((hist.total == 0) || (v < hist.min))
+		hist.min = v;
+	if (v > hist.max)
+		hist.max = v;
+	hist.total++;
+	hist.sum += v;
 }
 
+/*
+ * The highest value of a bucket
+ */
+static unsigned long long hist_value(const unsigned int e, const unsigned int s)
+{
+	if (e == 0)
+		return s;
 
-static void error(struct Conn *C)
+	return ((unsigned long long) (s + HIST_SUB + 1) << (e - 1)) - 1;
+}
+
+static unsigned long long hist_percentile(const double p)
 {
-	Log(0, "Error on id=%llu (%s).\n",
-		Conn_getid(C), Conn_strerror());
+	unsigned long long want, seen = 0;
+	unsigned int e, s;
+
+	want = (unsigned long long) ceil(p / 100.0 * hist.total);
+	if (want == 0)
+		want = 1;
+
+	for (e = 0; e < HIST_EXP; e++) {
+		for (s = 0; s < HIST_SUB; s++) {
+			seen += hist.counts[e][s];
+			if (seen >= want)
+				return hist_value(e, s) < hist.max ?
+					hist_value(e, s) : hist.max;
+		}
+	}
+
+	return hist.max;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Key generators
+ */
+static enum dist		dist = DIST_UNIFORM;
+static unsigned int		v6_pct;
+static unsigned int		keys_no = 100000;
+static double			zipf_s = 1.0;
+static double			*zipf_cdf;
+static char			(*keys)[64];
+static unsigned long		replay_pos;
+
+static void random_addr(char *out, const size_t out_size)
+{
+	unsigned long long r = rnd();
+
+	if ((v6_pct > 0) && ((rnd() % 100) < v6_pct)) {
+		/* In 2000::/3, where the v6 tables are */
+		snprintf(out, out_size, "%x:%x:%x:%x::%x",
+			(unsigned int) (0x2000 | ((r >> 48) & 0x1FFF)),
+			(unsigned int) ((r >> 32) & 0xFFFF),
+			(unsigned int) ((r >> 16) & 0xFFFF),
+			(unsigned int) (r & 0xFFFF),
+			(unsigned int) (rnd() & 0xFFFF));
+		return;
+	}
+
+	snprintf(out, out_size, "%u.%u.%u.%u",
+		(unsigned int) (r >> 24) & 0xFF, (unsigned int) (r >> 16) & 0xFF,
+		(unsigned int) (r >> 8) & 0xFF, (unsigned int) r & 0xFF);
+}
+
+/*
+ * Zipf: a fixed population of keys, key k is picked with weight 1/k^s
+ */
+static int zipf_init(void)
 {
-	struct Conn *C;
-	int ret;
 	unsigned int i;
+	double sum = 0;
 
-	Conn_debug(Logf, 0);
+	keys = malloc(keys_no * sizeof(keys[0]));
+	zipf_cdf = (double *) malloc(keys_no * sizeof(double));
+	if ((keys == NULL) || (zipf_cdf == NULL))
+		return -1;
 
-	if (argc >= 3)
-		conf_port = strtol(argv[2], NULL, 10);
+	for (i = 0; i < keys_no; i++) {
+		random_addr(keys[i], sizeof(keys[i]));
+		sum += 1.0 / pow(i + 1, zipf_s);
+		zipf_cdf[i] = sum;
+	}
+	for (i = 0; i < keys_no; i++)
+		zipf_cdf[i] /= sum;
 
-	ret = Conn_init(0);
-	if (ret == -1) {
-		Log(0, "Cannot init Conn (%s)!\n",
-			Conn_strerror());
-		return 1;
+	return 0;
+}
+
+static int replay_init(const char *file)
+{
+	FILE *f;
+	char line[512];
+	unsigned int size = 0;
+	void *p;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return -1;
+
+	keys_no = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, " \t\r\n")] = '\0';
+		if (line[0] == '\0')
+			continue;
+
+		if (keys_no == size) {
+			size = size * 2 + 1024;
+			p = realloc(keys, size * sizeof(keys[0]));
+			if (p == NULL) {
+				fclose(f);
+				return -1;
+			}
+			keys = p;
+		}
+		line[sizeof(keys[0]) - 1] = '\0';
+		strcpy(keys[keys_no++], line);
 	}
+	fclose(f);
+
+	return keys_no > 0 ? 0 : -1;
+}
 
-	/* set callbacks */
-	Conn_data_cb = data;
-	Conn_error_cb = error;
-	Conn_connected_cb = connected_cb;
+static const char *next_addr(char *buf, const size_t buf_size)
+{
+	unsigned long lo, hi, mid;
+	double u;
+
+	switch (dist) {
+	case DIST_ZIPF:
+		u = (rnd() >> 11) * (1.0 / 9007199254740992.0);
+		lo = 0;
+		hi = keys_no - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (zipf_cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return keys[lo];
 
-	/* build data */
-	for (i = 0; i < REQUESTS; i++) {
-		snprintf(ips[i], sizeof(ips[i]), "%ld.%ld.%ld.%ld",
-			random() % 255, random() % 255, random() % 255, random() %255);
+	case DIST_REPLAY:
+		return keys[replay_pos++ % keys_no];
+
+	default:
+		random_addr(buf, buf_size);
+		return buf;
 	}
+}
 
-	/* prefer IPv6 */
-	Log(1, "IPv6...\n");
-	C = Conn_alloc();
-	if (!C) {
-		Log(0, "Cannot alloc a Conn v6 structure (%s)!\n",
-			Conn_strerror());
+/*
+ * An answer: the tag is the time the request was due, from start
+ */
+static void answer_cb(void *tag, const char *answer, void *arg)
+{
+	unsigned long long due = (unsigned long) tag;
+
+	(void) arg;
+
+	hist_add(now_ns() - start_ns - due);
+
+	if (strncmp(answer, "OK", 2) == 0)
+		answers_ok++;
+	else if (strncmp(answer, IP2CLUE_CLIENT_LOST,
+		strlen(IP2CLUE_CLIENT_LOST)) == 0)
+		answers_lost++;		/* the connection failed */
+	else
+		answers_er++;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ip2clue_stress [-a addr | -p port] [-c conns]"
+		" [-w depth] [-b batch] [-r rate]\n"
+		"       [-d seconds] [-k uniform|zipf|replay] [-n keys] [-s zipf_s]"
+		" [-f file] [-6 v6_pct] [-S seed]\n"
+		"  -r rate    requests per second, open loop (default 0 ="
+		" closed loop)\n"
+		"  -w depth   requests in flight per connection (default 1)\n"
+		"  -b batch   addresses per request line, \"M\" (default 1)\n"
+		"  -k dist    uniform over all addresses, zipf over -n keys"
+		" or replay -f file\n"
+		"  -6 pct     percent of IPv6 addresses (default 0)\n"
+		"Latency is counted from the time a request was due.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ip2clue_client *c;
+	struct timespec ts;
+	char addr[256], buf[64];
+	const char *file = NULL;
+	unsigned int conns = 1, depth = 1, batch = 1, seconds = 10;
+	unsigned long long sent = 0, now, due, end_ns;
+	double rate = 0, elapsed;
+	int port = 9999, opt, ret = 0;
+
+	addr[0] = '\0';
+	while ((opt = getopt(argc, argv, "a:p:c:w:b:r:d:k:n:s:f:6:S:h")) != -1) {
+		switch (opt) {
+		case 'a': snprintf(addr, sizeof(addr), "%s", optarg); break;
+		case 'p': port = strtol(optarg, NULL, 10); break;
+		case 'c': conns = strtoul(optarg, NULL, 10); break;
+		case 'w': depth = strtoul(optarg, NULL, 10); break;
+		case 'b': batch = strtoul(optarg, NULL, 10); break;
+		case 'r': rate = strtod(optarg, NULL); break;
+		case 'd': seconds = strtoul(optarg, NULL, 10); break;
+		case 'k':
+			if (strcmp(optarg, "zipf") == 0)
+				dist = DIST_ZIPF;
+			else if (strcmp(optarg, "replay") == 0)
+				dist = DIST_REPLAY;
+			else if (strcmp(optarg, "uniform") == 0)
+				dist = DIST_UNIFORM;
+			else {
+				usage();
+				return 1;
+			}
+			break;
+		case 'n': keys_no = strtoul(optarg, NULL, 10); break;
+		case 's': zipf_s = strtod(optarg, NULL); break;
+		case 'f': file = optarg; break;
+		case '6': v6_pct = strtoul(optarg, NULL, 10); break;
+		case 'S': rnd_state = strtoull(optarg, NULL, 10) | 1; break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if ((seconds == 0) || (keys_no == 0)
+		|| ((dist == DIST_REPLAY) && (file == NULL))) {
+		usage();
 		return 1;
 	}
 
-	Conn_set_socket_domain(C, PF_INET6);
-	Conn_set_socket_type(C, SOCK_STREAM);
-	Conn_set_socket_addr(C, "::1");
-	Conn_set_socket_port(C, conf_port);
-	ret = Conn_commit(C);
-	if (ret != 0) {
-		Log(0, "Cannot commit v6 (%s)!\n",
-			Conn_strerror());
-
-		Log(1, "IPv4...\n");
-		Conn_set_socket_domain(C, PF_INET);
-		Conn_set_socket_type(C, SOCK_STREAM);
-		Conn_set_socket_addr(C, "127.0.0.1");
-		Conn_set_socket_port(C, conf_port);
-		ret = Conn_commit(C);
-		if (ret != 0) {
-			Log(0, "Cannot commit v4 (%s)!\n",
-				Conn_strerror());
-			return 1;
+	if ((dist == DIST_ZIPF) && (zipf_init() != 0)) {
+		fprintf(stderr, "Cannot alloc %u keys!\n", keys_no);
+		return 1;
+	}
+	if ((dist == DIST_REPLAY) && (replay_init(file) != 0)) {
+		fprintf(stderr, "Cannot load addresses from [%s]!\n", file);
+		return 1;
+	}
+
+	/* prefer IPv6 */
+	if (addr[0] != '\0') {
+		c = ip2clue_client_open(addr, conns, depth, batch, answer_cb,
+			NULL);
+	} else {
+		snprintf(addr, sizeof(addr), "[::1]:%d", port);
+		c = ip2clue_client_open(addr, conns, depth, batch, answer_cb,
+			NULL);
+		if (c == NULL) {
+			snprintf(addr, sizeof(addr), "127.0.0.1:%d", port);
+			c = ip2clue_client_open(addr, conns, depth, batch,
+				answer_cb, NULL);
 		}
 	}
+	if (c == NULL) {
+		fprintf(stderr, "Cannot connect (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	/* The sleeps must end when a request is due, not 50us later */
+	if (rate > 0)
+		prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
 
-	Log(1, "Start polling...\n");
+	start_ns = now_ns();
+	end_ns = (unsigned long long) seconds * 1000000000ULL;
 	while (1) {
-		ret = Conn_poll(-1);
-		if (ret == -1) {
-			Log(0, "Error in Conn_poll (%s)!\n",
-				Conn_strerror());
-			break;
-		} else if (ret == 0) {
+		now = now_ns() - start_ns;
+		if (now >= end_ns)
 			break;
+
+		if (rate <= 0) {
+			/* Closed loop: submit waits while all the windows are full */
+			if (ip2clue_client_submit(c, next_addr(buf, sizeof(buf)),
+				(void *) (unsigned long) now) != 0)
+				break;
+			sent++;
+			continue;
 		}
+
+		/* Open loop: all the requests due by now */
+		while (1) {
+			due = (unsigned long long) (sent * 1000000000.0 / rate);
+			if ((due > now) || (due >= end_ns))
+				break;
+			if (ip2clue_client_submit(c, next_addr(buf, sizeof(buf)),
+				(void *) (unsigned long) due) != 0)
+				goto out_err;
+			sent++;
+		}
+
+		if (due <= now)
+			continue;
+
+		/* Nothing to wait for: sleep until the next one is due */
+		if (answers_ok + answers_er + answers_lost == sent) {
+			ts.tv_sec = (start_ns + due) / 1000000000ULL;
+			ts.tv_nsec = (start_ns + due) % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			continue;
+		}
+
+		if (ip2clue_client_poll_ns(c, due - now) == -1)
+			goto out_err;
 	}
 
-	Conn_shutdown();
+	if (ip2clue_client_wait(c) != 0)
+		goto out_err;
+	goto out;
 
-	return 0;
+	out_err:
+	fprintf(stderr, "Error (%s)!\n", ip2clue_strerror());
+	ret = 1;
+
+	out:
+	elapsed = (now_ns() - start_ns) / 1e9;
+	ip2clue_client_close(c);
+
+	printf("%llu requests in %.2fs: %.1f/s", sent, elapsed,
+		hist.total / elapsed);
+	if (rate > 0)
+		printf(" (target %.1f/s)", rate);
+	printf("\n%u connections, depth %u, batch %u, %s keys, %u%% IPv6\n",
+		conns, depth, batch, dist == DIST_ZIPF ? "zipf" :
+		dist == DIST_REPLAY ? "replayed" : "uniform", v6_pct);
+	printf("answers: %llu OK, %llu ER, %llu lost\n",
+		answers_ok, answers_er, answers_lost);
+	if (hist.total > 0)
+		printf("latency (us): min %.1f, mean %.1f, p50 %.1f, p90 %.1f,"
+			" p99 %.1f, p99.9 %.1f, p99.99 %.1f, max %.1f\n",
+			hist.min / 1000.0, hist.sum / hist.total / 1000.0,
+			hist_percentile(50) / 1000.0,
+			hist_percentile(90) / 1000.0,
+			hist_percentile(99) / 1000.0,
+			hist_percentile(99.9) / 1000.0,
+			hist_percentile(99.99) / 1000.0,
+			hist.max / 1000.0);
+
+	return ret;
 }
@@ -2,14 +2,31 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <signal.h>
 #include <pthread.h>
 
 #include <Conn.h>
 
 #include <i_types.h>
 #include <i_util.h>
+#include <i_fmt.h>
 #include <i_conf.h>
+#include <i_mem.h>
+#include <i_rcu.h>
+#include <i_reclaim.h>
+#include <i_uring.h>
+#include <i_net.h>
+#include <i_udp.h>
+#include <i_bin.h>
+#include <i_shm.h>
 #include <parser.h>
 
 static FILE			*Logf = NULL;
@@ -20,23 +37,218 @@ static char			*conf_filename = "/etc/ip2clue/ip2clued.conf";
 static char			*conf_datadir;
 static char			*conf_files;
 static char			*conf_format;
+static const struct ip2clue_fmt	*conf_fmt;	/* compiled conf_format */
 static unsigned int		conf_refresh;
+static unsigned int		conf_reload_delay;
 static unsigned int		conf_port;
 static unsigned int		conf_ipv4;
 static unsigned int		conf_ipv6;
 static unsigned int		conf_debug;
 static unsigned int		conf_nodaemon;
+static unsigned int		conf_mem_hugepages;
+static unsigned int		conf_mem_prefault;
+static unsigned int		conf_mem_lock;
+static char			*conf_loader_sched;
+static unsigned int		conf_loader_nice;
+static char			*conf_loader_cpus;
+static unsigned int		conf_mem_budget;	/* MiB, 0 = no limit */
+static char			*conf_startup_files;
+static unsigned int		conf_threads;	/* 0 = one Conn loop */
+static char			*conf_io_cpus;
+static unsigned int		conf_io_uring;
+static unsigned int		conf_udp;
+static unsigned int		conf_udp_threads;
+static char			*conf_unix_socket;
+static char			*conf_unix_dgram;
+static unsigned int		conf_unix_mode;
+static char			*conf_shm;
+
+/*
+ * The current list, published with RCU: readers take no lock, the loader
+ * swaps the pointer and frees the old list when no reader can see it.
+ */
+static struct ip2clue_list	list_empty;
+static struct ip2clue_list	*list = &list_empty;
+
+/* Loader wake up: inotify on the data dirs, and 'L' command (eventfd) */
+static struct ip2clue_shm_writer	shm;	/* if conf_shm is set */
+
+static int			watch_fd = -1;
+static int			wake_fd = -1;
+static struct ip2clue_split	watch_names;	/* base names of the files */
+
+
+/*
+ * Asks the loader to check the files now
+ */
+static int loader_wake(void)
+{
+	unsigned long long one = 1;
+
+	if (wake_fd == -1) {
+		errno = ENOTSUP;
+		return -1;
+	}
 
-/* This will protect accesses to list 'list' */
-static pthread_rwlock_t		list_rwlock;
+	if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+		return -1;
 
-static struct ip2clue_list	list;
+	return 0;
+}
 
+/*
+ * The list snapshot used by all the lines of one read (see batch_begin)
+ */
+static __thread struct ip2clue_list	*batch_list;
 
-static int data_cb(struct Conn *C, char *line)
+/*
+ * Enters a read section and returns the list to search; NULL if no reader
+ * slot is free. Inside a batch, the read section is only nested.
+ */
+static struct ip2clue_list *list_hold(void)
+{
+	if (ip2clue_rcu_read_lock() != 0)
+		return NULL;
+
+	if (batch_list != NULL)
+		return batch_list;
+
+	return (struct ip2clue_list *) ip2clue_rcu_dereference((void **) &list);
+}
+
+static void list_release(void)
+{
+	ip2clue_rcu_read_unlock();
+}
+
+/*
+ * Called around all the complete lines of one read: one read section and
+ * one snapshot for all of them, however many are pipelined.
+ */
+static void batch_begin(void)
+{
+	batch_list = list_hold();
+}
+
+static void batch_end(void)
+{
+	if (batch_list == NULL)
+		return;
+
+	batch_list = NULL;
+	list_release();
+}
+
+/*
+ * "M<ip1> <ip2> ... <ipN>": one answer line per address, in order, all
+ * from the same list snapshot. The last line has no '\n' (added by answer).
+ * It saves round trips, not lookups: every address is still one binary
+ * search. The sorted merge (ip2clue_list_lookup_sorted) is for batches
+ * much bigger than a line, like the ones of ip2clue_annotate.
+ */
+static void answer_many(struct ip2clue_list *l, const struct ip2clue_fmt *f,
+	char *ips, char *out, const size_t out_size)
+{
+	char *ip, *e;
+	size_t len = 0;
+	int last;
+
+	strcpy(out, "");
+	ip = ips;
+	while (1) {
+		while ((*ip == ' ') || (*ip == '\t'))
+			ip++;
+		if (*ip == '\0')
+			break;
+
+		for (e = ip; (*e != '\0') && (*e != ' ') && (*e != '\t'); e++)
+			;
+		last = *e == '\0';
+		*e = '\0';
+
+		if (len > 0)
+			out[len++] = '\n';
+
+		/* An answer is much shorter than this */
+		if (out_size - len < 1024) {
+			snprintf(out + len, out_size - len,
+				"ER errmsg=\"too many addresses\"");
+			return;
+		}
+
+		if (ip2clue_list_search_fmt(l, out + len, out_size - len,
+			f, ip) < 1)
+			snprintf(out + len, out_size - len,
+				"ER ip=%s errmsg=\"%s\"",
+				ip, ip2clue_strerror());
+		len += strlen(out + len);
+
+		if (last)
+			break;
+		ip = e + 1;
+	}
+
+	if (len == 0)
+		snprintf(out, out_size, "ER errmsg=\"no address\"");
+}
+
+/*
+ * "F<format>" sets the format of the client, "F" alone goes back to the
+ * configured one. The Conn loop keeps no state per client (@fmt is NULL).
+ * The format is compiled for this client only: the I/O thread frees it
+ * with the connection, so clients cannot fill the shared table.
+ */
+static void answer_format(char *format, char *out, const size_t out_size,
+	const struct ip2clue_fmt **fmt)
 {
-	int err, close = 0;
-	char out[2048], *p;
+	const struct ip2clue_fmt *f;
+
+	if (fmt == NULL) {
+		snprintf(out, out_size, "ER errmsg=\"F needs I/O threads\"");
+		return;
+	}
+
+	f = NULL;
+	if (*format != '\0') {
+		f = ip2clue_fmt_new(format);
+		if (f == NULL) {
+			snprintf(out, out_size, "ER errmsg=\"%s\"",
+				ip2clue_strerror());
+			return;
+		}
+	}
+
+	if (*fmt != NULL)
+		ip2clue_fmt_free(*fmt);
+	*fmt = f;
+	strcpy(out, f == NULL ? "OK format reset" : "OK format set");
+}
+
+/*
+ * Answers one command line; used by the Conn loop and by the I/O threads.
+ * Returns the length of the answer ('\n' included).
+ */
+static size_t answer(char *line, char *out, const size_t out_size, int *close,
+	const struct ip2clue_fmt **fmt)
+{
+	int err;
+	char *p;
+	size_t len;
+	struct ip2clue_list *l;
+	const struct ip2clue_fmt *f;
+
+	f = conf_fmt;
+	if ((fmt != NULL) && (*fmt != NULL))
+		f = *fmt;
+
+	l = list_hold();
+	if (l == NULL) {
+		Log(0, "%s!\n", ip2clue_strerror());
+		snprintf(out, out_size, "ER errmsg=\"%s\"\n",
+			ip2clue_strerror());
+		*close = 1;
+		return strlen(out);
+	}
 
 	switch (line[0]) {
 	case 'R':
@@ -46,22 +258,42 @@ static int data_cb(struct Conn *C, char *line)
 		if (p)
 			*p = '\0';
 
-		pthread_rwlock_rdlock(&list_rwlock);
-
-		err = ip2clue_list_search(&list, out, sizeof(out) - 1,
-			conf_format, line);
+		err = ip2clue_list_search_fmt(l, out, out_size - 1, f, line);
 		if (err < 1)
-			snprintf(out, sizeof(out), "ER ip=%s errmsg=\"%s\"",
+			snprintf(out, out_size - 1, "ER ip=%s errmsg=\"%s\"",
 				line, ip2clue_strerror());
+		break;
 
-		pthread_rwlock_unlock(&list_rwlock);
+	case 'M':
+		answer_many(l, f, line + 1, out, out_size - 1);
+		break;
 
+	case 'F':
+		answer_format(line + 1, out, out_size - 1, fmt);
 		break;
 
 	case 'S':
-		pthread_rwlock_rdlock(&list_rwlock);
-		ip2clue_list_stats(out, sizeof(out) - 1, &list);
-		pthread_rwlock_unlock(&list_rwlock);
+		ip2clue_list_stats(out, out_size - 1, l);
+		len = strlen(out);
+		ip2clue_net_peer_stats(out + len, out_size - 1 - len, 0);
+		break;
+
+	case 'J':
+		ip2clue_list_stats_json(out, out_size - 1, l);
+		/* The peers go inside the top object */
+		len = strlen(out);
+		if ((len > 0) && (out[len - 1] == '}')
+			&& (ip2clue_net_peer_stats(out + len - 1,
+				out_size - 1 - len, 1) > 0))
+			strcat(out, "}");
+		break;
+
+	case 'L':
+		if (loader_wake() == 0)
+			strcpy(out, "OK reload started");
+		else
+			snprintf(out, out_size - 1, "ER errmsg=\"%s\"",
+				strerror(errno));
 		break;
 
 	/* This is only for debug
@@ -74,7 +306,7 @@ static int data_cb(struct Conn *C, char *line)
 	case 'q':
 	case 'Q':
 		strcpy(out, "Bye!");
-		close = 1;
+		*close = 1;
 		break;
 
 	default:
@@ -82,24 +314,110 @@ static int data_cb(struct Conn *C, char *line)
 		break;
 	}
 
+	list_release();
+
 	strcat(out, "\n");
 
-	err = Conn_enqueue(C, out, strlen(out));
+	return strlen(out);
+}
+
+/*
+ * Answers one line received by UDP: only lookups, because the source
+ * address is not verified; no "F" either, it would compile a format for
+ * every datagram. The reply
+ * of a datagram, "M" included, is cut at the length of the request
+ * (ip2clue_udp_reply), so a spoofed one is not amplified; not for the
+ * unix datagram socket, where the sender is local.
+ */
+static size_t answer_udp(char *line, char *out, const size_t out_size,
+	int *close, const struct ip2clue_fmt **fmt)
+{
+	if ((line[0] != 'R') && (line[0] != 'M')) {
+		snprintf(out, out_size, "ER errmsg=\"Only R/M over UDP\"\n");
+		return strlen(out);
+	}
+
+	return answer(line, out, out_size, close, fmt);
+}
+
+/*
+ * Answers one binary request; used by the I/O threads
+ */
+static size_t answer_bin(const unsigned char *in, const size_t in_len,
+	size_t *used, unsigned char *out, const size_t out_size, int *close)
+{
+	struct ip2clue_list *l;
+	size_t len;
+
+	l = list_hold();
+	if (l == NULL) {
+		Log(0, "%s!\n", ip2clue_strerror());
+		*used = in_len;
+		*close = 1;
+		return 0;
+	}
+
+	len = ip2clue_bin_answer(l, in, in_len, used, out, out_size, close);
+
+	list_release();
+
+	return len;
+}
+
+/*
+ * Answers of the Conn loop, for all the lines of one read; the Conn loop
+ * runs in one thread only.
+ */
+static char	conn_out[2 * IP2CLUE_NET_ANSWER_MAX];
+static size_t	conn_out_len;
+static int	conn_close;
+
+/*
+ * Sends the collected answers with one enqueue
+ */
+static void conn_flush(struct Conn *C)
+{
+	int err;
+
+	if (conn_out_len == 0)
+		return;
+
+	err = Conn_enqueue(C, conn_out, conn_out_len);
+	conn_out_len = 0;
 	if (err == -1) {
 		Log(0, "Error in enqueue (%s)!\n",
 			Conn_strerror());
-		Conn_close(C);
+		conn_close = 1;
 	}
+}
 
-	if (close == 1)
-		Conn_close(C);
+static int data_cb(struct Conn *C, char *line)
+{
+	/* After 'Q' (or an error) the rest of the lines are ignored */
+	if (conn_close == 1)
+		return 0;
+
+	if (sizeof(conn_out) - conn_out_len < IP2CLUE_NET_ANSWER_MAX)
+		conn_flush(C);
+
+	conn_out_len += answer(line, conn_out + conn_out_len,
+		IP2CLUE_NET_ANSWER_MAX, &conn_close, NULL);
 
 	return 0;
 }
 
 static void data(struct Conn *C)
 {
+	conn_out_len = 0;
+	conn_close = 0;
+
+	batch_begin();
 	Conn_for_every_line(C, data_cb);
+	batch_end();
+
+	conn_flush(C);
+	if (conn_close == 1)
+		Conn_close(C);
 }
 
 
@@ -109,49 +427,580 @@ static void error(struct Conn *C)
 		Conn_getid(C), Conn_strerror());
 }
 
+/*
+ * Logs how the freshly loaded databases were loaded
+ * A db that was just loaded is referenced only by the new list.
+ */
+static void log_load_stats(struct ip2clue_list *l)
+{
+	unsigned int i;
+	struct ip2clue_db *db;
+	struct ip2clue_load_stats *s;
+
+	for (i = 0; i < l->number; i++) {
+		db = l->entries[i];
+		if (__atomic_load_n(&db->usage_count, __ATOMIC_RELAXED) != 1)
+			continue;
+
+		s = &db->load;
+		Log(0, "Loaded [%s] in %llums (cpu %llums):"
+			" io/parse/index/alloc=%llu/%llu/%llu/%llums"
+			", read=%lluB, rows=%llu (%llu/s), rss_peak=+%lldkB\n",
+			db->file, s->total_wall_us / 1000, s->total_cpu_us / 1000,
+			s->wall_us[IP2CLUE_PHASE_IO] / 1000,
+			s->wall_us[IP2CLUE_PHASE_PARSE] / 1000,
+			s->wall_us[IP2CLUE_PHASE_INDEX] / 1000,
+			s->wall_us[IP2CLUE_PHASE_ALLOC] / 1000,
+			s->bytes_read, s->rows, s->rows_per_sec,
+			s->rss_peak_delta_kb);
+	}
+}
+
+/*
+ * Logs the files that failed to load in this refresh; the previous copy,
+ * if any, is still used
+ */
+static void log_failures(struct ip2clue_list *l, const time_t since)
+{
+	unsigned int i;
+	struct ip2clue_failure *f;
+
+	for (i = 0; i < l->failures_no; i++) {
+		f = &l->failures[i];
+		if (f->last < since)
+			continue;
+
+		Log(0, "Cannot load [%s] (%s), failure %u;"
+			" retry in %lds or when the file changes.\n",
+			f->file, f->error, f->count, (long) (f->retry - f->last));
+	}
+}
+
+/*
+ * Publishes a new list; the old one is freed when no reader can see it
+ * anymore: in background or, if @now is 1, before returning
+ */
+static void list_publish(struct ip2clue_list *new, const int now)
+{
+	struct ip2clue_list *old;
+
+	old = (struct ip2clue_list *) ip2clue_rcu_publish((void **) &list, new);
+
+	if (old != &list_empty)
+		ip2clue_reclaim_list(old, now);
+}
+
+/*
+ * Copies the new list in shared memory, for the local clients
+ */
+static void shm_publish(struct ip2clue_list *l)
+{
+	if (conf_shm == NULL)
+		return;
+
+	if (ip2clue_shm_publish(&shm, l) != 0) {
+		Log(0, "Cannot publish in shm (%s)!\n", ip2clue_strerror());
+		return;
+	}
+
+	Log(1, "Published generation %u in shm [%s].\n",
+		shm.generation, conf_shm);
+}
+
+/*
+ * Watches the directories of the configured files for new versions
+ * (written in place or renamed over). Returns -1 if inotify is not usable;
+ * then we poll every 'refresh' seconds, as before.
+ */
+static int watch_init(void)
+{
+	struct ip2clue_split s;
+	char path[1024], *file, *name;
+	unsigned int i, watches = 0;
+	int files;
+
+	watch_names.count = 0;
+	files = ip2clue_split(&s, conf_files, ", ");
+	if (files == -1)
+		return -1;
+
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd == -1) {
+		Log(0, "Cannot init inotify (%s); polling every %us!\n",
+			strerror(errno), conf_refresh);
+		return -1;
+	}
+
+	for (i = 0; i < s.count; i++) {
+		file = strchr(s.fields[i], ':');
+		if (file == NULL)
+			continue;
+		file++;
+
+		snprintf(path, sizeof(path), "%s/%s", conf_datadir, file);
+		name = strrchr(path, '/');
+		*name = '\0';
+		snprintf(watch_names.fields[watch_names.count],
+			sizeof(watch_names.fields[0]), "%s", name + 1);
+		watch_names.count++;
+
+		/* The same dir twice gives the same watch; fine */
+		if (inotify_add_watch(watch_fd, path,
+			IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+			Log(0, "Cannot watch [%s] (%s)!\n",
+				path, strerror(errno));
+			continue;
+		}
+		watches++;
+	}
+
+	if (watches == 0) {
+		Log(0, "Nothing to watch; polling every %us!\n", conf_refresh);
+		close(watch_fd);
+		watch_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads all queued inotify events
+ * Returns 1 if one of them is about a configured file.
+ */
+static int watch_read(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n, off;
+	unsigned int i;
+	int ret = 0;
+
+	while (1) {
+		n = read(watch_fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+
+		for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) (buf + off);
+			if ((ev->mask & IN_Q_OVERFLOW) || (ev->len == 0)) {
+				ret = 1;
+				continue;
+			}
+			for (i = 0; i < watch_names.count; i++)
+				if (strcmp(ev->name, watch_names.fields[i]) == 0)
+					ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Waits until something may have changed: a file event (debounced, a
+ * download usually writes and renames several files), an 'L' command,
+ * or, without inotify, the refresh interval.
+ * Returns -1 if there is nothing to wait for.
+ */
+static int loader_wait(void)
+{
+	struct pollfd pfd[2];
+	unsigned long long counter, start, quiet;
+	int timeout, changed = 0;
+	time_t retry, now;
+
+	retry = ip2clue_list_next_retry(list);
+	if ((watch_fd == -1) && (wake_fd == -1) && (conf_refresh == 0)
+		&& (retry == 0))
+		return -1;
+
+	pfd[0].fd = wake_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = watch_fd;
+	pfd[1].events = POLLIN;
+
+	/* Polling only if we cannot be told about changes */
+	timeout = -1;
+	if ((watch_fd == -1) && (conf_refresh > 0))
+		timeout = conf_refresh * 1000;
+
+	/* A file failed to load: wake up when it can be tried again */
+	if (retry > 0) {
+		now = time(NULL);
+		if (retry <= now)
+			timeout = 0;
+		else if ((timeout == -1) || ((retry - now) * 1000 < timeout))
+			timeout = (retry - now) * 1000;
+	}
+
+	while (changed == 0) {
+		if (poll(pfd, 2, timeout) <= 0)
+			return 0;
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(wake_fd, &counter, sizeof(counter)) > 0)
+				Log(1, "Reload asked by a client.\n");
+			return 0;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			changed = watch_read();
+	}
+
+	/* Debounce: wait until the dir is quiet (but not forever) */
+	start = now_ms();
+	quiet = start;
+	while (now_ms() - start < 20ULL * conf_reload_delay) {
+		if (poll(&pfd[1], 1, conf_reload_delay) <= 0) {
+			if (now_ms() - quiet >= conf_reload_delay)
+				break;
+			continue;
+		}
+		watch_read();
+		quiet = now_ms();
+	}
+	Log(1, "Files changed, reloading...\n");
+
+	return 0;
+}
+
+/*
+ * Parses a CPU list like '0,2-3'
+ */
+static int cpus_parse(cpu_set_t *set, const char *s)
+{
+	unsigned long a, b;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*s != '\0') {
+		a = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+		b = a;
+		s = end;
+		if (*s == '-') {
+			s++;
+			b = strtoul(s, &end, 10);
+			if ((end == s) || (b < a))
+				return -1;
+			s = end;
+		}
+		for (; (a <= b) && (a < CPU_SETSIZE); a++)
+			CPU_SET(a, set);
+
+		while ((*s == ',') || (*s == ' '))
+			s++;
+	}
+
+	return 0;
+}
+
+/*
+ * Keeps the loader from competing with the request serving:
+ * scheduling class, nice level, CPUs. Best effort, only logged.
+ */
+static void loader_sched_setup(void)
+{
+	struct sched_param sp;
+	cpu_set_t set;
+	int policy = -1, ret;
+
+	memset(&sp, 0, sizeof(sp));
+	if (conf_loader_sched != NULL) {
+		if (strcmp(conf_loader_sched, "idle") == 0)
+			policy = SCHED_IDLE;
+		else if (strcmp(conf_loader_sched, "batch") == 0)
+			policy = SCHED_BATCH;
+		else if (strcmp(conf_loader_sched, "normal") == 0)
+			policy = SCHED_OTHER;
+		else
+			Log(0, "Invalid loader_sched [%s]!\n", conf_loader_sched);
+	}
+	if (policy != -1) {
+		ret = pthread_setschedparam(pthread_self(), policy, &sp);
+		if (ret != 0)
+			Log(0, "Cannot set loader scheduling to [%s] (%s)!\n",
+				conf_loader_sched, strerror(ret));
+	}
+
+	/* On Linux, this changes only the calling thread */
+	if ((conf_loader_nice > 0)
+		&& (setpriority(PRIO_PROCESS, 0, conf_loader_nice) != 0))
+		Log(0, "Cannot set loader nice to %u (%s)!\n",
+			conf_loader_nice, strerror(errno));
+
+	if (conf_loader_cpus != NULL) {
+		if (cpus_parse(&set, conf_loader_cpus) != 0) {
+			Log(0, "Invalid loader_cpus [%s]!\n", conf_loader_cpus);
+		} else {
+			ret = pthread_setaffinity_np(pthread_self(),
+				sizeof(set), &set);
+			if (ret != 0)
+				Log(0, "Cannot bind loader to cpus [%s] (%s)!\n",
+					conf_loader_cpus, strerror(ret));
+		}
+	}
+}
+
+/*
+ * Returns how much memory the dbs of a list use
+ */
+static unsigned long long list_mem(const struct ip2clue_list *l)
+{
+	unsigned long long mem = 0;
+	unsigned int i;
+
+	for (i = 0; i < l->number; i++)
+		mem += l->entries[i]->mem;
+
+	return mem;
+}
+
+/*
+ * Loads the changed files and publishes the new list
+ * If the old and new copies do not fit in 'mem_budget', the changed dbs are
+ * loaded one at a time, and the old copy is freed before the next one.
+ * If nothing is served yet (startup), the list is published as soon as the
+ * first db (or all the 'startup_files') are loaded, and then after each db.
+ */
+static void loader_refresh(void)
+{
+	struct ip2clue_list *list2;
+	struct ip2clue_reclaim_stats r;
+	unsigned long long need, used, budget;
+	unsigned int max_loads = 0, pass_max, left = 0, wait = 0;
+	int ret, changes;
+	time_t start;
+	const char *only = NULL;
+
+	start = time(NULL);
+
+	if (list->number == 0) {
+		max_loads = 1;
+		only = conf_startup_files;
+		Log(0, "Nothing served yet: publishing as soon as %s loaded.\n",
+			only ? "the startup files are" : "a db is");
+	}
+
+	if (conf_mem_budget > 0) {
+		budget = (unsigned long long) conf_mem_budget * 1024 * 1024;
+		changes = ip2clue_list_changes(list, conf_datadir, conf_files,
+			&need);
+		ip2clue_reclaim_stats(&r);
+		used = list_mem(list) + r.pending_bytes;
+		if ((changes > 1) && (used + need > budget)) {
+			max_loads = 1;
+			wait = 1;
+			Log(0, "Reload of %d db(s) needs ~%lluMiB more, %lluMiB"
+				" in use, budget %uMiB: loading one at a time.\n",
+				changes, need / 1048576, used / 1048576,
+				conf_mem_budget);
+
+			/* What the previous reloads left must go first */
+			ip2clue_reclaim_wait();
+		}
+	}
+
+	do {
+		/* We are the only writer, so we can look at 'list' freely */
+		list2 = (struct ip2clue_list *) malloc(sizeof(struct ip2clue_list));
+		if (list2 == NULL) {
+			Log(0, "Cannot alloc memory for a new list!\n");
+			return;
+		}
+
+		/* All the startup files go in the first pass */
+		pass_max = only != NULL ? 0 : max_loads;
+
+		ip2clue_list_init(list2);
+		ret = ip2clue_list_refresh_max(list2, list, conf_datadir,
+			conf_files, pass_max, only, &left);
+		if (ret != 0) {
+			Log(0, "Cannot refresh list (%s)!"
+				" Will try again later...\n",
+				ip2clue_strerror());
+			free(list2);
+			return;
+		}
+
+		log_load_stats(list2);
+		log_failures(list2, start);
+		/* Old copy must be gone before we load the next one */
+		list_publish(list2, wait);
+		shm_publish(list2);
+
+		if (left > 0)
+			Log(1, "%u db(s) left to load.\n", left);
+		only = NULL;
+	} while ((max_loads > 0) && (left > 0));
+}
+
 static void *worker_loader(void *arg)
 {
-	int ret;
-	struct ip2clue_list list2;
+	(void) arg;
 
 	Log(0, "Loader worker started...\n");
+	loader_sched_setup();
+	if (watch_init() == 0)
+		Log(0, "Watching data files for changes...\n");
+
 	while (1) {
 		/* Test if we need to reload files */
 
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		loader_refresh();
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		if (loader_wait() != 0)
+			break;
+	}
 
-		ret = ip2clue_list_refresh(&list2, &list, conf_datadir, conf_files);
+	return NULL;
+}
+
+/*
+ * Serves the clients from one Conn loop, in the main thread
+ */
+static int serve_conn(void)
+{
+	struct Conn *C4 = NULL, *C6 = NULL;
+	int ret;
+
+	ret = Conn_init(0);
+	if (ret == -1) {
+		Log(0, "Cannot init Conn (%s)!\n",
+			Conn_strerror());
+		return -1;
+	}
+
+	/* set callbacks */
+	Conn_data_cb = data;
+	Conn_error_cb = error;
+
+	if (conf_ipv4 == 1) {
+		Log(0, "IPv4...\n");
+		C4 = Conn_alloc();
+		if (!C4) {
+			Log(0, "Cannot alloc a Conn v4 structure (%s)!\n",
+				Conn_strerror());
+			return -1;
+		}
+		Conn_set_socket_domain(C4, PF_INET);
+		Conn_set_socket_type(C4, SOCK_STREAM);
+		Conn_set_socket_bind_addr(C4, "0.0.0.0");
+		Conn_set_socket_bind_port(C4, conf_port);
+		ret = Conn_commit(C4);
 		if (ret != 0) {
-			Log(0, "Cannot refresh list (%s)!"
-				" Sleeping and try again later...\n",
-				ip2clue_strerror());
-		} else {
-			pthread_rwlock_wrlock(&list_rwlock);
-			ret = ip2clue_list_replace(&list, &list2);
-			if (ret != 0)
-				Log(0, "Cannot replace list (%s)!\n",
-					ip2clue_strerror());
-			pthread_rwlock_unlock(&list_rwlock);
+			Log(0, "Cannot commit (%s)!\n",
+				Conn_strerror());
+			return -1;
 		}
+	}
 
-		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	if (conf_ipv6 == 1) {
+		Log(0, "IPv6...\n");
+		C6 = Conn_alloc();
+		if (!C6) {
+			Log(0, "Cannot alloc a Conn v6 structure (%s)!\n",
+				Conn_strerror());
+			return -1;
+		}
+		Conn_set_socket_domain(C6, PF_INET6);
+		Conn_set_socket_type(C6, SOCK_STREAM);
+		Conn_set_socket_bind_addr(C6, "::");
+		Conn_set_socket_bind_port(C6, conf_port);
+		ret = Conn_commit(C6);
+		if (ret != 0) {
+			Log(0, "Cannot commit (%s)!\n",
+				Conn_strerror());
+			return -1;
+		}
+	}
 
-		if (conf_refresh == 0)
+	Log(0, "Master starts polling...\n");
+	while (1) {
+		ret = Conn_poll(-1);
+		if (ret == -1) {
+			Log(0, "Error in Conn_poll (%s)!\n",
+				Conn_strerror());
+			break;
+		} else if (ret == 0) {
 			break;
+		}
+	}
+
+	Conn_shutdown();
+
+	return 0;
+}
 
-		sleep(conf_refresh);
+/*
+ * Serves the clients from 'threads' I/O threads, until SIGINT/SIGTERM
+ */
+static int serve_threads(const sigset_t *signals)
+{
+	struct ip2clue_net_conf nc;
+	cpu_set_t cpus;
+	int sig;
+
+	memset(&nc, 0, sizeof(nc));
+	nc.threads = conf_threads;
+	nc.port = conf_port;
+	nc.ipv4 = conf_ipv4;
+	nc.ipv6 = conf_ipv6;
+	nc.uring = conf_io_uring;
+	nc.local_path = conf_unix_socket;
+	nc.local_mode = conf_unix_mode;
+	nc.cb = answer;
+	nc.bin = answer_bin;
+	nc.begin = batch_begin;
+	nc.end = batch_end;
+	if (conf_io_cpus != NULL) {
+		if (cpus_parse(&cpus, conf_io_cpus) != 0)
+			Log(0, "Invalid io_cpus [%s]!\n", conf_io_cpus);
+		else
+			nc.cpus = &cpus;
 	}
 
-	return NULL;
+	if ((nc.uring == 1) && (ip2clue_net_start(&nc) != 0)) {
+		Log(0, "Cannot start io_uring threads (%s); using epoll!\n",
+			ip2clue_strerror());
+		nc.uring = 0;
+	}
+
+	if ((nc.uring == 0) && (ip2clue_net_start(&nc) != 0)) {
+		Log(0, "Cannot start I/O threads (%s)!\n", ip2clue_strerror());
+		return -1;
+	}
+
+	Log(0, "Serving with %u %s threads...\n", conf_threads,
+		nc.uring ? "io_uring" : "epoll");
+	sigwait(signals, &sig);
+	Log(0, "Got signal %d, stopping...\n", sig);
+
+	ip2clue_net_stop();
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	struct Conn *C4 = NULL, *C6 = NULL;
 	int ret;
 	pthread_t workers[1];
 	void *res;
 	struct ip2clue_conf *conf;
+	struct ip2clue_udp_conf uc;
+	sigset_t signals;
 
 	Logf = fopen(log_file, "w");
 	if (!Logf) {
@@ -177,11 +1026,29 @@ int main(int argc, char *argv[])
 	conf_files = ip2clue_conf_get(conf, "files");
 	conf_format = ip2clue_conf_get(conf, "format");
 	conf_refresh = ip2clue_conf_get_ul(conf, "refresh", 10);
+	conf_reload_delay = ip2clue_conf_get_ul(conf, "reload_delay", 10);
 	conf_port = ip2clue_conf_get_ul(conf, "port", 10);
 	conf_ipv4 = ip2clue_conf_get_ul(conf, "ipv4", 10);
 	conf_ipv6 = ip2clue_conf_get_ul(conf, "ipv6", 10);
 	conf_debug = ip2clue_conf_get_ul(conf, "debug", 10);
 	conf_nodaemon = ip2clue_conf_get_ul(conf, "nodaemon", 10);
+	conf_mem_hugepages = ip2clue_conf_get_ul(conf, "mem_hugepages", 10);
+	conf_mem_prefault = ip2clue_conf_get_ul(conf, "mem_prefault", 10);
+	conf_mem_lock = ip2clue_conf_get_ul(conf, "mem_lock", 10);
+	conf_mem_budget = ip2clue_conf_get_ul(conf, "mem_budget", 10);
+	conf_loader_sched = ip2clue_conf_get(conf, "loader_sched");
+	conf_loader_nice = ip2clue_conf_get_ul(conf, "loader_nice", 10);
+	conf_loader_cpus = ip2clue_conf_get(conf, "loader_cpus");
+	conf_startup_files = ip2clue_conf_get(conf, "startup_files");
+	conf_threads = ip2clue_conf_get_ul(conf, "threads", 10);
+	conf_io_cpus = ip2clue_conf_get(conf, "io_cpus");
+	conf_io_uring = ip2clue_conf_get_ul(conf, "io_uring", 10);
+	conf_udp = ip2clue_conf_get_ul(conf, "udp", 10);
+	conf_udp_threads = ip2clue_conf_get_ul(conf, "udp_threads", 10);
+	conf_unix_socket = ip2clue_conf_get(conf, "unix_socket");
+	conf_unix_dgram = ip2clue_conf_get(conf, "unix_dgram");
+	conf_unix_mode = ip2clue_conf_get_ul(conf, "unix_mode", 8);
+	conf_shm = ip2clue_conf_get(conf, "shm");
 
 	if (!conf_datadir || !conf_files) {
 		fprintf(stderr, "ERROR: 'datadir = ' or 'files = '"
@@ -197,100 +1064,144 @@ int main(int argc, char *argv[])
 
 	if (!conf_format)
 		conf_format = "OK ip=%P cs=%s tz=%t isp=%i";
+	conf_fmt = ip2clue_fmt_get(conf_format);
+	if (conf_fmt == NULL) {
+		fprintf(stderr, "ERROR: Invalid format (%s)!\n",
+			ip2clue_strerror());
+		return 1;
+	}
 
 	if (conf_port == 0)
 		conf_port = 9999;
 
+	if (conf_reload_delay == 0)
+		conf_reload_delay = 500;
+
+	/* The owner and its group; "unix_mode = 0666" opens it to all */
+	if ((conf_unix_mode == 0) || (conf_unix_mode > 0777))
+		conf_unix_mode = 0660;
+
+	if (conf_udp_threads == 0)
+		conf_udp_threads = 1;
+
+	/* io_uring runs on the I/O threads; old kernels use what we had */
+	if (conf_io_uring) {
+		if (ip2clue_uring_probe() != 0) {
+			Log(0, "io_uring not usable (%s); using %s!\n",
+				ip2clue_strerror(),
+				conf_threads > 0 ? "epoll threads" : "one Conn loop");
+			conf_io_uring = 0;
+		} else if (conf_threads == 0) {
+			conf_threads = 1;
+		}
+	}
+
+	/* The unix stream socket is served by the I/O threads */
+	if ((conf_unix_socket != NULL) && (conf_threads == 0))
+		conf_threads = 1;
+
+	/* mem_hugepages: 0 = no, 1 = transparent huge pages, 2 = hugetlbfs */
+	ip2clue_mem_set_policy(
+		(conf_mem_hugepages == 1 ? IP2CLUE_MEM_THP : 0)
+		| (conf_mem_hugepages == 2 ? IP2CLUE_MEM_HUGETLB : 0)
+		| (conf_mem_prefault ? IP2CLUE_MEM_PREFAULT : 0)
+		| (conf_mem_lock ? IP2CLUE_MEM_LOCK : 0));
+
 	Log(1, "Parameters: datadir=[%s] files=[%s] format=[%s]"
-		" refresh=%lu port=%u ipv4=%u ipv6=%u"
-		" debug=%u nodaemon=%u",
+		" refresh=%u reload_delay=%ums port=%u ipv4=%u ipv6=%u"
+		" debug=%u nodaemon=%u"
+		" mem_hugepages=%u mem_prefault=%u mem_lock=%u"
+		" mem_budget=%uMiB loader_sched=%s loader_nice=%u"
+		" loader_cpus=%s threads=%u io_cpus=%s io_uring=%u"
+		" udp=%u udp_threads=%u unix_socket=%s unix_dgram=%s"
+		" unix_mode=%04o shm=%s\n",
 		conf_datadir, conf_files, conf_format,
-		conf_refresh, conf_port, conf_ipv4, conf_ipv6,
-		conf_debug, conf_nodaemon);
+		conf_refresh, conf_reload_delay, conf_port, conf_ipv4, conf_ipv6,
+		conf_debug, conf_nodaemon,
+		conf_mem_hugepages, conf_mem_prefault, conf_mem_lock,
+		conf_mem_budget,
+		conf_loader_sched ? conf_loader_sched : "normal",
+		conf_loader_nice,
+		conf_loader_cpus ? conf_loader_cpus : "all",
+		conf_threads, conf_io_cpus ? conf_io_cpus : "all",
+		conf_io_uring, conf_udp, conf_udp_threads,
+		conf_unix_socket ? conf_unix_socket : "none",
+		conf_unix_dgram ? conf_unix_dgram : "none",
+		conf_unix_mode, conf_shm ? conf_shm : "none");
 
 
 	if (conf_nodaemon == 0)
 		daemon(0, 0);
 
 
-	ip2clue_list_init(&list);
+	ip2clue_list_init(&list_empty);
 
+	/*
+	 * With I/O threads, the main thread waits for the signals;
+	 * block them before any thread is started, they inherit the mask.
+	 */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (conf_threads > 0)
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
 	Conn_debug(Logf, conf_debug);
 
-	Log(0, "Starting 'files reload' thread...\n");
-	ret = pthread_create(&workers[0], NULL, worker_loader, NULL);
+	Log(0, "Starting 'reclaim' thread...\n");
+	ret = ip2clue_reclaim_start();
 	if (ret != 0) {
-		Log(0, "Cannot start loader thread (%s)!\n",
-			strerror(errno));
+		Log(0, "Cannot start reclaim thread (%s)!\n",
+			ip2clue_strerror());
 		return 1;
 	}
 
-
-	ret = Conn_init(0);
-	if (ret == -1) {
-		Log(0, "Cannot init Conn (%s)!\n",
-			Conn_strerror());
-		return 1;
+	if ((conf_shm != NULL) && (ip2clue_shm_create(&shm, conf_shm) != 0)) {
+		Log(0, "Cannot create shm (%s); not publishing!\n",
+			ip2clue_strerror());
+		conf_shm = NULL;
 	}
 
-	/* set callbacks */
-	Conn_data_cb = data;
-	Conn_error_cb = error;
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1)
+		Log(0, "Cannot create eventfd (%s); 'L' will not work!\n",
+			strerror(errno));
 
-	if (conf_ipv4 == 1) {
-		Log(0, "IPv4...\n");
-		C4 = Conn_alloc();
-		if (!C4) {
-			Log(0, "Cannot alloc a Conn v4 structure (%s)!\n",
-				Conn_strerror());
-			return 1;
-		}
-		Conn_set_socket_domain(C4, PF_INET);
-		Conn_set_socket_type(C4, SOCK_STREAM);
-		Conn_set_socket_bind_addr(C4, "0.0.0.0");
-		Conn_set_socket_bind_port(C4, conf_port);
-		ret = Conn_commit(C4);
-		if (ret != 0) {
-			Log(0, "Cannot commit (%s)!\n",
-				Conn_strerror());
-			return 1;
-		}
+	Log(0, "Starting 'files reload' thread...\n");
+	ret = pthread_create(&workers[0], NULL, worker_loader, NULL);
+	if (ret != 0) {
+		Log(0, "Cannot start loader thread (%s)!\n",
+			strerror(errno));
+		return 1;
 	}
 
-	if (conf_ipv6 == 1) {
-		Log(0, "IPv6...\n");
-		C6 = Conn_alloc();
-		if (!C6) {
-			Log(0, "Cannot alloc a Conn v6 structure (%s)!\n",
-				Conn_strerror());
-			return 1;
-		}
-		Conn_set_socket_domain(C6, PF_INET6);
-		Conn_set_socket_type(C6, SOCK_STREAM);
-		Conn_set_socket_bind_addr(C6, "::");
-		Conn_set_socket_bind_port(C6, conf_port);
-		ret = Conn_commit(C6);
-		if (ret != 0) {
-			Log(0, "Cannot commit (%s)!\n",
-				Conn_strerror());
+
+	if (conf_udp || (conf_unix_dgram != NULL)) {
+		memset(&uc, 0, sizeof(uc));
+		uc.threads = conf_udp_threads;
+		uc.port = conf_port;
+		uc.ipv4 = conf_udp ? conf_ipv4 : 0;
+		uc.ipv6 = conf_udp ? conf_ipv6 : 0;
+		uc.local_path = conf_unix_dgram;
+		uc.local_mode = conf_unix_mode;
+		uc.cb = answer_udp;
+		uc.begin = batch_begin;
+		uc.end = batch_end;
+		if (ip2clue_udp_start(&uc) != 0) {
+			Log(0, "Cannot start UDP (%s)!\n", ip2clue_strerror());
 			return 1;
 		}
+		Log(0, "Serving UDP with %u thread(s)...\n", conf_udp_threads);
 	}
 
-	Log(0, "Master starts polling...\n");
-	while (1) {
-		ret = Conn_poll(-1);
-		if (ret == -1) {
-			Log(0, "Error in Conn_poll (%s)!\n",
-				Conn_strerror());
-			break;
-		} else if (ret == 0) {
-			break;
-		}
-	}
+	if (conf_threads > 0)
+		ret = serve_threads(&signals);
+	else
+		ret = serve_conn();
+	if (ret != 0)
+		return 1;
 
-	Conn_shutdown();
+	ip2clue_udp_stop();
 
 	ret = pthread_cancel(workers[0]);
 	if (ret != 0) {
@@ -304,7 +1215,11 @@ int main(int argc, char *argv[])
 			strerror(errno));
 	}
 
-	ip2clue_list_destroy(&list);
+	if (conf_shm != NULL)
+		ip2clue_shm_destroy(&shm);
+
+	list_publish(&list_empty, 0);
+	ip2clue_reclaim_stop();
 
 	ip2clue_conf_free(conf);
 
@@ -0,0 +1,259 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: libip2clue - handles over the ip2clue databases
+ * Every handle has its own list of databases, published like the daemon
+ * does it (i_rcu.c): lookups only load a pointer, a reload builds a new list
+ * (reusing the unchanged files), swaps it in and frees the old one when no
+ * lookup can see it anymore. Nothing here writes global state: errors are per
+ * thread (ip2clue_error), the counters are in the databases of the handle.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <i_addr.h>
+#include <i_rcu.h>
+#include <parser.h>
+#include <libip2clue.h>
+
+#if IP2CLUE_RCU_MAX_READERS != IP2CLUE_MAX_THREADS
+#error "IP2CLUE_MAX_THREADS must match the rcu reader slots"
+#endif
+
+struct ip2clue
+{
+	char			*dir;
+	char			*files;
+	struct ip2clue_list	*list;		/* published, see i_rcu.c */
+	pthread_mutex_t		reload_lock;	/* one reload at a time */
+};
+
+/*
+ * Loads the files of a handle, reusing the unchanged ones from @old
+ * Returns the new list or NULL on error.
+ */
+static struct ip2clue_list *ip2clue_handle_load(struct ip2clue *h,
+	struct ip2clue_list *old)
+{
+	struct ip2clue_list *list;
+
+	list = (struct ip2clue_list *) malloc(sizeof(struct ip2clue_list));
+	if (list == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for a list");
+		return NULL;
+	}
+
+	ip2clue_list_init(list);
+	if (ip2clue_list_refresh(list, old, h->dir, h->files) != 0) {
+		free(list);
+		return NULL;
+	}
+
+	return list;
+}
+
+static void ip2clue_handle_free_list(struct ip2clue_list *list)
+{
+	if (list == NULL)
+		return;
+
+	ip2clue_list_destroy(list);
+	free(list);
+}
+
+/*
+ * Opens a handle over @files (same syntax as 'files' in ip2clued.conf:
+ * "maxmind:file1, ip2location:file2") from @dir
+ * All the files must load. Returns NULL on error (see ip2clue_strerror).
+ */
+struct ip2clue *ip2clue_open(const char *dir, const char *files)
+{
+	struct ip2clue *h;
+	struct ip2clue_list *list;
+
+	h = (struct ip2clue *) calloc(1, sizeof(struct ip2clue));
+	if (h == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for a handle");
+		return NULL;
+	}
+
+	h->dir = strdup(dir);
+	h->files = strdup(files);
+	if ((h->dir == NULL) || (h->files == NULL)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory for a handle");
+		goto out_free;
+	}
+
+	list = ip2clue_handle_load(h, NULL);
+	if (list == NULL)
+		goto out_free;
+
+	if (list->failures_no > 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error), "%s",
+			list->failures[0].error);
+		ip2clue_handle_free_list(list);
+		goto out_free;
+	}
+
+	h->list = list;
+	pthread_mutex_init(&h->reload_lock, NULL);
+
+	return h;
+
+	out_free:
+	free(h->dir);
+	free(h->files);
+	free(h);
+	return NULL;
+}
+
+/*
+ * Copies a result out of the tables
+ */
+static void ip2clue_info_fill(struct ip2clue_info *info,
+	const struct ip2clue_result *r)
+{
+	const struct ip2clue_extra *e = r->extra;
+	const unsigned int *a;
+
+	memset(info, 0, sizeof(struct ip2clue_info));
+
+	if (r->v4_or_v6 == IP2CLUE_TYPE_V4) {
+		info->version = 4;
+		info->ip_start[0] = r->ip_start[0];
+		info->ip_end[0] = r->ip_end[0];
+		a = info->ip_start;
+		snprintf(info->start, sizeof(info->start), "%u.%u.%u.%u",
+			a[0] >> 24, (a[0] >> 16) & 0xFF, (a[0] >> 8) & 0xFF,
+			a[0] & 0xFF);
+		a = info->ip_end;
+		snprintf(info->end, sizeof(info->end), "%u.%u.%u.%u",
+			a[0] >> 24, (a[0] >> 16) & 0xFF, (a[0] >> 8) & 0xFF,
+			a[0] & 0xFF);
+	} else {
+		info->version = 6;
+		memcpy(info->ip_start, r->ip_start, sizeof(info->ip_start));
+		memcpy(info->ip_end, r->ip_end, sizeof(info->ip_end));
+		ip2clue_addr_v6(info->start, sizeof(info->start), info->ip_start);
+		ip2clue_addr_v6(info->end, sizeof(info->end), info->ip_end);
+	}
+
+	snprintf(info->country_short, sizeof(info->country_short), "%s",
+		r->country_short);
+
+	if (e == NULL)
+		return;
+
+	info->has_extra = 1;
+	snprintf(info->country_long, sizeof(info->country_long), "%s",
+		e->country_long);
+	snprintf(info->region, sizeof(info->region), "%s", e->region);
+	snprintf(info->city, sizeof(info->city), "%s", e->city);
+	snprintf(info->isp, sizeof(info->isp), "%s", e->isp);
+	info->latitude = e->latitude;
+	info->longitude = e->longitude;
+	snprintf(info->zip, sizeof(info->zip), "%s", e->zip);
+	snprintf(info->domain, sizeof(info->domain), "%s", e->domain);
+	snprintf(info->timezone, sizeof(info->timezone), "%s", e->timezone);
+	snprintf(info->netspeed, sizeof(info->netspeed), "%s", e->netspeed);
+	snprintf(info->idd, sizeof(info->idd), "%s", e->idd);
+	snprintf(info->areacode, sizeof(info->areacode), "%s", e->areacode);
+	snprintf(info->ws_code, sizeof(info->ws_code), "%s", e->ws_code);
+	snprintf(info->ws_name, sizeof(info->ws_name), "%s", e->ws_name);
+}
+
+/*
+ * Searches the textual address @addr (IPv4 or IPv6)
+ * Returns 1 if found (and fills @info), 0 if not found, -1 if @addr is
+ * malformed, -2 if IP2CLUE_MAX_THREADS other threads already do lookups.
+ */
+int ip2clue_lookup(struct ip2clue *h, const char *addr,
+	struct ip2clue_info *info)
+{
+	struct ip2clue_addr a;
+	struct ip2clue_list *list;
+	struct ip2clue_result r;
+	int ret;
+
+	if (ip2clue_addr_parse_strict(&a, addr) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"malformed address");
+		return -1;
+	}
+
+	if (ip2clue_rcu_read_lock() != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"more than %d threads do lookups", IP2CLUE_MAX_THREADS);
+		return -2;
+	}
+
+	list = (struct ip2clue_list *) ip2clue_rcu_dereference((void **) &h->list);
+	ret = ip2clue_list_lookup_addr(list, &a, IP2CLUE_FIELD_ALL, &r);
+	if (ret == 1)
+		ip2clue_info_fill(info, &r);
+
+	ip2clue_rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Loads again the files that changed on disk
+ * The lookups go on meanwhile, on the old tables. A file that cannot be
+ * loaded keeps its old copy; its error is returned, with -1, but the other
+ * files are still switched. Returns 0 if OK.
+ */
+int ip2clue_reload(struct ip2clue *h)
+{
+	struct ip2clue_list *old, *list;
+	int ret = 0;
+
+	pthread_mutex_lock(&h->reload_lock);
+
+	/* Only reloads change it and we hold the lock */
+	old = h->list;
+
+	list = ip2clue_handle_load(h, old);
+	if (list == NULL) {
+		ret = -1;
+		goto out_unlock;
+	}
+
+	if (list->failures_no > 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error), "%s",
+			list->failures[0].error);
+		ret = -1;
+	}
+
+	ip2clue_rcu_publish((void **) &h->list, list);
+	ip2clue_rcu_synchronize();
+	ip2clue_handle_free_list(old);
+
+	out_unlock:
+	pthread_mutex_unlock(&h->reload_lock);
+	return ret;
+}
+
+/*
+ * Frees a handle; no other thread may use it anymore
+ */
+void ip2clue_close(struct ip2clue *h)
+{
+	if (h == NULL)
+		return;
+
+	ip2clue_handle_free_list(h->list);
+	pthread_mutex_destroy(&h->reload_lock);
+	free(h->dir);
+	free(h->files);
+	free(h);
+}
@@ -0,0 +1,101 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: libip2clue - search the ip2clue databases from your program
+ * A handle owns its own copy of the tables. Lookups and reloads can be done
+ * from many threads at the same time; only ip2clue_close must not run while
+ * another thread still uses the handle. A thread that did a lookup holds a
+ * slot until it exits; the slots are shared by all the handles of the
+ * process and there are IP2CLUE_MAX_THREADS of them.
+ */
+
+#ifndef IP2CLUE_LIBIP2CLUE_H
+#define IP2CLUE_LIBIP2CLUE_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The library is built with -fvisibility=hidden; only this API is exported */
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+#define IP2CLUE_API	__attribute__ ((visibility ("default")))
+#else
+#define IP2CLUE_API
+#endif
+
+/* Max number of threads doing lookups at the same time, in the process */
+#define IP2CLUE_MAX_THREADS	256
+
+struct ip2clue;
+
+/* A found address; a copy, it stays valid after a reload */
+struct ip2clue_info
+{
+	unsigned int	version;		/* 4 or 6 */
+	unsigned int	ip_start[4], ip_end[4];	/* host order; v4 uses [0] */
+	char		start[40], end[40];	/* the range, as text */
+	char		country_short[4];
+	int		has_extra;		/* 0 = only the country is known */
+	char		country_long[32];
+	char		region[32];
+	char		city[32];
+	char		isp[64];
+	float		latitude;
+	float		longitude;
+	char		zip[16];
+	char		domain[64];
+	char		timezone[16];
+	char		netspeed[16];
+	char		idd[16];
+	char		areacode[32];
+	char		ws_code[16];
+	char		ws_name[32];
+};
+
+IP2CLUE_API extern struct ip2clue	*ip2clue_open(const char *dir,
+				const char *files);
+/* 1 = found, 0 = not found, -1 = bad address, -2 = too many threads */
+IP2CLUE_API extern int	ip2clue_lookup(struct ip2clue *h, const char *addr,
+				struct ip2clue_info *info);
+IP2CLUE_API extern int	ip2clue_reload(struct ip2clue *h);
+IP2CLUE_API extern void	ip2clue_close(struct ip2clue *h);
+
+/*
+ * Client of a running ip2clued, for one thread. Addresses are pipelined on
+ * a pool of connections and the answers come back to a callback, in the
+ * submit order on each connection. The callback must not submit.
+ * The addresses pending on a connection that fails are answered by the
+ * client itself, with "ER lost errmsg=..." (IP2CLUE_CLIENT_LOST); the
+ * daemon never answers like that.
+ */
+struct ip2clue_client;
+
+#define IP2CLUE_CLIENT_LOST	"ER lost "
+
+typedef void		ip2clue_client_cb(void *tag, const char *answer,
+				void *arg);
+
+IP2CLUE_API extern struct ip2clue_client	*ip2clue_client_open(
+				const char *addr,
+				const unsigned int conns,
+				const unsigned int window,
+				const unsigned int batch,
+				ip2clue_client_cb *cb, void *arg);
+IP2CLUE_API extern int	ip2clue_client_format(struct ip2clue_client *c,
+				const char *format);
+IP2CLUE_API extern int	ip2clue_client_submit(struct ip2clue_client *c,
+				const char *ip, void *tag);
+IP2CLUE_API extern int	ip2clue_client_poll(struct ip2clue_client *c,
+				const int timeout);
+IP2CLUE_API extern int	ip2clue_client_poll_ns(struct ip2clue_client *c,
+				const long long timeout_ns);
+IP2CLUE_API extern int	ip2clue_client_wait(struct ip2clue_client *c);
+IP2CLUE_API extern void	ip2clue_client_close(struct ip2clue_client *c);
+
+/* The reason of the last error in the calling thread */
+IP2CLUE_API extern char	*ip2clue_strerror(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,9 +13,12 @@
 #include <unistd.h>
 
 #include <i_util.h>
+#include <i_mem.h>
+#include <i_reclaim.h>
 #include <parser_core.h>
 #include <parser_text.h>
 #include <parser_ip2location.h>
+#include <parser_mmdb.h>
 
 /*
  * Parse file and store data in @db database
@@ -24,14 +27,28 @@ int ip2clue_parse_file(struct ip2clue_db *db, const char *file_name,
 	const char *format)
 {
 	struct timeval ts, te;
+	struct ip2clue_clock cs, ce;
+	long long rss_start;
 	int err;
 
 	gettimeofday(&ts, NULL);
+	ip2clue_clock_now(&cs);
+	rss_start = ip2clue_rss_peak_start();
+	memset(&db->load, 0, sizeof(db->load));
 
 	db->ts_load = ts.tv_sec;
 	db->ts = 0;
+	db->cells = NULL;
+	memset(&db->cells_mem, 0, sizeof(db->cells_mem));
+	memset(&db->extras_mem, 0, sizeof(db->extras_mem));
+	memset(&db->map, 0, sizeof(db->map));
+	db->priv = NULL;
 	snprintf(db->file, sizeof(db->file), "%s", file_name);
 
+	/* Before parsing: a change during the load will trigger a new one */
+	if (ip2clue_file_id_get(&db->file_id, file_name) != 0)
+		memset(&db->file_id, 0, sizeof(db->file_id));
+
 	err = -1;
 
 	/* webhosting.info */
@@ -50,6 +67,9 @@ int ip2clue_parse_file(struct ip2clue_db *db, const char *file_name,
 	} else if (!strcasecmp(format, "ip2location")) {
 		db->format = IP2CLUE_FORMAT_IP2LOCATION;
 		err = ip2clue_parse_ip2location(db);
+	} else if (!strcasecmp(format, "mmdb")) {
+		db->format = IP2CLUE_FORMAT_MMDB;
+		err = ip2clue_parse_mmdb(db);
 	} else {
 		snprintf(ip2clue_error, sizeof(ip2clue_error),
 			"invalid file format [%s]", format);
@@ -59,15 +79,28 @@ int ip2clue_parse_file(struct ip2clue_db *db, const char *file_name,
 	if (err == -1)
 		return -1;
 
+	/* Fault in (and lock) the tables before anybody searches them */
+	ip2clue_clock_now(&ce);
+	ip2clue_mem_finish(&db->cells_mem);
+	ip2clue_mem_finish(&db->extras_mem);
+	ip2clue_mem_finish(&db->map);
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_ALLOC, &ce);
+
 	gettimeofday(&te, NULL);
 
 	db->elap_load_ms = (te.tv_sec - ts.tv_sec) * 1000 +
 		(te.tv_usec - ts.tv_usec) / 1000;
 
+	ip2clue_clock_now(&ce);
+	db->load.total_wall_us = ce.wall_us - cs.wall_us;
+	db->load.total_cpu_us = ce.cpu_us - cs.cpu_us;
+	if (db->load.total_wall_us > 0)
+		db->load.rows_per_sec = db->load.rows * 1000000ULL
+			/ db->load.total_wall_us;
+	db->load.rss_peak_delta_kb = ip2clue_rss_peak_delta(rss_start);
+
 	db->usage_count = 0;
-	db->lookup_ok = 0;
-	db->lookup_notfound = 0;
-	db->lookup_malformed = 0;
+	memset(db->counters, 0, sizeof(db->counters));
 
 	return 0;
 }
@@ -79,6 +112,10 @@ void ip2clue_list_init(struct ip2clue_list *list)
 {
 	list->number = 0;
 	list->entries = NULL;
+	list->failures_no = 0;
+	list->failures = NULL;
+	list->loading_no = 0;
+	list->loading = NULL;
 }
 
 /*
@@ -88,6 +125,16 @@ void ip2clue_list_destroy(struct ip2clue_list *list)
 {
 	unsigned int i;
 
+	if (list->failures != NULL)
+		free(list->failures);
+	list->failures_no = 0;
+	list->failures = NULL;
+
+	if (list->loading != NULL)
+		free(list->loading);
+	list->loading_no = 0;
+	list->loading = NULL;
+
 	if (list->entries == NULL)
 		return;
 
@@ -99,6 +146,34 @@ void ip2clue_list_destroy(struct ip2clue_list *list)
 	list->entries = NULL;
 }
 
+/*
+ * Shows where the tables of a db live: 'cells=thp+prefault,extras=...'
+ * @quote is put around names and values.
+ */
+static void ip2clue_db_mem(char *out, const size_t out_size,
+	const struct ip2clue_db *db, const char *eq, const char *quote)
+{
+	const struct ip2clue_mem *m[3];
+	static const char *names[3] = {"cells", "extras", "map"};
+	char flags[64];
+	unsigned int i;
+	size_t len = 0;
+
+	m[0] = &db->cells_mem;
+	m[1] = &db->extras_mem;
+	m[2] = &db->map;
+
+	out[0] = '\0';
+	for (i = 0; (i < 3) && (len < out_size); i++) {
+		if (m[i]->p == NULL)
+			continue;
+		ip2clue_mem_flags(flags, sizeof(flags), m[i]->flags);
+		len += snprintf(out + len, out_size - len, "%s%s%s%s%s%s%s%s",
+			len > 0 ? "," : "", quote, names[i], quote, eq,
+			quote, flags, quote);
+	}
+}
+
 /*
  * Output statistics about the databases
  * TODO: Add number of lookups (successful or not) and number of reloads.
@@ -106,16 +181,24 @@ void ip2clue_list_destroy(struct ip2clue_list *list)
 void ip2clue_list_stats(char *out, const size_t out_size, struct ip2clue_list *list)
 {
 	size_t rest, line_size;
-	char line[512];
+	char line[1024], mem[128];
 	struct ip2clue_db *db;
+	struct ip2clue_load_stats *l;
+	struct ip2clue_reclaim_stats r;
+	struct ip2clue_counters sum;
+	struct ip2clue_failure *f;
 	unsigned int i;
 
 	rest = out_size;
 
 	strcpy(out, "");
 
-	line_size = snprintf(line, sizeof(line), "%u database(s)",
-		list->number);
+	ip2clue_reclaim_stats(&r);
+	line_size = snprintf(line, sizeof(line), "%u database(s)"
+		", reclaim: pending=%lluB in %u list(s)"
+		", freed=%lluB in %llu db(s)",
+		list->number, r.pending_bytes, r.pending_lists,
+		r.reclaimed_bytes, r.reclaimed_dbs);
 	if (rest < line_size)
 		return;
 
@@ -124,24 +207,181 @@ void ip2clue_list_stats(char *out, const size_t out_size, struct ip2clue_list *l
 
 	for (i = 0; i < list->number; i++) {
 		db = list->entries[i];
+		l = &db->load;
+		ip2clue_counters_sum(db, &sum);
+		ip2clue_db_mem(mem, sizeof(mem), db, "=", "");
 		line_size = snprintf(line, sizeof(line),
 			"\n"
 			"db %u: format [%s], %s, entries=%llu"
 			", build_ts=%ld, load_ts=%ld, load=%ums"
 			", file=[%s], mem=%lluB"
-			" ok/notfound/malformed=%llu/%llu/%llu",
+			" ok/notfound/malformed=%llu/%llu/%llu"
+			", io/parse/index/alloc=%llu/%llu/%llu/%lluus"
+			" cpu=%llu/%llu/%llu/%lluus"
+			", read=%lluB, rows=%llu (%llu/s), rss_peak=+%lldkB"
+			", placement=[%s]",
 			i, ip2clue_format(db->format),
 			db->v4_or_v6 == 4 ? "ipv4" : "ipv6",
 			db->no_of_cells,
 			db->ts, db->ts_load, db->elap_load_ms,
 			db->file, db->mem,
-			db->lookup_ok, db->lookup_notfound, db->lookup_malformed);
+			sum.ok, sum.notfound, sum.malformed,
+			l->wall_us[IP2CLUE_PHASE_IO],
+			l->wall_us[IP2CLUE_PHASE_PARSE],
+			l->wall_us[IP2CLUE_PHASE_INDEX],
+			l->wall_us[IP2CLUE_PHASE_ALLOC],
+			l->cpu_us[IP2CLUE_PHASE_IO],
+			l->cpu_us[IP2CLUE_PHASE_PARSE],
+			l->cpu_us[IP2CLUE_PHASE_INDEX],
+			l->cpu_us[IP2CLUE_PHASE_ALLOC],
+			l->bytes_read, l->rows, l->rows_per_sec,
+			l->rss_peak_delta_kb, mem);
+		if (rest < line_size)
+			return;
+
+		strcat(out, line);
+		rest -= line_size;
+	}
+
+	for (i = 0; i < list->failures_no; i++) {
+		f = &list->failures[i];
+		line_size = snprintf(line, sizeof(line),
+			"\n"
+			"failed: file=[%s], failures=%u, last_ts=%ld"
+			", retry_ts=%ld, errmsg=\"%s\"",
+			f->file, f->count, f->last, f->retry, f->error);
 		if (rest < line_size)
 			return;
 
 		strcat(out, line);
 		rest -= line_size;
 	}
+
+	for (i = 0; i < list->loading_no; i++) {
+		line_size = snprintf(line, sizeof(line),
+			"\n"
+			"loading: file=[%s], serving=%s",
+			list->loading[i].file,
+			list->loading[i].has_old ? "old copy" : "nothing");
+		if (rest < line_size)
+			return;
+
+		strcat(out, line);
+		rest -= line_size;
+	}
+}
+
+/*
+ * Copies @s in @out escaping it for a JSON string
+ */
+void ip2clue_json_escape(char *out, const size_t out_size, const char *s)
+{
+	size_t i = 0;
+
+	while ((*s != '\0') && (i + 7 < out_size)) {
+		if ((*s == '"') || (*s == '\\')) {
+			out[i++] = '\\';
+			out[i++] = *s;
+		} else if ((unsigned char) *s < 0x20) {
+			i += snprintf(out + i, out_size - i, "\\u%04x",
+				(unsigned char) *s);
+		} else {
+			out[i++] = *s;
+		}
+		s++;
+	}
+	out[i] = '\0';
+}
+
+/*
+ * Same as ip2clue_list_stats, but as one line of JSON, for scripts
+ * If the output does not fit, an error object is returned instead.
+ */
+void ip2clue_list_stats_json(char *out, const size_t out_size,
+	struct ip2clue_list *list)
+{
+	size_t len;
+	char file[256], mem[128], error[512];
+	struct ip2clue_db *db;
+	struct ip2clue_load_stats *l;
+	struct ip2clue_reclaim_stats r;
+	struct ip2clue_counters sum;
+	struct ip2clue_failure *f;
+	unsigned int i, j;
+	static const char *phases[IP2CLUE_PHASE_MAX] =
+		{"io", "parse", "index", "alloc"};
+
+	ip2clue_reclaim_stats(&r);
+	len = snprintf(out, out_size, "{\"reclaim\":{\"pending_bytes\":%llu"
+		",\"pending_lists\":%u,\"reclaimed_bytes\":%llu"
+		",\"reclaimed_dbs\":%llu},\"databases\":[",
+		r.pending_bytes, r.pending_lists,
+		r.reclaimed_bytes, r.reclaimed_dbs);
+
+	for (i = 0; (i < list->number) && (len < out_size); i++) {
+		db = list->entries[i];
+		l = &db->load;
+		ip2clue_counters_sum(db, &sum);
+		ip2clue_json_escape(file, sizeof(file), db->file);
+		ip2clue_db_mem(mem, sizeof(mem), db, ":", "\"");
+		len += snprintf(out + len, out_size - len,
+			"%s{\"id\":%u,\"format\":\"%s\",\"type\":\"%s\""
+			",\"file\":\"%s\",\"entries\":%llu,\"mem\":%llu"
+			",\"build_ts\":%ld,\"load_ts\":%ld,\"load_ms\":%u"
+			",\"placement\":{%s}"
+			",\"lookups\":{\"ok\":%llu,\"notfound\":%llu"
+			",\"malformed\":%llu}"
+			",\"load\":{\"bytes_read\":%llu,\"rows\":%llu"
+			",\"rows_per_sec\":%llu,\"rss_peak_delta_kb\":%lld"
+			",\"wall_us\":%llu,\"cpu_us\":%llu,\"phases\":{",
+			i > 0 ? "," : "", i, ip2clue_format(db->format),
+			db->v4_or_v6 == 4 ? "ipv4" : "ipv6",
+			file, db->no_of_cells, db->mem,
+			db->ts, db->ts_load, db->elap_load_ms, mem,
+			sum.ok, sum.notfound, sum.malformed,
+			l->bytes_read, l->rows, l->rows_per_sec,
+			l->rss_peak_delta_kb, l->total_wall_us, l->total_cpu_us);
+
+		for (j = 0; (j < IP2CLUE_PHASE_MAX) && (len < out_size); j++)
+			len += snprintf(out + len, out_size - len,
+				"%s\"%s\":{\"wall_us\":%llu,\"cpu_us\":%llu}",
+				j > 0 ? "," : "", phases[j],
+				l->wall_us[j], l->cpu_us[j]);
+
+		if (len < out_size)
+			len += snprintf(out + len, out_size - len, "}}}");
+	}
+
+	if (len < out_size)
+		len += snprintf(out + len, out_size - len, "],\"failures\":[");
+
+	for (i = 0; (i < list->failures_no) && (len < out_size); i++) {
+		f = &list->failures[i];
+		ip2clue_json_escape(file, sizeof(file), f->file);
+		ip2clue_json_escape(error, sizeof(error), f->error);
+		len += snprintf(out + len, out_size - len,
+			"%s{\"file\":\"%s\",\"failures\":%u,\"last_ts\":%ld"
+			",\"retry_ts\":%ld,\"error\":\"%s\"}",
+			i > 0 ? "," : "", file, f->count, f->last, f->retry,
+			error);
+	}
+
+	if (len < out_size)
+		len += snprintf(out + len, out_size - len, "],\"loading\":[");
+
+	for (i = 0; (i < list->loading_no) && (len < out_size); i++) {
+		ip2clue_json_escape(file, sizeof(file), list->loading[i].file);
+		len += snprintf(out + len, out_size - len,
+			"%s{\"file\":\"%s\",\"serving_old\":%s}",
+			i > 0 ? "," : "", file,
+			list->loading[i].has_old ? "true" : "false");
+	}
+
+	if (len < out_size)
+		len += snprintf(out + len, out_size - len, "]}");
+
+	if (len >= out_size)
+		snprintf(out, out_size, "{\"error\":\"output too big\"}");
 }
 
 /*
@@ -180,7 +420,8 @@ int ip2clue_list_clone(struct ip2clue_list *dst, struct ip2clue_list *src)
 
 	for (i = 0; i < src->number; i++) {
 		dst->entries[i] = src->entries[i];
-		src->entries[i]->usage_count++;
+		__atomic_add_fetch(&src->entries[i]->usage_count, 1,
+			__ATOMIC_RELAXED);
 	}
 
 	return 0;
@@ -256,21 +497,211 @@ static struct ip2clue_db *ip2clue_db_search(const struct ip2clue_list *l,
 }
 
 /*
- * Refreshes a db list if files changed
+ * Searches a failure record by file name
+ */
+static const struct ip2clue_failure *ip2clue_failure_search(
+	const struct ip2clue_list *l, const char *file)
+{
+	unsigned int i;
+
+	if (l == NULL)
+		return NULL;
+
+	for (i = 0; i < l->failures_no; i++)
+		if (strcmp(l->failures[i].file, file) == 0)
+			return &l->failures[i];
+
+	return NULL;
+}
+
+/*
+ * Records in @l that @path failed to load (reason in ip2clue_error)
+ * @prev is the previous record for the same file, if any.
+ */
+static void ip2clue_failure_add(struct ip2clue_list *l,
+	const struct ip2clue_failure *prev, const char *path, const time_t now)
+{
+	struct ip2clue_failure *f;
+	unsigned int i, delay;
+
+	f = &l->failures[l->failures_no++];
+	memset(f, 0, sizeof(struct ip2clue_failure));
+	snprintf(f->file, sizeof(f->file), "%.*s", (int) sizeof(f->file) - 1,
+		path);
+	snprintf(f->error, sizeof(f->error), "%s", ip2clue_error);
+	f->count = prev != NULL ? prev->count + 1 : 1;
+
+	delay = IP2CLUE_RETRY_MIN;
+	for (i = 1; (i < f->count) && (delay < IP2CLUE_RETRY_MAX); i++)
+		delay *= 2;
+	if (delay > IP2CLUE_RETRY_MAX)
+		delay = IP2CLUE_RETRY_MAX;
+
+	f->last = now;
+	f->retry = now + delay;
+
+	if (ip2clue_file_id_get(&f->file_id, path) != 0)
+		memset(&f->file_id, 0, sizeof(f->file_id));
+}
+
+/*
+ * Returns when the next failed file must be tried again, 0 if none
+ */
+time_t ip2clue_list_next_retry(const struct ip2clue_list *l)
+{
+	time_t next = 0;
+	unsigned int i;
+
+	for (i = 0; i < l->failures_no; i++)
+		if ((next == 0) || (l->failures[i].retry < next))
+			next = l->failures[i].retry;
+
+	return next;
+}
+
+/*
+ * Looks at one entry of the options ('format:file')
+ * Fills @path, @old (the db from @src for the same file, if any) and
+ * @fail (the failure record from @src, if the file failed before).
+ * Returns 1 if the file must be (re)loaded, 0 if @old can be used (if
+ * @old is NULL, the entry is skipped), -1 on error.
+ */
+static int ip2clue_list_entry(const struct ip2clue_list *src,
+	const char *dir, const char *option, char *path, const size_t path_size,
+	struct ip2clue_db **old, const struct ip2clue_failure **fail)
+{
+	struct ip2clue_file_id id;
+	char *file;
+	int err;
+
+	file = strchr(option, ':');
+	if (file == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"invalid option [%s] (no ':')", option);
+		return -1;
+	}
+	file++;
+
+	snprintf(path, path_size, "%s/%s", dir, file);
+
+	/* See if we can find the db in the old list */
+	*old = ip2clue_db_search(src, path);
+
+	/* Failed before: wait for the backoff or for a new version */
+	*fail = ip2clue_failure_search(src, path);
+	if (*fail != NULL) {
+		err = ip2clue_file_id_get(&id, path);
+		if ((time(NULL) < (*fail)->retry) && ((err != 0)
+			|| (memcmp(&id, &(*fail)->file_id, sizeof(id)) == 0)))
+			return 0;
+		return 1;
+	}
+
+	if (*old == NULL)
+		return 1;
+
+	/*
+	 * Changed or replaced? If the file is missing (being replaced,
+	 * probably), we keep the old data.
+	 */
+	err = ip2clue_file_id_get(&id, path);
+	if ((err != 0) || (memcmp(&id, &(*old)->file_id, sizeof(id)) == 0))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Finds what a refresh would load
+ * @bytes receives an estimation of the memory needed: the size of the old
+ * copy of each changed db, or the file size for a new one.
+ * Returns the number of dbs to load, -1 on error.
+ */
+int ip2clue_list_changes(struct ip2clue_list *src, const char *dir,
+	const char *options, unsigned long long *bytes)
+{
+	struct ip2clue_split s;
+	struct ip2clue_db *old;
+	const struct ip2clue_failure *fail;
+	struct ip2clue_file_id id;
+	char path[1024];
+	unsigned int i;
+	int files, ret, changes = 0;
+
+	*bytes = 0;
+
+	files = ip2clue_split(&s, options, ", ");
+	if (files == -1)
+		return -1;
+
+	for (i = 0; i < s.count; i++) {
+		ret = ip2clue_list_entry(src, dir, s.fields[i], path,
+			sizeof(path), &old, &fail);
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			continue;
+
+		changes++;
+		if (old != NULL)
+			*bytes += old->mem;
+		else if (ip2clue_file_id_get(&id, path) == 0)
+			*bytes += id.size;
+	}
+
+	return changes;
+}
+
+/*
+ * Returns 1 if the file of @option ('format:file') is in @files
+ * (a list like 'file1, file2'; 'format:file' is accepted, too)
+ */
+static int ip2clue_list_in(const char *files, const char *option)
+{
+	struct ip2clue_split s;
+	const char *file, *p;
+	unsigned int i;
+
+	file = strchr(option, ':');
+	file = file != NULL ? file + 1 : option;
+
+	if (ip2clue_split(&s, files, ", ") == -1)
+		return 0;
+
+	for (i = 0; i < s.count; i++) {
+		p = strchr(s.fields[i], ':');
+		p = p != NULL ? p + 1 : s.fields[i];
+		if (strcmp(p, file) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Refreshes a db list if files changed, loading at most @max_loads dbs
+ * (0 = no limit) and, if @only is not NULL, only the files listed in it.
+ * The other changed dbs keep the old copy (a new file is left out), are
+ * shown in @dst->loading and counted in @left, if not NULL; refresh again
+ * later.
+ * A file that fails to load does not stop the others: the old copy is kept
+ * (or the file is left out), the failure is recorded in @dst->failures and
+ * the file is tried again later, with backoff.
+ * Returns -1 only for invalid options or no memory.
  * @options can be something like 'maxmind:file1, ip2location:file2'.
  */
-int ip2clue_list_refresh(struct ip2clue_list *dst, struct ip2clue_list *src,
-	const char *dir, const char *options)
+int ip2clue_list_refresh_max(struct ip2clue_list *dst, struct ip2clue_list *src,
+	const char *dir, const char *options, const unsigned int max_loads,
+	const char *only, unsigned int *left)
 {
-	struct ip2clue_db *db;
+	struct ip2clue_db *db, *old;
+	const struct ip2clue_failure *fail;
 	struct ip2clue_split s;
 	int files, err, force_load;
-	unsigned int i;
-	time_t mtime = 0;
-	struct stat S;
-	char *file;
+	unsigned int i, loads = 0, skipped = 0;
 	char path[1024];
 	unsigned int mem;
+	time_t now;
 
 	files = ip2clue_split(&s, options, ", ");
 	if (files == -1)
@@ -279,33 +710,49 @@ int ip2clue_list_refresh(struct ip2clue_list *dst, struct ip2clue_list *src,
 	if (ip2clue_list_alloc(dst, files) != 0)
 		return -1;
 
-	for (i = 0; i < dst->number; i++) {
-		/* find the last change of the file */
-		file = strchr(s.fields[i], ':');
-		if (file == NULL) {
-			snprintf(ip2clue_error, sizeof(ip2clue_error),
-				"invalid option [%s] (no ':')", s.fields[i]);
-			goto out_free_dst; /* Invalid entry */
-		}
-		file++;
-
-		force_load = 1;
-
-		snprintf(path, sizeof(path), "%s/%s", dir, file);
+	mem = files * sizeof(struct ip2clue_failure);
+	dst->failures = (struct ip2clue_failure *) malloc(mem);
+	if (dst->failures == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc %u bytes for failures", mem);
+		goto out_free_dst;
+	}
+	dst->failures_no = 0;
 
-		/* See if we can find the db in the old list */
-		db = ip2clue_db_search(src, path);
-		if (db != NULL) {
-			/* is it still fresh? */
-			err = stat(path, &S);
-			if (err == 0)
-				mtime = S.st_mtime;
+	mem = files * sizeof(struct ip2clue_loading);
+	dst->loading = (struct ip2clue_loading *) malloc(mem);
+	if (dst->loading == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc %u bytes for loading", mem);
+		goto out_free_dst;
+	}
+	dst->loading_no = 0;
+
+	now = time(NULL);
+	dst->number = 0;
+	for (i = 0; i < s.count; i++) {
+		force_load = ip2clue_list_entry(src, dir, s.fields[i], path,
+			sizeof(path), &old, &fail);
+		if (force_load == -1)
+			goto out_free_dst; /* Invalid entry */
 
-			/* file changed? */
-			if (db->ts_load >= mtime)
-				force_load = 0;
+		if ((force_load == 1)
+			&& (((max_loads > 0) && (loads >= max_loads))
+			|| ((only != NULL) && !ip2clue_list_in(only, s.fields[i])))) {
+			/* Only shown in the stats: truncate long paths */
+			snprintf(dst->loading[dst->loading_no].file,
+				sizeof(dst->loading[0].file), "%.*s",
+				(int) sizeof(dst->loading[0].file) - 1, path);
+			dst->loading[dst->loading_no++].has_old = old != NULL;
+			skipped++;
+			force_load = 0;
 		}
 
+		/* Not tried now: the failure stays */
+		if ((force_load == 0) && (fail != NULL))
+			dst->failures[dst->failures_no++] = *fail;
+
+		db = old;
 		if (force_load == 1) {
 			mem = sizeof(struct ip2clue_db);
 			db = (struct ip2clue_db *) malloc(mem);
@@ -319,14 +766,34 @@ int ip2clue_list_refresh(struct ip2clue_list *dst, struct ip2clue_list *src,
 			err = ip2clue_list_load_one(db, dir, s.fields[i]);
 			if (err != 0) {
 				free(db);
-				goto out_free_dst;
+				ip2clue_failure_add(dst, fail, path, now);
+				db = old;
+			} else {
+				loads++;
 			}
 		}
-		db->usage_count++;
 
-		dst->entries[i] = db;
+		if (db == NULL)
+			continue;
+
+		__atomic_add_fetch(&db->usage_count, 1, __ATOMIC_RELAXED);
+
+		dst->entries[dst->number++] = db;
+	}
+
+	if (dst->failures_no == 0) {
+		free(dst->failures);
+		dst->failures = NULL;
 	}
 
+	if (dst->loading_no == 0) {
+		free(dst->loading);
+		dst->loading = NULL;
+	}
+
+	if (left != NULL)
+		*left = skipped;
+
 	return 0;
 
 	out_free_dst:
@@ -335,6 +802,16 @@ int ip2clue_list_refresh(struct ip2clue_list *dst, struct ip2clue_list *src,
 	return -1;
 }
 
+/*
+ * Refreshes a db list if files changed
+ * @options can be something like 'maxmind:file1, ip2location:file2'.
+ */
+int ip2clue_list_refresh(struct ip2clue_list *dst, struct ip2clue_list *src,
+	const char *dir, const char *options)
+{
+	return ip2clue_list_refresh_max(dst, src, dir, options, 0, NULL, NULL);
+}
+
 /*
  * Parse an option string
  * @options can be something like 'maxmind:file1, ip2location:file2'.
@@ -342,5 +819,16 @@ int ip2clue_list_refresh(struct ip2clue_list *dst, struct ip2clue_list *src,
 int ip2clue_list_load(struct ip2clue_list *list, const char *dir,
 	const char *options)
 {
-	return ip2clue_list_refresh(list, NULL, dir, options);
+	if (ip2clue_list_refresh(list, NULL, dir, options) != 0)
+		return -1;
+
+	/* Here, all the files must load */
+	if (list->failures_no > 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error), "%s",
+			list->failures[0].error);
+		ip2clue_list_destroy(list);
+		return -1;
+	}
+
+	return 0;
 }
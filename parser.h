@@ -14,6 +14,10 @@ extern void	ip2clue_list_destroy(struct ip2clue_list *db);
 
 extern void	ip2clue_list_stats(char *out,
 			const size_t out_size, struct ip2clue_list *list);
+extern void	ip2clue_list_stats_json(char *out,
+			const size_t out_size, struct ip2clue_list *list);
+extern void	ip2clue_json_escape(char *out, const size_t out_size,
+			const char *s);
 
 extern int	ip2clue_list_clone(struct ip2clue_list *dst,
 			struct ip2clue_list *src);
@@ -21,6 +25,17 @@ extern int	ip2clue_list_clone(struct ip2clue_list *dst,
 extern int	ip2clue_list_replace(struct ip2clue_list *dst,
 			struct ip2clue_list *src);
 
+extern time_t	ip2clue_list_next_retry(const struct ip2clue_list *l);
+
+extern int	ip2clue_list_changes(struct ip2clue_list *src,
+			const char *dir, const char *options,
+			unsigned long long *bytes);
+
+extern int	ip2clue_list_refresh_max(struct ip2clue_list *dst,
+			struct ip2clue_list *src, const char *dir,
+			const char *options, const unsigned int max_loads,
+			const char *only, unsigned int *left);
+
 extern int	ip2clue_list_refresh(struct ip2clue_list *dst,
 			struct ip2clue_list *src, const char *dir,
 			const char *options);
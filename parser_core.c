@@ -29,6 +29,7 @@ char *ip2clue_format(enum ip2clue_format f)
 	case IP2CLUE_FORMAT_MAXMIND_V6: return "maxmind-v6";
 	case IP2CLUE_FORMAT_SOFTWARE77: return "software77";
 	case IP2CLUE_FORMAT_IP2LOCATION: return "ip2location";
+	case IP2CLUE_FORMAT_MMDB: return "mmdb";
 	default: return "unknown";
 	}
 }
@@ -16,6 +16,7 @@
 
 #include <i_types.h>
 #include <i_util.h>
+#include <i_mem.h>
 #include <parser_ip2location.h>
 
 enum ip2clue_ip2location_item
@@ -55,6 +56,15 @@ static unsigned char ip2clue_ip2location_lut[IP2CLUE_IP2LOCATION_ITEMS][19] =
 	{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,10,15}
 };
 
+/*
+ * A country only db keeps just the long country name in the extras; the
+ * rows share one extra per name, from a table of this size.
+ */
+#define IP2CLUE_IP2LOCATION_SHARED	1024
+
+/* Bytes read by xread* functions, for the load stats (per loading thread) */
+static __thread unsigned long long ip2clue_ip2location_bytes;
+
 /*
  * Returns position for a db_type and for an item
  */
@@ -81,6 +91,8 @@ static int xread8(unsigned char *ret, const int fd, off_t off)
 	}
 
 	n = read(fd, ret, 1);
+	if (n > 0)
+		ip2clue_ip2location_bytes += n;
 	if (n != 1) {
 		snprintf(ip2clue_error, sizeof(ip2clue_error),
 			"cannot read (%s) n=%d at off %lld",
@@ -110,6 +122,8 @@ static int xread32(unsigned int *ret, const int fd, off_t off)
 		return -1;
 
 	n = read(fd, &c, 4);
+	if (n > 0)
+		ip2clue_ip2location_bytes += n;
 	if (n != 4)
 		return -1;
 
@@ -157,6 +171,8 @@ static int xread_float(float *ret, const int fd, off_t off)
 		return -1;
 
 	n = read(fd, ret, 4);
+	if (n > 0)
+		ip2clue_ip2location_bytes += n;
 	if (n != 4)
 		return -1;
 
@@ -169,39 +185,39 @@ static int xread_float(float *ret, const int fd, off_t off)
 }
 
 /*
- * Read a string
+ * Read a string in @out (an empty one if its length is 0)
  */
-static char *xread_str(char *out, const size_t out_len, const int fd,
+static int xread_str(char *out, const size_t out_len, const int fd,
 	const off_t off, unsigned int extra_add)
 {
 	unsigned char len;
-	static char v[128];
 	ssize_t n;
 	unsigned int real_offset;
 
 	/* first, read offset */
 	if (xread32(&real_offset, fd, off) != 0)
-		return NULL;
+		return -1;
 
 	real_offset += extra_add;
 
 	if (xread8(&len, fd, real_offset) != 0)
-		return NULL;
-
-	strcpy(v, "");
+		return -1;
 
+	out[0] = '\0';
 	if (len == 0)
-		return v;
+		return 0;
 
 	if (len > out_len - 1)
 		len = out_len - 1;
 
 	n = read(fd, out, len);
+	if (n > 0)
+		ip2clue_ip2location_bytes += n;
 	if (n != len) {
 		snprintf(ip2clue_error, sizeof(ip2clue_error),
 			"cannot read at offset %lld, len=%d, n=%d (%s)",
 			(long long) off, len, n, strerror(errno));
-		return NULL;
+		return -1;
 	}
 	out[n] = '\0';
 
@@ -229,6 +245,35 @@ void substract(unsigned int *a)
 		}
 }
 
+/*
+ * Returns the shared extra with the same country_long as @x
+ * Returns NULL if the table is full.
+ */
+static struct ip2clue_extra *ip2clue_ip2location_shared(
+	struct ip2clue_extra *extras, unsigned char *used,
+	const struct ip2clue_extra *x)
+{
+	unsigned int h = 2166136261U, i;
+	const char *p;
+
+	for (p = x->country_long; *p != '\0'; p++)
+		h = (h ^ (unsigned char) *p) * 16777619U;
+
+	for (i = 0; i < IP2CLUE_IP2LOCATION_SHARED; i++) {
+		h %= IP2CLUE_IP2LOCATION_SHARED;
+		if (used[h] == 0) {
+			used[h] = 1;
+			memcpy(&extras[h], x, sizeof(struct ip2clue_extra));
+			return &extras[h];
+		}
+		if (strcmp(extras[h].country_long, x->country_long) == 0)
+			return &extras[h];
+		h++;
+	}
+
+	return NULL;
+}
+
 /*
  * IP2country specific file
  */
@@ -246,10 +291,17 @@ int ip2clue_parse_ip2location(struct ip2clue_db *db)
 	unsigned int off, cur, next;
 	char *s;
 	unsigned int add, final, s_len;
-	struct ip2clue_extra *e;
+	struct ip2clue_extra *e, *extras;
+	unsigned long long extras_no;
+	unsigned char used[IP2CLUE_IP2LOCATION_SHARED];
+	int shared;
 	/*char src[60], dst[60];*/
 	struct tm tm;
 	/*char dump[256];*/
+	struct ip2clue_clock start;
+
+	ip2clue_clock_now(&start);
+	ip2clue_ip2location_bytes = 0;
 
 	fd = open(db->file, O_RDONLY);
 	if (fd == -1) {
@@ -303,9 +355,28 @@ int ip2clue_parse_ip2location(struct ip2clue_db *db)
 	} else {
 		db->mem = db->no_of_cells * sizeof(struct ip2clue_cell_v4);
 	}
-	db->cells = malloc(db->mem);
-	if (db->cells == NULL)
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_IO, &start);
+	if (ip2clue_mem_alloc(&db->cells_mem, db->mem) != 0)
 		goto out_close;
+	db->cells = db->cells_mem.p;
+
+	/*
+	 * One arena for all the extras, instead of one malloc per cell. If
+	 * the country is the only column, a small shared table is enough.
+	 */
+	shared = 1;
+	for (i = IP2CLUE_IP2LOCATION_COUNTRY + 1; i < IP2CLUE_IP2LOCATION_ITEMS; i++)
+		if (ip2clue_ip2location_pos(db_type, i) != 0)
+			shared = 0;
+	extras_no = shared ? IP2CLUE_IP2LOCATION_SHARED : db->no_of_cells;
+	memset(used, 0, sizeof(used));
+
+	if (ip2clue_mem_alloc(&db->extras_mem,
+		extras_no * sizeof(struct ip2clue_extra)) != 0)
+		goto out_free_cells;
+	extras = (struct ip2clue_extra *) db->extras_mem.p;
+	db->mem += extras_no * sizeof(struct ip2clue_extra);
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_ALLOC, &start);
 
 	/* parse file */
 	db->current = 0;
@@ -495,13 +566,16 @@ int ip2clue_parse_ip2location(struct ip2clue_db *db)
 			}
 		}
 
-		if (x_set == 1) {
-			e = (struct ip2clue_extra *) malloc(sizeof(struct ip2clue_extra));
+		if ((x_set == 1) && shared) {
+			e = ip2clue_ip2location_shared(extras, used, &x);
 			if (e == NULL) {
 				snprintf(ip2clue_error, sizeof(ip2clue_error),
-					"cannot alloc memory");
+					"more than %u country names",
+					IP2CLUE_IP2LOCATION_SHARED);
 				goto out_parse_error;
 			}
+		} else if (x_set == 1) {
+			e = &extras[db->current];
 			memcpy(e, &x, sizeof(struct ip2clue_extra));
 			/*
 			ip2clue_print_extra(dump, sizeof(dump), e);
@@ -526,11 +600,19 @@ int ip2clue_parse_ip2location(struct ip2clue_db *db)
 
 	close(fd);
 
+	/* Records are read field by field, so the reads are in 'parse' */
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_PARSE, &start);
+	db->load.bytes_read = ip2clue_ip2location_bytes;
+	db->load.rows = db->current;
+
 	return 0;
 
 	out_parse_error:
-	ip2clue_destroy(db);
-	free(db);
+	ip2clue_mem_free(&db->extras_mem);
+
+	out_free_cells:
+	ip2clue_mem_free(&db->cells_mem);
+	db->cells = NULL;
 
 	out_close:
 	close(fd);
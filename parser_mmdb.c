@@ -0,0 +1,718 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: parser for IP files
+ * MaxMind DB (mmdb) stuff: the file is mmap-ed and the search tree is walked
+ * in place. Data records are decoded only for the requested fields.
+ */
+
+#include <i_config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <i_mem.h>
+#include <parser_mmdb.h>
+
+#define MMDB_POINTER	1
+#define MMDB_UTF8	2
+#define MMDB_DOUBLE	3
+#define MMDB_BYTES	4
+#define MMDB_UINT16	5
+#define MMDB_UINT32	6
+#define MMDB_MAP	7
+#define MMDB_INT32	8
+#define MMDB_UINT64	9
+#define MMDB_UINT128	10
+#define MMDB_ARRAY	11
+#define MMDB_BOOLEAN	14
+#define MMDB_FLOAT	15
+
+#define MMDB_MAX_DEPTH	32
+
+static const unsigned char ip2clue_mmdb_marker[] =
+	"\xAB\xCD\xEF" "MaxMind.com";
+
+struct ip2clue_mmdb
+{
+	const unsigned char	*tree;
+	const unsigned char	*data;		/* data section */
+	size_t			data_size;
+	const unsigned char	*meta;		/* metadata section */
+	size_t			meta_size;
+	unsigned int		node_count;
+	unsigned int		record_size;
+	unsigned int		node_bytes;
+	unsigned int		ip_version;
+	unsigned int		ipv4_start;	/* node of ::/96 */
+};
+
+/* A decoded value; payload starts at 'off' in its section */
+struct ip2clue_mmdb_val
+{
+	unsigned int		type;
+	unsigned int		size;
+	size_t			off;
+	unsigned int		via_pointer;
+};
+
+/*
+ * Which data paths map on which fields
+ * Paths that can hold the same field are tried in order.
+ */
+struct ip2clue_mmdb_field
+{
+	unsigned int		field;
+	size_t			off;		/* in struct ip2clue_extra */
+	size_t			size;		/* 0 means float */
+	const char		*path[5];
+};
+
+#define X(m) offsetof(struct ip2clue_extra, m), sizeof(((struct ip2clue_extra *) 0)->m)
+static const struct ip2clue_mmdb_field ip2clue_mmdb_fields[] =
+{
+	{IP2CLUE_FIELD_COUNTRY_LONG, X(country_long), {"country", "names", "en", NULL}},
+	{IP2CLUE_FIELD_COUNTRY_LONG, X(country_long), {"registered_country", "names", "en", NULL}},
+	{IP2CLUE_FIELD_REGION, X(region), {"subdivisions", "0", "names", "en", NULL}},
+	{IP2CLUE_FIELD_CITY, X(city), {"city", "names", "en", NULL}},
+	{IP2CLUE_FIELD_ISP, X(isp), {"isp", NULL}},
+	{IP2CLUE_FIELD_ISP, X(isp), {"autonomous_system_organization", NULL}},
+	{IP2CLUE_FIELD_LATITUDE, offsetof(struct ip2clue_extra, latitude), 0, {"location", "latitude", NULL}},
+	{IP2CLUE_FIELD_LONGITUDE, offsetof(struct ip2clue_extra, longitude), 0, {"location", "longitude", NULL}},
+	{IP2CLUE_FIELD_ZIP, X(zip), {"postal", "code", NULL}},
+	{IP2CLUE_FIELD_DOMAIN, X(domain), {"domain", NULL}},
+	{IP2CLUE_FIELD_TIMEZONE, X(timezone), {"location", "time_zone", NULL}},
+	{IP2CLUE_FIELD_NETSPEED, X(netspeed), {"connection_type", NULL}},
+	{0, 0, 0, {NULL}}
+};
+#undef X
+
+/*
+ * Decodes the control byte(s) at @off
+ * Pointers are followed (only one level, as the spec says).
+ * @next is set after the control bytes of a map/array, else after the value.
+ */
+static int ip2clue_mmdb_decode(const unsigned char *base, const size_t size,
+	size_t off, struct ip2clue_mmdb_val *v, size_t *next, const int follow)
+{
+	unsigned int ctrl, type, len, ss, n;
+	size_t ptr, dummy;
+
+	if (off >= size)
+		return -1;
+
+	ctrl = base[off++];
+	type = ctrl >> 5;
+
+	if (type == MMDB_POINTER) {
+		if (follow == 0)
+			return -1;
+
+		ss = (ctrl >> 3) & 3;
+		if (off + ss + 1 > size)
+			return -1;
+
+		switch (ss) {
+		case 0:
+			ptr = ((ctrl & 7) << 8) | base[off];
+			break;
+		case 1:
+			ptr = (((ctrl & 7) << 16) | (base[off] << 8)
+				| base[off + 1]) + 2048;
+			break;
+		case 2:
+			ptr = (((ctrl & 7) << 24) | (base[off] << 16)
+				| (base[off + 1] << 8) | base[off + 2]) + 526336;
+			break;
+		default:
+			ptr = ((size_t) base[off] << 24) | (base[off + 1] << 16)
+				| (base[off + 2] << 8) | base[off + 3];
+			break;
+		}
+		*next = off + ss + 1;
+
+		if (ip2clue_mmdb_decode(base, size, ptr, v, &dummy, 0) != 0)
+			return -1;
+		v->via_pointer = 1;
+
+		return 0;
+	}
+
+	if (type == 0) {
+		if (off >= size)
+			return -1;
+		type = 7 + base[off++];
+	}
+
+	len = ctrl & 0x1F;
+	if (len >= 29) {
+		n = len - 28;
+		if (off + n > size)
+			return -1;
+		if (n == 1)
+			len = 29 + base[off];
+		else if (n == 2)
+			len = 285 + ((base[off] << 8) | base[off + 1]);
+		else
+			len = 65821 + ((base[off] << 16) | (base[off + 1] << 8)
+				| base[off + 2]);
+		off += n;
+	}
+
+	v->type = type;
+	v->size = len;
+	v->off = off;
+	v->via_pointer = 0;
+
+	switch (type) {
+	case MMDB_MAP:
+	case MMDB_ARRAY:
+	case MMDB_BOOLEAN:
+		*next = off;
+		return 0;
+	case MMDB_DOUBLE:
+		if (len != 8)
+			return -1;
+		break;
+	case MMDB_FLOAT:
+		if (len != 4)
+			return -1;
+		break;
+	}
+
+	if (off + len > size)
+		return -1;
+	*next = off + len;
+
+	return 0;
+}
+
+/*
+ * Skips a full value (maps and arrays included)
+ */
+static int ip2clue_mmdb_skip(const unsigned char *base, const size_t size,
+	size_t off, size_t *next, const unsigned int depth)
+{
+	struct ip2clue_mmdb_val v;
+	unsigned int i;
+
+	if (depth > MMDB_MAX_DEPTH)
+		return -1;
+
+	if (ip2clue_mmdb_decode(base, size, off, &v, next, 1) != 0)
+		return -1;
+
+	if (v.via_pointer == 1)
+		return 0;
+
+	if (v.type == MMDB_MAP) {
+		for (i = 0; i < v.size; i++) {
+			if (ip2clue_mmdb_skip(base, size, *next, next, depth + 1) != 0)
+				return -1;
+			if (ip2clue_mmdb_skip(base, size, *next, next, depth + 1) != 0)
+				return -1;
+		}
+	} else if (v.type == MMDB_ARRAY) {
+		for (i = 0; i < v.size; i++)
+			if (ip2clue_mmdb_skip(base, size, *next, next, depth + 1) != 0)
+				return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Finds the value for @key in the map (or the element in the array) at @off
+ * Returns 1 if found, 0 if not, -1 on error.
+ */
+static int ip2clue_mmdb_child(const unsigned char *base, const size_t size,
+	const size_t off, const char *key, size_t *val_off)
+{
+	struct ip2clue_mmdb_val v, k;
+	size_t next, key_len;
+	unsigned int i, index;
+
+	if (ip2clue_mmdb_decode(base, size, off, &v, &next, 1) != 0)
+		return -1;
+
+	next = v.off;
+
+	if (v.type == MMDB_ARRAY) {
+		index = strtoul(key, NULL, 10);
+		if (index >= v.size)
+			return 0;
+		for (i = 0; i < index; i++)
+			if (ip2clue_mmdb_skip(base, size, next, &next, 1) != 0)
+				return -1;
+		*val_off = next;
+		return 1;
+	}
+
+	if (v.type != MMDB_MAP)
+		return 0;
+
+	key_len = strlen(key);
+	for (i = 0; i < v.size; i++) {
+		if (ip2clue_mmdb_decode(base, size, next, &k, &next, 1) != 0)
+			return -1;
+		if ((k.type == MMDB_UTF8) && (k.size == key_len)
+			&& (memcmp(base + k.off, key, key_len) == 0)) {
+			*val_off = next;
+			return 1;
+		}
+		if (ip2clue_mmdb_skip(base, size, next, &next, 1) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Follows @path starting at @off
+ * Returns 1 if found, 0 if not, -1 on error.
+ */
+static int ip2clue_mmdb_path(const unsigned char *base, const size_t size,
+	size_t off, const char * const *path, struct ip2clue_mmdb_val *v)
+{
+	size_t next;
+	int err;
+
+	for (; *path != NULL; path++) {
+		err = ip2clue_mmdb_child(base, size, off, *path, &off);
+		if (err != 1)
+			return err;
+	}
+
+	if (ip2clue_mmdb_decode(base, size, off, v, &next, 1) != 0)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Returns an unsigned integer value (big endian, up to 16 bytes)
+ * Returns -1 if it does not fit in 64 bits.
+ */
+static int ip2clue_mmdb_uint64(const unsigned char *base,
+	const struct ip2clue_mmdb_val *v, unsigned long long *ret)
+{
+	unsigned long long r = 0;
+	unsigned int i;
+
+	for (i = 0; i < v->size; i++) {
+		if ((r >> 56) != 0)
+			return -1;
+		r = (r << 8) | base[v->off + i];
+	}
+	*ret = r;
+
+	return 0;
+}
+
+/*
+ * Returns an unsigned integer value of at most 8 bytes
+ */
+static unsigned long long ip2clue_mmdb_uint(const unsigned char *base,
+	const struct ip2clue_mmdb_val *v)
+{
+	unsigned long long r = 0;
+
+	ip2clue_mmdb_uint64(base, v, &r);
+
+	return r;
+}
+
+/*
+ * Returns a floating point value (double, float or integers)
+ */
+static float ip2clue_mmdb_float(const unsigned char *base,
+	const struct ip2clue_mmdb_val *v)
+{
+	unsigned long long u;
+	unsigned int u32;
+	double d;
+	float f;
+
+	switch (v->type) {
+	case MMDB_DOUBLE:
+		u = ip2clue_mmdb_uint(base, v);
+		memcpy(&d, &u, sizeof(d));
+		return d;
+	case MMDB_FLOAT:
+		u32 = ip2clue_mmdb_uint(base, v);
+		memcpy(&f, &u32, sizeof(f));
+		return f;
+	case MMDB_UINT16:
+	case MMDB_UINT32:
+	case MMDB_UINT64:
+		return ip2clue_mmdb_uint(base, v);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Copies a string value, truncating it
+ */
+static void ip2clue_mmdb_str(char *out, const size_t out_size,
+	const unsigned char *base, const struct ip2clue_mmdb_val *v)
+{
+	size_t len;
+
+	if (v->type != MMDB_UTF8) {
+		out[0] = '\0';
+		return;
+	}
+
+	len = v->size;
+	if (len > out_size - 1)
+		len = out_size - 1;
+	memcpy(out, base + v->off, len);
+	out[len] = '\0';
+}
+
+/*
+ * Reads a record of a node
+ */
+static unsigned int ip2clue_mmdb_record(const struct ip2clue_mmdb *m,
+	const unsigned int node, const unsigned int bit)
+{
+	const unsigned char *p;
+
+	p = m->tree + (size_t) node * m->node_bytes;
+	switch (m->record_size) {
+	case 24:
+		p += bit * 3;
+		return (p[0] << 16) | (p[1] << 8) | p[2];
+	case 28:
+		if (bit == 0)
+			return ((p[3] & 0xF0) << 20) | (p[0] << 16)
+				| (p[1] << 8) | p[2];
+		return ((p[3] & 0x0F) << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+	default:
+		p += bit * 4;
+		return ((unsigned int) p[0] << 24) | (p[1] << 16)
+			| (p[2] << 8) | p[3];
+	}
+}
+
+/*
+ * Fills @r with the requested @fields from the data record at @off
+ */
+static int ip2clue_mmdb_fill(const struct ip2clue_mmdb *m, const size_t off,
+	const unsigned int fields, struct ip2clue_result *r)
+{
+	static const char *cs_path[] = {"country", "iso_code", NULL};
+	static const char *rcs_path[] = {"registered_country", "iso_code", NULL};
+	const struct ip2clue_mmdb_field *f;
+	struct ip2clue_mmdb_val v;
+	unsigned int done = 0;
+	char *dst;
+	int err;
+
+	strcpy(r->country_short, "ZZ");
+	if (fields & IP2CLUE_FIELD_COUNTRY_SHORT) {
+		err = ip2clue_mmdb_path(m->data, m->data_size, off, cs_path, &v);
+		if (err == 0)
+			err = ip2clue_mmdb_path(m->data, m->data_size, off,
+				rcs_path, &v);
+		if (err == -1)
+			goto out_corrupt;
+		if (err == 1)
+			ip2clue_mmdb_str(r->country_short,
+				sizeof(r->country_short), m->data, &v);
+	}
+
+	if ((fields & IP2CLUE_FIELD_EXTRA) == 0) {
+		r->extra = NULL;
+		return 0;
+	}
+
+	memset(&r->extra_buf, 0, sizeof(struct ip2clue_extra));
+	r->extra = &r->extra_buf;
+
+	for (f = ip2clue_mmdb_fields; f->field != 0; f++) {
+		if (((fields & f->field) == 0) || (done & f->field))
+			continue;
+
+		err = ip2clue_mmdb_path(m->data, m->data_size, off, f->path, &v);
+		if (err == -1)
+			goto out_corrupt;
+		if (err == 0)
+			continue;
+
+		dst = (char *) &r->extra_buf + f->off;
+		if (f->size == 0)
+			*(float *) dst = ip2clue_mmdb_float(m->data, &v);
+		else
+			ip2clue_mmdb_str(dst, f->size, m->data, &v);
+		done |= f->field;
+	}
+
+	return 0;
+
+	out_corrupt:
+	snprintf(ip2clue_error, sizeof(ip2clue_error),
+		"corrupted mmdb data record at %llu",
+		(unsigned long long) off);
+	return -1;
+}
+
+/*
+ * Walks the tree for @ip (host order, v4 in ip[0])
+ * Returns 1 if found, 0 if not, -1 on error.
+ */
+int ip2clue_mmdb_lookup(struct ip2clue_db *db, const enum ip2clue_type type,
+	const unsigned int *ip, const unsigned int fields,
+	struct ip2clue_result *r)
+{
+	const struct ip2clue_mmdb *m = db->priv;
+	unsigned int node, bits, i, bit, mask, words;
+	size_t off;
+
+	if (type == IP2CLUE_TYPE_V4) {
+		bits = 32;
+		node = m->ip_version == 4 ? 0 : m->ipv4_start;
+	} else {
+		if (m->ip_version == 4) {
+			__atomic_add_fetch(&ip2clue_counters(db)->notfound, 1,
+				__ATOMIC_RELAXED);
+			return 0;
+		}
+		bits = 128;
+		node = 0;
+	}
+
+	for (i = 0; (i < bits) && (node < m->node_count); i++) {
+		bit = (ip[i / 32] >> (31 - (i % 32))) & 1;
+		node = ip2clue_mmdb_record(m, node, bit);
+	}
+
+	if (node <= m->node_count) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot find address");
+		__atomic_add_fetch(&ip2clue_counters(db)->notfound,
+			1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	off = node - m->node_count - 16;
+	if (off >= m->data_size) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"corrupted mmdb search tree");
+		return -1;
+	}
+
+	/* i is now the prefix length */
+	r->v4_or_v6 = type;
+	words = type == IP2CLUE_TYPE_V4 ? 1 : 4;
+	for (bit = 0; bit < words; bit++) {
+		if (i >= (bit + 1) * 32)
+			mask = 0xFFFFFFFFU;
+		else if (i <= bit * 32)
+			mask = 0;
+		else
+			mask = 0xFFFFFFFFU << (32 - (i - bit * 32));
+		r->ip_start[bit] = ip[bit] & mask;
+		r->ip_end[bit] = ip[bit] | ~mask;
+	}
+	r->db = db;
+
+	if (ip2clue_mmdb_fill(m, off, fields, r) != 0)
+		return -1;
+
+	__atomic_add_fetch(&ip2clue_counters(db)->ok, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/*
+ * Finds the metadata marker (it is in the last 128KiB)
+ */
+static const unsigned char *ip2clue_mmdb_find_meta(const unsigned char *map,
+	const size_t size)
+{
+	size_t mlen = sizeof(ip2clue_mmdb_marker) - 1;
+	size_t off, stop;
+
+	if (size < mlen)
+		return NULL;
+
+	/* Offsets, not pointers: the scan must not go below 'map' */
+	stop = size > 128 * 1024 ? size - 128 * 1024 : 0;
+	for (off = size - mlen + 1; off-- > stop; )
+		if ((map[off] == 0xAB)
+			&& (memcmp(map + off, ip2clue_mmdb_marker, mlen) == 0))
+			return map + off + mlen;
+
+	return NULL;
+}
+
+/*
+ * Reads an unsigned metadata key
+ */
+static int ip2clue_mmdb_meta_uint(const struct ip2clue_mmdb *m,
+	const char *key, unsigned long long *ret)
+{
+	const char *path[2];
+	struct ip2clue_mmdb_val v;
+
+	path[0] = key;
+	path[1] = NULL;
+	if (ip2clue_mmdb_path(m->meta, m->meta_size, 0, path, &v) != 1)
+		return -1;
+
+	if ((v.type != MMDB_UINT16) && (v.type != MMDB_UINT32)
+		&& (v.type != MMDB_UINT64) && (v.type != MMDB_UINT128))
+		return -1;
+
+	/* A uint128 is accepted only if it fits in 64 bits */
+	return ip2clue_mmdb_uint64(m->meta, &v, ret);
+}
+
+/*
+ * MaxMind DB file
+ */
+int ip2clue_parse_mmdb(struct ip2clue_db *db)
+{
+	int fd;
+	struct stat st;
+	unsigned char *map;
+	const unsigned char *meta;
+	struct ip2clue_mmdb *m;
+	unsigned long long node_count, record_size, ip_version, epoch;
+	size_t tree_size, meta_off;
+	unsigned int i;
+	struct ip2clue_clock start;
+
+	ip2clue_clock_now(&start);
+
+	fd = open(db->file, O_RDONLY);
+	if (fd == -1) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot open [%s] (%s)",
+			db->file, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot stat [%s] (%s)",
+			db->file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"empty file [%s]", db->file);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot mmap [%s] (%s)",
+			db->file, strerror(errno));
+		return -1;
+	}
+
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_IO, &start);
+
+	m = (struct ip2clue_mmdb *) malloc(sizeof(struct ip2clue_mmdb));
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_ALLOC, &start);
+	if (m == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc memory");
+		goto out_unmap;
+	}
+
+	meta = ip2clue_mmdb_find_meta(map, st.st_size);
+	if (meta == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s] is not a MaxMind DB file (no metadata)", db->file);
+		goto out_free;
+	}
+	meta_off = meta - map;
+	m->meta = meta;
+	m->meta_size = st.st_size - meta_off;
+
+	if ((ip2clue_mmdb_meta_uint(m, "node_count", &node_count) != 0)
+		|| (ip2clue_mmdb_meta_uint(m, "record_size", &record_size) != 0)
+		|| (ip2clue_mmdb_meta_uint(m, "ip_version", &ip_version) != 0)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s]: invalid mmdb metadata", db->file);
+		goto out_free;
+	}
+	if (ip2clue_mmdb_meta_uint(m, "build_epoch", &epoch) != 0)
+		epoch = 0;
+
+	if ((record_size != 24) && (record_size != 28) && (record_size != 32)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s]: unsupported record size %llu",
+			db->file, record_size);
+		goto out_free;
+	}
+	if ((ip_version != 4) && (ip_version != 6)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s]: invalid ip version %llu",
+			db->file, ip_version);
+		goto out_free;
+	}
+
+	m->node_count = node_count;
+	m->record_size = record_size;
+	m->node_bytes = record_size * 2 / 8;
+	m->ip_version = ip_version;
+	tree_size = (size_t) node_count * m->node_bytes;
+	if ((node_count == 0) || (node_count > 0xFFFFFFFFULL)
+		|| (tree_size + 16 + sizeof(ip2clue_mmdb_marker) - 1 > meta_off)) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"[%s]: search tree bigger than the file", db->file);
+		goto out_free;
+	}
+	m->tree = map;
+	m->data = map + tree_size + 16;
+	m->data_size = meta_off - (sizeof(ip2clue_mmdb_marker) - 1)
+		- tree_size - 16;
+
+	/* IPv4 addresses live in ::/96 of an IPv6 tree */
+	m->ipv4_start = 0;
+	if (m->ip_version == 6)
+		for (i = 0; (i < 96) && (m->ipv4_start < m->node_count); i++)
+			m->ipv4_start = ip2clue_mmdb_record(m, m->ipv4_start, 0);
+
+	/* The tree is searched in place: checking it is the whole index */
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_INDEX, &start);
+	db->load.bytes_read = m->meta_size;	/* the rest is paged on demand */
+	db->load.rows = node_count;
+
+	ip2clue_mem_map(&db->map, map, st.st_size);
+	db->priv = m;
+	db->cells = NULL;
+	db->no_of_cells = node_count;
+	db->mem = st.st_size;
+	db->ts = epoch;
+	db->v4_or_v6 = ip_version == 4 ? IP2CLUE_TYPE_V4 : IP2CLUE_TYPE_V6;
+
+	return 0;
+
+	out_free:
+	free(m);
+
+	out_unmap:
+	munmap(map, st.st_size);
+
+	return -1;
+}
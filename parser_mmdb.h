@@ -0,0 +1,16 @@
+#ifndef IP2CLUE_PARSER_MMDB_H
+#define IP2CLUE_PARSER_MMDB_H 1
+
+#include <i_config.h>
+
+#include <i_types.h>
+
+extern int		ip2clue_parse_mmdb(struct ip2clue_db *db);
+
+extern int		ip2clue_mmdb_lookup(struct ip2clue_db *db,
+				const enum ip2clue_type type,
+				const unsigned int *ip,
+				const unsigned int fields,
+				struct ip2clue_result *r);
+
+#endif
@@ -8,12 +8,14 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
-#include <arpa/inet.h>
 
 #include <i_types.h>
 #include <i_util.h>
+#include <i_addr.h>
 #include <parser_core.h>
 #include <parser_text.h>
+#include <i_input.h>
+#include <i_mem.h>
 #include <parser_ip2location.h>
 
 static int ip2clue_set_fields(struct ip2clue_fields *f,
@@ -90,30 +92,32 @@ static int ip2clue_add_cell(struct ip2clue_db *db, const struct ip2clue_split *s
 		else
 			strcpy(cell4->country_short, "ZZ");
 	} else if (db->v4_or_v6 == IP2CLUE_TYPE_V6) {
-		struct in6_addr addr;
+		struct ip2clue_addr addr;
 
 		p_cell6 = (struct ip2clue_cell_v6 *) db->cells;
 		cell6 = &p_cell6[db->current];
 
 		cell6->extra = NULL;
 
-		if (inet_pton(AF_INET6, s->fields[f->ip_start], (void *) &addr) != 1) {
+		if ((ip2clue_addr_parse_strict(&addr, s->fields[f->ip_start]) != 0)
+			|| (addr.v4_or_v6 != IP2CLUE_TYPE_V6)) {
 			snprintf(ip2clue_error, sizeof(ip2clue_error),
 				"malformed address [%s]",
 				s->fields[f->ip_start]);
 			return -1;
 		}
 		for (i = 0; i < 4; i++)
-			cell6->ip_start[i] = ntohl(addr.s6_addr32[i]);
+			cell6->ip_start[i] = addr.ip[i];
 
-		if (inet_pton(AF_INET6, s->fields[f->ip_end], (void *) &addr) != 1) {
+		if ((ip2clue_addr_parse_strict(&addr, s->fields[f->ip_end]) != 0)
+			|| (addr.v4_or_v6 != IP2CLUE_TYPE_V6)) {
 			snprintf(ip2clue_error, sizeof(ip2clue_error),
 				"malformed address [%s]",
 				s->fields[f->ip_end]);
 			return -1;
 		}
 		for (i = 0; i < 4; i++)
-			cell6->ip_end[i] = ntohl(addr.s6_addr32[i]);
+			cell6->ip_end[i] = addr.ip[i];
 
 		if (f->country_short > 0)
 			snprintf(cell6->country_short, sizeof(cell6->country_short),
@@ -131,17 +135,49 @@ static int ip2clue_add_cell(struct ip2clue_db *db, const struct ip2clue_split *s
 }
 
 /*
- * Parse a text file
+ * Grows the cells array (we do not know the number of lines in advance
+ * because the input can be compressed)
+ */
+static int ip2clue_grow_cells(struct ip2clue_db *db, const size_t cell_size)
+{
+	unsigned long long cells;
+	void *p;
+	struct ip2clue_clock start;
+
+	ip2clue_clock_now(&start);
+	cells = db->no_of_cells == 0 ? 64 * 1024 : db->no_of_cells * 2;
+	p = realloc(db->cells, cells * cell_size);
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_ALLOC, &start);
+	if (p == NULL) {
+		snprintf(ip2clue_error, sizeof(ip2clue_error),
+			"cannot alloc %llu bytes",
+			cells * (unsigned long long) cell_size);
+		return -1;
+	}
+
+	db->cells = p;
+	db->no_of_cells = cells;
+
+	return 0;
+}
+
+/*
+ * Parse a text file (plain, gzip or zip)
  */
 int ip2clue_parse_text(struct ip2clue_db *db)
 {
 	int err;
-	FILE *f;
+	struct ip2clue_input *in;
 	char line[1024], *r;
 	struct ip2clue_split s;
 	unsigned long line_no, final_lines;
 	struct ip2clue_fields fields;
 	unsigned int pos;
+	size_t cell_size;
+	struct ip2clue_clock start, loop;
+	unsigned long long io_us[2], alloc_us[2];
+
+	ip2clue_clock_now(&start);
 
 	err = ip2clue_set_fields(&fields, db->format);
 	if (err != 0)
@@ -149,41 +185,35 @@ int ip2clue_parse_text(struct ip2clue_db *db)
 
 	db->v4_or_v6 = fields.v4_or_v6;
 
-	/* First, count the number of lines to know how many memory to alloc */
-	db->no_of_cells = ip2clue_file_lines(db->file);
-	if (db->no_of_cells == -1)
-		return -1;
-
-	/* Second, alloc memory for whole data */
 	if (db->v4_or_v6 == IP2CLUE_TYPE_V4)
-		db->mem = db->no_of_cells * sizeof(struct ip2clue_cell_v4);
+		cell_size = sizeof(struct ip2clue_cell_v4);
 	else if (db->v4_or_v6 == IP2CLUE_TYPE_V6)
-		db->mem = db->no_of_cells * sizeof(struct ip2clue_cell_v6);
+		cell_size = sizeof(struct ip2clue_cell_v6);
 	else
 		return -1;
-	db->cells = malloc(db->mem);
-	if (db->cells == NULL) {
-		snprintf(ip2clue_error, sizeof(ip2clue_error),
-			"cannot alloc %llu bytes",
-			db->mem);
+
+	in = ip2clue_input_open(db->file);
+	if (in == NULL)
 		return -1;
-	}
+	in->stats = &db->load;
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_IO, &start);
 
-	f = fopen(db->file, "r");
-	if (f == NULL) {
-		snprintf(ip2clue_error, sizeof(ip2clue_error),
-			"cannot open [%s] (%s)",
-			db->file, strerror(errno));
-		goto out_free_db_cells;
-	}
+	/* What is not I/O or alloc in the loop below is parsing */
+	loop = start;
+	io_us[0] = db->load.wall_us[IP2CLUE_PHASE_IO];
+	io_us[1] = db->load.cpu_us[IP2CLUE_PHASE_IO];
+	alloc_us[0] = db->load.wall_us[IP2CLUE_PHASE_ALLOC];
+	alloc_us[1] = db->load.cpu_us[IP2CLUE_PHASE_ALLOC];
 
-	/* Fourth, do the parsing */
+	/* Parse in one pass, growing the cells array as needed */
+	db->cells = NULL;
+	db->no_of_cells = 0;
 	line_no = 0;
 	final_lines = 0;
 	while (1) {
 		line_no++;
 
-		r = fgets(line, sizeof(line) - 1, f);
+		r = ip2clue_input_gets(in, line, sizeof(line) - 1);
 		if (r == NULL)
 			break;
 
@@ -211,9 +241,8 @@ int ip2clue_parse_text(struct ip2clue_db *db)
 		}
 
 		if (final_lines == db->no_of_cells) {
-			snprintf(ip2clue_error, sizeof(ip2clue_error),
-				"seems that the file changed behind our back");
-			goto out_parse_error;
+			if (ip2clue_grow_cells(db, cell_size) != 0)
+				goto out_parse_error;
 		}
 
 		db->current = final_lines;
@@ -223,18 +252,40 @@ int ip2clue_parse_text(struct ip2clue_db *db)
 
 		final_lines++;
 	}
-	fclose(f);
 
+	/* A read or decompression error also ends the loop */
+	if (in->eof == 0)
+		goto out_parse_error;
+
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_PARSE, &loop);
+	db->load.wall_us[IP2CLUE_PHASE_PARSE] -=
+		(db->load.wall_us[IP2CLUE_PHASE_IO] - io_us[0])
+		+ (db->load.wall_us[IP2CLUE_PHASE_ALLOC] - alloc_us[0]);
+	db->load.cpu_us[IP2CLUE_PHASE_PARSE] -=
+		(db->load.cpu_us[IP2CLUE_PHASE_IO] - io_us[1])
+		+ (db->load.cpu_us[IP2CLUE_PHASE_ALLOC] - alloc_us[1]);
+
+	db->load.bytes_read = in->bytes_in;
+	db->load.rows = final_lines;
+	ip2clue_input_close(in);
+
+	/* Give back the unused tail, move to the final place */
+	ip2clue_clock_now(&start);
 	db->no_of_cells = final_lines;
+	db->mem = final_lines * cell_size;
+	if (final_lines > 0) {
+		ip2clue_mem_adopt(&db->cells_mem, db->cells, db->mem);
+		db->cells = db->cells_mem.p;
+	}
+	ip2clue_phase_end(&db->load, IP2CLUE_PHASE_ALLOC, &start);
 
 	return 0;
 
 	out_parse_error:
-	fclose(f);
-
-	out_free_db_cells:
+	ip2clue_input_close(in);
 	free(db->cells);
 	db->cells = NULL;
+	db->no_of_cells = 0;
 
 	return -1;
 }
@@ -0,0 +1,327 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: differential test of ip2clue_addr_parse against inet_pton
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <i_types.h>
+#include <i_addr.h>
+
+#define RANDOM_CASES	2000000
+
+static unsigned long	tested, valid;
+static char		*page_end;	/* last byte before a PROT_NONE page */
+
+static const char *adversarial[] =
+{
+	"", ".", ":", "::", ":::", "::1", "1::", "1:", ":1", "1::2::3",
+	"0.0.0.0", "255.255.255.255", "256.1.1.1", "1.2.3", "1.2.3.4.5",
+	"01.2.3.4", "1.02.3.4", "0.0.0.00", "1..2.3", "1.2.3.", ".1.2.3.4",
+	"1.2.3.4 ", " 1.2.3.4", "1.2.3.4\n", "999.1.1.1", "1.2.3.1000",
+	"12345::", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6:7:8:9", "1:2:3:4:5:6:7::",
+	"::2:3:4:5:6:7:8", "1:2:3:4:5:6:7:8::", "::ffff:1.2.3.4",
+	"::1.2.3.4", "1:2:3:4:5:6:1.2.3.4", "1:2:3:4:5:6:7:1.2.3.4",
+	"::ffff:01.2.3.4", "::ffff:1.2.3", "::ffff:1.2.3.4.5", "1.2.3.4::",
+	"ffff::1.2.3.4", "2002:c000:0204::1", "fe80::1%eth0", "fe80::1%",
+	"FFFF:ABCD::EF01", "g::1", "1:2:3:4:5:6:7:8g", "::ffff:1.2.3.256",
+	"00000::", "0000::", "1:2:3:4:5:6:7:8:", ":1:2:3:4:5:6:7:8",
+	"1.2.3.4%eth0", "::1.2.3.4:5", "a.b.c.d", "1.2.3.4a", "0x1.2.3.4",
+	"::0.0.0.0", "::255.255.255.255", "1::2:3:4:5:6:7", "1:2::3:4:5:6:7",
+	"1:2:3:4:5:6::7", "::1:2:3:4:5:6:7", "1:2:3:4:5:6:7::", "::1:2::",
+	"00.0.0.0", "0.0.0.0.", "1.2.3.4.", "::1.", "::1.2", "::.1.2.3",
+	NULL
+};
+
+/*
+ * Compares our parser with inet_pton for one string
+ */
+static void diff_one(const char *s)
+{
+	struct ip2clue_addr a;
+	struct in_addr in4;
+	struct in6_addr in6;
+	int r4, r6, ours;
+	unsigned int i, ip[4];
+
+	tested++;
+	r4 = inet_pton(AF_INET, s, &in4) == 1;
+	r6 = inet_pton(AF_INET6, s, &in6) == 1;
+	ours = ip2clue_addr_parse_strict(&a, s) == 0;
+
+	/* inet_pton does not know about zone ids */
+	if (ours && strchr(s, '%'))
+		return;
+
+	if (ours != (r4 || r6)) {
+		printf("ERROR: [%s]: inet_pton says %s, we say %s!\n",
+			s, (r4 || r6) ? "valid" : "invalid",
+			ours ? "valid" : "invalid");
+		abort();
+	}
+
+	if (!ours)
+		return;
+	valid++;
+
+	if (r4) {
+		if ((a.v4_or_v6 != IP2CLUE_TYPE_V4)
+			|| (a.ip[0] != ntohl(in4.s_addr))) {
+			printf("ERROR: [%s]: v4 mismatch %08x/%08x!\n",
+				s, a.ip[0], ntohl(in4.s_addr));
+			abort();
+		}
+		return;
+	}
+
+	for (i = 0; i < 4; i++)
+		ip[i] = ntohl(in6.s6_addr32[i]);
+	if ((a.v4_or_v6 != IP2CLUE_TYPE_V6)
+		|| (memcmp(ip, a.ip, sizeof(ip)) != 0)) {
+		printf("ERROR: [%s]: v6 mismatch %08x:%08x:%08x:%08x!\n",
+			s, a.ip[0], a.ip[1], a.ip[2], a.ip[3]);
+		abort();
+	}
+}
+
+/*
+ * Same, with the string just before an unreadable page: must not crash
+ */
+static void diff_one_page_end(const char *s)
+{
+	size_t len;
+
+	len = strlen(s) + 1;
+	memcpy(page_end - len + 1, s, len);
+	diff_one(page_end - len + 1);
+}
+
+/*
+ * Builds a random, mostly valid, address
+ */
+static void random_addr(char *out, const size_t out_size)
+{
+	unsigned int g[8], i, start, len;
+	char *p;
+
+	switch (random() % 4) {
+	case 0:
+		snprintf(out, out_size, "%ld.%ld.%ld.%ld",
+			random() % 256, random() % 256, random() % 256,
+			random() % 256);
+		return;
+	case 1:
+		/* small numbers too, they make the '::' cases interesting */
+		for (i = 0; i < 8; i++)
+			g[i] = random() % 3 ? random() % 65536 : 0;
+		snprintf(out, out_size, "%x:%x:%x:%x:%x:%x:%x:%x",
+			g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7]);
+		return;
+	case 2:
+		/* compressed */
+		for (i = 0; i < 8; i++)
+			g[i] = random() % 65536;
+		start = random() % 8;
+		len = 1 + random() % (8 - start);
+		p = out;
+		for (i = 0; i < start; i++)
+			p += sprintf(p, "%s%x", i ? ":" : "", g[i]);
+		p += sprintf(p, "::");
+		for (i = start + len; i < 8; i++)
+			p += sprintf(p, "%x%s", g[i], i < 7 ? ":" : "");
+		return;
+	default:
+		/* IPv4 tail */
+		snprintf(out, out_size, "%s%ld.%ld.%ld.%ld",
+			random() % 2 ? "::ffff:" : "::",
+			random() % 256, random() % 256, random() % 256,
+			random() % 256);
+		return;
+	}
+}
+
+/*
+ * Changes, inserts or removes a random char
+ */
+static void mutate(char *s, const size_t size)
+{
+	static const char alphabet[] = "0123456789abcdefABCDEFgx:.% \n";
+	size_t len, pos;
+
+	len = strlen(s);
+	pos = len ? random() % len : 0;
+	switch (random() % 3) {
+	case 0:
+		if (len > 0)
+			s[pos] = alphabet[random() % (sizeof(alphabet) - 1)];
+		break;
+	case 1:
+		if (len + 2 < size) {
+			memmove(s + pos + 1, s + pos, len - pos + 1);
+			s[pos] = alphabet[random() % (sizeof(alphabet) - 1)];
+		}
+		break;
+	default:
+		if (len > 0)
+			memmove(s + pos, s + pos + 1, len - pos);
+		break;
+	}
+}
+
+static const char *corpus_v4[] =
+{
+	"1.2.3.4", "10.20.30.40", "192.168.100.200", "255.255.255.255",
+	"8.8.8.8", "172.16.254.1", "100.64.0.10", "203.0.113.77",
+	NULL
+};
+
+static const char *corpus_v6[] =
+{
+	"2001:db8:85a3::8a2e:370:7334", "::1", "fe80::1ff:fe23:4567:890a",
+	"2001:4860:4860::8888", "::ffff:192.0.2.128", "2a00:1450:4001:81c::200e",
+	"1:2:3:4:5:6:7:8", "2002:c000:204::1",
+	NULL
+};
+
+static long elapsed_us(const struct timeval *ts, const struct timeval *te)
+{
+	return (te->tv_sec - ts->tv_sec) * 1000000 + (te->tv_usec - ts->tv_usec);
+}
+
+/*
+ * Times @n parses of @corpus by inet_pton and by us; the best of 3 runs
+ * each, so a busy machine does not decide the result
+ */
+static void speed(const int af, const char *name, const unsigned int n,
+	const char **corpus)
+{
+	struct ip2clue_addr a;
+	struct in6_addr in6;
+	struct timeval ts, te;
+	unsigned int i, k, run, sink = 0;
+	long t, pton = -1, ours = -1;
+
+	for (k = 0; corpus[k] != NULL; k++)
+		;
+
+	for (run = 0; run < 3; run++) {
+		gettimeofday(&ts, NULL);
+		for (i = 0; i < n; i++)
+			sink += inet_pton(af, corpus[i % k], &in6);
+		gettimeofday(&te, NULL);
+		t = elapsed_us(&ts, &te);
+		if ((pton == -1) || (t < pton))
+			pton = t;
+
+		gettimeofday(&ts, NULL);
+		for (i = 0; i < n; i++)
+			sink += ip2clue_addr_parse(&a, corpus[i % k]) != NULL;
+		gettimeofday(&te, NULL);
+		t = elapsed_us(&ts, &te);
+		if ((ours == -1) || (t < ours))
+			ours = t;
+	}
+
+	printf("%u %s parses: inet_pton %ldus, ip2clue_addr_parse %ldus.\n",
+		n, name, pton, ours);
+	if (sink != 6 * n) {
+		printf("ERROR: %s corpus does not parse!\n", name);
+		abort();
+	}
+#if defined(__OPTIMIZE__) && !defined(__SANITIZE_ADDRESS__)
+	/* Unoptimized or instrumented, we cannot be compared with the libc */
+	if (ours >= pton) {
+		printf("ERROR: %s parser is not faster than inet_pton!\n", name);
+		abort();
+	}
+#endif
+}
+
+int main(void)
+{
+	unsigned int i, j;
+	char s[128], *p;
+	struct ip2clue_addr a;
+	const char *e;
+
+	setlinebuf(stdout);
+	srandom(1);
+
+	p = mmap(NULL, 2 * 4096, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((p == MAP_FAILED) || (mprotect(p + 4096, 4096, PROT_NONE) != 0)) {
+		printf("Cannot prepare the guard page!\n");
+		return 1;
+	}
+	page_end = p + 4095;
+
+	for (i = 0; adversarial[i] != NULL; i++) {
+		diff_one(adversarial[i]);
+		diff_one_page_end(adversarial[i]);
+	}
+
+	for (i = 0; i < RANDOM_CASES; i++) {
+		random_addr(s, sizeof(s));
+		diff_one(s);
+		for (j = random() % 3; j > 0; j--)
+			mutate(s, sizeof(s));
+		diff_one(s);
+		if (i % 16 == 0)
+			diff_one_page_end(s);
+	}
+
+	printf("%lu strings compared with inet_pton, %lu valid.\n",
+		tested, valid);
+
+	/* lenient parsing and classes */
+	e = ip2clue_addr_parse(&a, "fe80::1%eth0 rest");
+	if ((e == NULL) || (strcmp(e, " rest") != 0) || (a.ip[3] != 1)) {
+		printf("ERROR: zone id!\n");
+		abort();
+	}
+	e = ip2clue_addr_parse(&a, "1.2.3.4 x");
+	if ((e == NULL) || (*e != ' ') || (a.addr_class != IP2CLUE_ADDR_V4)) {
+		printf("ERROR: trailing data!\n");
+		abort();
+	}
+	if ((ip2clue_addr_parse_strict(&a, "::ffff:10.1.2.3") != 0)
+		|| (a.addr_class != IP2CLUE_ADDR_V4_MAPPED)
+		|| (a.v4 != 0x0A010203)) {
+		printf("ERROR: v4 mapped!\n");
+		abort();
+	}
+	if ((ip2clue_addr_parse_strict(&a, "::10.1.2.3") != 0)
+		|| (a.addr_class != IP2CLUE_ADDR_V4_COMPAT)
+		|| (a.v4 != 0x0A010203)) {
+		printf("ERROR: v4 compatible!\n");
+		abort();
+	}
+	if ((ip2clue_addr_parse_strict(&a, "2002:0a01:0203::1") != 0)
+		|| (a.addr_class != IP2CLUE_ADDR_6TO4)
+		|| (a.v4 != 0x0A010203)) {
+		printf("ERROR: 6to4!\n");
+		abort();
+	}
+	if ((ip2clue_addr_parse_strict(&a, "::1") != 0)
+		|| (a.addr_class != IP2CLUE_ADDR_V6)) {
+		printf("ERROR: ::1 is not v4 compatible!\n");
+		abort();
+	}
+
+	/* speed: must beat inet_pton on the same corpus */
+	speed(AF_INET, "v4", 4000000, corpus_v4);
+	speed(AF_INET6, "v6", 1000000, corpus_v6);
+
+	printf("All addr tests passed.\n");
+
+	return 0;
+}
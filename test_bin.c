@@ -0,0 +1,173 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: checks the binary protocol against a small MaxMind CSV db
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <i_bin.h>
+#include <parser.h>
+#include <test_util.h>
+
+/*
+ * One request, byte by byte: nothing is answered until it is complete
+ */
+static void test_partial(struct ip2clue_list *l)
+{
+	static unsigned char out[IP2CLUE_BIN_OUT_MAX];
+	unsigned char req[64];
+	unsigned int ip = 0x01020304;
+	size_t used, len;
+	int req_len, close = 0, i;
+
+	req_len = ip2clue_bin_request(req, sizeof(req), 7, 0,
+		IP2CLUE_TYPE_V4, &ip, 1);
+	for (i = 0; i < req_len - 1; i++) {
+		ip2clue_bin_answer(l, req, i, &used, out, sizeof(out), &close);
+		if (used != 0)
+			break;
+	}
+	expect(i == req_len - 1, "partial request waits for more bytes");
+
+	len = ip2clue_bin_answer(l, req, req_len, &used, out, sizeof(out),
+		&close);
+	expect((used == (size_t) req_len) && (len > 0) && (close == 0),
+		"complete request is answered");
+}
+
+/*
+ * Requests the stream cannot recover from, or that are too big
+ */
+static void test_errors(struct ip2clue_list *l)
+{
+	static unsigned char out[IP2CLUE_BIN_OUT_MAX];
+	struct ip2clue_bin_header h;
+	unsigned char req[8 + 255 * 4];
+	size_t used, len;
+	int close = 0;
+
+	memset(req, 0, sizeof(req));
+	req[6] = 1;
+	req[7] = 5;
+	len = ip2clue_bin_answer(l, req, 12, &used, out, sizeof(out), &close);
+	ip2clue_bin_header(out, len, &h);
+	expect((close == 1) && (used == 12) && (h.status == IP2CLUE_BIN_EINVAL),
+		"bad family closes the connection");
+
+	close = 0;
+	req[6] = 255;
+	req[7] = IP2CLUE_TYPE_V4;
+	len = ip2clue_bin_answer(l, req, sizeof(req), &used, out, sizeof(out),
+		&close);
+	ip2clue_bin_header(out, len, &h);
+	expect((close == 0) && (used == sizeof(req))
+		&& (h.status == IP2CLUE_BIN_EINVAL) && (h.count == 0),
+		"too many addresses are refused, stream goes on");
+}
+
+int main(void)
+{
+	static unsigned char out[IP2CLUE_BIN_OUT_MAX];
+	struct ip2clue_list list;
+	struct ip2clue_bin_header h;
+	struct ip2clue_result r;
+	char dir[] = "/tmp/ip2clue_bin_XXXXXX";
+	char path[128];
+	unsigned char req[256];
+	unsigned int v4[3], v6[2 * 4];
+	unsigned int fields;
+	size_t used, len, off;
+	int req_len, close = 0, found, n;
+
+	setlinebuf(stdout);
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Cannot create temp dir!\n");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/t.csv", dir);
+	write_csv(path, "RO");
+
+	ip2clue_list_init(&list);
+	if (ip2clue_list_load(&list, dir, "maxmind:t.csv") != 0) {
+		printf("Cannot load list (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	/*
+	 * v4 batch: found, found, not found
+	 * Text dbs have no extra: the asked strings are empty, lat/lon 0.
+	 */
+	v4[0] = 0x01020304;
+	v4[1] = 0x0A0B0C0D;
+	v4[2] = 0x0B000001;
+	fields = IP2CLUE_FIELD_COUNTRY_LONG | IP2CLUE_FIELD_LATITUDE;
+	req_len = ip2clue_bin_request(req, sizeof(req), 0x01020304, fields,
+		IP2CLUE_TYPE_V4, v4, 3);
+	expect(req_len == 8 + 3 * 4, "v4 request size");
+
+	len = ip2clue_bin_answer(&list, req, req_len, &used, out, sizeof(out),
+		&close);
+	expect((used == (size_t) req_len) && (close == 0), "v4 request used");
+	expect(ip2clue_bin_header(out, len, &h) == (int) len,
+		"response length");
+	expect((h.id == 0x01020304) && (h.fields == fields) && (h.count == 3)
+		&& (h.status == IP2CLUE_BIN_OK), "response header");
+
+	off = IP2CLUE_BIN_RESP_HEADER;
+	n = ip2clue_bin_record(out + off, len - off, h.fields, &found, &r);
+	expect((n > 0) && found && (r.v4_or_v6 == IP2CLUE_TYPE_V4)
+		&& (memcmp(r.country_short, "RO", 2) == 0)
+		&& (r.ip_start[0] == 0x01020300) && (r.ip_end[0] == 0x010203FF)
+		&& (r.extra->country_long[0] == '\0')
+		&& (r.extra->latitude == 0),
+		"first record: RO, 1.2.3.0-1.2.3.255, no extra");
+	off += n;
+
+	n = ip2clue_bin_record(out + off, len - off, h.fields, &found, &r);
+	expect((n > 0) && found && (memcmp(r.country_short, "US", 2) == 0),
+		"second record: US");
+	off += n;
+
+	n = ip2clue_bin_record(out + off, len - off, h.fields, &found, &r);
+	expect((n == 2) && !found, "third record: not found");
+	off += n;
+	expect(off == len, "no bytes left");
+
+	/* v6 batch: v4 mapped falls back to the v4 db, plain v6 not found */
+	memset(v6, 0, sizeof(v6));
+	v6[2] = 0xFFFF;
+	v6[3] = 0x01020304;
+	v6[4] = 0x20010DB8;
+	req_len = ip2clue_bin_request(req, sizeof(req), 9, 0,
+		IP2CLUE_TYPE_V6, v6, 2);
+	len = ip2clue_bin_answer(&list, req, req_len, &used, out, sizeof(out),
+		&close);
+	ip2clue_bin_header(out, len, &h);
+	off = IP2CLUE_BIN_RESP_HEADER;
+	n = ip2clue_bin_record(out + off, len - off, h.fields, &found, &r);
+	expect((n > 0) && found && (r.v4_or_v6 == IP2CLUE_TYPE_V4)
+		&& (memcmp(r.country_short, "RO", 2) == 0),
+		"::ffff:1.2.3.4 -> RO");
+	off += n;
+	n = ip2clue_bin_record(out + off, len - off, h.fields, &found, &r);
+	expect((n == 2) && !found, "2001:db8:: not found");
+
+	test_partial(&list);
+	test_errors(&list);
+
+	ip2clue_list_destroy(&list);
+	unlink(path);
+	rmdir(dir);
+
+	printf("All bin tests passed.\n");
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: pipelines addresses to a fake daemon with the client pool
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libip2clue.h>
+#include <test_util.h>
+
+#define ADDRS	5000
+
+static int		answered[ADDRS], bad, order_bad, errors, lost;
+static unsigned long	last;
+static int		drop_after;	/* the server closes after N lines */
+static char		format[64];
+
+/*
+ * Answers like the daemon: one line per address, in order
+ */
+static void *serve(void *arg)
+{
+	int fd = (int) (long) arg;
+	FILE *f;
+	char line[16384], out[20000], *ip;
+	size_t len;
+	int lines = 0;
+
+	f = fdopen(fd, "r");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if ((drop_after > 0) && (++lines > drop_after))
+			break;
+
+		len = 0;
+		if (line[0] == 'F') {
+			snprintf(format, sizeof(format), "%.63s", line + 1);
+			len = snprintf(out, sizeof(out), "OK format set\n");
+		} else {
+			for (ip = strtok(line + 1, " "); ip != NULL;
+				ip = strtok(NULL, " "))
+				len += snprintf(out + len, sizeof(out) - len,
+					"OK ip=%s\n", ip);
+		}
+
+		if (send(fd, out, len, MSG_NOSIGNAL) != (ssize_t) len)
+			break;
+	}
+	fclose(f);
+
+	return NULL;
+}
+
+static void *server(void *arg)
+{
+	int lfd = (int) (long) arg, fd;
+	pthread_t t;
+
+	while ((fd = accept(lfd, NULL, NULL)) != -1) {
+		pthread_create(&t, NULL, serve, (void *) (long) fd);
+		pthread_detach(t);
+	}
+
+	return NULL;
+}
+
+static void cb(void *tag, const char *answer, void *arg)
+{
+	unsigned long i = (unsigned long) tag;
+	char want[64];
+
+	(void) arg;
+
+	if (strncmp(answer, "ER", 2) == 0) {
+		if (strncmp(answer, IP2CLUE_CLIENT_LOST,
+			strlen(IP2CLUE_CLIENT_LOST)) == 0)
+			lost++;
+		errors++;
+		return;
+	}
+
+	snprintf(want, sizeof(want), "OK ip=10.0.%lu.%lu", i / 256, i % 256);
+	if ((i >= ADDRS) || (strcmp(answer, want) != 0))
+		bad++;
+	else
+		answered[i]++;
+
+	if ((i > 0) && (i != last + 1))
+		order_bad++;
+	last = i;
+}
+
+/*
+ * Sends all the addresses; returns how many were answered once
+ */
+static int run(struct ip2clue_client *c)
+{
+	unsigned long i;
+	char ip[32];
+	int once = 0;
+
+	memset(answered, 0, sizeof(answered));
+	bad = order_bad = errors = lost = 0;
+	last = 0;
+
+	for (i = 0; i < ADDRS; i++) {
+		snprintf(ip, sizeof(ip), "10.0.%lu.%lu", i / 256, i % 256);
+		if (ip2clue_client_submit(c, ip, (void *) i) != 0)
+			errors++;
+	}
+	if (ip2clue_client_wait(c) != 0)
+		errors++;
+
+	for (i = 0; i < ADDRS; i++)
+		if (answered[i] == 1)
+			once++;
+
+	return once;
+}
+
+int main(void)
+{
+	struct ip2clue_client *c;
+	struct sockaddr_in sa;
+	socklen_t sa_len = sizeof(sa);
+	pthread_t t;
+	char addr[64];
+	int lfd, on = 1;
+
+	setlinebuf(stdout);
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) != 0)
+		|| (listen(lfd, 16) != 0)
+		|| (getsockname(lfd, (struct sockaddr *) &sa, &sa_len) != 0)) {
+		printf("Cannot listen!\n");
+		return 1;
+	}
+	pthread_create(&t, NULL, server, (void *) (long) lfd);
+	snprintf(addr, sizeof(addr), "127.0.0.1:%u", ntohs(sa.sin_port));
+
+	expect(ip2clue_client_open(addr, 1, 10, 61, cb, NULL) == NULL,
+		"batch too big");
+	expect(ip2clue_client_open("127.0.0.1", 1, 10, 1, cb, NULL) == NULL,
+		"no port");
+
+	c = ip2clue_client_open(addr, 1, 100, 8, cb, NULL);
+	expect(c != NULL, "open one connection");
+	expect((run(c) == ADDRS) && (bad == 0) && (order_bad == 0)
+		&& (errors == 0), "5000 addresses in order, batches of 8");
+	expect(ip2clue_client_submit(c, "1.2.3.4 x", NULL) == -1,
+		"address with a space refused");
+	expect(ip2clue_client_format(c, "%s %c") == 0, "format set");
+	expect(strcmp(format, "%s %c") == 0, "server got the format");
+	ip2clue_client_close(c);
+
+	c = ip2clue_client_open(addr, 4, 64, 5, cb, NULL);
+	expect(c != NULL, "open four connections");
+	expect((run(c) == ADDRS) && (bad == 0) && (errors == 0),
+		"5000 addresses over four connections");
+	ip2clue_client_close(c);
+
+	c = ip2clue_client_open(addr, 1, 10, 1, cb, NULL);
+	expect((run(c) == ADDRS) && (bad == 0) && (order_bad == 0),
+		"no batching (R lines)");
+	ip2clue_client_close(c);
+
+	/* The server drops the connection: errors, then a new connection */
+	c = ip2clue_client_open(addr, 1, 50, 10, cb, NULL);
+	drop_after = 100;
+	run(c);
+	expect((errors > 0) && (lost > 0) && (bad == 0),
+		"lost connection answers errors");
+	drop_after = 0;
+	expect((run(c) == ADDRS) && (errors == 0), "reconnected");
+	ip2clue_client_close(c);
+
+	printf("All client tests passed.\n");
+
+	return 0;
+}
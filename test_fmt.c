@@ -0,0 +1,95 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: checks the compiled formats
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <i_fmt.h>
+#include <test_util.h>
+
+/*
+ * Renders @format for @r and compares with @want
+ */
+static void expect_render(const char *format, const struct ip2clue_result *r,
+	const char *want)
+{
+	const struct ip2clue_fmt *f;
+	char out[512], what[256];
+	int len;
+
+	f = ip2clue_fmt_get(format);
+	len = f == NULL ? -1 : ip2clue_fmt_render(out, sizeof(out), f, r,
+		"1.2.3.4");
+	snprintf(what, sizeof(what), "[%s] -> [%s]", format, want);
+	expect((len == (int) strlen(want)) && (strcmp(out, want) == 0), what);
+}
+
+int main(void)
+{
+	struct ip2clue_result r;
+	struct ip2clue_extra e;
+	const struct ip2clue_fmt *f, *g;
+	char out[16], format[IP2CLUE_FMT_MAX + 2];
+
+	setlinebuf(stdout);
+
+	memset(&e, 0, sizeof(e));
+	strcpy(e.country_long, "Romania");
+	strcpy(e.city, "Bucharest");
+	e.latitude = 44.5;
+
+	memset(&r, 0, sizeof(r));
+	strcpy(r.country_short, "RO");
+	r.extra = &e;
+
+	expect_render("OK ip=%P cs=%s cl=%L", &r, "OK ip=1.2.3.4 cs=RO cl=Romania");
+	expect_render("%c/%x", &r, "Bucharest/44.500000");
+	expect_render("100%% %q%s%", &r, "100% RO");
+	expect_render("", &r, "");
+
+	f = ip2clue_fmt_get("%s %c");
+	expect((f != NULL) && (f->fields
+		== (IP2CLUE_FIELD_COUNTRY_SHORT | IP2CLUE_FIELD_CITY)),
+		"fields of [%s %c]");
+	expect(f->ops_no == 3, "ops of [%s %c]");
+
+	g = ip2clue_fmt_get("%s %c");
+	expect(f == g, "same format, same compiled copy");
+
+	/* A private copy, outside the shared table */
+	g = ip2clue_fmt_new("%s %c");
+	expect((g != NULL) && (g != f) && (g->fields == f->fields)
+		&& (g->ops_no == f->ops_no), "private compiled copy");
+	ip2clue_fmt_free(g);
+
+	/* A country only format must not touch the extra record */
+	r.extra = (struct ip2clue_extra *) 1;
+	expect_render("%s ip=%P", &r, "RO ip=1.2.3.4");
+	f = ip2clue_fmt_get("%s ip=%P");
+	expect((f->fields & IP2CLUE_FIELD_EXTRA) == 0, "country only format");
+
+	/* Text dbs have no extra */
+	r.extra = NULL;
+	expect_render("%s city=%c", &r, "RO city=");
+
+	r.extra = &e;
+	f = ip2clue_fmt_get("%L %L %L");
+	expect(ip2clue_fmt_render(out, sizeof(out), f, &r, "1.2.3.4") == -1,
+		"output too short");
+
+	memset(format, 'a', sizeof(format) - 1);
+	format[sizeof(format) - 1] = '\0';
+	expect(ip2clue_fmt_get(format) == NULL, "format too long");
+	expect(ip2clue_fmt_new(format) == NULL, "private format too long");
+
+	printf("All fmt tests passed.\n");
+
+	return 0;
+}
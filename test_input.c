@@ -0,0 +1,315 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: reads plain, gzip and zip files written here with zlib
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <i_util.h>
+#include <i_input.h>
+#include <test_util.h>
+
+/* More than the 64KiB buffers of i_input, so they are refilled */
+#define DATA_SIZE	(200 * 1024)
+
+static char		dir[] = "/tmp/ip2clue_input_XXXXXX";
+static char		data[DATA_SIZE + 64];
+static size_t		data_len;
+
+/*
+ * Compresses @len bytes of @in; @wbits selects gzip (31) or raw (-15)
+ * Returns the compressed length.
+ */
+static size_t pack(unsigned char *out, const size_t out_size,
+	const char *in, const size_t len, const int wbits)
+{
+	z_stream z;
+	size_t n;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 6, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY)
+		!= Z_OK)
+		abort();
+	z.next_in = (unsigned char *) in;
+	z.avail_in = len;
+	z.next_out = out;
+	z.avail_out = out_size;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+		abort();
+	n = out_size - z.avail_out;
+	deflateEnd(&z);
+
+	return n;
+}
+
+static void put16(unsigned char *p, const unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(unsigned char *p, const unsigned int v)
+{
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+/*
+ * Appends a zip local header and @csize bytes of @body to @f
+ * The sizes are 0 when @flags has bit 3 (streamed, data descriptor after).
+ */
+static void zip_entry(FILE *f, const char *name, const unsigned int flags,
+	const unsigned int method, const unsigned char *body,
+	const size_t csize, const size_t usize, const unsigned long crc)
+{
+	unsigned char h[30];
+	int streamed = (flags & 8) != 0;
+
+	memset(h, 0, sizeof(h));
+	put32(h, 0x04034b50);
+	put16(h + 4, 20);
+	put16(h + 6, flags);
+	put16(h + 8, method);
+	put32(h + 14, streamed ? 0 : crc);
+	put32(h + 18, streamed ? 0 : csize);
+	put32(h + 22, streamed ? 0 : usize);
+	put16(h + 26, strlen(name));
+	fwrite(h, 1, sizeof(h), f);
+	fwrite(name, 1, strlen(name), f);
+	fwrite(body, 1, csize, f);
+
+	if (streamed) {
+		put32(h, 0x08074b50);
+		put32(h + 4, crc);
+		put32(h + 8, csize);
+		put32(h + 12, usize);
+		fwrite(h, 1, 16, f);
+	}
+}
+
+/* The start of a central directory, to see that it is not read as data */
+static void zip_end(FILE *f)
+{
+	unsigned char h[4];
+
+	put32(h, 0x02014b50);
+	fwrite(h, 1, sizeof(h), f);
+}
+
+static FILE *create(const char *name, char *path, const size_t path_size)
+{
+	FILE *f;
+
+	snprintf(path, path_size, "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (f == NULL)
+		abort();
+
+	return f;
+}
+
+/*
+ * Reads @path to the end; returns 1 if it gave exactly @want (of @len)
+ * and the type @type
+ */
+static int read_all(const char *path, const char *want, const size_t len,
+	const char *type)
+{
+	struct ip2clue_input *in;
+	static char got[DATA_SIZE * 2 + 64];
+	char line[512];
+	size_t n = 0, l;
+	int ok;
+
+	in = ip2clue_input_open(path);
+	if (in == NULL) {
+		printf("Cannot open [%s] (%s)!\n", path, ip2clue_strerror());
+		return 0;
+	}
+
+	while (ip2clue_input_gets(in, line, sizeof(line)) != NULL) {
+		l = strlen(line);
+		if (n + l > sizeof(got))
+			break;
+		memcpy(got + n, line, l);
+		n += l;
+	}
+
+	ok = (in->eof == 1) && (n == len) && (memcmp(got, want, len) == 0)
+		&& (strcmp(ip2clue_input_type_name(in), type) == 0);
+	ip2clue_input_close(in);
+	unlink(path);
+
+	return ok;
+}
+
+/*
+ * Opens @path and reads it to the end; returns 1 if that fails with an
+ * error containing @err
+ */
+static int refused(const char *path, const char *err)
+{
+	struct ip2clue_input *in;
+	char line[512];
+	int ret;
+
+	ip2clue_error[0] = '\0';
+	in = ip2clue_input_open(path);
+	if (in != NULL) {
+		while (ip2clue_input_gets(in, line, sizeof(line)) != NULL)
+			;
+		if (in->eof == 1) {
+			ip2clue_input_close(in);
+			unlink(path);
+			return 0;
+		}
+		ip2clue_input_close(in);
+	}
+	unlink(path);
+
+	ret = strstr(ip2clue_strerror(), err) != NULL;
+	if (!ret)
+		printf("Got error [%s], expected [%s]\n", ip2clue_strerror(), err);
+
+	return ret;
+}
+
+int main(void)
+{
+	static unsigned char z[DATA_SIZE + 4096], z2[DATA_SIZE + 4096];
+	static char twice[DATA_SIZE * 2 + 128];
+	char path[128];
+	size_t zlen, zlen2;
+	unsigned long crc;
+	unsigned int i;
+	FILE *f;
+
+	setlinebuf(stdout);
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Cannot create temp dir!\n");
+		return 1;
+	}
+
+	for (i = 0; data_len < DATA_SIZE; i++)
+		data_len += snprintf(data + data_len, sizeof(data) - data_len,
+			"\"%u\",\"%u\",\"RO\",\"Romania\"\n", i * 256, i * 256 + 255);
+	crc = crc32(crc32(0, NULL, 0), (const unsigned char *) data, data_len);
+
+	f = create("t.csv", path, sizeof(path));
+	fwrite(data, 1, data_len, f);
+	fclose(f);
+	expect(read_all(path, data, data_len, "plain"), "plain");
+
+	/* gzip */
+	zlen = pack(z, sizeof(z), data, data_len, 31);
+	f = create("t.csv.gz", path, sizeof(path));
+	fwrite(z, 1, zlen, f);
+	fclose(f);
+	expect(read_all(path, data, data_len, "gzip"), "gzip");
+
+	/* gzip, two members (cat a.gz b.gz) */
+	zlen2 = pack(z2, sizeof(z2), "\"1\",\"2\",\"US\",\"x\"\n", 17, 31);
+	f = create("two.csv.gz", path, sizeof(path));
+	fwrite(z, 1, zlen, f);
+	fwrite(z2, 1, zlen2, f);
+	fclose(f);
+	memcpy(twice, data, data_len);
+	memcpy(twice + data_len, "\"1\",\"2\",\"US\",\"x\"\n", 17);
+	expect(read_all(path, twice, data_len + 17, "gzip"),
+		"gzip with two members");
+
+	/* gzip cut in the middle */
+	f = create("cut.csv.gz", path, sizeof(path));
+	fwrite(z, 1, zlen / 2, f);
+	fclose(f);
+	expect(refused(path, "truncated"), "truncated gzip is refused");
+
+	/* zip, stored */
+	f = create("s.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 0, 0, (const unsigned char *) data, data_len,
+		data_len, crc);
+	zip_end(f);
+	fclose(f);
+	expect(read_all(path, data, data_len, "zip"), "zip, stored");
+
+	/* zip, deflated */
+	zlen = pack(z, sizeof(z), data, data_len, -15);
+	f = create("d.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 0, 8, z, zlen, data_len, crc);
+	zip_end(f);
+	fclose(f);
+	expect(read_all(path, data, data_len, "zip"), "zip, deflated");
+
+	/* zip, deflated, sizes in a data descriptor (zip -, streamed) */
+	f = create("dd.zip", path, sizeof(path));
+	zip_entry(f, "-", 8, 8, z, zlen, data_len, crc);
+	zip_end(f);
+	fclose(f);
+	expect(read_all(path, data, data_len, "zip"),
+		"zip, deflated, with a data descriptor");
+
+	/* zip, a directory first */
+	f = create("dir.zip", path, sizeof(path));
+	zip_entry(f, "GeoIP/", 0, 0, NULL, 0, 0, 0);
+	zip_entry(f, "GeoIP/t.csv", 0, 8, z, zlen, data_len, crc);
+	zip_end(f);
+	fclose(f);
+	expect(read_all(path, data, data_len, "zip"),
+		"zip, a directory entry first");
+
+	/* Refused */
+	f = create("enc.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 1, 8, z, zlen, data_len, crc);
+	fclose(f);
+	expect(refused(path, "encrypted"), "encrypted zip is refused");
+
+	f = create("sds.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 8, 0, (const unsigned char *) data, data_len,
+		data_len, crc);
+	fclose(f);
+	expect(refused(path, "stored entry without size"),
+		"stored zip entry without size is refused");
+
+	f = create("bz.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 0, 12, z, zlen, data_len, crc);
+	fclose(f);
+	expect(refused(path, "unsupported compression method 12"),
+		"unknown zip method is refused");
+
+	f = create("cut.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 0, 8, z, zlen / 2, data_len, crc);
+	fclose(f);
+	expect(refused(path, "truncated"), "truncated zip is refused");
+
+	f = create("cuts.zip", path, sizeof(path));
+	zip_entry(f, "t.csv", 0, 0, (const unsigned char *) data,
+		data_len / 2, data_len, crc);
+	fseek(f, 18, SEEK_SET);
+	put32(z2, data_len);
+	fwrite(z2, 1, 4, f);
+	fclose(f);
+	expect(refused(path, "truncated"), "truncated stored zip is refused");
+
+	f = create("cutdir.zip", path, sizeof(path));
+	zip_entry(f, "GeoIP/", 0, 0, (const unsigned char *) data, 100,
+		100, 0);
+	fseek(f, 18, SEEK_SET);
+	put32(z2, 200000);
+	fwrite(z2, 1, 4, f);
+	fclose(f);
+	expect(refused(path, "truncated"),
+		"truncated zip directory entry is refused");
+
+	rmdir(dir);
+
+	printf("All input tests passed.\n");
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: uses libip2clue from several threads while it reloads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libip2clue.h>
+#include <test_util.h>
+
+#define THREADS	4
+
+static struct ip2clue	*h;
+static int		stop;
+static unsigned long	lookups[THREADS], bad[THREADS];
+
+static void *worker(void *arg)
+{
+	unsigned long i = (unsigned long) arg;
+	struct ip2clue_info info;
+
+	while (__atomic_load_n(&stop, __ATOMIC_RELAXED) == 0) {
+		if ((ip2clue_lookup(h, "1.2.3.4", &info) != 1)
+			|| ((strcmp(info.country_short, "RO") != 0)
+			&& (strcmp(info.country_short, "DE") != 0)))
+			bad[i]++;
+		lookups[i]++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Takes a reader slot and keeps it until every holder has tried
+ */
+static pthread_barrier_t	hold;
+static int			held[IP2CLUE_MAX_THREADS];
+
+static void *holder(void *arg)
+{
+	unsigned long i = (unsigned long) arg;
+	struct ip2clue_info info;
+
+	held[i] = ip2clue_lookup(h, "1.2.3.4", &info);
+	pthread_barrier_wait(&hold);
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct ip2clue_info info;
+	pthread_t t[THREADS], th[IP2CLUE_MAX_THREADS];
+	char dir[] = "/tmp/ip2clue_lib_XXXXXX";
+	char path[128];
+	unsigned long i, total = 0, total_bad = 0;
+	int reloads = 0, found = 0, full = 0;
+
+	setlinebuf(stdout);
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Cannot create temp dir!\n");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/t.csv", dir);
+	write_csv(path, "RO");
+
+	expect((ip2clue_open(dir, "maxmind:missing.csv") == NULL)
+		&& (strstr(ip2clue_strerror(), "missing.csv") != NULL),
+		"open fails for a missing file");
+
+	h = ip2clue_open(dir, "maxmind:t.csv");
+	if (h == NULL) {
+		printf("Cannot open (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	expect((ip2clue_lookup(h, "1.2.3.4", &info) == 1)
+		&& (info.version == 4)
+		&& (strcmp(info.country_short, "RO") == 0)
+		&& (info.ip_start[0] == 0x01020300)
+		&& (strcmp(info.start, "1.2.3.0") == 0)
+		&& (strcmp(info.end, "1.2.3.255") == 0)
+		&& (info.has_extra == 0), "1.2.3.4 -> RO, 1.2.3.0-1.2.3.255");
+	expect(ip2clue_lookup(h, "11.0.0.1", &info) == 0, "11.0.0.1 not found");
+	expect((ip2clue_lookup(h, "::ffff:10.1.1.1", &info) == 1)
+		&& (strcmp(info.country_short, "US") == 0),
+		"::ffff:10.1.1.1 -> US");
+	expect((ip2clue_lookup(h, "1.2.3.4 ", &info) == -1)
+		&& (strcmp(ip2clue_strerror(), "malformed address") == 0),
+		"malformed address");
+
+	/* Lookups go on while the file changes under them */
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&t[i], NULL, worker, (void *) i);
+
+	for (i = 0; i < 20; i++) {
+		write_csv(path, (i % 2) == 0 ? "DE" : "RO");
+		if (ip2clue_reload(h) == 0)
+			reloads++;
+		usleep(5000);
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(t[i], NULL);
+		total += lookups[i];
+		total_bad += bad[i];
+	}
+	printf("%lu lookups during %d reloads\n", total, reloads);
+	expect((reloads == 20) && (total > 0) && (total_bad == 0),
+		"lookups during reloads");
+
+	expect((ip2clue_lookup(h, "1.2.3.4", &info) == 1)
+		&& (strcmp(info.country_short, "RO") == 0), "last version seen");
+
+	/* This thread holds one slot, so one of the holders finds none */
+	pthread_barrier_init(&hold, NULL, IP2CLUE_MAX_THREADS);
+	for (i = 0; i < IP2CLUE_MAX_THREADS; i++) {
+		if (pthread_create(&th[i], NULL, holder, (void *) i) != 0) {
+			printf("Cannot create thread!\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < IP2CLUE_MAX_THREADS; i++) {
+		pthread_join(th[i], NULL);
+		if (held[i] == 1)
+			found++;
+		else if (held[i] == -2)
+			full++;
+	}
+	pthread_barrier_destroy(&hold);
+	expect((found == IP2CLUE_MAX_THREADS - 1) && (full == 1),
+		"too many threads -> -2");
+
+	pthread_barrier_init(&hold, NULL, 1);
+	pthread_create(&th[0], NULL, holder, (void *) 0);
+	pthread_join(th[0], NULL);
+	pthread_barrier_destroy(&hold);
+	expect(held[0] == 1, "slots freed at thread exit");
+
+	ip2clue_close(h);
+
+	unlink(path);
+	rmdir(dir);
+
+	printf("All lib tests passed.\n");
+
+	return 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: the merge join must answer like the binary search;
+ * ip2clue-annotate must find the addresses and keep the order
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <parser.h>
+#include <test_util.h>
+
+#define KEYS	20000
+#define LINES	5000
+
+static int cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_v6(const void *a, const void *b)
+{
+	return ip2clue_compare_v6((const unsigned int *) a,
+		(const unsigned int *) b);
+}
+
+/*
+ * Line @i of the ip2clue-annotate input and its expected answer:
+ * v4 (AA or BB), the same v4 mapped (falls back to v4), v6 (V6 or not
+ * found) and a quoted v4 not found. Line 2500 is longer than the buffer.
+ */
+static void gen_line(char *line, const size_t line_size, char *ans,
+	const size_t ans_size, const unsigned long i)
+{
+	unsigned int n = (i / 4) % 256;
+	char ip[64];
+	size_t len;
+
+	switch (i % 4) {
+	case 0:
+	case 1:
+		snprintf(ip, sizeof(ip), "%s10.0.%u.1",
+			i % 4 == 1 ? "::ffff:" : "", n);
+		snprintf(ans, ans_size, "%s", (n % 2) == 0 ? "AA" : "BB");
+		break;
+	case 2:
+		snprintf(ip, sizeof(ip), "2001:%x::1", n);
+		if ((n % 2) == 0)
+			snprintf(ans, ans_size, "V6");
+		else
+			snprintf(ans, ans_size, "ER ip=%s errmsg=\"not found\"",
+				ip);
+		break;
+	default:
+		snprintf(ip, sizeof(ip), "12.0.0.1");
+		snprintf(ans, ans_size, "ER ip=%s errmsg=\"not found\"", ip);
+		break;
+	}
+
+	snprintf(line, line_size, "%lu %s%s%s x", i, i % 4 == 3 ? "\"" : "",
+		ip, i % 4 == 3 ? "\"" : "");
+	if (i == 2500) {
+		len = strlen(line);
+		memset(line + len, 'x', 6000);
+		line[len + 6000] = '\0';
+	}
+}
+
+/*
+ * Runs ip2clue-annotate on @in; returns the output, one line per entry
+ */
+static char *annotate(const char *dir, const char *args, const char *in,
+	const char *out)
+{
+	char cmd[512], *buf;
+	FILE *f;
+	long len;
+
+	snprintf(cmd, sizeof(cmd), "./ip2clue-annotate -d %s"
+		" -f 'maxmind:a.csv, maxmind:b.csv, maxmind-v6:c.csv' -F %%s"
+		" %s %s > %s", dir, args, in, out);
+	if (system(cmd) != 0)
+		return NULL;
+
+	f = fopen(out, "r");
+	if (f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	buf = (char *) malloc(len + 1);
+	if ((buf == NULL) || (fread(buf, 1, len, f) != (size_t) len)) {
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	fclose(f);
+
+	return buf;
+}
+
+int main(void)
+{
+	struct ip2clue_list list;
+	struct ip2clue_result *r, one;
+	unsigned int *ips, *sorted, i, start, same = 0, hits = 0;
+	unsigned char *found;
+	unsigned long n;
+	char dir[] = "/tmp/ip2clue_merge_XXXXXX";
+	char path[128], in[128], out[128], line[6200], ans[128], exp[6400];
+	char *buf, *p, *e;
+	int mode;
+	FILE *f;
+
+	setlinebuf(stdout);
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Cannot create temp dir!\n");
+		return 1;
+	}
+
+	/*
+	 * Two tables with holes: the first has every other /24 of 10/8,
+	 * the second the whole 10/8 plus 11.0.0.0/24
+	 */
+	snprintf(path, sizeof(path), "%s/a.csv", dir);
+	f = fopen(path, "w");
+	for (start = 0x0A000000; start < 0x0B000000; start += 512)
+		fprintf(f, "\"x\",\"x\",\"%u\",\"%u\",\"AA\",\"x\"\n",
+			start, start + 255);
+	fclose(f);
+
+	snprintf(path, sizeof(path), "%s/b.csv", dir);
+	f = fopen(path, "w");
+	fprintf(f, "\"x\",\"x\",\"%u\",\"%u\",\"BB\",\"x\"\n",
+		0x0A000000, 0x0AFFFFFF);
+	fprintf(f, "\"x\",\"x\",\"%u\",\"%u\",\"CC\",\"x\"\n",
+		0x0B000000, 0x0B0000FF);
+	fclose(f);
+
+	ip2clue_list_init(&list);
+	if (ip2clue_list_load(&list, dir, "maxmind:a.csv, maxmind:b.csv") != 0) {
+		printf("Cannot load list (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	/* Random keys around the tables, with duplicates, sorted */
+	sorted = (unsigned int *) malloc(KEYS * sizeof(unsigned int));
+	ips = (unsigned int *) calloc(4 * KEYS, sizeof(unsigned int));
+	r = (struct ip2clue_result *) malloc(KEYS * sizeof(struct ip2clue_result));
+	found = (unsigned char *) calloc(KEYS, 1);
+	srand(1);
+	for (i = 0; i < KEYS; i++)
+		sorted[i] = 0x09F00000 + (rand() % 0x01200000);
+	sorted[KEYS - 1] = sorted[KEYS - 2];
+	qsort(sorted, KEYS, sizeof(unsigned int), cmp);
+	for (i = 0; i < KEYS; i++)
+		ips[4 * i] = sorted[i];
+
+	hits = ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V4, ips, KEYS,
+		IP2CLUE_FIELD_ALL, r, found);
+
+	for (i = 0; i < KEYS; i++) {
+		if (ip2clue_list_lookup_bin(&list, IP2CLUE_TYPE_V4, &ips[4 * i],
+			IP2CLUE_FIELD_ALL, &one) != found[i])
+			continue;
+		if (found[i] && ((one.db != r[i].db)
+			|| (one.ip_start[0] != r[i].ip_start[0])
+			|| (strcmp(one.country_short, r[i].country_short) != 0)))
+			continue;
+		same++;
+	}
+	printf("%u found of %u\n", hits, KEYS);
+	expect((same == KEYS) && (hits > 0) && (hits < KEYS),
+		"same answers as the binary search");
+
+	/* Found ones are skipped */
+	expect(ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V4, ips, KEYS,
+		IP2CLUE_FIELD_ALL, r, found) == 0, "found ones are skipped");
+
+	memset(found, 0, KEYS);
+	expect(ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V6, ips, KEYS,
+		IP2CLUE_FIELD_ALL, r, found) == 0, "no v6 tables");
+	expect(ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V4, ips, 0,
+		IP2CLUE_FIELD_ALL, r, found) == 0, "no keys");
+
+	ip2clue_list_destroy(&list);
+
+	/* v6: every other 2001:x::/32, x < 256 */
+	snprintf(path, sizeof(path), "%s/c.csv", dir);
+	f = fopen(path, "w");
+	for (start = 0; start < 256; start += 2)
+		fprintf(f, "\"2001:%x::\",\"2001:%x:ffff:ffff:ffff:ffff:ffff:ffff\","
+			"\"x\",\"x\",\"V6\",\"x\"\n", start, start);
+	fclose(f);
+
+	ip2clue_list_init(&list);
+	if (ip2clue_list_load(&list, dir, "maxmind-v6:c.csv") != 0) {
+		printf("Cannot load v6 list (%s)!\n", ip2clue_strerror());
+		return 1;
+	}
+
+	for (i = 0; i < KEYS; i++) {
+		ips[4 * i] = 0x20010000 + (rand() % 300);
+		ips[4 * i + 1] = rand();
+		ips[4 * i + 2] = rand();
+		ips[4 * i + 3] = rand();
+	}
+	memcpy(&ips[4 * (KEYS - 1)], &ips[4 * (KEYS - 2)], 4 * sizeof(ips[0]));
+	qsort(ips, KEYS, 4 * sizeof(unsigned int), cmp_v6);
+	memset(found, 0, KEYS);
+
+	hits = ip2clue_list_lookup_sorted(&list, IP2CLUE_TYPE_V6, ips, KEYS,
+		IP2CLUE_FIELD_ALL, r, found);
+
+	same = 0;
+	for (i = 0; i < KEYS; i++) {
+		if (ip2clue_list_lookup_bin(&list, IP2CLUE_TYPE_V6, &ips[4 * i],
+			IP2CLUE_FIELD_ALL, &one) != found[i])
+			continue;
+		if (found[i] && ((one.db != r[i].db)
+			|| (memcmp(one.ip_start, r[i].ip_start,
+				sizeof(one.ip_start)) != 0)
+			|| (strcmp(one.country_short, r[i].country_short) != 0)))
+			continue;
+		same++;
+	}
+	printf("%u v6 found of %u\n", hits, KEYS);
+	expect((same == KEYS) && (hits > 0) && (hits < KEYS),
+		"v6: same answers as the binary search");
+
+	ip2clue_list_destroy(&list);
+
+	/*
+	 * The tool: column 2 (quoted too), v6, v4 mapped falling back to
+	 * the v4 tables, a line longer than the buffer, and the input order
+	 * kept over several rounds of 4 threads
+	 */
+	snprintf(in, sizeof(in), "%s/in", dir);
+	snprintf(out, sizeof(out), "%s/out", dir);
+	f = fopen(in, "w");
+	for (n = 0; n < LINES; n++) {
+		gen_line(line, sizeof(line), ans, sizeof(ans), n);
+		fprintf(f, "%s\n", line);
+	}
+	fclose(f);
+
+	for (mode = 0; mode < 2; mode++) {
+		buf = annotate(dir, mode == 0 ? "-c 2 -t 4 -b 1"
+			: "-c 2 -t 4 -b 1 -m search", in, out);
+		same = 0;
+		for (n = 0, p = buf; (p != NULL) && (n < LINES); n++, p = e + 1) {
+			e = strchr(p, '\n');
+			if (e == NULL)
+				break;
+			*e = '\0';
+			gen_line(line, sizeof(line), ans, sizeof(ans), n);
+			snprintf(exp, sizeof(exp), "%s\t%s", line, ans);
+			if (strcmp(p, exp) == 0)
+				same++;
+		}
+		expect((same == LINES) && (p != NULL) && (*p == '\0'),
+			mode == 0 ? "annotate: column, v6, v4 mapped, order"
+			: "annotate -m search: same output");
+		free(buf);
+	}
+
+	/* A regex with a group; a line without a match */
+	f = fopen(in, "w");
+	fprintf(f, "a ip=10.0.0.1 b\nnothing here\nip=::ffff:10.0.1.1\n");
+	fclose(f);
+	buf = annotate(dir, "-r 'ip=([0-9a-f.:]+)'", in, out);
+	expect((buf != NULL) && (strcmp(buf, "a ip=10.0.0.1 b\tAA\n"
+		"nothing here\tER errmsg=\"no address\"\n"
+		"ip=::ffff:10.0.1.1\tBB\n") == 0), "annotate: regex");
+	free(buf);
+
+	unlink(in);
+	unlink(out);
+	free(sorted);
+	free(ips);
+	free(r);
+	free(found);
+	snprintf(path, sizeof(path), "%s/a.csv", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/b.csv", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/c.csv", dir);
+	unlink(path);
+	rmdir(dir);
+
+	printf("All merge tests passed.\n");
+
+	return 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: writes small MaxMind DB files and checks lookups on them
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <parser.h>
+#include <test_util.h>
+
+/* Minimal MMDB writer */
+struct w
+{
+	unsigned char	buf[64 * 1024];
+	size_t		len;
+};
+
+#define REC_EMPTY	0
+#define REC_NODE	1
+#define REC_DATA	2
+
+struct node
+{
+	unsigned int	kind[2];
+	unsigned int	value[2];
+};
+
+static struct node	nodes[4096];
+static unsigned int	nodes_no;
+static int		node_count_u128;	/* 1: fits 64 bits, 2: too big */
+
+static void put(struct w *w, const void *p, const size_t n)
+{
+	memcpy(w->buf + w->len, p, n);
+	w->len += n;
+}
+
+static void put8(struct w *w, const unsigned int v)
+{
+	w->buf[w->len++] = v;
+}
+
+static void ctrl(struct w *w, const unsigned int type, const unsigned int size)
+{
+	if (type <= 7)
+		put8(w, (type << 5) | (size < 29 ? size : 29));
+	else
+		put8(w, size < 29 ? size : 29);
+	if (type > 7)
+		put8(w, type - 7);
+	if (size >= 29)
+		put8(w, size - 29);
+}
+
+static void str(struct w *w, const char *s)
+{
+	ctrl(w, 2, strlen(s));
+	put(w, s, strlen(s));
+}
+
+static void map(struct w *w, const unsigned int n)
+{
+	ctrl(w, 7, n);
+}
+
+static void array(struct w *w, const unsigned int n)
+{
+	ctrl(w, 11, n);
+}
+
+static void dbl(struct w *w, const double d)
+{
+	unsigned long long u;
+	int i;
+
+	memcpy(&u, &d, 8);
+	ctrl(w, 3, 8);
+	for (i = 7; i >= 0; i--)
+		put8(w, (u >> (i * 8)) & 0xFF);
+}
+
+static void uint_(struct w *w, const unsigned int type,
+	const unsigned long long v, const unsigned int bytes)
+{
+	int i;
+
+	ctrl(w, type, bytes);
+	for (i = bytes - 1; i >= 0; i--)
+		put8(w, (v >> (i * 8)) & 0xFF);
+}
+
+/* pointer with ss=0 (offset < 2048) */
+static void ptr(struct w *w, const unsigned int off)
+{
+	put8(w, (1 << 5) | ((off >> 8) & 7));
+	put8(w, off & 0xFF);
+}
+
+static void insert(const unsigned int *ip, const unsigned int len,
+	const unsigned int data_off)
+{
+	unsigned int i, node = 0, bit;
+
+	for (i = 0; i < len; i++) {
+		bit = (ip[i / 32] >> (31 - (i % 32))) & 1;
+		if (i == len - 1) {
+			nodes[node].kind[bit] = REC_DATA;
+			nodes[node].value[bit] = data_off;
+			break;
+		}
+		if (nodes[node].kind[bit] != REC_NODE) {
+			nodes[node].kind[bit] = REC_NODE;
+			nodes[node].value[bit] = nodes_no++;
+		}
+		node = nodes[node].value[bit];
+	}
+}
+
+static unsigned int rec(const struct node *n, const unsigned int bit)
+{
+	switch (n->kind[bit]) {
+	case REC_NODE: return n->value[bit];
+	case REC_DATA: return nodes_no + 16 + n->value[bit];
+	default: return nodes_no;
+	}
+}
+
+static void write_mmdb(const char *file, const unsigned int record_size,
+	const unsigned int ip_version, struct w *data)
+{
+	static struct w out;
+	unsigned int i, l, r;
+	FILE *f;
+
+	out.len = 0;
+	for (i = 0; i < nodes_no; i++) {
+		l = rec(&nodes[i], 0);
+		r = rec(&nodes[i], 1);
+		switch (record_size) {
+		case 24:
+			put8(&out, l >> 16); put8(&out, l >> 8); put8(&out, l);
+			put8(&out, r >> 16); put8(&out, r >> 8); put8(&out, r);
+			break;
+		case 28:
+			put8(&out, l >> 16); put8(&out, l >> 8); put8(&out, l);
+			put8(&out, ((l >> 20) & 0xF0) | ((r >> 24) & 0x0F));
+			put8(&out, r >> 16); put8(&out, r >> 8); put8(&out, r);
+			break;
+		default:
+			put8(&out, l >> 24); put8(&out, l >> 16);
+			put8(&out, l >> 8); put8(&out, l);
+			put8(&out, r >> 24); put8(&out, r >> 16);
+			put8(&out, r >> 8); put8(&out, r);
+			break;
+		}
+	}
+	for (i = 0; i < 16; i++)
+		put8(&out, 0);
+	put(&out, data->buf, data->len);
+	put(&out, "\xAB\xCD\xEF" "MaxMind.com", 14);
+
+	map(&out, 5);
+	str(&out, "node_count");
+	if (node_count_u128 > 0) {
+		ctrl(&out, 10, 16);
+		for (i = 0; i < 8; i++)
+			put8(&out, (i == 7) && (node_count_u128 == 2));
+		for (i = 0; i < 8; i++)
+			put8(&out, ((unsigned long long) nodes_no >> ((7 - i) * 8))
+				& 0xFF);
+	} else {
+		uint_(&out, 6, nodes_no, 4);
+	}
+	str(&out, "record_size"); uint_(&out, 5, record_size, 2);
+	str(&out, "ip_version"); uint_(&out, 5, ip_version, 2);
+	str(&out, "build_epoch"); uint_(&out, 9, 1278460800ULL, 8);
+	str(&out, "database_type"); str(&out, "ip2clue-test");
+
+	f = fopen(file, "w");
+	if (f == NULL) {
+		printf("Cannot create %s!\n", file);
+		abort();
+	}
+	fwrite(out.buf, 1, out.len, f);
+	fclose(f);
+}
+
+static void check(struct ip2clue_list *list, const char *format,
+	const char *ip, const char *expected)
+{
+	char out[512];
+	int ret;
+
+	ret = ip2clue_list_search(list, out, sizeof(out), format, ip);
+	if (expected == NULL) {
+		if (ret != 0) {
+			printf("ERROR: %s found [%s], expected not found!\n", ip, out);
+			abort();
+		}
+		return;
+	}
+
+	if (ret != 1) {
+		printf("ERROR: %s not found (%s)!\n", ip, ip2clue_strerror());
+		abort();
+	}
+
+	if (strcmp(out, expected) != 0) {
+		printf("ERROR: %s: expected [%s], got [%s]!\n", ip, expected, out);
+		abort();
+	}
+	printf("%s -> %s\n", ip, out);
+}
+
+/*
+ * Builds one db; v4 networks are put in ::/96 when @ip_version is 6
+ */
+static void build(const char *file, const unsigned int record_size,
+	const unsigned int ip_version)
+{
+	static struct w data;
+	unsigned int off_ro, off_us, off_nl, off_nl_name;
+	unsigned int ip[4];
+	unsigned int v4 = ip_version == 6 ? 3 : 0;
+
+	memset(nodes, 0, sizeof(nodes));
+	nodes_no = 1;
+	data.len = 0;
+
+	/* Shared string, reached by a pointer */
+	off_nl_name = data.len;
+	str(&data, "Netherlands");
+
+	off_ro = data.len;
+	map(&data, 4);
+	str(&data, "country");
+	map(&data, 2);
+	str(&data, "iso_code"); str(&data, "RO");
+	str(&data, "names"); map(&data, 2);
+	str(&data, "de"); str(&data, "Rumaenien");
+	str(&data, "en"); str(&data, "Romania");
+	str(&data, "city");
+	map(&data, 1); str(&data, "names"); map(&data, 1);
+	str(&data, "en"); str(&data, "Bucharest");
+	str(&data, "location");
+	map(&data, 3);
+	str(&data, "latitude"); dbl(&data, 44.5);
+	str(&data, "longitude"); dbl(&data, 26.25);
+	str(&data, "time_zone"); str(&data, "Europe/Bucharest");
+	str(&data, "subdivisions");
+	array(&data, 1);
+	map(&data, 1); str(&data, "names"); map(&data, 1);
+	str(&data, "en"); str(&data, "Bucuresti");
+
+	off_us = data.len;
+	map(&data, 2);
+	str(&data, "registered_country");
+	map(&data, 1); str(&data, "iso_code"); str(&data, "US");
+	str(&data, "autonomous_system_organization");
+	str(&data, "Example Networks, a very long name to be truncated by the extra field size");
+
+	off_nl = data.len;
+	map(&data, 1);
+	str(&data, "country");
+	map(&data, 2);
+	str(&data, "iso_code"); str(&data, "NL");
+	str(&data, "names"); map(&data, 1); str(&data, "en");
+	ptr(&data, off_nl_name);
+
+	memset(ip, 0, sizeof(ip));
+	ip[v4] = 0x01020300;	/* 1.2.3.0/24 */
+	insert(ip, v4 * 32 + 24, off_ro);
+	ip[v4] = 0x0A000000;	/* 10.0.0.0/8 */
+	insert(ip, v4 * 32 + 8, off_us);
+	if (ip_version == 6) {
+		ip[0] = 0x20010DB8;	/* 2001:db8::/32 */
+		ip[3] = 0;
+		insert(ip, 32, off_nl);
+	}
+
+	write_mmdb(file, record_size, ip_version, &data);
+}
+
+/*
+ * Replaces @file with something that is not a MaxMind DB
+ */
+static void garbage(const char *file)
+{
+	char tmp[160];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		abort();
+	fprintf(f, "this is not a MaxMind DB\n");
+	fclose(f);
+	rename(tmp, file);
+}
+
+/*
+ * A file that fails to load must not drop the others
+ */
+static void test_failures(const char *dir, const char *path)
+{
+	struct ip2clue_list l1, l2, l3, l4;
+	char bad[128];
+	const char *files = "mmdb:bad.mmdb, mmdb:t.mmdb";
+
+	snprintf(bad, sizeof(bad), "%s/bad.mmdb", dir);
+	build(path, 24, 4);
+	garbage(bad);
+
+	ip2clue_list_init(&l1);
+	ip2clue_list_init(&l2);
+	ip2clue_list_init(&l3);
+	ip2clue_list_init(&l4);
+
+	expect(ip2clue_list_refresh(&l1, NULL, dir, files) == 0,
+		"refresh with a bad file succeeds");
+	expect((l1.number == 1) && (l1.failures_no == 1)
+		&& (l1.failures[0].count == 1)
+		&& (l1.failures[0].retry > l1.failures[0].last),
+		"bad file is left out and recorded");
+	check(&l1, "%s", "1.2.3.4", "RO");
+
+	expect(ip2clue_list_refresh(&l2, &l1, dir, files) == 0,
+		"second refresh succeeds");
+	expect((l2.failures_no == 1) && (l2.failures[0].count == 1),
+		"bad file is not retried before the backoff");
+
+	build(bad, 24, 4);
+	expect(ip2clue_list_refresh(&l3, &l2, dir, files) == 0,
+		"refresh with the fixed file succeeds");
+	expect((l3.number == 2) && (l3.failures_no == 0),
+		"a new version is tried right away");
+
+	garbage(path);
+	expect(ip2clue_list_refresh(&l4, &l3, dir, files) == 0,
+		"refresh with a corrupted file succeeds");
+	expect((l4.number == 2) && (l4.entries[1] == l3.entries[1])
+		&& (l4.failures_no == 1),
+		"previous good copy is kept");
+	check(&l4, "%s", "1.2.3.4", "RO");
+
+	ip2clue_list_destroy(&l1);
+	ip2clue_list_destroy(&l2);
+	ip2clue_list_destroy(&l3);
+	ip2clue_list_destroy(&l4);
+
+	unlink(bad);
+}
+
+int main(void)
+{
+	struct ip2clue_list list;
+	char dir[] = "/tmp/ip2clue_mmdb_XXXXXX";
+	char path[128];
+	unsigned int i;
+	static const unsigned int sizes[] = {24, 28, 32};
+
+	setlinebuf(stdout);
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Cannot create temp dir!\n");
+		return 1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		printf("Record size %u, IPv6 tree...\n", sizes[i]);
+		snprintf(path, sizeof(path), "%s/t.mmdb", dir);
+		build(path, sizes[i], 6);
+
+		ip2clue_list_init(&list);
+		if (ip2clue_list_load(&list, dir, "mmdb:t.mmdb") != 0) {
+			printf("Cannot load list (%s)!\n", ip2clue_strerror());
+			return 1;
+		}
+
+		check(&list, "%s %L %c %r %t %x %y", "1.2.3.4",
+			"RO Romania Bucharest Bucuresti Europe/Buchares"
+			" 44.500000 26.250000");
+		check(&list, "%s", "1.2.3.255", "RO");
+		check(&list, "%s [%i]", "10.200.1.1",
+			"US [Example Networks, a very long name to be truncated by the extra]");
+		check(&list, "%s %L", "2001:db8:1::1", "NL Netherlands");
+		check(&list, "%s", "1.2.4.1", NULL);
+		check(&list, "%s", "2001:db9::1", NULL);
+		check(&list, "%s", "1.2.3.x", NULL);
+
+		ip2clue_list_destroy(&list);
+
+		printf("Record size %u, IPv4 tree...\n", sizes[i]);
+		build(path, sizes[i], 4);
+		if (ip2clue_list_load(&list, dir, "mmdb:t.mmdb") != 0) {
+			printf("Cannot load list (%s)!\n", ip2clue_strerror());
+			return 1;
+		}
+		check(&list, "%s %c", "1.2.3.4", "RO Bucharest");
+		check(&list, "%s", "10.0.0.0", "US");
+		check(&list, "%s", "11.0.0.0", NULL);
+		check(&list, "%s", "2001:db8::1", NULL);
+		ip2clue_list_destroy(&list);
+	}
+
+	node_count_u128 = 1;
+	build(path, 24, 4);
+	ip2clue_list_init(&list);
+	expect(ip2clue_list_load(&list, dir, "mmdb:t.mmdb") == 0,
+		"uint128 metadata that fits in 64 bits is read");
+	check(&list, "%s", "1.2.3.4", "RO");
+	ip2clue_list_destroy(&list);
+
+	node_count_u128 = 2;
+	build(path, 24, 4);
+	ip2clue_list_init(&list);
+	expect(ip2clue_list_load(&list, dir, "mmdb:t.mmdb") != 0,
+		"uint128 metadata over 64 bits is refused");
+	ip2clue_list_destroy(&list);
+	node_count_u128 = 0;
+
+	test_failures(dir, path);
+
+	unlink(path);
+	rmdir(dir);
+
+	printf("All mmdb tests passed.\n");
+
+	return 0;
+}
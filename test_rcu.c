@@ -0,0 +1,119 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: stress test for the RCU publication
+ * Readers check that what they see is never freed under them: the writer
+ * poisons the old version after ip2clue_rcu_synchronize.
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <i_util.h>
+#include <i_rcu.h>
+
+#define READERS		4
+#define VERSIONS	5000
+#define MAGIC		0x1BADC0DEU
+
+struct version
+{
+	unsigned int	magic;
+	unsigned int	id;
+	unsigned int	data[16];
+};
+
+static struct version	*current;
+static int		stop;
+static unsigned long	reads[READERS];
+
+static void *reader(void *arg)
+{
+	unsigned long no = (unsigned long) arg;
+	struct version *v;
+	unsigned int i, last = 0;
+
+	while (__atomic_load_n(&stop, __ATOMIC_RELAXED) == 0) {
+		if (ip2clue_rcu_read_lock() != 0) {
+			printf("ERROR: read_lock: %s!\n", ip2clue_strerror());
+			abort();
+		}
+
+		v = (struct version *) ip2clue_rcu_dereference((void **) &current);
+		for (i = 0; i < 16; i++) {
+			if ((v->magic != MAGIC) || (v->data[i] != v->id)) {
+				printf("ERROR: reader %lu sees freed version %u!\n",
+					no, v->id);
+				abort();
+			}
+		}
+		if (v->id < last) {
+			printf("ERROR: reader %lu went back in time!\n", no);
+			abort();
+		}
+		last = v->id;
+
+		/* nested sections are allowed */
+		ip2clue_rcu_read_lock();
+		ip2clue_rcu_read_unlock();
+
+		ip2clue_rcu_read_unlock();
+		reads[no]++;
+	}
+
+	return NULL;
+}
+
+static struct version *version_new(const unsigned int id)
+{
+	struct version *v;
+	unsigned int i;
+
+	v = (struct version *) malloc(sizeof(struct version));
+	if (v == NULL)
+		abort();
+	v->magic = MAGIC;
+	v->id = id;
+	for (i = 0; i < 16; i++)
+		v->data[i] = id;
+
+	return v;
+}
+
+int main(void)
+{
+	pthread_t t[READERS];
+	struct version *old;
+	unsigned long i, total = 0;
+
+	setlinebuf(stdout);
+
+	current = version_new(0);
+
+	for (i = 0; i < READERS; i++)
+		pthread_create(&t[i], NULL, reader, (void *) i);
+
+	for (i = 1; i <= VERSIONS; i++) {
+		old = (struct version *) ip2clue_rcu_publish((void **) &current,
+			version_new(i));
+		ip2clue_rcu_synchronize();
+		memset(old, 0xAA, sizeof(struct version));
+		free(old);
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < READERS; i++) {
+		pthread_join(t[i], NULL);
+		total += reads[i];
+	}
+	free(current);
+
+	printf("%d versions published, %lu reads by %d readers.\n",
+		VERSIONS, total, READERS);
+	printf("All rcu tests passed.\n");
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: publishes a list in shared memory and searches it
+ */
+
+#include <i_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <i_types.h>
+#include <i_util.h>
+#include <i_shm.h>
+#include <parser.h>
+#include <test_util.h>
+
+static void load(struct ip2clue_list *list, const char *dir, const char *cs)
+{
+	char path[128], files[64];
+
+	snprintf(path, sizeof(path), "%s/%s.csv", dir, cs);
+	write_csv(path, cs);
+
+	snprintf(files, sizeof(files), "maxmind:%s.csv", cs);
+	ip2clue_list_init(list);
+	if (ip2clue_list_load(list, dir, files) != 0) {
+		printf("Cannot load list (%s)!\n", ip2clue_strerror());
+		exit(1);
+	}
+}
+
+int main(void)
+{
+	struct ip2clue_list list1, list2;
+	struct ip2clue_shm_writer w;
+	struct ip2clue_shm s;
+	struct ip2clue_result r;
+	char dir[] = "/tmp/ip2clue_shm_XXXXXX";
+	char path[128], data[256], victim[128];
+	struct stat st;
+	unsigned int gen;
+	int fd;
+
+	setlinebuf(stdout);
+
+	if (mkdtemp(dir) == NULL) {
+		printf("Cannot create temp dir!\n");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/shm", dir);
+
+	load(&list1, dir, "RO");
+	load(&list2, dir, "DE");
+
+	expect(ip2clue_shm_create(&w, path) == 0, "create control file");
+	expect(ip2clue_shm_open(&s, path) == 0, "client maps it");
+	expect((ip2clue_shm_lookup(&s, "1.2.3.4", &r) == 0)
+		&& (strcmp(ip2clue_strerror(), "nothing published") == 0),
+		"nothing published yet");
+
+	expect(ip2clue_shm_publish(&w, &list1) == 0, "publish first list");
+	expect((ip2clue_shm_lookup(&s, "1.2.3.4", &r) == 1)
+		&& (strcmp(r.country_short, "RO") == 0)
+		&& (r.ip_start[0] == 0x01020300) && (r.ip_end[0] == 0x010203FF),
+		"1.2.3.4 -> RO, 1.2.3.0-1.2.3.255");
+	expect((ip2clue_shm_lookup(&s, "10.20.30.40", &r) == 1)
+		&& (strcmp(r.country_short, "US") == 0), "10.20.30.40 -> US");
+	expect(ip2clue_shm_lookup(&s, "11.0.0.1", &r) == 0, "11.0.0.1 not found");
+	expect(ip2clue_shm_lookup(&s, "1.2.3.0", &r) == 1, "first address");
+	expect(ip2clue_shm_lookup(&s, "1.2.2.255", &r) == 0, "before the first");
+	expect((ip2clue_shm_lookup(&s, "::ffff:1.2.3.4", &r) == 1)
+		&& (r.v4_or_v6 == IP2CLUE_TYPE_V4), "::ffff:1.2.3.4 -> v4 db");
+	expect(ip2clue_shm_lookup(&s, "1.2.3", &r) == 0, "malformed");
+	gen = s.generation;
+
+	/* Reload: the client switches at its next lookup */
+	snprintf(data, sizeof(data), "%s", w.h->data);
+	expect(ip2clue_shm_publish(&w, &list2) == 0, "publish second list");
+	expect((ip2clue_shm_lookup(&s, "1.2.3.4", &r) == 1)
+		&& (strcmp(r.country_short, "DE") == 0)
+		&& (s.generation == gen + 1), "1.2.3.4 -> DE, next generation");
+	expect(access(data, F_OK) != 0, "old data removed");
+
+	/* A new daemon goes on from the last generation */
+	ip2clue_shm_destroy(&w);
+	expect(ip2clue_shm_lookup(&s, "1.2.3.4", &r) == 0, "daemon gone");
+
+	/* A symlink planted at the next data file is not followed */
+	snprintf(victim, sizeof(victim), "%s/victim", dir);
+	fd = open(victim, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd == -1) || (write(fd, "x", 1) != 1)) {
+		printf("Cannot create [%s]!\n", victim);
+		return 1;
+	}
+	close(fd);
+	snprintf(data, sizeof(data), "%s.%u", path, gen + 2);
+	if (symlink(victim, data) != 0) {
+		printf("Cannot create symlink [%s]!\n", data);
+		return 1;
+	}
+
+	expect((ip2clue_shm_create(&w, path) == 0)
+		&& (ip2clue_shm_publish(&w, &list1) == 0), "daemon restarted");
+	expect((ip2clue_shm_lookup(&s, "1.2.3.4", &r) == 1)
+		&& (strcmp(r.country_short, "RO") == 0)
+		&& (s.generation == gen + 2), "same mapping, new generation");
+	expect((stat(victim, &st) == 0) && (st.st_size == 1)
+		&& (lstat(data, &st) == 0) && S_ISREG(st.st_mode),
+		"planted symlink replaced, its target untouched");
+
+	ip2clue_shm_close(&s);
+	ip2clue_shm_destroy(&w);
+	ip2clue_list_destroy(&list1);
+	ip2clue_list_destroy(&list2);
+	unlink(path);
+	unlink(victim);
+	snprintf(path, sizeof(path), "%s/RO.csv", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/DE.csv", dir);
+	unlink(path);
+	rmdir(dir);
+
+	printf("All shm tests passed.\n");
+
+	return 0;
+}
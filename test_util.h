@@ -0,0 +1,43 @@
+/*
+ * Author: Catalin(ux) M. BOIE
+ * Description: helpers shared by the test_*.c programs
+ */
+
+#ifndef IP2CLUE_TEST_UTIL_H
+#define IP2CLUE_TEST_UTIL_H 1
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline void expect(const int cond, const char *what)
+{
+	if (!cond) {
+		printf("ERROR: %s!\n", what);
+		abort();
+	}
+	printf("%s: OK\n", what);
+}
+
+/*
+ * A small MaxMind CSV: 1.2.3.0 - 1.2.3.255 -> @cs and
+ * 10.0.0.0 - 10.255.255.255 -> US. Written in one go (new inode), so a
+ * reload sees a new version.
+ */
+static inline void write_csv(const char *file, const char *cs)
+{
+	char tmp[256];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		abort();
+	fprintf(f, "\"x\",\"x\",\"16909056\",\"16909311\",\"%s\",\"x\"\n", cs);
+	fprintf(f, "\"x\",\"x\",\"167772160\",\"184549375\",\"US\",\"x\"\n");
+	fclose(f);
+
+	if (rename(tmp, file) != 0)
+		abort();
+}
+
+#endif